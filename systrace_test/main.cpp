@@ -35,6 +35,16 @@ int main(int argc, char **)
     }
 
 
+    // Scopes that begin in the same microsecond still have to nest.
+    for (int i = 0; i < 100; ++i) {
+        TRACE_EVENT0("app", "outerScope");
+        {
+            TRACE_EVENT0("app", "innerScope");
+            usleep(100);
+        }
+        usleep(200);
+    }
+
     printf("Ending\n");
     systrace_deinit();
 }
@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "CTraceMessages.h"
+
+// Controls a running traced, over its control socket.
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [-s <socket>] <command> [arguments]\n", argv0);
+    fprintf(stderr, "Commands:\n");
+    fprintf(stderr, "  start <file>           start recording to <file>\n");
+    fprintf(stderr, "  stop                   stop recording, and finish the trace\n");
+    fprintf(stderr, "  categories [<category>...]\n"
+                    "                         only record these categories (all, if none)\n");
+    fprintf(stderr, "  filter [<expression>]  only record events matching <expression> (see\n"
+                    "                         traced -F), or everything, if none\n");
+    fprintf(stderr, "  trigger                finish the current segment now, so the kept\n"
+                    "                         segments hold everything up to this point (or\n"
+                    "                         with traced -W, write out the window)\n");
+    fprintf(stderr, "  status                 show what traced is doing\n");
+    fprintf(stderr, "  report                 show per-tracepoint statistics (see traced -R)\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s, --socket <path>    traced's socket (default: $%s or %s)\n",
+            TRACED_SOCKET_ENV, TRACED_SOCKET_PATH);
+    fprintf(stderr, "  -h, --help             show this help\n");
+}
+
+static bool sendAll(int fd, const std::string &data)
+{
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t ret = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        sent += ret;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *socketPath = getenv(TRACED_SOCKET_ENV);
+    if (!socketPath || !*socketPath)
+        socketPath = TRACED_SOCKET_PATH;
+
+    static const struct option longOptions[] = {
+        { "socket", required_argument, 0, 's' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+s:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            socketPath = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        exit(-1);
+    }
+
+    std::string command = argv[optind];
+    if (command == "start") {
+        if (optind + 2 != argc) {
+            usage(argv[0]);
+            exit(-1);
+        }
+        // traced doesn't share our working directory.
+        std::string path = argv[optind + 1];
+        if (path[0] != '/') {
+            char *cwd = getcwd(NULL, 0);
+            if (!cwd) {
+                perror("Can't get working directory");
+                exit(-1);
+            }
+            path = std::string(cwd) + "/" + path;
+            free(cwd);
+        }
+        command += " " + path;
+    } else {
+        for (int i = optind + 1; i < argc; ++i)
+            command += std::string(" ") + argv[i];
+    }
+    if (command.find('\n') != std::string::npos) {
+        fprintf(stderr, "Arguments can't contain newlines\n");
+        exit(-1);
+    }
+    command += "\n";
+
+    std::string controlPath = std::string(socketPath) + TRACED_CONTROL_SUFFIX;
+    struct sockaddr_un remote;
+    if (controlPath.size() >= sizeof(remote.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", controlPath.c_str());
+        exit(-1);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("Can't create socket");
+        exit(-1);
+    }
+    remote.sun_family = AF_UNIX;
+    strcpy(remote.sun_path, controlPath.c_str());
+    int len = strlen(remote.sun_path) + sizeof(remote.sun_family) + 1;
+    if (connect(fd, (struct sockaddr *)&remote, len) == -1) {
+        fprintf(stderr, "Can't connect to traced on %s: %s\n", controlPath.c_str(), strerror(errno));
+        exit(-1);
+    }
+
+    if (!sendAll(fd, command)) {
+        perror("Can't talk to traced");
+        exit(-1);
+    }
+
+    // Print the reply, up to the line that says how it went.
+    std::string buffer;
+    for (;;) {
+        size_t end;
+        while ((end = buffer.find('\n')) != std::string::npos) {
+            std::string line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            if (line == "ok")
+                return 0;
+            if (line.compare(0, 6, "error ") == 0) {
+                fprintf(stderr, "traced: %s\n", line.c_str() + 6);
+                return 1;
+            }
+            printf("%s\n", line.c_str());
+        }
+
+        char data[1024];
+        ssize_t got = recv(fd, data, sizeof(data), 0);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            fprintf(stderr, "traced went away\n");
+            return 1;
+        }
+        buffer.append(data, got);
+    }
+}
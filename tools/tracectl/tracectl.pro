@@ -0,0 +1,9 @@
+QT =
+CONFIG -= app_bundle
+CONFIG += c++11
+TEMPLATE = app
+TARGET = tracectl
+INCLUDEPATH += . ../../traced
+
+# Input
+SOURCES += main.cpp
@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "CJsonTraceParser.h"
+#include "CTracepointStats.h"
+
+// Compares two JSON traces from traced, tracepoint by tracepoint (matched up
+// by category and name, whatever process they're in), and reports the ones
+// that got slower or faster by enough to matter, and by more than noise
+// would explain.
+
+const double DefaultThreshold = 5; // percent
+const double DefaultSignificance = 3;
+const uint64_t DefaultMinSlices = 10;
+
+// Events are handed over in batches of this many.
+const size_t BatchSize = 65536;
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options] <before.json> <after.json>\n", argv0);
+    fprintf(stderr, "Compares per-tracepoint statistics between two JSON traces from traced.\n");
+    fprintf(stderr, "  -t, --threshold <%%>    only report changes in mean or p99 duration (or\n"
+                    "                         count) of at least <%%> (default: %g)\n", DefaultThreshold);
+    fprintf(stderr, "  -z, --significance <z> only report changes at least <z> standard errors\n"
+                    "                         big (default: %g)\n", DefaultSignificance);
+    fprintf(stderr, "  -m, --min-slices <n>   only judge tracepoints with at least <n> slices in\n"
+                    "                         each trace (default: %" PRIu64 ")\n", DefaultMinSlices);
+    fprintf(stderr, "  -a, --all              list every tracepoint, not just those that changed\n");
+    fprintf(stderr, "  -j, --json             write the comparison as JSON\n");
+    fprintf(stderr, "  -e, --exit-code        exit with 1 if anything got slower\n");
+    fprintf(stderr, "  -T, --threads <n>      parse with <n> threads (default: one per core)\n");
+    fprintf(stderr, "  -h, --help             show this help\n");
+}
+
+enum class Verdict
+{
+    Same, // or not enough to go on
+    Slower,
+    Faster,
+    More, // tracepoints without slices: hit more often
+    Fewer,
+    New,
+    Gone
+};
+
+static const char *verdictName(Verdict verdict)
+{
+    switch (verdict) {
+    case Verdict::Same:
+        return "same";
+    case Verdict::Slower:
+        return "slower";
+    case Verdict::Faster:
+        return "faster";
+    case Verdict::More:
+        return "more";
+    case Verdict::Fewer:
+        return "fewer";
+    case Verdict::New:
+        return "new";
+    case Verdict::Gone:
+        return "gone";
+    }
+    return "?";
+}
+
+struct Comparison
+{
+    const TracepointStats *before = nullptr; // if it's in that trace
+    const TracepointStats *after = nullptr;
+    Verdict verdict = Verdict::Same;
+    double change = 0; // relative, in mean duration (or count, without slices)
+    double score = 0; // the change, in standard errors
+    double tailChange = 0; // relative, in p99 duration
+    double tailScore = 0; // the change, in standard errors (see tailScore())
+    int64_t impact = 0; // how much time the change in mean cost (or saved) in the later trace, in us
+};
+
+// Adds up the trace's statistics, parsing it in parallel.
+static bool aggregate(const char *path, int threads, TracepointAggregator &result)
+{
+    JsonTraceFile file;
+    if (!file.open(path))
+        return false;
+
+    std::vector<TracepointAggregator> ranges(threads);
+    uint64_t malformed = file.parse(threads, BatchSize, [&](int range, JsonEventTable &batch) {
+        ranges[range].add(batch);
+        return true;
+    });
+    if (malformed)
+        fprintf(stderr, "%s: skipped %" PRIu64 " lines that aren't events\n", path, malformed);
+    for (size_t i = 1; i < ranges.size(); ++i)
+        ranges[0].merge(ranges[i]);
+    std::swap(result, ranges[0]);
+    return true;
+}
+
+// Welch's t statistic for the difference in mean duration, taken as a z
+// score: with the numbers of slices in a trace, the distinction doesn't
+// matter.
+static double durationScore(const TracepointStats &a, const TracepointStats &b)
+{
+    double diff = b.mean() - a.mean();
+    double error = sqrt(a.variance() / a.slices + b.variance() / b.slices);
+    if (error == 0)
+        return diff == 0 ? 0 : copysign(INFINITY, diff);
+    return diff / error;
+}
+
+// How far the p99 moved, in standard errors: whether the share of b's slices
+// above a's p99 differs from a's own (about 1%), as a two-proportion z test.
+static double tailScore(const TracepointStats &a, const TracepointStats &b)
+{
+    uint64_t p99 = a.histogram.percentile(0.99);
+    double na = a.histogram.count(), nb = b.histogram.count();
+    double aboveA = a.histogram.countAbove(p99), aboveB = b.histogram.countAbove(p99);
+    double pooled = (aboveA + aboveB) / (na + nb);
+    double diff = aboveB / nb - aboveA / na;
+    double error = sqrt(pooled * (1 - pooled) * (1 / na + 1 / nb));
+    if (error == 0)
+        return diff == 0 ? 0 : copysign(INFINITY, diff);
+    return diff / error;
+}
+
+// Counts, taken as Poisson: the difference in standard errors.
+static double countScore(uint64_t a, uint64_t b)
+{
+    return ((double)b - (double)a) / sqrt((double)a + (double)b);
+}
+
+static double relativeChange(double a, double b)
+{
+    if (a == 0)
+        return b == 0 ? 0 : INFINITY;
+    return (b - a) / a;
+}
+
+static uint64_t percentile(const TracepointStats &s, double fraction)
+{
+    return std::min<uint64_t>(s.histogram.percentile(fraction), s.max);
+}
+
+static void compare(Comparison &c, double threshold, double significance, uint64_t minSlices)
+{
+    if (!c.before) {
+        c.verdict = Verdict::New;
+        c.impact = c.after->total;
+        return;
+    }
+    if (!c.after) {
+        c.verdict = Verdict::Gone;
+        c.impact = -c.before->total;
+        return;
+    }
+
+    const TracepointStats &a = *c.before, &b = *c.after;
+    if (a.slices || b.slices) {
+        if (a.slices < minSlices || b.slices < minSlices)
+            return;
+        c.change = relativeChange(a.mean(), b.mean());
+        c.score = durationScore(a, b);
+        c.tailChange = relativeChange(percentile(a, 0.99), percentile(b, 0.99));
+        c.tailScore = tailScore(a, b);
+        c.impact = llround((b.mean() - a.mean()) * b.slices);
+
+        // A slower tail is a regression even when the mean holds (or
+        // improves), and the other way around.
+        bool meanMoved = fabs(c.change) >= threshold && fabs(c.score) >= significance;
+        bool tailMoved = fabs(c.tailChange) >= threshold && fabs(c.tailScore) >= significance;
+        if ((meanMoved && c.change > 0) || (tailMoved && c.tailChange > 0))
+            c.verdict = Verdict::Slower;
+        else if (meanMoved || tailMoved)
+            c.verdict = Verdict::Faster;
+    } else {
+        c.change = relativeChange(a.count, b.count);
+        c.score = countScore(a.count, b.count);
+        if (fabs(c.change) >= threshold && fabs(c.score) >= significance)
+            c.verdict = c.change > 0 ? Verdict::More : Verdict::Fewer;
+    }
+}
+
+// "a -> b", with "-" for a tracepoint that's not in a trace (or for a value
+// that doesn't apply, as NAN).
+static std::string beforeAfter(const Comparison &c, const char *format, double (*value)(const TracepointStats &))
+{
+    char a[32] = "-", b[32] = "-";
+    if (c.before && !isnan(value(*c.before)))
+        snprintf(a, sizeof(a), format, value(*c.before));
+    if (c.after && !isnan(value(*c.after)))
+        snprintf(b, sizeof(b), format, value(*c.after));
+    return std::string(a) + " -> " + b;
+}
+
+static double slicesOrCount(const TracepointStats &s) { return s.slices ? s.slices : s.count; }
+static double meanOf(const TracepointStats &s) { return s.slices ? s.mean() : NAN; }
+static double p50Of(const TracepointStats &s) { return s.slices ? percentile(s, 0.5) : NAN; }
+static double p99Of(const TracepointStats &s) { return s.slices ? percentile(s, 0.99) : NAN; }
+
+static void writeText(const std::vector<Comparison> &rows)
+{
+    printf("%-7s %8s %8s %12s %22s %18s %18s %22s  %s\n", "", "change", "p99", "impact us", "mean us", "p50 us",
+           "p99 us", "slices (or count)", "tracepoint");
+    for (const Comparison &c : rows) {
+        char change[16] = "", tailChange[16] = "";
+        if (c.verdict != Verdict::New && c.verdict != Verdict::Gone && isfinite(c.change))
+            snprintf(change, sizeof(change), "%+.1f%%", c.change * 100);
+        if (c.before && c.after && c.before->slices && c.after->slices && isfinite(c.tailChange))
+            snprintf(tailChange, sizeof(tailChange), "%+.1f%%", c.tailChange * 100);
+        const TracepointStats &s = c.after ? *c.after : *c.before;
+        printf("%-7s %8s %8s %12" PRId64 " %22s %18s %18s %22s  %s/%s\n", verdictName(c.verdict), change, tailChange,
+               c.impact, beforeAfter(c, "%.1f", meanOf).c_str(), beforeAfter(c, "%.0f", p50Of).c_str(),
+               beforeAfter(c, "%.0f", p99Of).c_str(), beforeAfter(c, "%.0f", slicesOrCount).c_str(),
+               s.category.c_str(), s.name.c_str());
+    }
+}
+
+// Names are written as they were in the traces, escapes and all, so they're
+// valid JSON strings as they are.
+static void writeJsonStats(const char *key, const TracepointStats *s)
+{
+    if (!s) {
+        printf(",\"%s\":null", key);
+        return;
+    }
+    printf(",\"%s\":{\"count\":%" PRIu64 ",\"slices\":%" PRIu64 ",\"total_us\":%" PRId64 ",\"self_us\":%" PRId64
+           ",\"mean_us\":%.3f,\"p50_us\":%" PRIu64 ",\"p99_us\":%" PRIu64 ",\"max_us\":%" PRId64 "}",
+           key, s->count, s->slices, s->total, s->self, s->mean(), percentile(*s, 0.5), percentile(*s, 0.99), s->max);
+}
+
+// Infinite changes (from nothing to something) are written as null.
+static void writeJsonNumber(const char *key, double value)
+{
+    if (isfinite(value))
+        printf(",\"%s\":%.6g", key, value);
+    else
+        printf(",\"%s\":null", key);
+}
+
+// threshold is in percent, as given to -t.
+static void writeJson(const std::vector<Comparison> &rows, const char *before, const char *after, double threshold,
+                      double significance, size_t slower, size_t faster)
+{
+    // The paths aren't escaped: they'd need to be odd indeed to need it.
+    printf("{\"before\":\"%s\",\"after\":\"%s\",\"threshold\":%g,\"significance\":%g,"
+           "\"slower\":%zu,\"faster\":%zu,\"tracepoints\":[", before, after, threshold, significance, slower, faster);
+    for (size_t i = 0; i < rows.size(); ++i) {
+        const Comparison &c = rows[i];
+        const TracepointStats &s = c.after ? *c.after : *c.before;
+        printf("%s\n{\"category\":\"%s\",\"name\":\"%s\",\"verdict\":\"%s\"", i ? "," : "", s.category.c_str(),
+               s.name.c_str(), verdictName(c.verdict));
+        writeJsonNumber("change", c.change);
+        writeJsonNumber("score", c.score);
+        writeJsonNumber("p99_change", c.tailChange);
+        writeJsonNumber("p99_score", c.tailScore);
+        printf(",\"impact_us\":%" PRId64, c.impact);
+        writeJsonStats("before", c.before);
+        writeJsonStats("after", c.after);
+        printf("}");
+    }
+    printf("\n]}\n");
+}
+
+int main(int argc, char **argv)
+{
+    double threshold = DefaultThreshold;
+    double significance = DefaultSignificance;
+    uint64_t minSlices = DefaultMinSlices;
+    bool all = false;
+    bool json = false;
+    bool exitCode = false;
+    int threads = 0;
+
+    static const struct option longOptions[] = {
+        { "threshold", required_argument, NULL, 't' },
+        { "significance", required_argument, NULL, 'z' },
+        { "min-slices", required_argument, NULL, 'm' },
+        { "all", no_argument, NULL, 'a' },
+        { "json", no_argument, NULL, 'j' },
+        { "exit-code", no_argument, NULL, 'e' },
+        { "threads", required_argument, NULL, 'T' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:z:m:ajeT:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            threshold = atof(optarg);
+            if (threshold < 0) {
+                fprintf(stderr, "Invalid threshold: %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'z':
+            significance = atof(optarg);
+            if (significance < 0) {
+                fprintf(stderr, "Invalid significance: %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'm':
+            minSlices = strtoull(optarg, NULL, 10);
+            break;
+        case 'a':
+            all = true;
+            break;
+        case 'j':
+            json = true;
+            break;
+        case 'e':
+            exitCode = true;
+            break;
+        case 'T':
+            threads = atoi(optarg);
+            if (threads <= 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind != argc - 2) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // One trace after the other: each is parsed with all the threads there
+    // are, and only the statistics are kept.
+    TracepointAggregator before, after;
+    if (!aggregate(argv[optind], threads, before) || !aggregate(argv[optind + 1], threads, after))
+        return 2;
+
+    std::map<std::pair<std::string, std::string>, Comparison> byName;
+    for (const TracepointStats &s : before.stats())
+        byName[std::make_pair(s.category, s.name)].before = &s;
+    for (const TracepointStats &s : after.stats())
+        byName[std::make_pair(s.category, s.name)].after = &s;
+
+    std::vector<Comparison> rows;
+    size_t slower = 0, faster = 0;
+    for (auto &entry : byName) {
+        Comparison &c = entry.second;
+        compare(c, threshold / 100, significance, minSlices);
+        slower += c.verdict == Verdict::Slower;
+        faster += c.verdict == Verdict::Faster;
+        if (all || c.verdict != Verdict::Same)
+            rows.push_back(c);
+    }
+
+    // Biggest impact first; then the biggest changes, among those without.
+    std::stable_sort(rows.begin(), rows.end(), [](const Comparison &a, const Comparison &b) {
+        if (llabs(a.impact) != llabs(b.impact))
+            return llabs(a.impact) > llabs(b.impact);
+        return fabs(a.change) > fabs(b.change);
+    });
+
+    if (json) {
+        writeJson(rows, argv[optind], argv[optind + 1], threshold, significance, slower, faster);
+    } else {
+        writeText(rows);
+        fflush(stdout);
+        fprintf(stderr, "%zu slower, %zu faster\n", slower, faster);
+    }
+    return exitCode && slower ? 1 : 0;
+}
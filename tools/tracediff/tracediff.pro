@@ -0,0 +1,16 @@
+QT =
+CONFIG -= app_bundle
+CONFIG += c++11 thread
+TEMPLATE = app
+TARGET = tracediff
+INCLUDEPATH += . ../tracejson ../../traced
+
+# Input
+HEADERS += ../tracejson/CJsonTraceParser.h \
+           ../tracejson/CTracepointStats.h \
+           ../../traced/CTraceStatistics.h
+SOURCES += main.cpp \
+           ../tracejson/CJsonTraceParser.cpp \
+           ../tracejson/CTracepointStats.cpp \
+           ../../traced/CTraceStatistics.cpp \
+           ../../traced/CTraceStrings.cpp
@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <thread>
+
+#include "CJsonTraceParser.h"
+
+// Names are short, and hashed twice an event: this takes them 8 bytes at a
+// time.
+static uint64_t hashString(const char *data, size_t length)
+{
+    uint64_t h = length * 0x9e3779b97f4a7c15ull;
+    uint64_t word;
+    for (; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, 8);
+        h = (h ^ word) * 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 31;
+    }
+    word = 0;
+    for (size_t i = 0; i < length; ++i)
+        word |= (uint64_t)(unsigned char)data[i] << (i * 8);
+    h = (h ^ word) * 0xbf58476d1ce4e5b9ull;
+    return h ^ (h >> 31);
+}
+
+uint32_t JsonStringTable::intern(const char *data, size_t length)
+{
+    if (m_strings.size() * 2 >= m_slots.size())
+        grow();
+
+    uint64_t h = hashString(data, length);
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        uint32_t slot = m_slots[i];
+        if (!slot) {
+            m_slots[i] = m_strings.size() + 1;
+            m_strings.emplace_back(data, length);
+            m_hashes.push_back(h);
+            return m_strings.size() - 1;
+        }
+        const std::string &s = m_strings[slot - 1];
+        if (m_hashes[slot - 1] == h && s.size() == length && memcmp(s.data(), data, length) == 0)
+            return slot - 1;
+    }
+}
+
+void JsonStringTable::grow()
+{
+    m_slots.assign(std::max<size_t>(m_slots.size() * 2, 64), 0);
+    size_t mask = m_slots.size() - 1;
+    for (size_t id = 0; id < m_strings.size(); ++id) {
+        size_t i = m_hashes[id] & mask;
+        while (m_slots[i])
+            i = (i + 1) & mask;
+        m_slots[i] = id + 1;
+    }
+}
+
+void JsonEventTable::clear()
+{
+    phase.clear();
+    pid.clear();
+    tid.clear();
+    timestamp.clear();
+    duration.clear();
+    category.clear();
+    name.clear();
+    value.clear();
+    id.clear();
+    offset.clear();
+    length.clear();
+}
+
+template <typename T>
+static void appendColumn(std::vector<T> &to, const std::vector<T> &from)
+{
+    to.insert(to.end(), from.begin(), from.end());
+}
+
+void JsonEventTable::append(const JsonEventTable &other)
+{
+    appendColumn(phase, other.phase);
+    appendColumn(pid, other.pid);
+    appendColumn(tid, other.tid);
+    appendColumn(timestamp, other.timestamp);
+    appendColumn(duration, other.duration);
+    appendColumn(value, other.value);
+    appendColumn(id, other.id);
+    appendColumn(offset, other.offset);
+    appendColumn(length, other.length);
+
+    // The other table's strings are numbered its own way.
+    std::vector<uint32_t> ids(other.strings.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        const std::string &s = other.strings.string(i);
+        ids[i] = strings.intern(s.data(), s.size());
+    }
+    for (uint32_t c : other.category)
+        category.push_back(ids[c]);
+    for (uint32_t n : other.name)
+        name.push_back(ids[n]);
+}
+
+// Finds the first c in [p, end), or returns end. What's searched for is
+// mostly a few bytes away (the end of a key, or a name), where memchr's
+// call and setup cost more than the search; this looks at 16 bytes at a
+// time, inline.
+static inline const char *findByte(const char *p, const char *end, char c)
+{
+#ifdef __SSE2__
+    const __m128i needle = _mm_set1_epi8(c);
+    for (; end - p >= 16; p += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end && *p != c)
+        ++p;
+    return p;
+}
+
+namespace {
+
+// Parses one event's line. Everything is bounded by end, as the line isn't
+// terminated (it's in the middle of the mapping).
+class LineParser
+{
+public:
+    LineParser(const char *p, const char *end) : m_p(p), m_end(end) {}
+
+    bool parse(JsonEventTable &table);
+
+private:
+    struct Event
+    {
+        char phase = 0;
+        int64_t pid = -1;
+        int64_t tid = 0;
+        int64_t ts = 0;
+        int64_t dur = 0;
+        int64_t value = 0;
+        uint64_t id = 0;
+        const char *cat = "";
+        size_t catLength = 0;
+        const char *name = "";
+        size_t nameLength = 0;
+    };
+
+    bool parseTraced(Event &e);
+    bool parseAny(Event &e);
+
+    void skipSpace()
+    {
+        while (m_p < m_end && (*m_p == ' ' || *m_p == '\t' || *m_p == '\r'))
+            ++m_p;
+    }
+    bool expect(char c)
+    {
+        skipSpace();
+        if (m_p == m_end || *m_p != c)
+            return false;
+        ++m_p;
+        return true;
+    }
+    bool digits(int64_t &value);
+    bool rawString(const char *&start, size_t &length);
+    bool string(const char *&start, size_t &length);
+    bool number(int64_t &value);
+    bool firstNumber(int64_t &value, bool &found);
+    bool skipValue();
+
+    const char *m_p;
+    const char *m_end;
+};
+
+// A run of digits, as traced writes numbers.
+bool LineParser::digits(int64_t &value)
+{
+    const char *start = m_p;
+    uint64_t v = 0;
+    while (m_p < m_end && *m_p >= '0' && *m_p <= '9')
+        v = v * 10 + (*m_p++ - '0');
+    value = v;
+    return m_p != start;
+}
+
+// The rest of a string whose opening quote has been read, as traced writes
+// them: without escapes.
+bool LineParser::rawString(const char *&start, size_t &length)
+{
+    start = m_p;
+    const char *quote = findByte(m_p, m_end, '"');
+    if (quote == m_end || (quote > start && quote[-1] == '\\'))
+        return false;
+    length = quote - start;
+    m_p = quote + 1;
+    return true;
+}
+
+// Leaves start and length covering the string's contents, still escaped:
+// traced doesn't escape anything it writes, so that's only a problem for
+// names from elsewhere, which come out as they're written in the file.
+bool LineParser::string(const char *&start, size_t &length)
+{
+    if (!expect('"'))
+        return false;
+    start = m_p;
+    for (;;) {
+        const char *quote = findByte(m_p, m_end, '"');
+        if (quote == m_end)
+            return false;
+        // Escaped if it's after an odd number of backslashes.
+        const char *b = quote;
+        while (b > start && b[-1] == '\\')
+            --b;
+        m_p = quote + 1;
+        if ((quote - b) % 2 == 0) {
+            length = quote - start;
+            return true;
+        }
+    }
+}
+
+// Reads an integer, or the integer part of a number with a fraction or an
+// exponent (timestamps from other tools can have those).
+bool LineParser::number(int64_t &value)
+{
+    skipSpace();
+    const char *start = m_p;
+    bool negative = m_p < m_end && *m_p == '-';
+    if (negative)
+        ++m_p;
+    if (m_p == m_end || *m_p < '0' || *m_p > '9')
+        return false;
+    uint64_t v = 0;
+    while (m_p < m_end && *m_p >= '0' && *m_p <= '9')
+        v = v * 10 + (*m_p++ - '0');
+    value = negative ? -(int64_t)v : (int64_t)v;
+    if (m_p == m_end || (*m_p != '.' && *m_p != 'e' && *m_p != 'E'))
+        return true;
+
+    // Rare enough to do properly, but slowly.
+    while (m_p < m_end && *m_p && strchr("0123456789.eE+-", *m_p))
+        ++m_p;
+    char buf[64];
+    size_t length = std::min<size_t>(m_p - start, sizeof(buf) - 1);
+    memcpy(buf, start, length);
+    buf[length] = 0;
+    value = (int64_t)strtod(buf, nullptr);
+    return true;
+}
+
+bool LineParser::skipValue()
+{
+    skipSpace();
+    if (m_p == m_end)
+        return false;
+    const char *start;
+    size_t length;
+    switch (*m_p) {
+    case '"':
+        return string(start, length);
+    case '{':
+    case '[': {
+        int depth = 0;
+        while (m_p < m_end) {
+            char c = *m_p;
+            if (c == '"') {
+                if (!string(start, length))
+                    return false;
+                continue;
+            }
+            ++m_p;
+            if (c == '{' || c == '[')
+                ++depth;
+            else if ((c == '}' || c == ']') && --depth == 0)
+                return true;
+        }
+        return false;
+    }
+    default:
+        // A number, true, false or null.
+        while (m_p < m_end && *m_p != ',' && *m_p != '}' && *m_p != ']')
+            ++m_p;
+        return true;
+    }
+}
+
+// Finds the first number among an object's values: a counter's value, or a
+// clock sync marker's realtime_us.
+bool LineParser::firstNumber(int64_t &value, bool &found)
+{
+    if (!expect('{'))
+        return false;
+    if (expect('}'))
+        return true;
+    do {
+        const char *key;
+        size_t keyLength;
+        if (!string(key, keyLength) || !expect(':'))
+            return false;
+        skipSpace();
+        if (!found && m_p < m_end && (*m_p == '-' || (*m_p >= '0' && *m_p <= '9'))) {
+            if (!number(value))
+                return false;
+            found = true;
+        } else if (!skipValue()) {
+            return false;
+        }
+    } while (expect(','));
+    return expect('}');
+}
+
+// Takes the keys in the order traced writes them (see JsonTraceOutput), with
+// nothing between them, as prefixes to compare rather than keys to look up.
+bool LineParser::parseTraced(Event &e)
+{
+#define TAKE(literal) (size_t(m_end - m_p) >= sizeof(literal) - 1 && memcmp(m_p, literal, sizeof(literal) - 1) == 0 \
+                       && (m_p += sizeof(literal) - 1))
+    if (!TAKE("{\"pid\":") || !digits(e.pid))
+        return false;
+    if (TAKE(",\"tid\":") && !digits(e.tid))
+        return false;
+    if (!TAKE(",\"ts\":") || !digits(e.ts))
+        return false;
+    if (TAKE(",\"dur\":") && !digits(e.dur))
+        return false;
+    if (!TAKE(",\"ph\":\"") || m_end - m_p < 2 || m_p[1] != '"')
+        return false;
+    e.phase = *m_p;
+    m_p += 2;
+    if (TAKE(",\"cat\":\"") && !rawString(e.cat, e.catLength))
+        return false;
+    if (!TAKE(",\"name\":\"") || !rawString(e.name, e.nameLength))
+        return false;
+    if (TAKE(",\"id\":")) {
+        if (TAKE("\"")) {
+            const char *s;
+            size_t length;
+            if (!rawString(s, length))
+                return false;
+            e.id = strtoull(s, nullptr, 16);
+        } else {
+            int64_t n;
+            if (!digits(n))
+                return false;
+            e.id = n;
+        }
+    }
+    bool hasValue = false;
+    if (TAKE(",\"args\":") && !firstNumber(e.value, hasValue))
+        return false;
+    return TAKE("}") && m_p == m_end;
+#undef TAKE
+}
+
+bool LineParser::parse(JsonEventTable &table)
+{
+    Event e;
+    const char *start = m_p;
+    if (!parseTraced(e)) {
+        m_p = start;
+        e = Event();
+        if (!parseAny(e))
+            return false;
+    }
+
+    table.phase.push_back(e.phase);
+    table.pid.push_back(e.pid);
+    table.tid.push_back(e.tid);
+    table.timestamp.push_back(e.ts);
+    table.duration.push_back(e.dur);
+    table.category.push_back(table.strings.intern(e.cat, e.catLength));
+    table.name.push_back(table.strings.intern(e.name, e.nameLength));
+    table.value.push_back(e.value);
+    table.id.push_back(e.id);
+    return true;
+}
+
+// Takes the keys in any order, with any spacing, skipping any it doesn't
+// know.
+bool LineParser::parseAny(Event &e)
+{
+    int64_t n;
+    bool hasTs = false, hasValue = false;
+
+    if (!expect('{'))
+        return false;
+    if (expect('}'))
+        return false;
+    do {
+        const char *key;
+        size_t keyLength;
+        if (!string(key, keyLength) || !expect(':'))
+            return false;
+
+#define KEY_IS(k) (keyLength == sizeof(k) - 1 && memcmp(key, k, sizeof(k) - 1) == 0)
+        if (KEY_IS("pid")) {
+            if (!number(e.pid))
+                return false;
+        } else if (KEY_IS("tid")) {
+            if (!number(e.tid))
+                return false;
+        } else if (KEY_IS("ts")) {
+            if (!number(e.ts))
+                return false;
+            hasTs = true;
+        } else if (KEY_IS("dur")) {
+            if (!number(e.dur))
+                return false;
+        } else if (KEY_IS("ph")) {
+            const char *s;
+            size_t length;
+            if (!string(s, length) || length != 1)
+                return false;
+            e.phase = *s;
+        } else if (KEY_IS("cat")) {
+            if (!string(e.cat, e.catLength))
+                return false;
+        } else if (KEY_IS("name")) {
+            if (!string(e.name, e.nameLength))
+                return false;
+        } else if (KEY_IS("id")) {
+            // traced writes ids as hex strings; other tools use numbers.
+            skipSpace();
+            if (m_p < m_end && *m_p == '"') {
+                const char *s;
+                size_t length;
+                if (!string(s, length))
+                    return false;
+                char buf[32];
+                length = std::min(length, sizeof(buf) - 1);
+                memcpy(buf, s, length);
+                buf[length] = 0;
+                e.id = strtoull(buf, nullptr, 0);
+            } else {
+                if (!number(n))
+                    return false;
+                e.id = n;
+            }
+        } else if (KEY_IS("args")) {
+            skipSpace();
+            if (m_p < m_end && *m_p == '{') {
+                if (!firstNumber(e.value, hasValue))
+                    return false;
+            } else if (!skipValue()) {
+                return false;
+            }
+        } else if (!skipValue()) {
+            return false;
+        }
+#undef KEY_IS
+    } while (expect(','));
+    if (!expect('}'))
+        return false;
+
+    // Metadata events ("M") are kept: they name processes and threads.
+    return e.phase && e.pid >= 0 && (hasTs || e.phase == 'M');
+}
+
+}
+
+JsonTraceFile::~JsonTraceFile()
+{
+    if (m_data)
+        munmap((void *)m_data, m_size);
+}
+
+bool JsonTraceFile::open(const char *path)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr, "Can't stat %s: %s\n", path, strerror(errno));
+        ::close(fd);
+        return false;
+    }
+    m_size = st.st_size;
+    if (m_size == 0) {
+        ::close(fd);
+        m_data = nullptr;
+        return true;
+    }
+    void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Can't map %s: %s\n", path, strerror(errno));
+        m_size = 0;
+        return false;
+    }
+    // It's read front to back, a range per thread.
+    madvise(data, m_size, MADV_SEQUENTIAL);
+    m_data = (const char *)data;
+    return true;
+}
+
+// Whether the line is one to parse. The lines traced writes around the
+// events ("{"traceEvents": [", "]," and what comes after) aren't, and
+// neither is anything that isn't an object.
+static bool isEventLine(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        ++p;
+    if (p == end || *p != '{')
+        return false;
+    static const char header[] = "{\"traceEvents\"";
+    return !(size_t(end - p) >= sizeof(header) - 1 && memcmp(p, header, sizeof(header) - 1) == 0);
+}
+
+// Parses the lines that start in [begin, end).
+static uint64_t parseRange(const char *data, const char *begin, const char *end, size_t batchSize, int range,
+                           const JsonTraceFile::BatchFunction &consume)
+{
+    JsonEventTable batch;
+    uint64_t malformed = 0;
+    const char *p = begin;
+    while (p < end) {
+        // memchr is vectorized, and lines are long enough for that to pay.
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        if (!eol)
+            eol = end;
+        const char *last = eol;
+        while (last > p && (last[-1] == ',' || last[-1] == '\r' || last[-1] == ' '))
+            --last;
+        if (isEventLine(p, last)) {
+            const char *start = p;
+            while (*start != '{')
+                ++start;
+            LineParser parser(start, last);
+            if (parser.parse(batch)) {
+                batch.offset.push_back(start - data);
+                batch.length.push_back(last - start);
+                if (batch.size() >= batchSize) {
+                    if (!consume(range, batch))
+                        return malformed;
+                    batch.clear();
+                }
+            } else {
+                ++malformed;
+            }
+        }
+        p = eol + 1;
+    }
+    if (batch.size())
+        consume(range, batch);
+    return malformed;
+}
+
+uint64_t JsonTraceFile::parse(int threads, size_t batchSize, const BatchFunction &consume) const
+{
+    if (!m_size)
+        return 0;
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    // Small ranges aren't worth a thread.
+    threads = (int)std::max<size_t>(1, std::min<size_t>(threads, m_size / (1 << 20) + 1));
+    batchSize = std::max<size_t>(batchSize, 1);
+
+    // Each range ends just after a newline, so every line is in exactly one.
+    std::vector<const char *> bounds;
+    bounds.push_back(m_data);
+    const char *end = m_data + m_size;
+    for (int i = 1; i < threads; ++i) {
+        const char *p = std::max(bounds.back(), m_data + m_size / threads * i);
+        const char *eol = (const char *)memchr(p, '\n', end - p);
+        bounds.push_back(eol ? eol + 1 : end);
+    }
+    bounds.push_back(end);
+
+    std::vector<uint64_t> malformed(threads);
+    std::vector<std::thread> workers;
+    for (int i = 1; i < threads; ++i) {
+        workers.emplace_back([&, i]() {
+            malformed[i] = parseRange(m_data, bounds[i], bounds[i + 1], batchSize, i, consume);
+        });
+    }
+    malformed[0] = parseRange(m_data, bounds[0], bounds[1], batchSize, 0, consume);
+    for (std::thread &t : workers)
+        t.join();
+
+    uint64_t total = 0;
+    for (uint64_t n : malformed)
+        total += n;
+    return total;
+}
+
+uint64_t JsonTraceFile::load(JsonEventTable &table, int threads) const
+{
+    // A table per range, put together in order once they're all parsed.
+    std::vector<JsonEventTable> ranges(threads <= 0 ? std::max(1u, std::thread::hardware_concurrency()) : threads);
+    uint64_t malformed = parse(ranges.size(), SIZE_MAX, [&](int range, JsonEventTable &batch) {
+        std::swap(ranges[range], batch);
+        return true;
+    });
+    for (JsonEventTable &range : ranges) {
+        if (table.size() == 0 && table.strings.size() == 0)
+            std::swap(table, range);
+        else
+            table.append(range);
+    }
+    return malformed;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CJSONTRACEPARSER_H
+#define CJSONTRACEPARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Reads Chrome JSON traces, as traced writes them, fast enough for traces
+// of many gigabytes: the file is mapped into memory, split into ranges at
+// line boundaries, and each range parsed on a thread of its own into tables
+// of events.
+//
+// That relies on traced writing one event per line (as it always does). Any
+// key order is fine, and unknown keys are skipped, but an event split over
+// several lines isn't understood.
+
+// Strings (categories and names) in a JsonEventTable, numbered from 0 in the
+// order they're first seen.
+class JsonStringTable
+{
+public:
+    uint32_t intern(const char *data, size_t length);
+    const std::string &string(uint32_t id) const { return m_strings[id]; }
+    size_t size() const { return m_strings.size(); }
+
+private:
+    void grow();
+
+    std::vector<std::string> m_strings;
+    std::vector<uint64_t> m_hashes;
+    std::vector<uint32_t> m_slots; // open addressing: id + 1, or 0 if free
+};
+
+// Events, a column per field, in the order they're in the file.
+struct JsonEventTable
+{
+    std::vector<char> phase; // "ph": 'X', 'B', 'E', 'C', 'b', 'e', 'c'...
+    std::vector<uint64_t> pid;
+    std::vector<uint64_t> tid; // 0 if there isn't one
+    std::vector<int64_t> timestamp; // microseconds
+    std::vector<int64_t> duration; // "dur", for complete events
+    std::vector<uint32_t> category; // in strings
+    std::vector<uint32_t> name; // in strings
+    std::vector<int64_t> value; // the first number in "args": a counter's value
+    std::vector<uint64_t> id; // "id", for counters and async events
+
+    // Where each event's line is in the file, and how long it is (without
+    // its newline, or the comma before that).
+    std::vector<uint64_t> offset;
+    std::vector<uint32_t> length;
+
+    JsonStringTable strings;
+
+    size_t size() const { return phase.size(); }
+    void clear();
+
+    // Adds other's events to the end of this table.
+    void append(const JsonEventTable &other);
+};
+
+class JsonTraceFile
+{
+public:
+    JsonTraceFile() {}
+    ~JsonTraceFile();
+    JsonTraceFile(const JsonTraceFile &) = delete;
+    JsonTraceFile &operator=(const JsonTraceFile &) = delete;
+
+    // Returns false (having said why) if path can't be mapped.
+    bool open(const char *path);
+
+    const char *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    // Splits the file into up to threads ranges (0 for one per core), and
+    // parses each on a thread of its own, passing its events to consume in
+    // batches of up to batchSize, on that thread. Each range's batches come
+    // in file order; consume returns false to stop parsing that range.
+    // Returns how many lines couldn't be parsed.
+    typedef std::function<bool(int range, JsonEventTable &batch)> BatchFunction;
+    uint64_t parse(int threads, size_t batchSize, const BatchFunction &consume) const;
+
+    // Parses the whole file into table, in file order.
+    uint64_t load(JsonEventTable &table, int threads) const;
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+#endif // CJSONTRACEPARSER_H
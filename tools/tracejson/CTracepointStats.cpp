@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <algorithm>
+
+#include "CTracepointStats.h"
+
+// Bounds on what we keep while matching slices up, as in traced.
+const size_t MaxOpenSlicesPerThread = 1024;
+const size_t MaxFinishedSlicesPerThread = 4096;
+const size_t MaxOpenAsyncSlices = 1024 * 1024;
+
+double TracepointStats::variance() const
+{
+    return slices > 1 ? m2 / (slices - 1) : 0;
+}
+
+uint32_t TracepointAggregator::tracepoint(const std::string &category, const std::string &name)
+{
+    auto key = std::make_pair(category, name);
+    auto it = m_index.find(key);
+    if (it != m_index.end())
+        return it->second;
+    uint32_t index = m_stats.size();
+    m_index.emplace(key, index);
+    m_stats.emplace_back();
+    m_stats.back().category = category;
+    m_stats.back().name = name;
+    return index;
+}
+
+void TracepointAggregator::addSlice(uint32_t tracepoint, int64_t duration, int64_t children)
+{
+    TracepointStats &s = m_stats[tracepoint];
+    // Welford's method: the variance, without the cancellation that summing
+    // squares would suffer.
+    double before = s.mean();
+    ++s.slices;
+    s.total += duration;
+    s.m2 += (duration - before) * (duration - s.mean());
+    s.self += duration - std::min(children, duration);
+    s.max = std::max(s.max, duration);
+    s.histogram.record(duration);
+}
+
+// Takes the finished slices nested in [start, end] off the top of the
+// thread's stack, and returns how long they took between them.
+int64_t TracepointAggregator::claimChildren(Thread &thread, int64_t start, int64_t end)
+{
+    int64_t children = 0;
+    std::vector<Interval> &finished = thread.finished;
+    while (!finished.empty() && finished.back().start >= start && finished.back().end <= end) {
+        children += finished.back().end - finished.back().start;
+        finished.pop_back();
+    }
+    return children;
+}
+
+void TracepointAggregator::pushFinished(Thread &thread, const Interval &interval)
+{
+    if (thread.finished.size() >= MaxFinishedSlicesPerThread) {
+        thread.finished.erase(thread.finished.begin(), thread.finished.begin() + thread.finished.size() / 2);
+        thread.trimmed = true;
+    }
+    thread.finished.push_back(interval);
+}
+
+void TracepointAggregator::sliceEnded(Thread &thread, uint32_t tracepoint, int64_t start, int64_t end)
+{
+    int64_t children = claimChildren(thread, start, end);
+    if (thread.reachesBack())
+        thread.pending.push_back(Pending { false, tracepoint, start, end, children });
+    pushFinished(thread, Interval { start, end });
+    addSlice(tracepoint, end - start, children);
+}
+
+// An end whose begin is in an earlier range: everything that finished on
+// the thread since this range began is nested in it. (An earlier orphan is
+// too, but how long that took is only known once they're merged.)
+void TracepointAggregator::orphanEnded(Thread &thread, int64_t end)
+{
+    int64_t children = 0;
+    for (const Interval &i : thread.finished) {
+        if (i.start != INT64_MIN)
+            children += i.end - i.start;
+    }
+    thread.finished.clear();
+    thread.pending.push_back(Pending { true, 0, 0, end, children });
+    thread.finished.push_back(Interval { INT64_MIN, end });
+}
+
+void TracepointAggregator::add(const JsonEventTable &batch)
+{
+    // The batch's strings, as tracepoints: looked up once per batch, not
+    // once per event.
+    std::unordered_map<uint64_t, uint32_t> tracepoints;
+    ThreadKey lastKey(UINT64_MAX, UINT64_MAX);
+    Thread *thread = nullptr;
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        char phase = batch.phase[i];
+        if (phase == 'M' || phase == 'c')
+            continue;
+
+        if (phase == 'B' || phase == 'E' || phase == 'X') {
+            ThreadKey key(batch.pid[i], batch.tid[i]);
+            if (key != lastKey) {
+                thread = &m_threads[key];
+                lastKey = key;
+            }
+        }
+
+        // An end needn't be named: it's the innermost open slice's.
+        if (phase == 'E') {
+            if (thread->open.empty()) {
+                orphanEnded(*thread, batch.timestamp[i]);
+            } else {
+                Open begin = thread->open.back();
+                thread->open.pop_back();
+                if (batch.timestamp[i] >= begin.start)
+                    sliceEnded(*thread, begin.tracepoint, begin.start, batch.timestamp[i]);
+            }
+            continue;
+        }
+
+        uint64_t key = (uint64_t)batch.category[i] << 32 | batch.name[i];
+        auto it = tracepoints.find(key);
+        if (it == tracepoints.end()) {
+            uint32_t index = tracepoint(batch.strings.string(batch.category[i]), batch.strings.string(batch.name[i]));
+            it = tracepoints.emplace(key, index).first;
+        }
+        uint32_t index = it->second;
+
+        if (phase == 'e') {
+            AsyncKey async(batch.pid[i], index, batch.id[i]);
+            auto open = m_openAsync.find(async);
+            if (open == m_openAsync.end()) {
+                m_orphanAsyncEnds.push_back(AsyncEnd { async, batch.timestamp[i] });
+            } else {
+                if (batch.timestamp[i] >= open->second)
+                    addSlice(index, batch.timestamp[i] - open->second, 0);
+                m_openAsync.erase(open);
+            }
+            continue;
+        }
+
+        ++m_stats[index].count;
+        if (phase == 'X') {
+            sliceEnded(*thread, index, batch.timestamp[i], batch.timestamp[i] + batch.duration[i]);
+        } else if (phase == 'B') {
+            if (thread->open.size() < MaxOpenSlicesPerThread)
+                thread->open.push_back(Open { index, batch.timestamp[i] });
+        } else if (phase == 'b') {
+            if (m_openAsync.size() < MaxOpenAsyncSlices)
+                m_openAsync[AsyncKey(batch.pid[i], index, batch.id[i])] = batch.timestamp[i];
+        }
+    }
+}
+
+void TracepointAggregator::merge(const TracepointAggregator &later)
+{
+    std::vector<uint32_t> remap(later.m_stats.size());
+    for (size_t i = 0; i < later.m_stats.size(); ++i) {
+        const TracepointStats &from = later.m_stats[i];
+        remap[i] = tracepoint(from.category, from.name);
+        TracepointStats &to = m_stats[remap[i]];
+        // Chan et al.'s parallel form of Welford's method.
+        if (from.slices) {
+            double delta = from.mean() - to.mean();
+            to.m2 += from.m2 + delta * delta * to.slices * from.slices / (to.slices + from.slices);
+        }
+        to.count += from.count;
+        to.slices += from.slices;
+        to.total += from.total;
+        to.self += from.self;
+        to.max = std::max(to.max, from.max);
+        to.histogram.merge(from.histogram);
+    }
+
+    for (const auto &entry : later.m_threads) {
+        const Thread &from = entry.second;
+        Thread &to = m_threads[entry.first];
+
+        // Replayed in order, against this thread as it was when later's
+        // events began: whatever later did in between was above them on the
+        // stack, and didn't touch what's here.
+        for (const Pending &p : from.pending) {
+            if (!p.orphan) {
+                int64_t extra = claimChildren(to, p.start, p.end);
+                if (extra) {
+                    int64_t duration = p.end - p.start;
+                    int64_t before = duration - std::min(p.children, duration);
+                    int64_t after = duration - std::min(p.children + extra, duration);
+                    m_stats[remap[p.tracepoint]].self -= before - after;
+                }
+                continue;
+            }
+
+            // Its begin is the innermost one still open here, if any.
+            if (to.open.empty())
+                continue;
+            Open begin = to.open.back();
+            to.open.pop_back();
+            if (p.end < begin.start)
+                continue;
+            int64_t children = p.children + claimChildren(to, begin.start, p.end);
+            addSlice(begin.tracepoint, p.end - begin.start, children);
+            pushFinished(to, Interval { begin.start, p.end });
+        }
+
+        // (The orphan's, if any, is already here.)
+        for (const Interval &i : from.finished) {
+            if (i.start != INT64_MIN)
+                pushFinished(to, i);
+        }
+        to.trimmed = to.trimmed || from.trimmed;
+        for (const Open &open : from.open) {
+            if (to.open.size() < MaxOpenSlicesPerThread)
+                to.open.push_back(Open { remap[open.tracepoint], open.start });
+        }
+    }
+
+    for (const AsyncEnd &end : later.m_orphanAsyncEnds) {
+        AsyncKey key(std::get<0>(end.key), remap[std::get<1>(end.key)], std::get<2>(end.key));
+        auto open = m_openAsync.find(key);
+        if (open == m_openAsync.end())
+            continue;
+        if (end.end >= open->second)
+            addSlice(std::get<1>(key), end.end - open->second, 0);
+        m_openAsync.erase(open);
+    }
+    for (const auto &open : later.m_openAsync) {
+        if (m_openAsync.size() < MaxOpenAsyncSlices) {
+            AsyncKey key(std::get<0>(open.first), remap[std::get<1>(open.first)], std::get<2>(open.first));
+            m_openAsync[key] = open.second;
+        }
+    }
+}
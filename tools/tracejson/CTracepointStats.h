@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACEPOINTSTATS_H
+#define CTRACEPOINTSTATS_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "CJsonTraceParser.h"
+#include "CTraceStatistics.h"
+
+// How often a tracepoint (a category and name) was hit, and for slices, how
+// long they took: as traced -R reports them, but from a JSON trace.
+struct TracepointStats
+{
+    std::string category;
+    std::string name;
+    uint64_t count = 0; // events of any kind (begins, not ends)
+    uint64_t slices = 0; // complete events, and begin/end pairs (sync or async)
+    int64_t total = 0; // microseconds, over slices
+    int64_t self = 0; // total, less that of the slices nested in them
+    int64_t max = 0;
+    double m2 = 0; // sum of squared differences of durations from the mean
+    LatencyHistogram histogram;
+
+    double mean() const { return slices ? (double)total / slices : 0; }
+    double variance() const;
+};
+
+// Adds up TracepointStats over a trace, a batch of events at a time, without
+// holding on to the events. Slices are matched up, and nested, as
+// TracepointStatistics does in traced: per thread, in the order they're in
+// the file, which is the order traced writes them unless it was asked to
+// sort them (-w).
+//
+// Parsing in parallel gives each range of the file its own aggregator; they
+// are merged, in file order, at the end. A begin in one range and its end in
+// a later one are paired up then, and slices finishing early in a range that
+// have children in the one before get their self time put right.
+class TracepointAggregator
+{
+public:
+    void add(const JsonEventTable &batch);
+
+    // Adds in later, which covers the events just after this one's. Ranges
+    // are merged into the first, in order: anything that's still unmatched
+    // in later after that never began, as far as this trace goes.
+    void merge(const TracepointAggregator &later);
+
+    const std::vector<TracepointStats> &stats() const { return m_stats; }
+
+private:
+    struct Open
+    {
+        uint32_t tracepoint;
+        int64_t start;
+    };
+    struct Interval
+    {
+        int64_t start;
+        int64_t end;
+    };
+
+    // A slice that may have children in the aggregator before this one, as
+    // nothing else here was in the way; or an end whose begin is there.
+    struct Pending
+    {
+        bool orphan; // an end without its begin: tracepoint and start unknown
+        uint32_t tracepoint;
+        int64_t start;
+        int64_t end;
+        int64_t children; // found so far
+    };
+
+    struct Thread
+    {
+        std::vector<Open> open; // begun, not ended yet
+        // Slices that may yet turn out to be nested in a later one; the first
+        // is an orphan's (with start INT64_MIN) if one has ended.
+        std::vector<Interval> finished;
+        std::vector<Pending> pending;
+        bool trimmed = false; // finished has been cut short; nothing before it can be reached
+
+        // Whether nothing that finished here is in the way of the slices
+        // before: only, perhaps, an orphan, which may turn out to be nested.
+        bool reachesBack() const
+        {
+            return !trimmed && (finished.empty() || (finished.size() == 1 && finished[0].start == INT64_MIN));
+        }
+    };
+
+    typedef std::pair<uint64_t, uint64_t> ThreadKey; // pid, tid
+    typedef std::tuple<uint64_t, uint32_t, uint64_t> AsyncKey; // pid, tracepoint, id
+
+    struct AsyncEnd
+    {
+        AsyncKey key;
+        int64_t end;
+    };
+
+    uint32_t tracepoint(const std::string &category, const std::string &name);
+    void addSlice(uint32_t tracepoint, int64_t duration, int64_t children);
+    static int64_t claimChildren(Thread &thread, int64_t start, int64_t end);
+    static void pushFinished(Thread &thread, const Interval &interval);
+    void sliceEnded(Thread &thread, uint32_t tracepoint, int64_t start, int64_t end);
+    void orphanEnded(Thread &thread, int64_t end);
+
+    std::vector<TracepointStats> m_stats;
+    std::map<std::pair<std::string, std::string>, uint32_t> m_index;
+    std::map<ThreadKey, Thread> m_threads;
+    std::map<AsyncKey, int64_t> m_openAsync;
+    std::vector<AsyncEnd> m_orphanAsyncEnds;
+};
+
+#endif // CTRACEPOINTSTATS_H
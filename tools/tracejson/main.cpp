@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "CJsonTraceParser.h"
+#include "CTracepointStats.h"
+
+// Reads a JSON trace from traced, in parallel, and says what's in it: a
+// summary, statistics for each tracepoint, or every event as CSV.
+
+// Events are handed over in batches of this many.
+const size_t BatchSize = 65536;
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options] <trace.json>\n", argv0);
+    fprintf(stderr, "Summarizes a JSON trace written by traced.\n");
+    fprintf(stderr, "  -t, --tracepoints      show how often each tracepoint was hit, and how long\n"
+                    "                         its slices took (as traced -R does)\n");
+    fprintf(stderr, "  -c, --csv              write every event out as CSV\n");
+    fprintf(stderr, "  -j, --threads <n>      parse with <n> threads (default: one per core)\n");
+    fprintf(stderr, "  -h, --help             show this help\n");
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reportSpeed(const JsonTraceFile &file, double start, uint64_t malformed)
+{
+    double elapsed = std::max(now() - start, 1e-6);
+    fprintf(stderr, "Parsed %.1f MB in %.2fs (%.0f MB/s)", file.size() / 1e6, elapsed, file.size() / 1e6 / elapsed);
+    if (malformed)
+        fprintf(stderr, ", skipping %" PRIu64 " lines that aren't events", malformed);
+    fprintf(stderr, "\n");
+}
+
+struct Summary
+{
+    uint64_t events = 0;
+    uint64_t phases[256] = {};
+    std::set<uint64_t> pids;
+    std::set<std::pair<uint64_t, uint64_t>> threads;
+    int64_t first = INT64_MAX;
+    int64_t last = INT64_MIN;
+
+    void add(const JsonEventTable &batch)
+    {
+        events += batch.size();
+        for (size_t i = 0; i < batch.size(); ++i) {
+            ++phases[(unsigned char)batch.phase[i]];
+            // Runs of events from one thread are common; skip the lookups.
+            if (i == 0 || batch.pid[i] != batch.pid[i - 1] || batch.tid[i] != batch.tid[i - 1]) {
+                pids.insert(batch.pid[i]);
+                if (batch.tid[i]) // counters and async events don't say
+                    threads.insert(std::make_pair(batch.pid[i], batch.tid[i]));
+            }
+            if (batch.phase[i] == 'M')
+                continue;
+            first = std::min(first, batch.timestamp[i]);
+            last = std::max(last, batch.timestamp[i] + batch.duration[i]);
+        }
+    }
+
+    void merge(const Summary &other)
+    {
+        events += other.events;
+        for (int i = 0; i < 256; ++i)
+            phases[i] += other.phases[i];
+        pids.insert(other.pids.begin(), other.pids.end());
+        threads.insert(other.threads.begin(), other.threads.end());
+        first = std::min(first, other.first);
+        last = std::max(last, other.last);
+    }
+};
+
+static int summarize(const JsonTraceFile &file, int threads)
+{
+    double start = now();
+    std::vector<Summary> ranges(threads);
+    uint64_t malformed = file.parse(threads, BatchSize, [&](int range, JsonEventTable &batch) {
+        ranges[range].add(batch);
+        return true;
+    });
+    for (size_t i = 1; i < ranges.size(); ++i)
+        ranges[0].merge(ranges[i]);
+    reportSpeed(file, start, malformed);
+
+    const Summary &s = ranges[0];
+    printf("events: %" PRIu64 "\n", s.events);
+    for (int i = 0; i < 256; ++i) {
+        if (s.phases[i])
+            printf("  '%c': %" PRIu64 "\n", i, s.phases[i]);
+    }
+    printf("processes: %zu\n", s.pids.size());
+    printf("threads: %zu\n", s.threads.size());
+    if (s.first <= s.last)
+        printf("time: %" PRId64 " to %" PRId64 " (%.3fs)\n", s.first, s.last, (s.last - s.first) / 1e6);
+    return 0;
+}
+
+static int showTracepoints(const JsonTraceFile &file, int threads)
+{
+    double start = now();
+    std::vector<TracepointAggregator> ranges(threads);
+    uint64_t malformed = file.parse(threads, BatchSize, [&](int range, JsonEventTable &batch) {
+        ranges[range].add(batch);
+        return true;
+    });
+    for (size_t i = 1; i < ranges.size(); ++i)
+        ranges[0].merge(ranges[i]);
+    reportSpeed(file, start, malformed);
+
+    std::vector<TracepointStats> stats = ranges[0].stats();
+    std::sort(stats.begin(), stats.end(), [](const TracepointStats &a, const TracepointStats &b) {
+        return a.total != b.total ? a.total > b.total : a.count > b.count;
+    });
+    printf("%10s %10s %14s %14s %10s %10s %10s  %s\n", "count", "slices", "total us", "self us", "p50 us", "p99 us",
+           "max us", "tracepoint");
+    for (const TracepointStats &s : stats) {
+        printf("%10" PRIu64 " %10" PRIu64 " %14" PRId64 " %14" PRId64 " %10" PRIu64 " %10" PRIu64 " %10" PRId64 "  %s/%s\n",
+               s.count, s.slices, s.total, s.self, std::min<uint64_t>(s.histogram.percentile(0.5), s.max),
+               std::min<uint64_t>(s.histogram.percentile(0.99), s.max), s.max, s.category.c_str(), s.name.c_str());
+    }
+    return 0;
+}
+
+// Quotes a field for CSV, if it needs it.
+static void writeCsvField(const std::string &s)
+{
+    if (s.find_first_of(",\"\n") == std::string::npos) {
+        fwrite(s.data(), 1, s.size(), stdout);
+        return;
+    }
+    putchar('"');
+    for (char c : s) {
+        if (c == '"')
+            putchar('"');
+        putchar(c);
+    }
+    putchar('"');
+}
+
+static int writeCsv(const JsonTraceFile &file, int threads)
+{
+    double start = now();
+    JsonEventTable table;
+    uint64_t malformed = file.load(table, threads);
+    reportSpeed(file, start, malformed);
+
+    printf("ph,pid,tid,ts,dur,cat,name,value,id\n");
+    for (size_t i = 0; i < table.size(); ++i) {
+        printf("%c,%" PRIu64 ",%" PRIu64 ",%" PRId64 ",%" PRId64 ",", table.phase[i], table.pid[i], table.tid[i],
+               table.timestamp[i], table.duration[i]);
+        writeCsvField(table.strings.string(table.category[i]));
+        putchar(',');
+        writeCsvField(table.strings.string(table.name[i]));
+        printf(",%" PRId64 ",%" PRIu64 "\n", table.value[i], table.id[i]);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    enum { Summarize, Tracepoints, Csv } mode = Summarize;
+    int threads = 0;
+
+    static const struct option longOptions[] = {
+        { "tracepoints", no_argument, NULL, 't' },
+        { "csv", no_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 'j' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "tcj:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            mode = Tracepoints;
+            break;
+        case 'c':
+            mode = Csv;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads <= 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!threads)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    JsonTraceFile file;
+    if (!file.open(argv[optind]))
+        return 1;
+
+    switch (mode) {
+    case Summarize:
+        return summarize(file, threads);
+    case Tracepoints:
+        return showTracepoints(file, threads);
+    case Csv:
+        return writeCsv(file, threads);
+    }
+    return 0;
+}
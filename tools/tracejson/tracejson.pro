@@ -0,0 +1,16 @@
+QT =
+CONFIG -= app_bundle
+CONFIG += c++11 thread
+TEMPLATE = app
+TARGET = tracejson
+INCLUDEPATH += . ../../traced
+
+# Input
+HEADERS += CJsonTraceParser.h \
+           CTracepointStats.h \
+           ../../traced/CTraceStatistics.h
+SOURCES += main.cpp \
+           CJsonTraceParser.cpp \
+           CTracepointStats.cpp \
+           ../../traced/CTraceStatistics.cpp \
+           ../../traced/CTraceStrings.cpp
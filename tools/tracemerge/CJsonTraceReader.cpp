@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "CJsonTraceReader.h"
+
+// Lines are handed over in batches of this many, with up to MaxBatches
+// waiting at a time.
+static const size_t BatchSize = 4096;
+static const size_t MaxBatches = 16;
+
+// Finds "key":<number> in line, returning where the number starts and ends.
+static bool findNumber(const std::string &line, const char *key, size_t &start, size_t &end, int64_t &value)
+{
+    size_t pos = line.find(key);
+    if (pos == std::string::npos)
+        return false;
+    start = pos + strlen(key);
+    const char *begin = line.c_str() + start;
+    char *stop;
+    value = strtoll(begin, &stop, 10);
+    if (stop == begin)
+        return false;
+    end = start + (stop - begin);
+    return true;
+}
+
+bool summarizeJsonTrace(const std::string &path, JsonTraceSummary &summary)
+{
+    JsonTraceFile file;
+    if (!file.open(path.c_str()))
+        return false;
+
+    // Each range of the file is summarized on its own, and the first clock
+    // sync marker taken from the earliest range that has one.
+    struct Range
+    {
+        JsonTraceSummary summary;
+        size_t clockSyncOffset = 0;
+        size_t clockSyncLength = 0;
+    };
+    std::vector<Range> ranges(std::max(1u, std::thread::hardware_concurrency()));
+    summary.malformed = file.parse(ranges.size(), BatchSize, [&](int index, JsonEventTable &batch) {
+        Range &range = ranges[index];
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (batch.phase[i] != 'c') {
+                range.summary.pids.insert(batch.pid[i]);
+                ++range.summary.events;
+            } else if (!range.summary.hasClockSync) {
+                range.summary.hasClockSync = true;
+                range.summary.realtimeOffset = batch.value[i] - batch.timestamp[i];
+                range.clockSyncOffset = batch.offset[i];
+                range.clockSyncLength = batch.length[i];
+            }
+        }
+        return true;
+    });
+
+    for (const Range &range : ranges) {
+        if (range.summary.hasClockSync && !summary.hasClockSync) {
+            summary.hasClockSync = true;
+            summary.realtimeOffset = range.summary.realtimeOffset;
+            summary.clockSyncLine.assign(file.data() + range.clockSyncOffset, range.clockSyncLength);
+        }
+        summary.pids.insert(range.summary.pids.begin(), range.summary.pids.end());
+        summary.events += range.summary.events;
+    }
+    return true;
+}
+
+JsonTraceReader::JsonTraceReader(const std::string &path, int64_t shift,
+                                 const std::unordered_map<uint64_t, int64_t> &pidShift,
+                                 uint64_t window, size_t maxHeld)
+    : m_path(path)
+    , m_shift(shift)
+    , m_pidShift(pidShift)
+    , m_window(window)
+    , m_maxHeld(std::max<size_t>(maxHeld, 1))
+    , m_finished(false)
+    , m_stopping(false)
+    , m_failed(false)
+    , m_dropped(0)
+    , m_batchPos(0)
+    , m_latest(INT64_MIN)
+    , m_drained(false)
+{
+    m_thread = std::thread(&JsonTraceReader::run, this);
+}
+
+JsonTraceReader::~JsonTraceReader()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+}
+
+// Moves the event's timestamp and pid. The numbers are replaced back to
+// front, so that each replacement leaves the earlier ones where they were.
+bool JsonTraceReader::rewrite(std::string &line, int64_t &timestamp) const
+{
+    size_t pidStart, pidEnd, tidStart = 0, tidEnd = 0, tsStart, tsEnd;
+    int64_t pid, tid = 0;
+    if (!findNumber(line, "\"pid\":", pidStart, pidEnd, pid) || !findNumber(line, "\"ts\":", tsStart, tsEnd, timestamp))
+        return false;
+    bool hasTid = findNumber(line, "\"tid\":", tidStart, tidEnd, tid) && tidStart < tsStart;
+
+    timestamp += m_shift;
+    if (m_shift)
+        line.replace(tsStart, tsEnd - tsStart, std::to_string(timestamp));
+
+    auto it = m_pidShift.find(pid);
+    if (it != m_pidShift.end()) {
+        if (hasTid)
+            line.replace(tidStart, tidEnd - tidStart, std::to_string(tid + it->second));
+        line.replace(pidStart, pidEnd - pidStart, std::to_string(pid + it->second));
+    }
+    return true;
+}
+
+void JsonTraceReader::run()
+{
+    JsonTraceFile file;
+    if (!file.open(m_path.c_str())) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_failed = m_finished = true;
+        m_cond.notify_all();
+        return;
+    }
+
+    // Parsed on this thread, in order, a batch at a time.
+    std::vector<JsonEventLine> lines;
+    uint64_t dropped = 0;
+    file.parse(1, BatchSize, [&](int, JsonEventTable &batch) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (batch.phase[i] == 'c')
+                continue;
+            JsonEventLine event;
+            event.text.assign(file.data() + batch.offset[i], batch.length[i]);
+            if (rewrite(event.text, event.timestamp))
+                lines.push_back(std::move(event));
+            else
+                ++dropped;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() { return m_batches.size() < MaxBatches || m_stopping; });
+        if (m_stopping)
+            return false;
+        m_batches.push_back(std::move(lines));
+        lines.clear();
+        m_cond.notify_all();
+        return true;
+    });
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_dropped = dropped;
+    m_finished = true;
+    m_cond.notify_all();
+}
+
+bool JsonTraceReader::take(std::vector<JsonEventLine> &batch)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [this]() { return !m_batches.empty() || m_finished; });
+    if (m_batches.empty())
+        return false;
+    batch = std::move(m_batches.front());
+    m_batches.pop_front();
+    m_cond.notify_all();
+    return true;
+}
+
+bool JsonTraceReader::next(JsonEventLine &line)
+{
+    auto later = [](const JsonEventLine &a, const JsonEventLine &b) {
+        return a.timestamp > b.timestamp;
+    };
+
+    // Read on until the earliest event held is older than the window (or
+    // there's nothing more to read).
+    while (!m_drained) {
+        if (!m_held.empty() && (m_held.front().timestamp + (int64_t)m_window <= m_latest || m_held.size() >= m_maxHeld))
+            break;
+        if (m_batchPos == m_batch.size()) {
+            m_batch.clear();
+            m_batchPos = 0;
+            if (!take(m_batch))
+                m_drained = true;
+            continue;
+        }
+        JsonEventLine &event = m_batch[m_batchPos++];
+        m_latest = std::max(m_latest, event.timestamp);
+        m_held.push_back(std::move(event));
+        std::push_heap(m_held.begin(), m_held.end(), later);
+    }
+
+    if (m_held.empty())
+        return false;
+    std::pop_heap(m_held.begin(), m_held.end(), later);
+    line = std::move(m_held.back());
+    m_held.pop_back();
+    return true;
+}
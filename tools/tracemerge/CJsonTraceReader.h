@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CJSONTRACEREADER_H
+#define CJSONTRACEREADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "CJsonTraceParser.h"
+
+// Reads JSON traces as traced writes them, one event per line, with
+// JsonTraceFile. Anything else (the header and footer lines, and the kernel
+// trace data atrace adds) is skipped.
+
+// What tracemerge needs to know about a trace before merging it.
+struct JsonTraceSummary
+{
+    // From the first clock sync marker (see JsonTraceOutput::writeClockSync):
+    // what to add to the trace's timestamps to get CLOCK_REALTIME.
+    bool hasClockSync = false;
+    int64_t realtimeOffset = 0;
+    std::string clockSyncLine;
+
+    std::set<uint64_t> pids;
+    uint64_t events = 0;
+
+    // Lines that look like events but can't be parsed, and so are left out.
+    uint64_t malformed = 0;
+};
+
+// Reads through the trace at path, in parallel. Returns false if it can't be
+// read.
+bool summarizeJsonTrace(const std::string &path, JsonTraceSummary &summary);
+
+// One event line, as it's to be written out.
+struct JsonEventLine
+{
+    int64_t timestamp;
+    std::string text;
+};
+
+// Reads events from a trace on a thread of its own, moving their timestamps
+// by shift and their pids (and tids) by pidShift[pid], if any, and hands
+// them out in timestamp order.
+//
+// traced writes events roughly, not exactly, in time order (complete events
+// go out when they end, for one), so they're held back for up to window
+// microseconds (of the trace's time) to put them in order, and no more than
+// maxHeld at a time. Clock sync markers are dropped.
+class JsonTraceReader
+{
+public:
+    JsonTraceReader(const std::string &path, int64_t shift, const std::unordered_map<uint64_t, int64_t> &pidShift,
+                    uint64_t window, size_t maxHeld);
+    ~JsonTraceReader();
+
+    // The next event. Returns false once they've all been read.
+    bool next(JsonEventLine &line);
+
+    // Whether the file couldn't be opened.
+    bool failed() const { return m_failed; }
+
+    // How many events were left out for having no pid or timestamp (those
+    // that can't be parsed at all are in JsonTraceSummary::malformed). Only
+    // known once next() has returned false.
+    uint64_t dropped() const { return m_dropped; }
+
+private:
+    void run();
+    bool rewrite(std::string &line, int64_t &timestamp) const;
+    bool take(std::vector<JsonEventLine> &batch);
+
+    std::string m_path;
+    int64_t m_shift;
+    std::unordered_map<uint64_t, int64_t> m_pidShift;
+    uint64_t m_window;
+    size_t m_maxHeld;
+
+    // Batches of lines from the reading thread. Bounded, so that a trace
+    // that's read faster than it's merged doesn't end up all in memory.
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<std::vector<JsonEventLine>> m_batches;
+    bool m_finished;
+    bool m_stopping;
+    bool m_failed;
+    uint64_t m_dropped;
+
+    // Only touched by next(): events read but not handed out yet, as a
+    // min-heap on timestamp, and the latest timestamp read.
+    std::vector<JsonEventLine> m_held;
+    std::vector<JsonEventLine> m_batch;
+    size_t m_batchPos;
+    int64_t m_latest;
+    bool m_drained;
+
+    std::thread m_thread;
+};
+
+#endif // CJSONTRACEREADER_H
@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "CTraceRecords.h"
+#include "CJsonTraceReader.h"
+
+// Recombines the shards of a trace written with traced -H into one trace,
+// as listed in its manifest; or merges separate JSON traces (from different
+// hosts, or runs of traced) into one, lining them up by their clock sync
+// markers.
+
+// How long to hold events back for, to write them in time order, by default.
+const int DefaultSortWindow = 2000;
+
+// How many events to hold back from any one trace, at most.
+const size_t MaxHeldEvents = 1024 * 1024;
+
+// A trace's colliding pids are moved up by a multiple of this (or a power of
+// ten times it, if there are bigger pids), as traced -A does for each host.
+const uint64_t PidStride = 10000000;
+
+struct ShardInfo
+{
+    std::string path;
+    int64_t offset; // to add to its timestamps
+};
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options] <manifest>\n", argv0);
+    fprintf(stderr, "       %s [options] <trace.json> <trace.json>...\n", argv0);
+    fprintf(stderr, "Combines the shards of a trace written with traced -H (json or binary),\n"
+                    "or merges JSON traces into one, in time order, on one clock.\n");
+    fprintf(stderr, "  -o, --output <file>    write the trace to <file> (default: stdout)\n");
+    fprintf(stderr, "  -w, --sort-window <ms> hold events back for up to <ms> to put them in\n"
+                    "                         order (default: %d)\n", DefaultSortWindow);
+    fprintf(stderr, "  -n, --no-align         don't line traces up by their clock sync markers\n");
+    fprintf(stderr, "  -k, --keep-pids        don't renumber processes whose pid is in more\n"
+                    "                         than one trace\n");
+    fprintf(stderr, "  -h, --help             show this help\n");
+}
+
+// Shards are listed relative to the manifest.
+static std::string siblingPath(const std::string &manifest, const std::string &name)
+{
+    size_t slash = manifest.rfind('/');
+    return slash == std::string::npos ? name : manifest.substr(0, slash + 1) + name;
+}
+
+static bool readManifest(const char *path, std::string &format, std::vector<ShardInfo> &shards,
+                         bool &hasRealtimeOffset, int64_t &realtimeOffset)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    char line[4096];
+    bool valid = fgets(line, sizeof(line), f) && strcmp(line, "traced-manifest 1\n") == 0;
+    while (valid && fgets(line, sizeof(line), f)) {
+        char name[1024];
+        long long offset;
+        if (sscanf(line, "format %1023s", name) == 1) {
+            format = name;
+        } else if (sscanf(line, "realtime-offset %lld", &offset) == 1) {
+            hasRealtimeOffset = true;
+            realtimeOffset = offset;
+        } else if (sscanf(line, "shard %1023s offset %lld", name, &offset) == 2) {
+            shards.push_back(ShardInfo { siblingPath(path, name), offset });
+        }
+        // Anything else is informational, or from a newer traced.
+    }
+    fclose(f);
+
+    if (!valid)
+        fprintf(stderr, "%s isn't a traced manifest\n", path);
+    return valid;
+}
+
+static const char JsonHeader[] = "{\"traceEvents\": [";
+
+static bool isManifest(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    char line[32];
+    bool manifest = fgets(line, sizeof(line), f) && strcmp(line, "traced-manifest 1\n") == 0;
+    fclose(f);
+    return manifest;
+}
+
+static bool mergeTraces(const std::vector<std::string> &paths, FILE *out, uint64_t window, bool align, bool keepPids)
+{
+    // First find out how the traces' clocks relate, and which pids collide,
+    // reading them all at once.
+    size_t count = paths.size();
+    std::vector<JsonTraceSummary> summaries(count);
+    std::vector<char> read(count);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < count; ++i) {
+        threads.emplace_back([&, i]() {
+            read[i] = summarizeJsonTrace(paths[i], summaries[i]);
+        });
+    }
+    for (std::thread &t : threads)
+        t.join();
+    if (std::find(read.begin(), read.end(), false) != read.end())
+        return false;
+
+    // Everything goes onto the clock of the first trace with a marker.
+    int reference = -1;
+    std::vector<int64_t> shifts(count, 0);
+    for (size_t i = 0; align && i < count; ++i) {
+        if (!summaries[i].hasClockSync) {
+            fprintf(stderr, "%s has no clock sync marker; leaving its times as they are\n", paths[i].c_str());
+            continue;
+        }
+        if (reference == -1)
+            reference = i;
+        shifts[i] = summaries[i].realtimeOffset - summaries[reference].realtimeOffset;
+    }
+
+    uint64_t maxPid = 0;
+    for (const JsonTraceSummary &summary : summaries) {
+        if (!summary.pids.empty())
+            maxPid = std::max(maxPid, *summary.pids.rbegin());
+    }
+    uint64_t stride = PidStride;
+    while (stride <= maxPid)
+        stride *= 10;
+
+    std::vector<std::unordered_map<uint64_t, int64_t>> pidShifts(count);
+    std::set<uint64_t> seen;
+    for (size_t i = 0; i < count; ++i) {
+        for (uint64_t pid : summaries[i].pids) {
+            if (!keepPids && seen.count(pid))
+                pidShifts[i][pid] = i * stride;
+        }
+        for (uint64_t pid : summaries[i].pids) {
+            auto it = pidShifts[i].find(pid);
+            seen.insert(it == pidShifts[i].end() ? pid : pid + it->second);
+        }
+        if (!pidShifts[i].empty())
+            fprintf(stderr, "%s: %zu processes renumbered, from %" PRIu64 " up\n", paths[i].c_str(),
+                    pidShifts[i].size(), i * stride);
+    }
+
+    // Then merge them, a little behind the latest event read from each.
+    std::vector<std::unique_ptr<JsonTraceReader>> readers;
+    std::vector<JsonEventLine> heads(count);
+    auto later = [&heads](size_t a, size_t b) {
+        return heads[a].timestamp > heads[b].timestamp;
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> queue(later);
+    for (size_t i = 0; i < count; ++i) {
+        readers.emplace_back(new JsonTraceReader(paths[i], shifts[i], pidShifts[i], window, MaxHeldEvents));
+        if (readers[i]->next(heads[i]))
+            queue.push(i);
+    }
+
+    fprintf(out, "%s\n", JsonHeader);
+    bool hasEvents = false;
+    if (reference != -1) {
+        // So that the result can be lined up with others in turn.
+        fputs(summaries[reference].clockSyncLine.c_str(), out);
+        hasEvents = true;
+    }
+
+    uint64_t events = 0;
+    uint64_t lateEvents = 0;
+    int64_t lastTimestamp = INT64_MIN;
+    while (!queue.empty()) {
+        size_t i = queue.top();
+        queue.pop();
+        const JsonEventLine &event = heads[i];
+        fputs(hasEvents ? ",\n" : "", out);
+        fputs(event.text.c_str(), out);
+        hasEvents = true;
+        ++events;
+        if (event.timestamp < lastTimestamp)
+            ++lateEvents;
+        else
+            lastTimestamp = event.timestamp;
+        if (readers[i]->next(heads[i]))
+            queue.push(i);
+    }
+    fputs("\n]\n}\n", out);
+
+    // The merge is missing whatever couldn't be read, so it's a failure,
+    // even with everything else written.
+    bool ok = true;
+    for (size_t i = 0; i < count; ++i) {
+        ok = !readers[i]->failed() && ok;
+        uint64_t dropped = summaries[i].malformed + readers[i]->dropped();
+        if (dropped) {
+            fprintf(stderr, "%s: left out %" PRIu64 " events that couldn't be parsed\n", paths[i].c_str(), dropped);
+            ok = false;
+        }
+    }
+    if (lateEvents)
+        fprintf(stderr, "%" PRIu64 " of %" PRIu64 " events were further out of order than the sort window (-w), and written out of order\n",
+                lateEvents, events);
+    return ok;
+}
+
+// Each event is on a line of its own, separated by commas, between the
+// header and footer lines that JsonTraceOutput writes.
+static bool mergeJson(const ShardInfo &shard, FILE *out, bool &hasEvents)
+{
+    FILE *in = fopen(shard.path.c_str(), "r");
+    if (!in) {
+        fprintf(stderr, "Can't open %s: %s\n", shard.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string line;
+    char buf[65536];
+    while (fgets(buf, sizeof(buf), in)) {
+        line += buf;
+        if (line.back() != '\n' && !feof(in))
+            continue; // longer than buf
+
+        while (!line.empty() && (line.back() == '\n' || line.back() == ','))
+            line.pop_back();
+        if (line.compare(0, 2, "{\"") == 0 && line.compare(0, strlen(JsonHeader), JsonHeader) != 0) {
+            if (shard.offset) {
+                size_t ts = line.find("\"ts\":");
+                if (ts != std::string::npos) {
+                    ts += 5;
+                    char *end;
+                    int64_t value = strtoll(line.c_str() + ts, &end, 10) + shard.offset;
+                    line.replace(ts, end - (line.c_str() + ts), std::to_string(value));
+                }
+            }
+            fputs(hasEvents ? ",\n" : "", out);
+            fputs(line.c_str(), out);
+            hasEvents = true;
+        }
+        line.clear();
+    }
+
+    bool ok = !ferror(in);
+    if (!ok)
+        fprintf(stderr, "Can't read %s: %s\n", shard.path.c_str(), strerror(errno));
+    fclose(in);
+    return ok;
+}
+
+// Binary shards can follow on from each other as they are: they all use
+// traced's string IDs, and a reader skips each one's file header. Only the
+// timestamps may need adjusting.
+static bool mergeBinary(const ShardInfo &shard, FILE *out)
+{
+    FILE *in = fopen(shard.path.c_str(), "r");
+    if (!in) {
+        fprintf(stderr, "Can't open %s: %s\n", shard.path.c_str(), strerror(errno));
+        return false;
+    }
+
+    RecordReader reader(in);
+    if (!reader.readFileHeader()) {
+        fprintf(stderr, "%s isn't a traced binary trace\n", shard.path.c_str());
+        fclose(in);
+        return false;
+    }
+    RecordType type;
+    std::string payload;
+    while (reader.next(type, payload)) {
+        if (type == RecordType::EventRecord && payload.size() >= sizeof(EventRecord) && shard.offset) {
+            EventRecord r;
+            memcpy(&r, payload.data(), sizeof(r));
+            r.timestamp += shard.offset;
+            memcpy(&payload[0], &r, sizeof(r));
+        }
+        RecordHeader h;
+        memset(&h, 0, sizeof(h));
+        h.length = payload.size();
+        h.type = type;
+        fwrite(&h, sizeof(h), 1, out);
+        fwrite(payload.data(), 1, payload.size(), out);
+    }
+
+    bool ok = !ferror(in);
+    if (!ok)
+        fprintf(stderr, "Can't read %s: %s\n", shard.path.c_str(), strerror(errno));
+    if (reader.corrupt()) {
+        fprintf(stderr, "%s is corrupt\n", shard.path.c_str());
+        ok = false;
+    }
+    fclose(in);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const char *outputPath = nullptr;
+    int sortWindow = DefaultSortWindow;
+    bool align = true;
+    bool keepPids = false;
+
+    static const struct option longOptions[] = {
+        { "output", required_argument, 0, 'o' },
+        { "sort-window", required_argument, 0, 'w' },
+        { "no-align", no_argument, 0, 'n' },
+        { "keep-pids", no_argument, 0, 'k' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:w:nkh", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'o':
+            outputPath = optarg;
+            break;
+        case 'w':
+            sortWindow = atoi(optarg);
+            if (sortWindow < 0) {
+                fprintf(stderr, "Invalid sort window: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'n':
+            align = false;
+            break;
+        case 'k':
+            keepPids = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+
+    if (optind == argc) {
+        usage(argv[0]);
+        exit(-1);
+    }
+
+    if (optind + 1 != argc || !isManifest(argv[optind])) {
+        FILE *out = outputPath ? fopen(outputPath, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "Can't open %s: %s\n", outputPath, strerror(errno));
+            exit(-1);
+        }
+        bool ok = mergeTraces(std::vector<std::string>(argv + optind, argv + argc), out, sortWindow * 1000ULL, align, keepPids);
+        if (fflush(out) != 0 || ferror(out)) {
+            perror("Can't write trace");
+            ok = false;
+        }
+        if (out != stdout)
+            fclose(out);
+        return ok ? 0 : -1;
+    }
+
+    std::string format;
+    std::vector<ShardInfo> shards;
+    bool hasRealtimeOffset = false;
+    int64_t realtimeOffset = 0;
+    if (!readManifest(argv[optind], format, shards, hasRealtimeOffset, realtimeOffset))
+        exit(-1);
+    if (format != "json" && format != "binary") {
+        fprintf(stderr, "Can't merge %s shards; each can be loaded on its own\n", format.c_str());
+        exit(-1);
+    }
+
+    FILE *out = outputPath ? fopen(outputPath, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Can't open %s: %s\n", outputPath, strerror(errno));
+        exit(-1);
+    }
+
+    bool ok = true;
+    bool hasEvents = false;
+    if (format == "json") {
+        fprintf(out, "%s\n", JsonHeader);
+        // The shards don't have markers of their own, but the manifest says
+        // the same thing.
+        if (hasRealtimeOffset) {
+            fprintf(out, "{\"pid\":0,\"tid\":0,\"ts\":0,\"ph\":\"c\",\"name\":\"clock_sync\",\"args\":{\"sync_id\":\"realtime\",\"realtime_us\":%" PRId64 "}}",
+                    realtimeOffset);
+            hasEvents = true;
+        }
+    } else {
+        RecordFileHeader h;
+        memcpy(h.magic, TRACED_RECORDS_MAGIC, sizeof(h.magic));
+        h.version = 1;
+        h.reserved = 0;
+        fwrite(&h, sizeof(h), 1, out);
+    }
+    for (const ShardInfo &shard : shards) {
+        if (format == "json")
+            ok = mergeJson(shard, out, hasEvents) && ok;
+        else
+            ok = mergeBinary(shard, out) && ok;
+    }
+    if (format == "json")
+        fputs("\n]\n}\n", out);
+
+    if (fflush(out) != 0 || ferror(out)) {
+        perror("Can't write trace");
+        ok = false;
+    }
+    if (out != stdout)
+        fclose(out);
+    return ok ? 0 : -1;
+}
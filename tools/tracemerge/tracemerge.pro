@@ -0,0 +1,13 @@
+QT =
+CONFIG -= app_bundle
+CONFIG += c++11 thread
+TEMPLATE = app
+TARGET = tracemerge
+INCLUDEPATH += . ../../traced ../tracejson
+
+# Input
+HEADERS += CJsonTraceReader.h \
+           ../tracejson/CJsonTraceParser.h
+SOURCES += main.cpp \
+           CJsonTraceReader.cpp \
+           ../tracejson/CJsonTraceParser.cpp
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <algorithm>
+
+#include "CTraceLod.h"
+
+static LodEvent single(const TraceEvent &e)
+{
+    return LodEvent { e, 1, e.duration };
+}
+
+LevelOfDetail::LevelOfDetail(uint64_t resolution, const Output &output)
+    : m_resolution(std::max<uint64_t>(resolution, 1))
+    , m_output(output)
+{
+}
+
+void LevelOfDetail::add(const TraceEvent &e)
+{
+    switch (e.type) {
+    case MessageType::DurationMessage: {
+        Thread &thread = m_threads[ThreadKey(e.pid, e.tid)];
+        if (!thread.starting.empty() && thread.starting.front().timestamp != e.timestamp)
+            addStartingSlices(thread);
+        thread.starting.push_back(e);
+        break;
+    }
+    case MessageType::CounterMessage:
+    case MessageType::CounterMessageWithId: {
+        CounterKey key(e.pid, e.categoryId, e.tracepointId, e.id);
+        auto it = m_counters.find(key);
+        if (it == m_counters.end()) {
+            // The first point is always kept.
+            Counter &counter = m_counters[key];
+            counter.kept = counter.latest = e;
+            counter.buckets = 0;
+            m_output(single(e));
+        } else {
+            addPoint(it->second, e);
+        }
+        break;
+    }
+    default:
+        m_output(single(e));
+        break;
+    }
+}
+
+void LevelOfDetail::finish()
+{
+    for (auto &thread : m_threads) {
+        addStartingSlices(thread.second);
+        finishRuns(thread.second, 0);
+    }
+    m_threads.clear();
+
+    for (auto &counter : m_counters)
+        finishCounter(counter.second);
+    m_counters.clear();
+}
+
+void LevelOfDetail::addStartingSlices(Thread &thread)
+{
+    // Longest first, so parents come before their children.
+    std::stable_sort(thread.starting.begin(), thread.starting.end(), [](const TraceEvent &a, const TraceEvent &b) {
+        return a.duration > b.duration;
+    });
+    for (const TraceEvent &e : thread.starting)
+        addSlice(thread, e);
+    thread.starting.clear();
+}
+
+void LevelOfDetail::finishRuns(Thread &thread, size_t depth)
+{
+    while (thread.runs.size() > depth) {
+        if (thread.runs.back().count)
+            m_output(thread.runs.back());
+        thread.runs.pop_back();
+    }
+}
+
+void LevelOfDetail::addSlice(Thread &thread, const TraceEvent &e)
+{
+    std::vector<OpenSlice> &open = thread.open;
+
+    // Timestamps are only microseconds, so a slice that took no time can
+    // still have others inside it.
+    while (!open.empty() && (open.back().end < e.timestamp || (open.back().end == e.timestamp && !open.back().empty)))
+        open.pop_back();
+    size_t depth = open.size();
+    bool small = e.duration < m_resolution;
+
+    // Anything inside a slice too small to see is too small as well, and is
+    // left out: it shows up again at a finer level.
+    bool hidden = !open.empty() && open.back().small;
+    open.push_back(OpenSlice { e.timestamp + e.duration, e.duration == 0, small });
+    if (hidden)
+        return;
+
+    // Anything deeper belonged to a previous slice at this depth, and mustn't
+    // grow past it.
+    finishRuns(thread, depth + 1);
+    if (thread.runs.size() <= depth)
+        thread.runs.resize(depth + 1, LodEvent { TraceEvent(), 0, 0 });
+
+    LodEvent &run = thread.runs[depth];
+    uint64_t runEnd = run.event.timestamp + run.event.duration;
+    if (run.count && small && run.event.tracepointId == e.tracepointId &&
+            run.event.categoryId == e.categoryId && e.timestamp <= runEnd + m_resolution) {
+        run.event.duration = std::max(runEnd, e.timestamp + e.duration) - run.event.timestamp;
+        run.count++;
+        run.totalDuration += e.duration;
+        return;
+    }
+
+    if (run.count)
+        m_output(run);
+    if (small) {
+        run = single(e);
+    } else {
+        m_output(single(e));
+        run.count = 0;
+    }
+}
+
+void LevelOfDetail::Bucket::start(uint64_t i, const TraceEvent &e)
+{
+    index = i;
+    first = last = lowest = highest = e;
+    timeSum = e.timestamp;
+    valueSum = e.value;
+    count = 1;
+}
+
+void LevelOfDetail::Bucket::add(const TraceEvent &e)
+{
+    last = e;
+    if (e.value < lowest.value)
+        lowest = e;
+    if (e.value > highest.value)
+        highest = e;
+    timeSum += e.timestamp;
+    valueSum += e.value;
+    count++;
+}
+
+// Points are put in buckets by time, and one is kept from each. Which one
+// depends on the point kept from the bucket before, and on the average of
+// the bucket after, so each bucket is decided once the next is complete.
+void LevelOfDetail::addPoint(Counter &counter, const TraceEvent &e)
+{
+    counter.latest = e;
+    uint64_t index = e.timestamp / m_resolution;
+
+    if (counter.buckets == 0) {
+        counter.current.start(index, e);
+        counter.buckets = 1;
+    } else if (counter.buckets == 1 && index == counter.current.index) {
+        counter.current.add(e);
+    } else if (counter.buckets == 1) {
+        counter.next.start(index, e);
+        counter.buckets = 2;
+    } else if (index == counter.next.index) {
+        counter.next.add(e);
+    } else {
+        const Bucket &next = counter.next;
+        choosePoint(counter, counter.current, next.timeSum / next.count, next.valueSum / next.count);
+        counter.current = counter.next;
+        counter.next.start(index, e);
+    }
+}
+
+// Keep whichever of the bucket's candidates makes the largest triangle with
+// the point kept before it, and the next point (or the average of the next
+// bucket).
+void LevelOfDetail::choosePoint(Counter &counter, const Bucket &bucket, double nextTime, double nextValue)
+{
+    double ax = counter.kept.timestamp;
+    double ay = counter.kept.value;
+    double maxArea = -1;
+    const TraceEvent *chosen = &bucket.first;
+    for (const TraceEvent *e : { &bucket.first, &bucket.lowest, &bucket.highest, &bucket.last }) {
+        double area = (ax - nextTime) * (double(e->value) - ay) - (ax - double(e->timestamp)) * (nextValue - ay);
+        area = area < 0 ? -area : area;
+        if (area > maxArea) {
+            maxArea = area;
+            chosen = e;
+        }
+    }
+
+    counter.kept = *chosen;
+    m_output(single(*chosen));
+}
+
+void LevelOfDetail::finishCounter(Counter &counter)
+{
+    // The last point is always kept too, so it stands in for the bucket after
+    // the last one.
+    const TraceEvent &latest = counter.latest;
+    if (counter.buckets == 2) {
+        const Bucket &next = counter.next;
+        choosePoint(counter, counter.current, next.timeSum / next.count, next.valueSum / next.count);
+        counter.current = counter.next;
+    }
+    if (counter.buckets && (counter.current.count > 1 || counter.current.first.timestamp != latest.timestamp))
+        choosePoint(counter, counter.current, latest.timestamp, latest.value);
+    if (counter.buckets && (counter.kept.timestamp != latest.timestamp || counter.kept.value != latest.value))
+        m_output(single(latest));
+}
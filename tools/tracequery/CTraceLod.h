@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACELOD_H
+#define CTRACELOD_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "CTraceEvent.h"
+
+// An event in a coarsened view of a trace. If count is more than 1, it's a
+// slice standing in for that many adjacent ones, which took totalDuration
+// between them.
+struct LodEvent
+{
+    TraceEvent event;
+    uint64_t count;
+    uint64_t totalDuration;
+};
+
+// Coarsens events for viewing at the given resolution, in microseconds: about
+// what one pixel would cover. Events are added in timestamp order, and each
+// coarsened one is passed to output as soon as it's known, so memory use
+// depends on how deeply slices nest, not on how many events there are. (That
+// means the output isn't in timestamp order: a run is written when it ends.)
+//
+// On each thread, runs of adjacent slices of the same tracepoint, at the same
+// depth, that are each shorter than the resolution (and no further apart) are
+// merged into one. Each counter is downsampled to about one point per
+// resolution with MinMaxLTTB: LTTB (Largest Triangle Three Buckets), which
+// keeps the shape of the line, peaks included, choosing from just the first,
+// last, lowest and highest points in each bucket. Everything else is kept as
+// it is. That includes begin and end events, which aren't paired up into
+// slices; traced writes complete events instead unless told not to (-B).
+class LevelOfDetail
+{
+public:
+    typedef std::function<void(const LodEvent &)> Output;
+
+    LevelOfDetail(uint64_t resolution, const Output &output);
+
+    void add(const TraceEvent &event);
+
+    // Write out everything still held back.
+    void finish();
+
+private:
+    struct OpenSlice
+    {
+        uint64_t end;
+        bool empty;
+        bool small;
+    };
+
+    struct Thread
+    {
+        // The current run at each depth, and the slices still open.
+        std::vector<LodEvent> runs;
+        std::vector<OpenSlice> open;
+
+        // Slices that start at the same time, held until we have them all,
+        // so that parents can go before their children.
+        std::vector<TraceEvent> starting;
+    };
+
+    // A counter's points, one resolution's worth of time.
+    struct Bucket
+    {
+        uint64_t index;
+        TraceEvent first;
+        TraceEvent last;
+        TraceEvent lowest;
+        TraceEvent highest;
+        double timeSum;
+        double valueSum;
+        uint64_t count;
+
+        void start(uint64_t index, const TraceEvent &e);
+        void add(const TraceEvent &e);
+    };
+
+    struct Counter
+    {
+        TraceEvent kept; // the last point written
+        TraceEvent latest; // the last point added
+        int buckets; // how many of current and next are in use
+        Bucket current;
+        Bucket next;
+    };
+
+    typedef std::pair<uint64_t, uint64_t> ThreadKey; // pid, tid
+    typedef std::tuple<uint64_t, uint32_t, uint32_t, uint64_t> CounterKey; // pid, category, name, id
+
+    void addStartingSlices(Thread &thread);
+    void addSlice(Thread &thread, const TraceEvent &e);
+    void finishRuns(Thread &thread, size_t depth);
+    void addPoint(Counter &counter, const TraceEvent &e);
+    void choosePoint(Counter &counter, const Bucket &bucket, double nextTime, double nextValue);
+    void finishCounter(Counter &counter);
+
+    uint64_t m_resolution;
+    Output m_output;
+    std::map<ThreadKey, Thread> m_threads;
+    std::map<CounterKey, Counter> m_counters;
+};
+
+#endif // CTRACELOD_H
@@ -0,0 +1,723 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "CJsonTraceParser.h"
+#include "CTraceLod.h"
+#include "CTraceStore.h"
+#include "CTraceStrings.h"
+#include "CTraceOutput.h"
+#include "CTraceWriter.h"
+
+// Answers questions about a trace written with traced -f store, reading only
+// the parts of it that the index says might be relevant; or, more slowly,
+// about a JSON trace, which has to be parsed through.
+
+const size_t MaxQueuedOutput = 64 * 1024 * 1024;
+
+struct Query
+{
+    int64_t pid = -1;
+    int64_t tid = -1;
+    const char *category = nullptr;
+    const char *tracepoint = nullptr;
+    uint64_t from = 0;
+    uint64_t to = UINT64_MAX;
+};
+
+// A store, mapped into memory. Pages are only read from disk when touched,
+// so a query only costs the index, and the blocks that it looks in.
+class Store
+{
+public:
+    ~Store()
+    {
+        if (m_data)
+            munmap((void*)m_data, m_size);
+    }
+
+    bool open(const char *path)
+    {
+        int fd = ::open(path, O_RDONLY);
+        if (fd == -1) {
+            perror("Can't open store");
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size < (off_t)(sizeof(StoreFileHeader) + sizeof(StoreTrailer))) {
+            fprintf(stderr, "%s isn't a trace store\n", path);
+            close(fd);
+            return false;
+        }
+        m_size = st.st_size;
+        void *data = mmap(0, m_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            perror("Can't map store");
+            return false;
+        }
+        m_data = static_cast<const char*>(data);
+        // Queries jump around; don't read ahead into blocks we won't need.
+        madvise(data, m_size, MADV_RANDOM);
+
+        const StoreFileHeader *h = reinterpret_cast<const StoreFileHeader*>(m_data);
+        memcpy(&m_trailer, m_data + m_size - sizeof(m_trailer), sizeof(m_trailer));
+        if (memcmp(h->magic, TRACED_STORE_MAGIC, sizeof(h->magic)) != 0 || h->version != 1 ||
+                memcmp(m_trailer.magic, TRACED_STORE_MAGIC, sizeof(m_trailer.magic)) != 0) {
+            fprintf(stderr, "%s isn't a complete trace store\n", path);
+            return false;
+        }
+        if (m_trailer.indexOffset + uint64_t(m_trailer.indexCount) * sizeof(StoreIndexEntry) > m_size - sizeof(m_trailer) ||
+                m_trailer.stringsOffset > m_trailer.indexOffset) {
+            fprintf(stderr, "%s is corrupt\n", path);
+            return false;
+        }
+
+        // Strings are numbered the way traced numbered them; intern them in
+        // the same order, and keep a map in case our IDs differ.
+        const char *p = m_data + m_trailer.stringsOffset;
+        const char *end = m_data + m_trailer.indexOffset;
+        for (uint32_t i = 0; i < m_trailer.stringCount; ++i) {
+            uint32_t len;
+            if (p + sizeof(len) > end)
+                break;
+            memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            if (p + len > end)
+                break;
+            m_stringIds.push_back(m_strings.intern(p, len));
+            p += len;
+        }
+        return true;
+    }
+
+    uint32_t indexCount() const { return m_trailer.indexCount; }
+
+    StoreIndexEntry indexEntry(uint32_t i) const
+    {
+        StoreIndexEntry entry;
+        memcpy(&entry, m_data + m_trailer.indexOffset + uint64_t(i) * sizeof(entry), sizeof(entry));
+        return entry;
+    }
+
+    // The store's ID for a string, or NotFound.
+    uint32_t storeStringId(const char *str) const
+    {
+        uint32_t id = m_strings.find(str, strlen(str));
+        for (uint32_t i = 0; id != TraceStringTable::NotFound && i < m_stringIds.size(); ++i) {
+            if (m_stringIds[i] == id)
+                return i;
+        }
+        return TraceStringTable::NotFound;
+    }
+
+    const TraceStringTable &strings() const { return m_strings; }
+
+    bool event(const StoreIndexEntry &entry, uint32_t i, EventRecord &r) const
+    {
+        uint64_t offset = entry.offset + uint64_t(i) * sizeof(r);
+        if (offset + sizeof(r) > m_trailer.stringsOffset)
+            return false;
+        memcpy(&r, m_data + offset, sizeof(r));
+        return true;
+    }
+
+    void toEvent(const EventRecord &r, TraceEvent &e) const
+    {
+        RecordReader::toEvent(r, e);
+        e.categoryId = e.categoryId < m_stringIds.size() ? m_stringIds[e.categoryId] : 0;
+        e.tracepointId = e.tracepointId < m_stringIds.size() ? m_stringIds[e.tracepointId] : 0;
+    }
+
+private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    StoreTrailer m_trailer;
+    TraceStringTable m_strings;
+    std::vector<uint32_t> m_stringIds; // store's IDs to m_strings'
+};
+
+typedef std::function<void(const TraceEvent &)> MatchCallback;
+
+// Passes the events in blocks that match the query to f, in timestamp order
+// (and in the order they were written, on ties). Each block is sorted, but a
+// thread's blocks can overlap, as slices are written when they end; so
+// they're merged, opening each only once the merge reaches its start. Only
+// the blocks that overlap in time are read at once.
+static void forEachStoreMatch(const Store &store, const Query &query, uint32_t categoryId, uint32_t tracepointId,
+                              std::vector<StoreIndexEntry> &blocks, const MatchCallback &f)
+{
+    std::stable_sort(blocks.begin(), blocks.end(), [](const StoreIndexEntry &a, const StoreIndexEntry &b) {
+        return a.start < b.start;
+    });
+
+    struct Cursor
+    {
+        const StoreIndexEntry *entry;
+        uint32_t next; // index of the event after this one
+        TraceEvent event;
+    };
+
+    // Moves the cursor to the block's next match, if there is one.
+    auto advance = [&](Cursor &c) {
+        EventRecord r;
+        while (c.next < c.entry->count && store.event(*c.entry, c.next++, r)) {
+            // Blocks are sorted, so nothing after this starts in time.
+            if (r.timestamp > query.to)
+                return false;
+            if (r.timestamp + r.duration < query.from)
+                continue;
+            if ((query.category && r.categoryId != categoryId) ||
+                    (query.tracepoint && r.tracepointId != tracepointId))
+                continue;
+            store.toEvent(r, c.event);
+            return true;
+        }
+        return false;
+    };
+
+    // Which comes later, for the heap: the earliest match is on top, and
+    // ties go in the order they were written.
+    auto later = [](const Cursor &a, const Cursor &b) {
+        if (a.event.timestamp != b.event.timestamp)
+            return a.event.timestamp > b.event.timestamp;
+        uint64_t aOffset = a.entry->offset, bOffset = b.entry->offset; // (packed)
+        return aOffset > bOffset;
+    };
+
+    std::vector<Cursor> heap;
+    size_t nextBlock = 0;
+    for (;;) {
+        while (nextBlock < blocks.size() && (heap.empty() || blocks[nextBlock].start <= heap.front().event.timestamp)) {
+            Cursor c { &blocks[nextBlock++], 0, TraceEvent() };
+            if (advance(c)) {
+                heap.push_back(c);
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+        }
+        if (heap.empty())
+            break;
+
+        std::pop_heap(heap.begin(), heap.end(), later);
+        f(heap.back().event);
+        if (advance(heap.back()))
+            std::push_heap(heap.begin(), heap.end(), later);
+        else
+            heap.pop_back();
+    }
+}
+
+// Whether path is a store, rather than a JSON trace.
+static bool isStore(const char *path)
+{
+    char magic[sizeof(StoreFileHeader().magic)];
+    FILE *f = fopen(path, "r");
+    bool store = f && fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, TRACED_STORE_MAGIC, sizeof(magic)) == 0;
+    if (f)
+        fclose(f);
+    return store;
+}
+
+static MessageType jsonEventType(char phase, uint64_t id)
+{
+    switch (phase) {
+    case 'B':
+        return MessageType::BeginMessage;
+    case 'E':
+        return MessageType::EndMessage;
+    case 'X':
+        return MessageType::DurationMessage;
+    case 'b':
+        return MessageType::AsyncBeginMessage;
+    case 'e':
+        return MessageType::AsyncEndMessage;
+    case 'C':
+        return id ? MessageType::CounterMessageWithId : MessageType::CounterMessage;
+    default:
+        return MessageType::NoMessage;
+    }
+}
+
+// The ID of str among the batch's strings, or -1.
+static int64_t jsonStringId(const JsonEventTable &batch, const char *str)
+{
+    for (size_t i = 0; i < batch.strings.size(); ++i) {
+        if (batch.strings.string(i) == str)
+            return i;
+    }
+    return -1;
+}
+
+// Finds the events in a JSON trace that match the query, parsing it in
+// parallel; only the matches are kept. With summarize, every event matches,
+// and none are kept: they're only counted.
+static bool queryJson(const char *path, const Query &query, bool summarize, TraceStringTable &strings,
+                      std::vector<TraceEvent> &matches)
+{
+    JsonTraceFile file;
+    if (!file.open(path))
+        return false;
+
+    // Each range's matches name their strings in a table of its own.
+    struct Range
+    {
+        JsonStringTable strings;
+        std::vector<TraceEvent> matches;
+        uint64_t events = 0;
+        uint64_t start = UINT64_MAX;
+        uint64_t end = 0;
+        std::set<std::pair<uint64_t, uint64_t>> threads;
+    };
+    std::vector<Range> ranges(std::max(1u, std::thread::hardware_concurrency()));
+    uint64_t malformed = file.parse(ranges.size(), 65536, [&](int index, JsonEventTable &batch) {
+        Range &range = ranges[index];
+        int64_t categoryId = query.category ? jsonStringId(batch, query.category) : -1;
+        int64_t tracepointId = query.tracepoint ? jsonStringId(batch, query.tracepoint) : -1;
+        if ((query.category && categoryId == -1) || (query.tracepoint && tracepointId == -1))
+            return true;
+
+        std::vector<int64_t> rangeIds(batch.strings.size(), -1);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            TraceEvent e;
+            e.type = jsonEventType(batch.phase[i], batch.id[i]);
+            if (e.type == MessageType::NoMessage)
+                continue;
+            e.pid = batch.pid[i];
+            e.tid = batch.tid[i];
+            e.timestamp = batch.timestamp[i];
+            e.duration = batch.duration[i];
+            e.value = batch.value[i];
+            e.id = batch.id[i];
+            if ((query.pid != -1 && e.pid != (uint64_t)query.pid) ||
+                    (query.tid != -1 && e.tid != (uint64_t)query.tid) ||
+                    e.timestamp > query.to || e.timestamp + e.duration < query.from ||
+                    (query.category && batch.category[i] != categoryId) ||
+                    (query.tracepoint && batch.name[i] != tracepointId))
+                continue;
+
+            if (summarize) {
+                ++range.events;
+                range.start = std::min(range.start, e.timestamp);
+                range.end = std::max(range.end, e.timestamp + e.duration);
+                if (e.tid) // counters and async events don't say
+                    range.threads.insert(std::make_pair(e.pid, e.tid));
+                continue;
+            }
+            for (uint32_t id : { batch.category[i], batch.name[i] }) {
+                if (rangeIds[id] == -1) {
+                    const std::string &str = batch.strings.string(id);
+                    rangeIds[id] = range.strings.intern(str.data(), str.size());
+                }
+            }
+            e.categoryId = rangeIds[batch.category[i]];
+            e.tracepointId = rangeIds[batch.name[i]];
+            range.matches.push_back(e);
+        }
+        return true;
+    });
+    if (malformed)
+        fprintf(stderr, "Skipped %" PRIu64 " lines that aren't events\n", malformed);
+
+    if (summarize) {
+        uint64_t events = 0, start = UINT64_MAX, end = 0;
+        std::set<std::pair<uint64_t, uint64_t>> threads;
+        for (const Range &range : ranges) {
+            events += range.events;
+            start = std::min(start, range.start);
+            end = std::max(end, range.end);
+            threads.insert(range.threads.begin(), range.threads.end());
+        }
+        printf("events: %" PRIu64 "\n", events);
+        printf("threads: %zu\n", threads.size());
+        if (events)
+            printf("time: %" PRIu64 " to %" PRIu64 " us\n", start, end);
+        return true;
+    }
+
+    for (Range &range : ranges) {
+        std::vector<uint32_t> ids(range.strings.size());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            const std::string &str = range.strings.string(i);
+            ids[i] = strings.intern(str.data(), str.size());
+        }
+        for (TraceEvent &e : range.matches) {
+            e.categoryId = ids[e.categoryId];
+            e.tracepointId = ids[e.tracepointId];
+            matches.push_back(e);
+        }
+        std::vector<TraceEvent>().swap(range.matches);
+    }
+    return true;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options] <store | trace.json>\n", argv0);
+    fprintf(stderr, "Lists the events in a store written by traced -f store, or in a JSON trace.\n");
+    fprintf(stderr, "  -p, --pid <pid>        only events from process <pid>\n");
+    fprintf(stderr, "  -t, --tid <tid>        only events from thread <tid>\n");
+    fprintf(stderr, "  -c, --category <name>  only events in category <name>\n");
+    fprintf(stderr, "  -n, --name <name>      only events of tracepoint <name>\n");
+    fprintf(stderr, "  -f, --from <us>        only events that end at or after <us>\n");
+    fprintf(stderr, "  -u, --to <us>          only events that start at or before <us>\n");
+    fprintf(stderr, "  -j, --json <file>      write the events as a Chrome JSON trace to <file>\n"
+                    "                         (- for stdout), rather than listing them\n");
+    fprintf(stderr, "  -l, --level-of-detail <us>\n"
+                    "                         with -j, merge and downsample events too small to\n"
+                    "                         see at a resolution of <us> per pixel (begin and\n"
+                    "                         end events are kept as they are)\n");
+    fprintf(stderr, "  -L, --pyramid <prefix> write levels of detail at 10us, 100us, ... as\n"
+                    "                         <prefix>.<us>us.json, until one is small enough\n");
+    fprintf(stderr, "  -s, --summary          describe the trace, rather than listing events\n");
+    fprintf(stderr, "  -h, --help             show this help\n");
+}
+
+static const char *typeName(MessageType type)
+{
+    switch (type) {
+    case MessageType::BeginMessage:
+        return "begin";
+    case MessageType::EndMessage:
+        return "end";
+    case MessageType::DurationMessage:
+        return "slice";
+    case MessageType::AsyncBeginMessage:
+        return "async-begin";
+    case MessageType::AsyncEndMessage:
+        return "async-end";
+    case MessageType::CounterMessage:
+    case MessageType::CounterMessageWithId:
+        return "counter";
+    default:
+        return "?";
+    }
+}
+
+// Levels of detail in a pyramid get 10 times coarser until one has no more
+// events than this, which the viewer can load comfortably.
+static const size_t PyramidTargetEvents = 100000;
+
+// A JSON trace being written, of every event given to it, or of a level of
+// detail.
+class JsonExport
+{
+public:
+    JsonExport(const TraceStringTable &strings, uint64_t resolution)
+        : m_strings(strings)
+        , m_resolution(resolution)
+    {
+    }
+
+    bool open(const char *path)
+    {
+        m_path = path;
+        if (m_path == "-") {
+            m_writer.reset(new TraceWriter(fileno(stdout), TraceCompressor::NoCompression, MaxQueuedOutput));
+        } else {
+            m_writer.reset(new TraceWriter(path, TraceFileOptions(), TraceCompressor::NoCompression, MaxQueuedOutput));
+            if (!m_writer->isOpen())
+                return false;
+        }
+
+        m_output.reset(new JsonTraceOutput(m_writer.get(), m_strings));
+        m_output->writeHeader();
+        if (m_resolution) {
+            m_level.reset(new LevelOfDetail(m_resolution, [this](const LodEvent &e) {
+                if (e.count > 1)
+                    m_output->writeAggregate(e.event, e.count, e.totalDuration);
+                else
+                    m_output->writeEvent(e.event);
+                written();
+            }));
+        }
+        return true;
+    }
+
+    void add(const TraceEvent &e)
+    {
+        if (m_level) {
+            m_level->add(e);
+        } else {
+            m_output->writeEvent(e);
+            written();
+        }
+    }
+
+    // Writes out the rest, and says whether all of it made it.
+    bool finish()
+    {
+        if (m_level)
+            m_level->finish();
+        m_output->finish();
+        uint64_t dropped = m_writer->droppedBytes();
+        m_output.reset();
+        m_writer.reset();
+        if (dropped) {
+            fprintf(stderr, "Dropped %" PRIu64 " bytes writing %s\n", dropped, m_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    const std::string &path() const { return m_path; }
+    uint64_t eventCount() const { return m_eventCount; }
+
+private:
+    void written()
+    {
+        if (++m_eventCount % 10000 == 0)
+            m_output->flush();
+    }
+
+    const TraceStringTable &m_strings;
+    uint64_t m_resolution;
+    std::string m_path;
+    std::unique_ptr<TraceWriter> m_writer;
+    std::unique_ptr<JsonTraceOutput> m_output;
+    std::unique_ptr<LevelOfDetail> m_level;
+    uint64_t m_eventCount = 0;
+};
+
+// Lists the matches, or writes them out as JSON. forEachMatch calls its
+// argument with each match, in timestamp order; span is how long they cover.
+// Every level of a pyramid is built in the same pass.
+template <typename ForEachMatch>
+static int writeMatches(ForEachMatch forEachMatch, uint64_t span, const TraceStringTable &strings,
+                        const char *jsonPath, const char *pyramidPrefix, uint64_t resolution)
+{
+    if (!jsonPath && !pyramidPrefix) {
+        forEachMatch([&](const TraceEvent &e) {
+            printf("%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %s %s %s",
+                   e.timestamp, e.duration, e.pid, e.tid, typeName(e.type),
+                   strings.string(e.categoryId), strings.string(e.tracepointId));
+            if (e.type == MessageType::CounterMessage || e.type == MessageType::CounterMessageWithId)
+                printf(" %" PRIu64, e.value);
+            printf("\n");
+        });
+        return 0;
+    }
+
+    std::vector<std::unique_ptr<JsonExport>> exports;
+    auto addExport = [&](const std::string &path, uint64_t resolution) {
+        exports.emplace_back(new JsonExport(strings, resolution));
+        return exports.back()->open(path.c_str());
+    };
+    if (pyramidPrefix) {
+        for (uint64_t level = 10; ; level *= 10) {
+            if (!addExport(std::string(pyramidPrefix) + "." + std::to_string(level) + "us.json", level))
+                return -1;
+            if (level > span)
+                break;
+        }
+    } else if (!addExport(jsonPath, resolution)) {
+        return -1;
+    }
+
+    forEachMatch([&](const TraceEvent &e) {
+        for (auto &out : exports)
+            out->add(e);
+    });
+
+    bool ok = true;
+    for (auto &out : exports)
+        ok = out->finish() && ok;
+
+    // Only the first level that's small enough is needed; anything coarser
+    // was written in case it was too big.
+    for (size_t i = 0; i + 1 < exports.size(); ++i) {
+        if (exports[i]->eventCount() <= PyramidTargetEvents) {
+            for (size_t j = i + 1; j < exports.size(); ++j)
+                unlink(exports[j]->path().c_str());
+            break;
+        }
+    }
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    Query query;
+    const char *jsonPath = nullptr;
+    const char *pyramidPrefix = nullptr;
+    uint64_t resolution = 0;
+    bool summary = false;
+
+    static const struct option longOptions[] = {
+        { "pid", required_argument, 0, 'p' },
+        { "tid", required_argument, 0, 't' },
+        { "category", required_argument, 0, 'c' },
+        { "name", required_argument, 0, 'n' },
+        { "from", required_argument, 0, 'f' },
+        { "to", required_argument, 0, 'u' },
+        { "json", required_argument, 0, 'j' },
+        { "level-of-detail", required_argument, 0, 'l' },
+        { "pyramid", required_argument, 0, 'L' },
+        { "summary", no_argument, 0, 's' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:t:c:n:f:u:j:l:L:sh", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'p':
+            query.pid = strtoll(optarg, NULL, 10);
+            break;
+        case 't':
+            query.tid = strtoll(optarg, NULL, 10);
+            break;
+        case 'c':
+            query.category = optarg;
+            break;
+        case 'n':
+            query.tracepoint = optarg;
+            break;
+        case 'f':
+            query.from = strtoull(optarg, NULL, 10);
+            break;
+        case 'u':
+            query.to = strtoull(optarg, NULL, 10);
+            break;
+        case 'j':
+            jsonPath = optarg;
+            break;
+        case 'l':
+            resolution = strtoull(optarg, NULL, 10);
+            break;
+        case 'L':
+            pyramidPrefix = optarg;
+            break;
+        case 's':
+            summary = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        exit(-1);
+    }
+
+    if (resolution && !jsonPath) {
+        fprintf(stderr, "-l only applies to JSON output (-j)\n");
+        exit(-1);
+    }
+
+    if (!isStore(argv[optind])) {
+        TraceStringTable strings;
+        std::vector<TraceEvent> matches;
+        if (!queryJson(argv[optind], query, summary, strings, matches))
+            exit(-1);
+        if (summary)
+            return 0;
+
+        // A JSON trace needn't be in any order, so it has to be sorted.
+        std::stable_sort(matches.begin(), matches.end(), [](const TraceEvent &a, const TraceEvent &b) {
+            return a.timestamp < b.timestamp;
+        });
+        uint64_t span = matches.empty() ? 0 : matches.back().timestamp - matches.front().timestamp;
+        return writeMatches([&](const MatchCallback &f) {
+            for (const TraceEvent &e : matches)
+                f(e);
+        }, span, strings, jsonPath, pyramidPrefix, resolution);
+    }
+
+    Store store;
+    if (!store.open(argv[optind]))
+        exit(-1);
+
+    if (summary) {
+        uint64_t events = 0;
+        uint64_t start = UINT64_MAX;
+        uint64_t end = 0;
+        std::vector<std::pair<uint64_t, uint64_t>> threads;
+        for (uint32_t i = 0; i < store.indexCount(); ++i) {
+            StoreIndexEntry entry = store.indexEntry(i);
+            // (Copied out, as they're packed.)
+            uint64_t pid = entry.pid, tid = entry.tid, entryStart = entry.start, entryEnd = entry.end;
+            events += entry.count;
+            start = std::min(start, entryStart);
+            end = std::max(end, entryEnd);
+            threads.push_back(std::make_pair(pid, tid));
+        }
+        std::sort(threads.begin(), threads.end());
+        threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+        printf("events: %" PRIu64 " in %u blocks\n", events, store.indexCount());
+        printf("threads: %zu\n", threads.size());
+        if (events)
+            printf("time: %" PRIu64 " to %" PRIu64 " us\n", start, end);
+        return 0;
+    }
+
+    // Look the names up once, and compare IDs from then on.
+    uint32_t categoryId = TraceStringTable::NotFound;
+    uint32_t tracepointId = TraceStringTable::NotFound;
+    if (query.category && (categoryId = store.storeStringId(query.category)) == TraceStringTable::NotFound)
+        return 0;
+    if (query.tracepoint && (tracepointId = store.storeStringId(query.tracepoint)) == TraceStringTable::NotFound)
+        return 0;
+
+    std::vector<StoreIndexEntry> blocks;
+    uint64_t start = UINT64_MAX;
+    uint64_t end = 0;
+    for (uint32_t i = 0; i < store.indexCount(); ++i) {
+        StoreIndexEntry entry = store.indexEntry(i);
+        if ((query.pid != -1 && entry.pid != (uint64_t)query.pid) ||
+                (query.tid != -1 && entry.tid != (uint64_t)query.tid) ||
+                entry.end < query.from || entry.start > query.to ||
+                (query.tracepoint && !entry.mayHaveTracepoint(tracepointId)))
+            continue;
+        blocks.push_back(entry);
+        uint64_t entryStart = entry.start, entryEnd = entry.end;
+        start = std::min(start, entryStart);
+        end = std::max(end, entryEnd);
+    }
+    uint64_t span = blocks.empty() ? 0 : std::min(end, query.to) - std::max(start, query.from);
+
+    return writeMatches([&](const MatchCallback &f) {
+        forEachStoreMatch(store, query, categoryId, tracepointId, blocks, f);
+    }, span, store.strings(), jsonPath, pyramidPrefix, resolution);
+}
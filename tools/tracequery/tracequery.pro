@@ -0,0 +1,30 @@
+QT =
+CONFIG -= app_bundle
+CONFIG += c++11 thread
+TEMPLATE = app
+TARGET = tracequery
+INCLUDEPATH += . ../../traced ../tracejson
+
+linux:LIBS += -lrt
+
+# Exporting reuses traced's output code, which may compress.
+CONFIG += link_pkgconfig
+packagesExist(libzstd) {
+    PKGCONFIG += libzstd
+    DEFINES += HAVE_ZSTD
+}
+packagesExist(zlib) {
+    PKGCONFIG += zlib
+    DEFINES += HAVE_ZLIB
+}
+
+# Input
+HEADERS += CTraceLod.h \
+           ../tracejson/CJsonTraceParser.h
+SOURCES += main.cpp \
+           CTraceLod.cpp \
+           ../tracejson/CJsonTraceParser.cpp \
+           ../../traced/CTraceStrings.cpp \
+           ../../traced/CTraceOutput.cpp \
+           ../../traced/CTraceWriter.cpp \
+           ../../traced/CTraceFile.cpp
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CPROTOWRITER_H
+#define CPROTOWRITER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+// A tiny protobuf encoder, so that we can write Perfetto traces without
+// dragging in libprotobuf. It only knows about the wire format: callers are
+// responsible for getting field numbers and types right.
+//
+// Nested messages are written in place: beginNested() reserves room for the
+// length, and endNested() patches it in once the size is known.
+class ProtoWriter
+{
+public:
+    enum WireType
+    {
+        Varint = 0,
+        Fixed64 = 1,
+        LengthDelimited = 2,
+        Fixed32 = 5
+    };
+
+    void appendVarint(uint32_t field, uint64_t value)
+    {
+        writeTag(field, Varint);
+        writeRawVarint(value);
+    }
+
+    void appendBytes(uint32_t field, const char *data, size_t length)
+    {
+        writeTag(field, LengthDelimited);
+        writeRawVarint(length);
+        m_buffer.append(data, length);
+    }
+
+    void appendString(uint32_t field, const char *str)
+    {
+        appendBytes(field, str, strlen(str));
+    }
+
+    void beginNested(uint32_t field)
+    {
+        writeTag(field, LengthDelimited);
+        m_buffer.append(MaxLengthSize, '\0');
+        m_nested.push_back(m_buffer.size());
+    }
+
+    void endNested()
+    {
+        size_t start = m_nested.back();
+        m_nested.pop_back();
+
+        char length[MaxLengthSize + 1];
+        size_t used = encodeVarint(length, m_buffer.size() - start);
+        m_buffer.replace(start - MaxLengthSize, MaxLengthSize, length, used);
+    }
+
+    const char *data() const { return m_buffer.data(); }
+    size_t size() const { return m_buffer.size(); }
+
+    void clear()
+    {
+        m_buffer.clear();
+        m_nested.clear();
+    }
+
+private:
+    // Enough for nested messages of up to 256mb, which is plenty.
+    static const size_t MaxLengthSize = 4;
+
+    static size_t encodeVarint(char *out, uint64_t value)
+    {
+        size_t i = 0;
+        while (value >= 0x80) {
+            out[i++] = (char)(value | 0x80);
+            value >>= 7;
+        }
+        out[i++] = (char)value;
+        return i;
+    }
+
+    void writeRawVarint(uint64_t value)
+    {
+        char buf[10];
+        m_buffer.append(buf, encodeVarint(buf, value));
+    }
+
+    void writeTag(uint32_t field, WireType type)
+    {
+        writeRawVarint((uint64_t(field) << 3) | type);
+    }
+
+    std::string m_buffer;
+    std::vector<size_t> m_nested;
+};
+
+#endif // CPROTOWRITER_H
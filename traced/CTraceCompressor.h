@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACECOMPRESSOR_H
+#define CTRACECOMPRESSOR_H
+
+#include <string.h>
+
+#include <string>
+
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+// Streaming compression of trace data, using whichever of zlib and zstd we
+// were built with. Shared by traced (for -z) and atrace (for -z).
+class TraceCompressor
+{
+public:
+    enum Format
+    {
+        NoCompression,
+        Zlib, // what Android's systrace expects from atrace
+        Gzip,
+        Zstd
+    };
+
+    enum Flush
+    {
+        NoFlush,
+        // Make everything so far decompressible, at some cost to the ratio.
+        SyncFlush,
+        Finish
+    };
+
+    // The best format available in this build, or NoCompression.
+    static Format bestFormat()
+    {
+#if defined(HAVE_ZSTD)
+        return Zstd;
+#elif defined(HAVE_ZLIB)
+        return Gzip;
+#else
+        return NoCompression;
+#endif
+    }
+
+    static const char *formatName(Format format)
+    {
+        switch (format) {
+        case Zlib:
+            return "zlib";
+        case Gzip:
+            return "gzip";
+        case Zstd:
+            return "zstd";
+        default:
+            return "none";
+        }
+    }
+
+    explicit TraceCompressor(Format format)
+        : m_format(format)
+        , m_valid(false)
+    {
+        switch (format) {
+#if defined(HAVE_ZLIB)
+        case Zlib:
+        case Gzip:
+            memset(&m_zs, 0, sizeof(m_zs));
+            // 15 bits of window, +16 to get a gzip header rather than a zlib one.
+            m_valid = deflateInit2(&m_zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                   format == Gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            break;
+#endif
+#if defined(HAVE_ZSTD)
+        case Zstd:
+            m_zstd = ZSTD_createCStream();
+            m_valid = m_zstd && !ZSTD_isError(ZSTD_initCStream(m_zstd, 3));
+            break;
+#endif
+        default:
+            break;
+        }
+    }
+
+    ~TraceCompressor()
+    {
+        if (!m_valid)
+            return;
+        switch (m_format) {
+#if defined(HAVE_ZLIB)
+        case Zlib:
+        case Gzip:
+            deflateEnd(&m_zs);
+            break;
+#endif
+#if defined(HAVE_ZSTD)
+        case Zstd:
+            ZSTD_freeCStream(m_zstd);
+            break;
+#endif
+        default:
+            break;
+        }
+    }
+
+    bool isValid() const { return m_valid; }
+
+    // Compress length bytes of data, appending any output that is ready to
+    // out. Returns false on error.
+    bool compress(const char *data, size_t length, Flush flush, std::string &out)
+    {
+        if (!m_valid)
+            return false;
+
+        switch (m_format) {
+#if defined(HAVE_ZLIB)
+        case Zlib:
+        case Gzip: {
+            const size_t step = 64 * 1024;
+            int mode = flush == Finish ? Z_FINISH : flush == SyncFlush ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+            m_zs.next_in = (Bytef*)data;
+            m_zs.avail_in = length;
+            int result;
+            do {
+                size_t used = out.size();
+                out.resize(used + step);
+                m_zs.next_out = (Bytef*)&out[used];
+                m_zs.avail_out = step;
+                result = deflate(&m_zs, mode);
+                out.resize(used + step - m_zs.avail_out);
+                if (result == Z_STREAM_ERROR)
+                    return false;
+            } while (m_zs.avail_out == 0 || (mode == Z_FINISH && result != Z_STREAM_END));
+            return true;
+        }
+#endif
+#if defined(HAVE_ZSTD)
+        case Zstd: {
+            const size_t step = 64 * 1024;
+            ZSTD_EndDirective mode = flush == Finish ? ZSTD_e_end : flush == SyncFlush ? ZSTD_e_flush : ZSTD_e_continue;
+            ZSTD_inBuffer in = { data, length, 0 };
+            size_t remaining;
+            do {
+                size_t used = out.size();
+                out.resize(used + step);
+                ZSTD_outBuffer o = { &out[used], step, 0 };
+                remaining = ZSTD_compressStream2(m_zstd, &o, &in, mode);
+                out.resize(used + o.pos);
+                if (ZSTD_isError(remaining))
+                    return false;
+            } while (mode == ZSTD_e_continue ? in.pos < in.size : remaining != 0);
+            return true;
+        }
+#endif
+        default:
+            // Built without the library for this format.
+            (void)data;
+            (void)length;
+            (void)flush;
+            (void)out;
+            return false;
+        }
+    }
+
+private:
+    Format m_format;
+    bool m_valid;
+#if defined(HAVE_ZLIB)
+    z_stream m_zs;
+#endif
+#if defined(HAVE_ZSTD)
+    ZSTD_CStream *m_zstd;
+#endif
+};
+
+#endif // CTRACECOMPRESSOR_H
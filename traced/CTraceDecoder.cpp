@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <algorithm>
+
+#include "CTraceDecoder.h"
+#include "CTraceMessages.h"
+#include "CTraceStrings.h"
+
+ChunkDecoder::ChunkDecoder(TraceStringTable &strings, uint32_t overflowStringId, const StringLimits &limits)
+    : m_strings(strings)
+    , m_overflowStringId(overflowStringId)
+    , m_limits(limits)
+    , m_stringBytes(0)
+    , m_stringsRefused(false)
+    , m_lastTimestamp(0)
+{
+}
+
+uint32_t ChunkDecoder::getString(uint64_t id) const
+{
+    if (id == TRACED_OVERFLOW_STRING_ID)
+        return m_overflowStringId;
+    if (id >= m_registeredStrings.size())
+        return 0;
+    return m_registeredStrings[id];
+}
+
+void ChunkDecoder::registerString(uint64_t id, const char *data, size_t length)
+{
+    if (id == TRACED_OVERFLOW_STRING_ID)
+        return;
+
+    if (id >= m_limits.maxIdsPerClient) {
+        m_stringsRefused = true;
+        return;
+    }
+
+    uint32_t globalId = m_strings.find(data, length);
+    if (globalId == TraceStringTable::NotFound) {
+        if (m_stringBytes + length > m_limits.maxBytesPerClient ||
+                m_strings.bytes() + length > m_limits.maxTotalBytes) {
+            m_stringsRefused = true;
+            return;
+        }
+        m_stringBytes += length;
+        globalId = m_strings.intern(data, length);
+    }
+
+    if (std::find(m_watchedStrings.begin(), m_watchedStrings.end(), globalId) != m_watchedStrings.end())
+        m_foundStrings.push_back(id);
+
+    if (id >= m_registeredStrings.size()) {
+        uint64_t size = std::max<uint64_t>(id + 1, m_registeredStrings.size() * 2);
+        m_registeredStrings.resize(std::min<uint64_t>(size, m_limits.maxIdsPerClient), 0);
+    }
+    m_registeredStrings[id] = globalId;
+}
+
+std::vector<uint64_t> ChunkDecoder::takeWatchedStrings()
+{
+    std::vector<uint64_t> found;
+    found.swap(m_foundStrings);
+    return found;
+}
+
+void ChunkDecoder::readRegularMessage(TraceEvent &ev, uint64_t processEpoch, const RegularMessage *m)
+{
+    ev.type = m->messageType;
+    ev.timestamp = m_lastTimestamp = processEpoch + m->microseconds;
+    ev.duration = 0;
+    ev.value = 0;
+    ev.id = 0;
+    ev.categoryId = getString(m->categoryId);
+    ev.tracepointId = getString(m->tracepointId);
+}
+
+bool ChunkDecoder::decode(const char *data, size_t length, TraceEventSink *sink)
+{
+    if (length < sizeof(ChunkHeader))
+        return false;
+
+    const ChunkHeader *h = (const ChunkHeader*)data;
+    if (h->magic != TRACED_PROTOCOL_MAGIC || h->version != TRACED_PROTOCOL_VERSION)
+        return false;
+
+    const uint64_t processEpoch = h->epoch;
+    const char *ptr = data + sizeof(ChunkHeader);
+    const char *end = data + length;
+
+    TraceEvent ev;
+    ev.pid = h->pid;
+    ev.tid = h->tid;
+
+    while (ptr < end) {
+        size_t remaining = end - ptr;
+        MessageType mtype = (MessageType)*ptr;
+        switch (mtype) {
+        case MessageType::RegisterStringMessage: {
+            if (remaining < sizeof(RegisterStringMessage))
+                return false;
+            const RegisterStringMessage *m = (const RegisterStringMessage*)ptr;
+            if (remaining < sizeof(RegisterStringMessage) + m->length)
+                return false;
+            registerString(m->id, &m->stringData, m->length);
+            ptr += sizeof(RegisterStringMessage) + m->length;
+            break;
+        }
+        case MessageType::BeginMessage:
+        case MessageType::EndMessage: {
+            if (remaining < sizeof(BeginMessage))
+                return false;
+            readRegularMessage(ev, processEpoch, (const RegularMessage*)ptr);
+            sink->writeEvent(ev);
+            ptr += sizeof(BeginMessage);
+            break;
+        }
+        case MessageType::DurationMessage: {
+            if (remaining < sizeof(DurationMessage))
+                return false;
+            const DurationMessage *m = (const DurationMessage*)ptr;
+            readRegularMessage(ev, processEpoch, m);
+            ev.duration = m->duration;
+            sink->writeEvent(ev);
+            ptr += sizeof(DurationMessage);
+            break;
+        }
+        case MessageType::CounterMessage: {
+            if (remaining < sizeof(CounterMessage))
+                return false;
+            const CounterMessage *m = (const CounterMessage*)ptr;
+            readRegularMessage(ev, processEpoch, m);
+            ev.value = m->value;
+            sink->writeEvent(ev);
+            ptr += sizeof(CounterMessage);
+            break;
+        }
+        case MessageType::CounterMessageWithId: {
+            if (remaining < sizeof(CounterMessageWithId))
+                return false;
+            const CounterMessageWithId *m = (const CounterMessageWithId*)ptr;
+            readRegularMessage(ev, processEpoch, m);
+            ev.value = m->value;
+            ev.id = m->id;
+            sink->writeEvent(ev);
+            ptr += sizeof(CounterMessageWithId);
+            break;
+        }
+        case MessageType::AsyncBeginMessage:
+        case MessageType::AsyncEndMessage: {
+            if (remaining < sizeof(AsyncBeginMessage))
+                return false;
+            const AsyncBeginMessage *m = (const AsyncBeginMessage*)ptr;
+            readRegularMessage(ev, processEpoch, m);
+            ev.id = m->cookie;
+            sink->writeEvent(ev);
+            ptr += sizeof(AsyncBeginMessage);
+            break;
+        }
+        case MessageType::NoMessage:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ChunkDecoder::registerStrings(const char *data, size_t length)
+{
+    class DiscardingSink : public TraceEventSink
+    {
+    public:
+        void writeEvent(const TraceEvent &) override {}
+    };
+
+    DiscardingSink discard;
+    return decode(data, length, &discard);
+}
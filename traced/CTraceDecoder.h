@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACEDECODER_H
+#define CTRACEDECODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "CTraceEvent.h"
+
+class TraceStringTable;
+
+// Limits on string registration, so that a client that keeps registering new
+// strings (formatted names, say) can't make traced grow without bound. Past
+// these, its new strings are all recorded as the overflow string.
+struct StringLimits
+{
+    uint64_t maxIdsPerClient = 1024 * 1024;
+    size_t maxBytesPerClient = 16 * 1024 * 1024;
+    size_t maxTotalBytes = 128 * 1024 * 1024;
+};
+
+// Turns the SHM chunks written by one client into TraceEvents.
+//
+// The client's strings are registered in its chunks, and are numbered by the
+// client, so one decoder is needed per client connection. It maps them into
+// the shared TraceStringTable as they're registered.
+class ChunkDecoder
+{
+public:
+    ChunkDecoder(TraceStringTable &strings, uint32_t overflowStringId, const StringLimits &limits);
+
+    // Decodes a chunk (including its ChunkHeader), passing each event to
+    // sink. Returns false if the chunk is malformed; any events before the
+    // problem have been passed on.
+    bool decode(const char *data, size_t length, TraceEventSink *sink);
+
+    // Only registers the chunk's strings, skipping over its events (for raw
+    // captures, which don't decode them).
+    bool registerStrings(const char *data, size_t length);
+
+    // Whether the client went over its string limits.
+    bool stringsRefused() const { return m_stringsRefused; }
+
+    // The client's string IDs registered so far, mapped to TraceStringTable
+    // IDs (0 for any it hasn't registered).
+    const std::vector<uint32_t> &registeredStrings() const { return m_registeredStrings; }
+
+    // The time of the last event decoded.
+    uint64_t lastTimestamp() const { return m_lastTimestamp; }
+
+    // Strings (as TraceStringTable IDs) to look out for: the IDs the client
+    // registers them under are collected, for takeWatchedStrings().
+    void watchStrings(const std::vector<uint32_t> &ids) { m_watchedStrings = ids; }
+
+    // The client's IDs for watched strings it has registered since the last
+    // call.
+    std::vector<uint64_t> takeWatchedStrings();
+
+private:
+    uint32_t getString(uint64_t id) const;
+    void registerString(uint64_t id, const char *data, size_t length);
+    void readRegularMessage(TraceEvent &ev, uint64_t processEpoch, const RegularMessage *m);
+
+    TraceStringTable &m_strings;
+    uint32_t m_overflowStringId;
+    StringLimits m_limits;
+
+    // Maps the client's string IDs to m_strings IDs. Client IDs are
+    // allocated densely, so this is just indexed by them.
+    std::vector<uint32_t> m_registeredStrings;
+
+    // How much this client has added to m_strings, and whether it has gone
+    // over its limits.
+    size_t m_stringBytes;
+    bool m_stringsRefused;
+
+    uint64_t m_lastTimestamp;
+
+    std::vector<uint32_t> m_watchedStrings;
+    std::vector<uint64_t> m_foundStrings;
+};
+
+#endif // CTRACEDECODER_H
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CTRACEEVENT_H
+#define CTRACEEVENT_H
+
+#include <stdint.h>
+
+#include "CTraceMessages.h"
+
+// A single event, decoded from a client's SHM chunk.
+//
+// Times are absolute, in microseconds, on the clients' CLOCK_MONOTONIC, so
+// events from different processes on the same host can be compared directly.
+// String IDs refer to traced's own TraceStringTable, not to the IDs that the
+// client registered them under.
+struct TraceEvent
+{
+    MessageType type;
+    uint64_t pid;
+    uint64_t tid;
+    uint64_t timestamp;
+    uint64_t duration; // DurationMessage only
+    uint64_t value;    // CounterMessage & CounterMessageWithId
+    uint64_t id;       // CounterMessageWithId id, or async cookie
+    uint32_t categoryId;
+    uint32_t tracepointId;
+};
+
+// Anything that consumes decoded events: an output format, or a stage that
+// passes them on to one.
+class TraceEventSink
+{
+public:
+    virtual ~TraceEventSink() {}
+    virtual void writeEvent(const TraceEvent &event) = 0;
+};
+
+#endif // CTRACEEVENT_H
@@ -0,0 +1,554 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+#include "CTraceFile.h"
+
+// Each buffer is written out once it's full. Keep enough of them that the
+// writer thread never has to wait for the disk unless it's really behind.
+static const int FileBufferCount = 4;
+static const size_t FileBufferSize = 1024 * 1024;
+
+// What O_DIRECT needs buffers, offsets and lengths to be aligned to. (It
+// varies, but this is the largest in common use.)
+static const size_t FileAlignment = 4096;
+
+#if defined(HAVE_IO_URING)
+// Just enough of io_uring to queue writes and wait for them to finish, using
+// the raw syscalls, so that we don't need liburing.
+class TraceIoRing
+{
+public:
+    static TraceIoRing *create(unsigned entries)
+    {
+        TraceIoRing *ring = new TraceIoRing;
+        if (!ring->setup(entries)) {
+            delete ring;
+            return nullptr;
+        }
+        return ring;
+    }
+
+    ~TraceIoRing()
+    {
+        if (m_sqes != MAP_FAILED)
+            munmap(m_sqes, m_sqesSize);
+        if (m_cq != MAP_FAILED)
+            munmap(m_cq, m_cqSize);
+        if (m_sq != MAP_FAILED)
+            munmap(m_sq, m_sqSize);
+        if (m_fd != -1)
+            ::close(m_fd);
+    }
+
+    // Queue a write of data to fd at offset (or at its current position, if
+    // offset is -1). Returns false if we couldn't.
+    bool submitWrite(int fd, const void *data, size_t length, uint64_t offset, uint64_t userData)
+    {
+        unsigned tail = *m_sqTail;
+        unsigned index = tail & *m_sqMask;
+        struct io_uring_sqe *sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)data;
+        sqe->len = length;
+        sqe->off = offset;
+        sqe->user_data = userData;
+        m_sqArray[index] = index;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        for (;;) {
+            int ret = syscall(__NR_io_uring_enter, m_fd, 1, 0, 0, NULL, 0);
+            if (ret >= 0)
+                return true;
+            if (errno != EINTR && errno != EAGAIN)
+                return false;
+        }
+    }
+
+    // Wait for a write to finish.
+    bool wait(uint64_t &userData, int &result)
+    {
+        for (;;) {
+            unsigned head = *m_cqHead;
+            if (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+                struct io_uring_cqe *cqe = &m_cqes[head & *m_cqMask];
+                userData = cqe->user_data;
+                result = cqe->res;
+                __atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+
+            int ret = syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0 && errno != EINTR)
+                return false;
+        }
+    }
+
+private:
+    TraceIoRing()
+        : m_fd(-1), m_sq(MAP_FAILED), m_cq(MAP_FAILED), m_sqes((struct io_uring_sqe*)MAP_FAILED)
+    {
+    }
+
+    bool setup(unsigned entries)
+    {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        m_fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (m_fd < 0) {
+            m_fd = -1;
+            return false;
+        }
+
+        m_sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        m_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+
+        m_sq = mmap(0, m_sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        m_cq = mmap(0, m_cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        m_sqes = (struct io_uring_sqe*)mmap(0, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (m_sq == MAP_FAILED || m_cq == MAP_FAILED || m_sqes == MAP_FAILED)
+            return false;
+
+        char *sq = (char*)m_sq;
+        m_sqTail = (unsigned*)(sq + p.sq_off.tail);
+        m_sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+        m_sqArray = (unsigned*)(sq + p.sq_off.array);
+
+        char *cq = (char*)m_cq;
+        m_cqHead = (unsigned*)(cq + p.cq_off.head);
+        m_cqTail = (unsigned*)(cq + p.cq_off.tail);
+        m_cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+        m_cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    int m_fd;
+    void *m_sq;
+    void *m_cq;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqSize;
+    size_t m_cqSize;
+    size_t m_sqesSize;
+
+    unsigned *m_sqTail;
+    unsigned *m_sqMask;
+    unsigned *m_sqArray;
+    unsigned *m_cqHead;
+    unsigned *m_cqTail;
+    unsigned *m_cqMask;
+    struct io_uring_cqe *m_cqes;
+};
+#else
+class TraceIoRing
+{
+public:
+    static TraceIoRing *create(unsigned) { return nullptr; }
+    bool submitWrite(int, const void *, size_t, uint64_t, uint64_t) { return false; }
+    bool wait(uint64_t &, int &) { return false; }
+};
+#endif
+
+TraceFile::TraceFile()
+    : m_buffers(nullptr)
+    , m_ring(nullptr)
+{
+    reset();
+}
+
+TraceFile::~TraceFile()
+{
+    close();
+    delete m_ring;
+    if (m_buffers) {
+        for (int i = 0; i < FileBufferCount; ++i)
+            free(m_buffers[i].data);
+        delete[] m_buffers;
+    }
+}
+
+void TraceFile::reset()
+{
+    m_fd = -1;
+    m_ownsFd = false;
+    m_regular = false;
+    m_seekable = false;
+    m_direct = false;
+    m_bufferedFd = -1;
+    m_offset = 0;
+    m_size = 0;
+    m_failed = false;
+    m_current = 0;
+    m_inFlight = 0;
+}
+
+void TraceFile::allocateBuffers()
+{
+    if (!m_ring)
+        m_ring = TraceIoRing::create(FileBufferCount * 2);
+
+    if (m_buffers)
+        return;
+
+    m_buffers = new Buffer[FileBufferCount];
+    for (int i = 0; i < FileBufferCount; ++i) {
+        Buffer &b = m_buffers[i];
+        if (posix_memalign((void**)&b.data, FileAlignment, FileBufferSize) != 0) {
+            perror("Can't allocate output buffer");
+            abort();
+        }
+        b.used = b.written = 0;
+        b.offset = 0;
+        b.inFlight = false;
+    }
+}
+
+bool TraceFile::open(const std::string &path, const TraceFileOptions &options)
+{
+    close();
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+#if defined(O_DIRECT)
+    if (options.direct) {
+        m_fd = ::open(path.c_str(), flags | O_DIRECT, 0644);
+        if (m_fd != -1) {
+            m_direct = true;
+            m_bufferedFd = ::open(path.c_str(), O_WRONLY | O_CLOEXEC);
+        } else if (errno == EINVAL) {
+            fprintf(stderr, "%s doesn't support direct I/O, using buffered writes\n", path.c_str());
+        }
+    }
+#endif
+    if (m_fd == -1)
+        m_fd = ::open(path.c_str(), flags, 0644);
+    if (m_fd == -1)
+        return false;
+
+    m_ownsFd = true;
+
+    // It might be a FIFO, or /dev/stdout.
+    struct stat st;
+    m_regular = fstat(m_fd, &st) == 0 && S_ISREG(st.st_mode);
+    m_seekable = m_regular || lseek(m_fd, 0, SEEK_CUR) != -1;
+
+#if defined(__linux__)
+    // Keep the file's size as it is: we may well not use all of it.
+    if (m_regular && options.preallocate && fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, options.preallocate) == -1)
+        fprintf(stderr, "Can't preallocate %s: %s\n", path.c_str(), strerror(errno));
+#endif
+
+    allocateBuffers();
+    return true;
+}
+
+void TraceFile::adopt(int fd)
+{
+    close();
+    m_fd = fd;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    m_seekable = pos != -1;
+    m_offset = m_seekable ? pos : 0;
+    allocateBuffers();
+}
+
+const char *TraceFile::backendName() const
+{
+    if (m_ring)
+        return m_direct ? "io_uring, direct" : "io_uring";
+    return m_direct ? "pwrite, direct" : "pwrite";
+}
+
+void TraceFile::write(const char *data, size_t length)
+{
+    if (m_fd == -1)
+        return;
+
+    m_size += length;
+    while (length) {
+        Buffer &b = m_buffers[m_current];
+        size_t n = std::min(length, FileBufferSize - b.used);
+        memcpy(b.data + b.used, data, n);
+        b.used += n;
+        data += n;
+        length -= n;
+
+        if (b.used == FileBufferSize) {
+            submit(b);
+            freeBuffer();
+        }
+    }
+}
+
+// Start writing out buffer, and move on to the next one.
+void TraceFile::submit(Buffer &b)
+{
+    // Writes to a pipe (or anything else without offsets) have to go in
+    // order, so only have one of those in flight at a time.
+    if (!m_seekable) {
+        while (m_inFlight)
+            waitForCompletion();
+    }
+
+    b.offset = m_offset;
+    b.written = 0;
+    b.inFlight = true;
+    m_offset += b.used;
+
+    if (!submitWrite(b))
+        completed(b, -errno);
+}
+
+bool TraceFile::submitWrite(Buffer &b)
+{
+    if (m_ring) {
+        uint64_t offset = m_seekable ? b.offset + b.written : (uint64_t)-1;
+        if (m_ring->submitWrite(m_fd, b.data + b.written, b.used - b.written, offset, &b - m_buffers)) {
+            ++m_inFlight;
+            return true;
+        }
+
+        // Not allowed to use io_uring after all (say, a seccomp filter).
+        // That writes b out too, as it's in flight.
+        stopUsingRing();
+        return true;
+    }
+
+    while (b.written < b.used) {
+        ssize_t ret = m_seekable
+            ? pwrite(m_fd, b.data + b.written, b.used - b.written, b.offset + b.written)
+            : ::write(m_fd, b.data + b.written, b.used - b.written);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        b.written += ret;
+    }
+    b.used = b.written = 0;
+    b.inFlight = false;
+    return true;
+}
+
+bool TraceFile::waitForCompletion()
+{
+    uint64_t index;
+    int result;
+    if (!m_ring || !m_ring->wait(index, result) || index >= (uint64_t)FileBufferCount) {
+        // Shouldn't happen; give up on everything in flight.
+        if (!m_failed)
+            fprintf(stderr, "Error writing trace: lost track of writes in flight\n");
+        for (int i = 0; i < FileBufferCount; ++i)
+            m_buffers[i].inFlight = false;
+        m_inFlight = 0;
+        m_failed = true;
+        return false;
+    }
+
+    --m_inFlight;
+    completed(m_buffers[index], result);
+    return true;
+}
+
+void TraceFile::completed(Buffer &b, int result)
+{
+    if ((result == -EINVAL || result == -EOPNOTSUPP) && m_ring) {
+        // Maybe the kernel's io_uring is too old to write (before 5.6). Carry
+        // on without it, starting with b, which is still in flight.
+        stopUsingRing();
+        return;
+    }
+
+    if (result < 0) {
+        if (!m_failed)
+            fprintf(stderr, "Error writing trace: %s\n", strerror(-result));
+        m_failed = true;
+        b.used = b.written = 0;
+        b.inFlight = false;
+        return;
+    }
+
+    b.written += result;
+    if (b.written < b.used && result > 0) {
+        // Short write; carry on with the rest.
+        if (!submitWrite(b))
+            completed(b, -errno);
+        return;
+    }
+
+    b.used = b.written = 0;
+    b.inFlight = false;
+}
+
+// Wait for every write still in flight through io_uring, whether it worked
+// or not, then write whatever they didn't with pwrite() instead.
+void TraceFile::stopUsingRing()
+{
+    TraceIoRing *ring = m_ring;
+    m_ring = nullptr;
+
+    while (m_inFlight) {
+        uint64_t index;
+        int result;
+        if (!ring->wait(index, result) || index >= (uint64_t)FileBufferCount)
+            break;
+        --m_inFlight;
+        // Any error but the one that got us here will come up again below.
+        if (result > 0)
+            m_buffers[index].written += result;
+    }
+    m_inFlight = 0;
+    delete ring;
+
+    for (int i = 0; i < FileBufferCount; ++i) {
+        Buffer &b = m_buffers[i];
+        if (b.inFlight && !submitWrite(b))
+            completed(b, -errno);
+    }
+}
+
+TraceFile::Buffer &TraceFile::freeBuffer()
+{
+    for (;;) {
+        for (int i = 1; i <= FileBufferCount; ++i) {
+            int index = (m_current + i) % FileBufferCount;
+            if (!m_buffers[index].inFlight) {
+                m_current = index;
+                return m_buffers[index];
+            }
+        }
+        waitForCompletion();
+    }
+}
+
+// In direct mode, the end of the data usually isn't aligned. Write that part
+// through the page cache instead, and keep it at the start of the buffer, so
+// that the next direct write of that block includes it.
+void TraceFile::writeTail(Buffer &b)
+{
+    size_t aligned = b.used & ~(FileAlignment - 1);
+    size_t tail = b.used - aligned;
+
+    if (aligned) {
+        b.used = aligned;
+        submit(b);
+        while (m_inFlight)
+            waitForCompletion();
+        // It's free again, and we're still on it.
+    }
+
+    if (tail) {
+        if (aligned)
+            memmove(b.data, b.data + aligned, tail);
+        int fd = m_bufferedFd != -1 ? m_bufferedFd : m_fd;
+        if (pwrite(fd, b.data, tail, m_offset) != (ssize_t)tail && !m_failed) {
+            fprintf(stderr, "Error writing trace: %s\n", strerror(errno));
+            m_failed = true;
+        }
+    }
+    b.used = tail;
+}
+
+void TraceFile::push()
+{
+    if (m_fd == -1)
+        return;
+
+    if (m_direct) {
+        sync();
+        return;
+    }
+
+    Buffer &b = m_buffers[m_current];
+    if (b.used) {
+        submit(b);
+        freeBuffer();
+    }
+}
+
+bool TraceFile::sync()
+{
+    if (m_fd == -1)
+        return false;
+
+    Buffer &b = m_buffers[m_current];
+    if (b.used) {
+        if (m_direct) {
+            // Wait first, so the tail can't be overwritten by an earlier
+            // write that's still in flight.
+            while (m_inFlight)
+                waitForCompletion();
+            writeTail(b);
+        } else {
+            submit(b);
+            freeBuffer();
+        }
+    }
+
+    while (m_inFlight)
+        waitForCompletion();
+    return !m_failed;
+}
+
+void TraceFile::close()
+{
+    if (m_fd == -1)
+        return;
+
+    sync();
+
+    if (m_ownsFd) {
+        // Give back whatever we preallocated and didn't use.
+        if (m_regular && ftruncate(m_fd, m_size) == -1 && !m_failed)
+            fprintf(stderr, "Can't truncate trace: %s\n", strerror(errno));
+        ::close(m_fd);
+    }
+    if (m_bufferedFd != -1)
+        ::close(m_bufferedFd);
+
+    if (m_buffers) {
+        for (int i = 0; i < FileBufferCount; ++i) {
+            m_buffers[i].used = m_buffers[i].written = 0;
+            m_buffers[i].inFlight = false;
+        }
+    }
+    reset();
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACEFILE_H
+#define CTRACEFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+class TraceIoRing;
+
+struct TraceFileOptions
+{
+    // Bypass the page cache (O_DIRECT), where the file system allows it.
+    bool direct = false;
+
+    // Reserve this much disk space up front, if we know roughly how big the
+    // file will get. Whatever isn't used is given back on close().
+    uint64_t preallocate = 0;
+};
+
+// The file end of TraceWriter: copies data into a few large, aligned buffers
+// and writes each one out as it fills, without waiting for it to finish. With
+// io_uring, several writes are in flight at once while the writer thread
+// carries on compressing the next buffer; without it, we fall back to
+// pwrite().
+//
+// Not thread safe; only the writer thread uses it.
+class TraceFile
+{
+public:
+    TraceFile();
+    ~TraceFile();
+
+    // Create (or truncate) path, and write to it.
+    bool open(const std::string &path, const TraceFileOptions &options);
+
+    // Write to an fd that's already open (stdout, say). It isn't closed.
+    void adopt(int fd);
+
+    bool isOpen() const { return m_fd != -1; }
+
+    void write(const char *data, size_t length);
+
+    // Start writing out everything so far, without waiting for it (unless
+    // we're writing directly, where the unaligned end has to be written
+    // synchronously). It's safe from us being killed after this, though
+    // not from a crash of the whole machine.
+    void push();
+
+    // Write out everything so far, and wait until it has been written.
+    bool sync();
+
+    void close();
+
+    const char *backendName() const;
+
+private:
+    struct Buffer
+    {
+        char *data;
+        size_t used;     // bytes of data
+        size_t written;  // of those, how many have been written
+        uint64_t offset; // where in the file data goes
+        bool inFlight;
+    };
+
+    void reset();
+    void allocateBuffers();
+    void submit(Buffer &buffer);
+    bool submitWrite(Buffer &buffer);
+    bool waitForCompletion();
+    void completed(Buffer &buffer, int result);
+    void stopUsingRing();
+    Buffer &freeBuffer();
+    void writeTail(Buffer &buffer);
+
+    int m_fd;
+    bool m_ownsFd;
+    bool m_regular;
+    bool m_seekable;
+    bool m_direct;
+    int m_bufferedFd; // for unaligned writes in direct mode
+    uint64_t m_offset;
+    uint64_t m_size;
+    bool m_failed;
+
+    Buffer *m_buffers;
+    int m_current;
+    int m_inFlight;
+
+    TraceIoRing *m_ring;
+};
+
+#endif // CTRACEFILE_H
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "CTraceFilter.h"
+#include "CTraceStrings.h"
+
+static const uint32_t AllTypes = ~0U;
+
+static uint32_t typeBit(MessageType type)
+{
+    return 1U << (uint8_t)type;
+}
+
+static const struct
+{
+    const char *name;
+    uint32_t bits;
+} typeNames[] = {
+    // (slice first, so expression() says it, rather than all three.)
+    { "slice", typeBit(MessageType::BeginMessage) | typeBit(MessageType::EndMessage) | typeBit(MessageType::DurationMessage) },
+    { "begin", typeBit(MessageType::BeginMessage) },
+    { "end", typeBit(MessageType::EndMessage) },
+    { "complete", typeBit(MessageType::DurationMessage) },
+    { "counter", typeBit(MessageType::CounterMessage) | typeBit(MessageType::CounterMessageWithId) },
+    { "async", typeBit(MessageType::AsyncBeginMessage) | typeBit(MessageType::AsyncEndMessage) },
+};
+
+static std::vector<std::string> split(const std::string &s, char separator)
+{
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        size_t end = std::min(s.find(separator, pos), s.size());
+        if (end > pos)
+            parts.push_back(s.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return parts;
+}
+
+static std::string join(const std::vector<std::string> &parts)
+{
+    std::string s;
+    for (const std::string &p : parts)
+        s += (s.empty() ? "" : ",") + p;
+    return s;
+}
+
+static std::string join(const std::vector<uint64_t> &values)
+{
+    std::vector<std::string> parts;
+    for (uint64_t v : values)
+        parts.push_back(std::to_string(v));
+    return join(parts);
+}
+
+static bool parseNumbers(const std::vector<std::string> &values, std::vector<uint64_t> &numbers)
+{
+    for (const std::string &v : values) {
+        char *end;
+        numbers.push_back(strtoull(v.c_str(), &end, 10));
+        if (*end)
+            return false;
+    }
+    return true;
+}
+
+EventFilter::EventFilter(const TraceStringTable &strings)
+    : m_strings(strings)
+    , m_next(nullptr)
+    , m_mergingSlices(false)
+    , m_minimumDuration(0)
+    , m_types(AllTypes)
+    , m_lastPid(UINT64_MAX)
+    , m_lastPidMatches(false)
+{
+}
+
+bool EventFilter::setExpression(const std::string &expression, std::string &error)
+{
+    return setExpression(split(expression, ' '), error);
+}
+
+bool EventFilter::setExpression(const std::vector<std::string> &terms, std::string &error)
+{
+    std::vector<uint64_t> pids;
+    std::vector<uint64_t> tids;
+    std::vector<std::string> processes;
+    std::vector<std::string> categories;
+    std::vector<std::string> tracepoints;
+    uint64_t minimumDuration = 0;
+    uint32_t types = AllTypes;
+
+    for (const std::string &term : terms) {
+        size_t eq = term.find('=');
+        std::string key = term.substr(0, eq);
+        std::vector<std::string> values = eq == std::string::npos ? std::vector<std::string>()
+                                                                   : split(term.substr(eq + 1), ',');
+        if (values.empty()) {
+            error = "expected key=value, not " + term;
+            return false;
+        } else if (key == "pid") {
+            if (!parseNumbers(values, pids)) {
+                error = "invalid pid in " + term;
+                return false;
+            }
+        } else if (key == "tid") {
+            if (!parseNumbers(values, tids)) {
+                error = "invalid tid in " + term;
+                return false;
+            }
+        } else if (key == "proc") {
+            processes.insert(processes.end(), values.begin(), values.end());
+        } else if (key == "cat") {
+            categories.insert(categories.end(), values.begin(), values.end());
+        } else if (key == "name") {
+            tracepoints.insert(tracepoints.end(), values.begin(), values.end());
+        } else if (key == "mindur") {
+            std::vector<uint64_t> durations;
+            if (values.size() != 1 || !parseNumbers(values, durations)) {
+                error = "invalid duration in " + term;
+                return false;
+            }
+            minimumDuration = durations[0];
+        } else if (key == "type") {
+            types = 0;
+            for (const std::string &v : values) {
+                uint32_t bits = 0;
+                for (const auto &t : typeNames) {
+                    if (v == t.name)
+                        bits = t.bits;
+                }
+                if (!bits) {
+                    error = "unknown event type " + v;
+                    return false;
+                }
+                types |= bits;
+            }
+        } else {
+            error = "unknown filter " + key;
+            return false;
+        }
+    }
+
+    m_pids = pids;
+    m_tids = tids;
+    m_processes = processes;
+    m_categories = categories;
+    m_tracepoints = tracepoints;
+    m_minimumDuration = minimumDuration;
+    m_types = types;
+    clearCaches();
+    return true;
+}
+
+void EventFilter::setCategories(const std::vector<std::string> &categories)
+{
+    m_categories = categories;
+    clearCaches();
+}
+
+std::string EventFilter::expression() const
+{
+    std::vector<std::string> terms;
+    if (!m_pids.empty())
+        terms.push_back("pid=" + join(m_pids));
+    if (!m_tids.empty())
+        terms.push_back("tid=" + join(m_tids));
+    if (!m_processes.empty())
+        terms.push_back("proc=" + join(m_processes));
+    if (!m_categories.empty())
+        terms.push_back("cat=" + join(m_categories));
+    if (!m_tracepoints.empty())
+        terms.push_back("name=" + join(m_tracepoints));
+    if (m_minimumDuration)
+        terms.push_back("mindur=" + std::to_string(m_minimumDuration));
+    if (m_types != AllTypes) {
+        std::vector<std::string> names;
+        uint32_t covered = 0;
+        for (const auto &t : typeNames) {
+            if ((m_types & t.bits) == t.bits && !(covered & t.bits)) {
+                names.push_back(t.name);
+                covered |= t.bits;
+            }
+        }
+        terms.push_back("type=" + join(names));
+    }
+
+    std::string s;
+    for (const std::string &t : terms)
+        s += (s.empty() ? "" : " ") + t;
+    return s;
+}
+
+void EventFilter::forgetProcess(uint64_t pid)
+{
+    m_processMatches.erase(pid);
+    if (pid == m_lastPid)
+        m_lastPid = UINT64_MAX;
+}
+
+void EventFilter::clearCaches()
+{
+    m_categoryMatches.clear();
+    m_tracepointMatches.clear();
+    m_processMatches.clear();
+    m_lastPid = UINT64_MAX;
+}
+
+bool EventFilter::nameMatches(uint32_t id, const std::vector<std::string> &patterns, std::vector<uint8_t> &cache)
+{
+    if (id >= cache.size())
+        cache.resize(std::max<size_t>(id + 1, m_strings.size()), 0);
+
+    uint8_t &match = cache[id];
+    if (!match) {
+        const char *name = m_strings.string(id);
+        bool found = false;
+        for (const std::string &p : patterns) {
+            if (fnmatch(p.c_str(), name, 0) == 0) {
+                found = true;
+                break;
+            }
+        }
+        match = found ? 1 : 2;
+    }
+    return match == 1;
+}
+
+// The name the kernel has for a process, or "" if it doesn't say (it's
+// gone, or this isn't Linux).
+static std::string readProcessName(uint64_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%llu/comm", (unsigned long long)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return std::string();
+    char name[256];
+    std::string result;
+    if (fgets(name, sizeof(name), f)) {
+        result = name;
+        if (!result.empty() && result.back() == '\n')
+            result.pop_back();
+    }
+    fclose(f);
+    return result;
+}
+
+static std::unordered_map<uint64_t, std::string> processNames;
+
+void EventFilter::rememberProcessName(uint64_t pid)
+{
+    processNames[pid] = readProcessName(pid);
+}
+
+void EventFilter::forgetProcessName(uint64_t pid)
+{
+    processNames.erase(pid);
+}
+
+std::string EventFilter::processName(uint64_t pid)
+{
+    auto it = processNames.find(pid);
+    return it != processNames.end() ? it->second : readProcessName(pid);
+}
+
+bool EventFilter::processMatches(uint64_t pid)
+{
+    if (pid == m_lastPid)
+        return m_lastPidMatches;
+
+    auto it = m_processMatches.find(pid);
+    if (it == m_processMatches.end()) {
+        bool match = m_pids.empty() || std::find(m_pids.begin(), m_pids.end(), pid) != m_pids.end();
+        if (match && !m_processes.empty()) {
+            std::string name = processName(pid);
+            match = false;
+            for (const std::string &p : m_processes) {
+                if (fnmatch(p.c_str(), name.c_str(), 0) == 0) {
+                    match = true;
+                    break;
+                }
+            }
+        }
+        it = m_processMatches.insert(std::make_pair(pid, match)).first;
+    }
+
+    m_lastPid = pid;
+    m_lastPidMatches = it->second;
+    return it->second;
+}
+
+bool EventFilter::matches(const TraceEvent &event)
+{
+    uint32_t types = m_types;
+    if (m_mergingSlices && (types & typeBit(MessageType::DurationMessage)))
+        types |= typeBit(MessageType::BeginMessage) | typeBit(MessageType::EndMessage);
+    if (!(types & typeBit(event.type)))
+        return false;
+    if (event.type == MessageType::DurationMessage && event.duration < m_minimumDuration)
+        return false;
+    if ((!m_pids.empty() || !m_processes.empty()) && !processMatches(event.pid))
+        return false;
+    if (!m_tids.empty() && std::find(m_tids.begin(), m_tids.end(), event.tid) == m_tids.end())
+        return false;
+    if (!m_categories.empty() && !nameMatches(event.categoryId, m_categories, m_categoryMatches))
+        return false;
+    if (!m_tracepoints.empty() && !nameMatches(event.tracepointId, m_tracepoints, m_tracepointMatches))
+        return false;
+    return true;
+}
+
+void EventFilter::writeEvent(const TraceEvent &event)
+{
+    if (!m_next || !matches(event))
+        return;
+    m_next->writeEvent(event);
+}
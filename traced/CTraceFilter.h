@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACEFILTER_H
+#define CTRACEFILTER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "CTraceEvent.h"
+
+class TraceStringTable;
+
+// Passes on the events that match a filter expression, such as
+//
+//     pid=123,456 proc=myapp* cat=gfx* name=Foo::* mindur=100 type=slice
+//
+// Each term is a key and a comma separated list of values, any of which may
+// match; an event has to match every term. Keys are pid, tid, proc (process
+// name), cat (category), name (tracepoint), mindur (in microseconds, for
+// complete events) and type (begin, end, complete, slice, counter, async).
+// proc, cat and name take globs.
+//
+// Names are only matched once per string ID (or process), so the cost per
+// event is a few lookups, however many patterns there are.
+//
+// In traced, this sits at the front of the pipeline and stays there while
+// recording is started and stopped (see tracectl); with nothing to pass
+// events to, it drops them all.
+class EventFilter : public TraceEventSink
+{
+public:
+    explicit EventFilter(const TraceStringTable &strings);
+
+    void setNext(TraceEventSink *next) { m_next = next; }
+    TraceEventSink *next() const { return m_next; }
+
+    // Replaces the whole filter. An empty expression matches everything.
+    // Returns false, sets error and leaves the filter alone if it isn't
+    // valid.
+    bool setExpression(const std::string &expression, std::string &error);
+    bool setExpression(const std::vector<std::string> &terms, std::string &error);
+
+    // Replaces just the cat term. An empty list enables every category.
+    void setCategories(const std::vector<std::string> &categories);
+
+    // The filter, as an expression ("" if it matches everything).
+    std::string expression() const;
+
+    // Have "complete" also match begin and end events, as they'll be merged
+    // into complete ones further on (see SliceMerger).
+    void setMergingSlices(bool merging) { m_mergingSlices = merging; }
+
+    uint64_t minimumDuration() const { return m_minimumDuration; }
+
+    // Looks up a process's name (on Linux), for proc terms: best done when it
+    // connects, as by the time its last events are filtered, it may have
+    // exited. Shared by all filters.
+    static void rememberProcessName(uint64_t pid);
+    static void forgetProcessName(uint64_t pid);
+    static std::string processName(uint64_t pid);
+
+    // A process exited, and its pid may be reused by one with another name.
+    void forgetProcess(uint64_t pid);
+
+    bool matches(const TraceEvent &event);
+    void writeEvent(const TraceEvent &event) override;
+
+private:
+    bool nameMatches(uint32_t id, const std::vector<std::string> &patterns, std::vector<uint8_t> &cache);
+    bool processMatches(uint64_t pid);
+    void clearCaches();
+
+    const TraceStringTable &m_strings;
+    TraceEventSink *m_next;
+    bool m_mergingSlices;
+
+    std::vector<uint64_t> m_pids; // empty for all
+    std::vector<uint64_t> m_tids;
+    std::vector<std::string> m_processes;
+    std::vector<std::string> m_categories;
+    std::vector<std::string> m_tracepoints;
+    uint64_t m_minimumDuration;
+    uint32_t m_types; // bit per MessageType
+
+    // Whether each category and tracepoint string ID matches, looked up the
+    // first time we see it: 0 if we haven't yet, 1 if it does, 2 if not.
+    std::vector<uint8_t> m_categoryMatches;
+    std::vector<uint8_t> m_tracepointMatches;
+
+    // Whether each process matches pid and proc. Events come in runs from
+    // the same process, so the last answer is kept handy.
+    std::unordered_map<uint64_t, bool> m_processMatches;
+    uint64_t m_lastPid;
+    bool m_lastPidMatches;
+};
+
+// Drops complete events shorter than the filter's mindur. It goes after
+// slices are merged, as until then, their durations aren't known.
+class DurationFilter : public TraceEventSink
+{
+public:
+    DurationFilter(TraceEventSink *next, const EventFilter &filter)
+        : m_next(next)
+        , m_filter(filter)
+    {
+    }
+
+    void writeEvent(const TraceEvent &event) override
+    {
+        if (event.type == MessageType::DurationMessage && event.duration < m_filter.minimumDuration())
+            return;
+        m_next->writeEvent(event);
+    }
+
+private:
+    TraceEventSink *m_next;
+    const EventFilter &m_filter;
+};
+
+#endif // CTRACEFILTER_H
@@ -24,16 +24,31 @@
 #ifndef CTRACEMESSAGES_H
 #define CTRACEMESSAGES_H
 
-// Used by traced to clean up at startup time. Used client side to figure out
-// what to allocate.
-#define TRACED_MAX_SHM_CHUNKS 99999
+// Where traced listens for clients, unless overridden by setting this
+// environment variable (in both traced and the clients).
+#define TRACED_SOCKET_PATH "/tmp/traced"
+#define TRACED_SOCKET_ENV "TRACED_SOCKET"
+
+// tracectl talks to traced on the client socket's path with this appended.
+// Unlike the client protocol, this one is lines of text (see TraceController).
+#define TRACED_CONTROL_SUFFIX ".ctl"
+
+// Live subscribers connect on the client socket's path with this appended
+// (see TraceSubscriber).
+#define TRACED_SUBSCRIBE_SUFFIX ".sub"
+
+// All SHM chunk names start with this. The full name is
+// <prefix>-<uid>-<traced pid>-<client pid>-<sequence>, so that chunks from
+// different sessions (and users) never collide, and traced can tell which
+// leftovers are its own.
+#define TRACED_SHM_PREFIX "tracechunk"
 
 // Used to mark a SHM chunk for some measure of safety.
 #define TRACED_PROTOCOL_MAGIC 0xDEADBEEFBAAD
 
 // Used to mark a SHM chunk as being written/read by a given version, for
 // safety's sake. Bump this if the protocol changes.
-#define TRACED_PROTOCOL_VERSION 256
+#define TRACED_PROTOCOL_VERSION 260
 
 enum class MessageType : uint8_t
 {
@@ -48,6 +63,86 @@ enum class MessageType : uint8_t
     CounterMessageWithId = 8
 };
 
+// Sent by traced to each client as soon as it connects, before anything else.
+// Tells the client what to name its SHM chunks for this session.
+struct SessionMessage
+{
+    uint64_t magic;
+    uint16_t version;
+    char chunkPrefix[64]; // nul-terminated
+};
+
+// Everything a client sends over the socket is one of these. They're all the
+// same size, so that traced can read them in batches straight out of its
+// buffer, and a client can send many at once.
+enum class ControlMessageType : uint16_t
+{
+    // First message on a new connection. chunkId is the client's pid, as
+    // used in its chunk names.
+    HelloMessage = 1,
+
+    // A chunk is ready to be read. chunkId is its sequence number (the last
+    // part of its name), and length is how many bytes of it were written.
+    // flags is TRACED_CHUNK_FULL if the client submitted it because it ran
+    // out of room, rather than because (say) the process is exiting.
+    SubmitChunkMessage = 2,
+
+    // Sent by traced to a client that has registered more strings than it
+    // is allowed to. The client should stop registering new strings, and use
+    // TRACED_OVERFLOW_STRING_ID for them instead.
+    TooManyStringsMessage = 3,
+
+    // Sent by traced to all clients when it can't keep up (or has caught up
+    // again). flags is the DegradeLevel to trace at from now on.
+    DegradeMessage = 4,
+
+    // Sent by traced to say that the category the client registered as
+    // string chunkId is a priority one, to keep tracing at
+    // DegradeLevel::PriorityOnly.
+    KeepCategoryMessage = 5
+};
+
+// How much clients should cut back their tracing, when traced is falling
+// behind (see DegradeMessage). Clients that don't know about this (or about
+// a level) just carry on tracing everything.
+enum class DegradeLevel : uint16_t
+{
+    Full = 0,
+
+    // Only trace one in TRACED_SAMPLE_INTERVAL of each thread's top level
+    // slices (with everything nested in them), counter updates, and async
+    // slices (by cookie, so that begins and ends stay together).
+    Sampled = 1,
+
+    // As Sampled, but only in the categories traced has sent in
+    // KeepCategoryMessages.
+    PriorityOnly = 2,
+
+    // Don't trace at all, until told otherwise.
+    Stopped = 3
+};
+
+#define TRACED_SAMPLE_INTERVAL 8
+
+// A string ID that clients never register, and use in place of strings that
+// traced has refused (see TooManyStringsMessage). Real IDs start at 1.
+#define TRACED_OVERFLOW_STRING_ID 0
+
+// See SubmitChunkMessage.
+#define TRACED_CHUNK_FULL 0x1
+
+struct ControlMessage
+{
+    ControlMessageType type;
+    uint16_t flags; // DegradeMessage: the level; SubmitChunkMessage: TRACED_CHUNK_FULL; unused otherwise
+    uint32_t length;
+    uint64_t chunkId;
+
+    // Counts up from 0 on each connection, so traced can tell if it missed
+    // something.
+    uint64_t sequence;
+};
+
 // ### consider splitting ChunkHeader to a ProcessHeaderMessage and
 // ChunkHeaderMessage. pid & epoch should never change, so that's 16 bytes of
 // each chunk wasted at present.
@@ -0,0 +1,718 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "CTraceOutput.h"
+#include "CTraceStrings.h"
+#include "CTraceRecords.h"
+
+void JsonTraceOutput::writeHeader()
+{
+    m_hasEvents = false;
+    m_hasFlushedEvents = false;
+    m_writer->printf("{\"traceEvents\": [\n");
+}
+
+void JsonTraceOutput::writeEvent(const TraceEvent &e)
+{
+    const char *cat = m_strings.string(e.categoryId);
+    const char *name = m_strings.string(e.tracepointId);
+
+    if (m_hasEvents)
+        m_writer->write(",\n", 2);
+    m_hasEvents = true;
+
+    switch (e.type) {
+    case MessageType::BeginMessage:
+        m_writer->printf("{\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"ts\":%" PRIu64 ",\"ph\":\"B\",\"cat\":\"%s\",\"name\":\"%s\"}", e.pid, e.tid, e.timestamp, cat, name);
+        break;
+    case MessageType::EndMessage:
+        m_writer->printf("{\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"ts\":%" PRIu64 ",\"ph\":\"E\",\"cat\":\"%s\",\"name\":\"%s\"}", e.pid, e.tid, e.timestamp, cat, name);
+        break;
+    case MessageType::DurationMessage:
+        m_writer->printf("{\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\"}", e.pid, e.tid, e.timestamp, e.duration, cat, name);
+        break;
+    case MessageType::CounterMessage:
+        m_writer->printf("{\"pid\":%" PRIu64 ",\"ts\":%" PRIu64 ",\"ph\":\"C\",\"cat\":\"%s\",\"name\":\"%s\",\"args\":{\"%s\":%" PRIu64 "}}", e.pid, e.timestamp, cat, name, name, e.value);
+        break;
+    case MessageType::CounterMessageWithId:
+        m_writer->printf("{\"pid\":%" PRIu64 ",\"ts\":%" PRIu64 ",\"ph\":\"C\",\"cat\":\"%s\",\"name\":\"%s\",\"id\":%" PRIu64 ",\"args\":{\"%s\":%" PRIu64 "}}", e.pid, e.timestamp, cat, name, e.id, name, e.value);
+        break;
+    case MessageType::AsyncBeginMessage:
+        m_writer->printf("{\"pid\":%" PRIu64 ",\"ts\":%" PRIu64 ",\"ph\":\"b\",\"cat\":\"%s\",\"name\":\"%s\",\"id\":\"%p\",\"args\":{}}", e.pid, e.timestamp, cat, name, (void*)e.id);
+        break;
+    case MessageType::AsyncEndMessage:
+        m_writer->printf("{\"pid\":%" PRIu64 ",\"ts\":%" PRIu64 ",\"ph\":\"e\",\"cat\":\"%s\",\"name\":\"%s\",\"id\":\"%p\",\"args\":{}}", e.pid, e.timestamp, cat, name, (void*)e.id);
+        break;
+    default:
+        break;
+    }
+}
+
+void JsonTraceOutput::writeAggregate(const TraceEvent &e, uint64_t count, uint64_t totalDuration)
+{
+    if (m_hasEvents)
+        m_writer->write(",\n", 2);
+    m_hasEvents = true;
+
+    m_writer->printf("{\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"args\":{\"count\":%" PRIu64 ",\"total_us\":%" PRIu64 "}}",
+                     e.pid, e.tid, e.timestamp, e.duration, m_strings.string(e.categoryId), m_strings.string(e.tracepointId),
+                     count, totalDuration);
+}
+
+void JsonTraceOutput::writeClockSync(uint64_t pid, uint64_t timestamp, uint64_t realtime)
+{
+    if (m_hasEvents)
+        m_writer->write(",\n", 2);
+    m_hasEvents = true;
+
+    m_writer->printf("{\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"ts\":%" PRIu64 ",\"ph\":\"c\",\"name\":\"clock_sync\",\"args\":{\"sync_id\":\"realtime\",\"realtime_us\":%" PRIu64 "}}",
+                     pid, pid, timestamp, realtime);
+}
+
+void JsonTraceOutput::flushed(bool dropped)
+{
+    if (dropped)
+        m_hasEvents = m_hasFlushedEvents;
+    else
+        m_hasFlushedEvents = m_hasEvents;
+}
+
+void JsonTraceOutput::writeFooter()
+{
+    m_writer->printf("\n]\n");
+
+    if (!m_systemTraceEvents.empty()) {
+        m_writer->printf(",\"systemTraceEvents\":\"# tracer:\\n");
+        m_writer->printf("%s", m_systemTraceEvents.c_str());
+        m_writer->printf("\"\n");
+    }
+
+    m_writer->printf("}\n");
+}
+
+// Field numbers from perfetto's protos/perfetto/trace/, for the handful of
+// messages that we need.
+namespace Perfetto {
+    enum TraceField { Trace_packet = 1 };
+    enum TracePacketField {
+        TracePacket_clockSnapshot = 6,
+        TracePacket_timestamp = 8,
+        TracePacket_trustedPacketSequenceId = 10,
+        TracePacket_trackEvent = 11,
+        TracePacket_internedData = 12,
+        TracePacket_sequenceFlags = 13,
+        TracePacket_tracePacketDefaults = 59,
+        TracePacket_trackDescriptor = 60
+    };
+    enum TracePacketDefaultsField { TracePacketDefaults_timestampClockId = 58 };
+    enum ClockSnapshotField { ClockSnapshot_clocks = 1, ClockSnapshot_primaryTraceClock = 2 };
+    enum ClockField { Clock_clockId = 1, Clock_timestamp = 2 };
+    enum TrackDescriptorField {
+        TrackDescriptor_uuid = 1,
+        TrackDescriptor_name = 2,
+        TrackDescriptor_process = 3,
+        TrackDescriptor_thread = 4,
+        TrackDescriptor_parentUuid = 5,
+        TrackDescriptor_counter = 8
+    };
+    enum ProcessDescriptorField { ProcessDescriptor_pid = 1 };
+    enum ThreadDescriptorField { ThreadDescriptor_pid = 1, ThreadDescriptor_tid = 2 };
+    enum TrackEventField {
+        TrackEvent_categoryIids = 3,
+        TrackEvent_type = 9,
+        TrackEvent_nameIid = 10,
+        TrackEvent_trackUuid = 11,
+        TrackEvent_counterValue = 30
+    };
+    enum InternedDataField { InternedData_eventCategories = 1, InternedData_eventNames = 2 };
+    enum InternedStringField { InternedString_iid = 1, InternedString_name = 2 };
+
+    enum TrackEventType { SliceBegin = 1, SliceEnd = 2, Instant = 3, Counter = 4 };
+    enum SequenceFlags { IncrementalStateCleared = 1, NeedsIncrementalState = 2 };
+    enum BuiltinClock { ClockMonotonic = 3, ClockBoottime = 6 };
+
+    // traced is the only writer, so all packets go on a single sequence.
+    const uint32_t SequenceId = 1;
+}
+
+using namespace Perfetto;
+
+enum TrackKind
+{
+    ProcessTrack = 1,
+    ThreadTrack,
+    CounterTrack,
+    AsyncTrack
+};
+
+// Track UUIDs only need to be unique within the trace, so derive them from
+// whatever identifies the track rather than keeping a table of them.
+static uint64_t trackUuid(TrackKind kind, uint64_t a, uint64_t b = 0, uint64_t c = 0)
+{
+    uint64_t h = kind;
+    for (uint64_t v : { a, b, c }) {
+        h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        h ^= h >> 31;
+    }
+    return h ? h : 1;
+}
+
+// Returns true if id wasn't yet marked as written.
+static bool markInterned(std::vector<bool> &interned, uint32_t id)
+{
+    if (id >= interned.size())
+        interned.resize(id + 1);
+    if (interned[id])
+        return false;
+    interned[id] = true;
+    return true;
+}
+
+// Start the sequence over: forget which tracks and strings the reader knows
+// about, and (re)set the packet defaults. Client timestamps are
+// CLOCK_MONOTONIC, so tell the reader that.
+void PerfettoTraceOutput::resetIncrementalState()
+{
+    m_knownTracks.clear();
+    m_internedCategories.clear();
+    m_internedNames.clear();
+
+    m_packet.clear();
+    m_packet.beginNested(Trace_packet);
+    m_packet.appendVarint(TracePacket_trustedPacketSequenceId, SequenceId);
+    m_packet.appendVarint(TracePacket_sequenceFlags, IncrementalStateCleared);
+    m_packet.beginNested(TracePacket_tracePacketDefaults);
+    m_packet.appendVarint(TracePacketDefaults_timestampClockId, ClockMonotonic);
+    m_packet.endNested();
+    m_packet.endNested();
+    m_writer->write(m_packet.data(), m_packet.size());
+}
+
+void PerfettoTraceOutput::flushed(bool dropped)
+{
+    // Track descriptors or interned strings may have gone with the dropped
+    // data, so start over.
+    if (dropped)
+        resetIncrementalState();
+}
+
+// How many complete events' begins are held back per thread, and for how long
+// after they end, at most (see PerfettoTraceOutput).
+static const size_t MaxHeldBegins = 256;
+static const uint64_t HeldBeginMicroseconds = 10 * 1000000;
+
+// Threads that have gone quiet (or away) don't keep their begins.
+void PerfettoTraceOutput::flush()
+{
+    m_packet.clear();
+    for (auto it = m_heldBegins.begin(); it != m_heldBegins.end();) {
+        if (it->second.latest + HeldBeginMicroseconds < m_latest) {
+            writeHeldBegins(it->second.events, it->second.events.size());
+            it = m_heldBegins.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    m_writer->write(m_packet.data(), m_packet.size());
+    TraceOutput::flush();
+}
+
+void PerfettoTraceOutput::writeFooter()
+{
+    m_packet.clear();
+    for (auto &held : m_heldBegins)
+        writeHeldBegins(held.second.events, held.second.events.size());
+    m_heldBegins.clear();
+    m_writer->write(m_packet.data(), m_packet.size());
+}
+
+void PerfettoTraceOutput::writeHeader()
+{
+    resetIncrementalState();
+
+    // The snapshot lets the reader line our CLOCK_MONOTONIC timestamps up with
+    // anything else in the trace (which will usually be using CLOCK_BOOTTIME).
+    m_packet.clear();
+    m_packet.beginNested(Trace_packet);
+    m_packet.appendVarint(TracePacket_trustedPacketSequenceId, SequenceId);
+    m_packet.beginNested(TracePacket_clockSnapshot);
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    m_packet.beginNested(ClockSnapshot_clocks);
+    m_packet.appendVarint(Clock_clockId, ClockMonotonic);
+    m_packet.appendVarint(Clock_timestamp, uint64_t(tp.tv_sec) * 1000000000 + tp.tv_nsec);
+    m_packet.endNested();
+#if defined(CLOCK_BOOTTIME)
+    clock_gettime(CLOCK_BOOTTIME, &tp);
+    m_packet.beginNested(ClockSnapshot_clocks);
+    m_packet.appendVarint(Clock_clockId, ClockBoottime);
+    m_packet.appendVarint(Clock_timestamp, uint64_t(tp.tv_sec) * 1000000000 + tp.tv_nsec);
+    m_packet.endNested();
+#endif
+    m_packet.endNested();
+    m_packet.endNested();
+
+    m_writer->write(m_packet.data(), m_packet.size());
+}
+
+uint64_t PerfettoTraceOutput::processTrack(uint64_t pid)
+{
+    uint64_t uuid = trackUuid(ProcessTrack, pid);
+    if (m_knownTracks.insert(uuid).second) {
+        m_packet.beginNested(Trace_packet);
+        m_packet.appendVarint(TracePacket_trustedPacketSequenceId, SequenceId);
+        m_packet.beginNested(TracePacket_trackDescriptor);
+        m_packet.appendVarint(TrackDescriptor_uuid, uuid);
+        m_packet.beginNested(TrackDescriptor_process);
+        m_packet.appendVarint(ProcessDescriptor_pid, pid);
+        m_packet.endNested();
+        m_packet.endNested();
+        m_packet.endNested();
+    }
+    return uuid;
+}
+
+uint64_t PerfettoTraceOutput::threadTrack(uint64_t pid, uint64_t tid)
+{
+    uint64_t uuid = trackUuid(ThreadTrack, pid, tid);
+    if (m_knownTracks.insert(uuid).second) {
+        processTrack(pid);
+        m_packet.beginNested(Trace_packet);
+        m_packet.appendVarint(TracePacket_trustedPacketSequenceId, SequenceId);
+        m_packet.beginNested(TracePacket_trackDescriptor);
+        m_packet.appendVarint(TrackDescriptor_uuid, uuid);
+        m_packet.beginNested(TrackDescriptor_thread);
+        m_packet.appendVarint(ThreadDescriptor_pid, pid);
+        m_packet.appendVarint(ThreadDescriptor_tid, tid);
+        m_packet.endNested();
+        m_packet.endNested();
+        m_packet.endNested();
+    }
+    return uuid;
+}
+
+uint64_t PerfettoTraceOutput::counterTrack(const TraceEvent &e)
+{
+    bool hasId = e.type == MessageType::CounterMessageWithId;
+    uint64_t uuid = trackUuid(CounterTrack, e.pid, e.tracepointId, hasId ? e.id : ~0ULL);
+    if (m_knownTracks.insert(uuid).second) {
+        uint64_t parent = processTrack(e.pid);
+        std::string name = m_strings.string(e.tracepointId);
+        if (hasId)
+            name += " " + std::to_string(e.id);
+
+        m_packet.beginNested(Trace_packet);
+        m_packet.appendVarint(TracePacket_trustedPacketSequenceId, SequenceId);
+        m_packet.beginNested(TracePacket_trackDescriptor);
+        m_packet.appendVarint(TrackDescriptor_uuid, uuid);
+        m_packet.appendVarint(TrackDescriptor_parentUuid, parent);
+        m_packet.appendBytes(TrackDescriptor_name, name.data(), name.size());
+        m_packet.beginNested(TrackDescriptor_counter);
+        m_packet.endNested();
+        m_packet.endNested();
+        m_packet.endNested();
+    }
+    return uuid;
+}
+
+uint64_t PerfettoTraceOutput::asyncTrack(const TraceEvent &e)
+{
+    uint64_t uuid = trackUuid(AsyncTrack, e.pid, e.tracepointId, e.id);
+    if (m_knownTracks.insert(uuid).second) {
+        uint64_t parent = processTrack(e.pid);
+        m_packet.beginNested(Trace_packet);
+        m_packet.appendVarint(TracePacket_trustedPacketSequenceId, SequenceId);
+        m_packet.beginNested(TracePacket_trackDescriptor);
+        m_packet.appendVarint(TrackDescriptor_uuid, uuid);
+        m_packet.appendVarint(TrackDescriptor_parentUuid, parent);
+        m_packet.appendString(TrackDescriptor_name, m_strings.string(e.tracepointId));
+        m_packet.endNested();
+        m_packet.endNested();
+    }
+    return uuid;
+}
+
+void PerfettoTraceOutput::beginPacket(uint64_t timestamp)
+{
+    m_packet.beginNested(Trace_packet);
+    m_packet.appendVarint(TracePacket_timestamp, timestamp * 1000);
+    m_packet.appendVarint(TracePacket_trustedPacketSequenceId, SequenceId);
+    m_packet.appendVarint(TracePacket_sequenceFlags, NeedsIncrementalState);
+}
+
+void PerfettoTraceOutput::endPacket()
+{
+    m_packet.endNested();
+}
+
+void PerfettoTraceOutput::writeSlice(const TraceEvent &e, uint64_t timestamp, int type, uint64_t track)
+{
+    beginPacket(timestamp);
+
+    if (type == SliceBegin) {
+        bool newCategory = markInterned(m_internedCategories, e.categoryId);
+        bool newName = markInterned(m_internedNames, e.tracepointId);
+        if (newCategory || newName) {
+            m_packet.beginNested(TracePacket_internedData);
+            if (newCategory) {
+                m_packet.beginNested(InternedData_eventCategories);
+                m_packet.appendVarint(InternedString_iid, e.categoryId + 1);
+                m_packet.appendString(InternedString_name, m_strings.string(e.categoryId));
+                m_packet.endNested();
+            }
+            if (newName) {
+                m_packet.beginNested(InternedData_eventNames);
+                m_packet.appendVarint(InternedString_iid, e.tracepointId + 1);
+                m_packet.appendString(InternedString_name, m_strings.string(e.tracepointId));
+                m_packet.endNested();
+            }
+            m_packet.endNested();
+        }
+    }
+
+    m_packet.beginNested(TracePacket_trackEvent);
+    m_packet.appendVarint(TrackEvent_type, type);
+    m_packet.appendVarint(TrackEvent_trackUuid, track);
+    if (type == SliceBegin) {
+        // iids are offset by one, as iid 0 is reserved.
+        m_packet.appendVarint(TrackEvent_categoryIids, e.categoryId + 1);
+        m_packet.appendVarint(TrackEvent_nameIid, e.tracepointId + 1);
+    }
+    m_packet.endNested();
+
+    endPacket();
+}
+
+// Writes the first count of begins outermost first, and forgets them.
+void PerfettoTraceOutput::writeHeldBegins(std::vector<TraceEvent> &begins, size_t count)
+{
+    for (size_t i = count; i-- > 0;) {
+        const TraceEvent &e = begins[i];
+        writeSlice(e, e.timestamp, SliceBegin, threadTrack(e.pid, e.tid));
+    }
+    begins.erase(begins.begin(), begins.begin() + count);
+}
+
+void PerfettoTraceOutput::writeCompleteSlice(const TraceEvent &e)
+{
+    uint64_t track = threadTrack(e.pid, e.tid);
+    uint64_t end = e.timestamp + e.duration;
+
+    // A slice with no duration can't be told apart from a sibling of whatever
+    // begins next, so it's written as one. It can't enclose anything held.
+    if (e.duration == 0) {
+        writeSlice(e, e.timestamp, SliceBegin, track);
+        writeSlice(e, end, SliceEnd, track);
+        return;
+    }
+
+    HeldBegins &held = m_heldBegins[track];
+    std::vector<TraceEvent> &begins = held.events;
+    held.latest = std::max(held.latest, end);
+    m_latest = std::max(m_latest, end);
+
+    // Anything held that begins after this one is nested in it, and so can't
+    // share a begin with anything still to come. Anything that begins with it
+    // is nested in it too, and stays held behind it.
+    size_t same = begins.size();
+    while (same > 0 && begins[same - 1].timestamp >= e.timestamp)
+        --same;
+    size_t nested = same;
+    while (nested < begins.size() && begins[nested].timestamp == e.timestamp)
+        ++nested;
+    for (size_t i = begins.size(); i-- > nested;)
+        writeSlice(begins[i], begins[i].timestamp, SliceBegin, track);
+    begins.resize(nested);
+    begins.push_back(e);
+
+    // The end can go now: anything nested in it has already ended.
+    writeSlice(e, end, SliceEnd, track);
+
+    // Begins are sorted, so the oldest are first. Those that began together
+    // are written together, so that they stay in order.
+    while (!begins.empty() && (begins.size() > MaxHeldBegins ||
+                               begins.front().timestamp + HeldBeginMicroseconds < held.latest)) {
+        size_t count = 1;
+        while (count < begins.size() && begins[count].timestamp == begins.front().timestamp)
+            ++count;
+        writeHeldBegins(begins, count);
+    }
+}
+
+void PerfettoTraceOutput::writeEvent(const TraceEvent &e)
+{
+    m_packet.clear();
+
+    switch (e.type) {
+    case MessageType::BeginMessage:
+        writeSlice(e, e.timestamp, SliceBegin, threadTrack(e.pid, e.tid));
+        break;
+    case MessageType::EndMessage:
+        writeSlice(e, e.timestamp, SliceEnd, threadTrack(e.pid, e.tid));
+        break;
+    case MessageType::DurationMessage:
+        writeCompleteSlice(e);
+        break;
+    case MessageType::CounterMessage:
+    case MessageType::CounterMessageWithId: {
+        uint64_t track = counterTrack(e);
+        beginPacket(e.timestamp);
+        m_packet.beginNested(TracePacket_trackEvent);
+        m_packet.appendVarint(TrackEvent_type, Counter);
+        m_packet.appendVarint(TrackEvent_trackUuid, track);
+        m_packet.appendVarint(TrackEvent_counterValue, e.value);
+        m_packet.endNested();
+        endPacket();
+        break;
+    }
+    case MessageType::AsyncBeginMessage:
+        writeSlice(e, e.timestamp, SliceBegin, asyncTrack(e));
+        break;
+    case MessageType::AsyncEndMessage:
+        writeSlice(e, e.timestamp, SliceEnd, asyncTrack(e));
+        break;
+    default:
+        break;
+    }
+
+    m_writer->write(m_packet.data(), m_packet.size());
+}
+
+void BinaryTraceOutput::writeHeader()
+{
+    // Each file (or segment) stands alone, so strings are written again.
+    m_writtenStrings.clear();
+    m_flushedStrings.clear();
+
+    RecordFileHeader h;
+    memcpy(h.magic, TRACED_RECORDS_MAGIC, sizeof(h.magic));
+    h.version = 1;
+    h.reserved = 0;
+    m_writer->write(reinterpret_cast<const char*>(&h), sizeof(h));
+}
+
+void BinaryTraceOutput::writeString(uint32_t id)
+{
+    if (!markInterned(m_writtenStrings, id))
+        return;
+
+    const char *str = m_strings.string(id);
+    uint32_t len = strlen(str);
+
+    RecordHeader h;
+    memset(&h, 0, sizeof(h));
+    h.length = offsetof(StringRecord, stringData) + len;
+    h.type = RecordType::StringRecord;
+    m_writer->write(reinterpret_cast<const char*>(&h), sizeof(h));
+    m_writer->write(reinterpret_cast<const char*>(&id), sizeof(id));
+    m_writer->write(str, len);
+}
+
+void BinaryTraceOutput::writeEvent(const TraceEvent &e)
+{
+    writeString(e.categoryId);
+    writeString(e.tracepointId);
+
+    struct {
+        RecordHeader h;
+        EventRecord r;
+    } __attribute__((packed)) rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.h.length = sizeof(rec.r);
+    rec.h.type = RecordType::EventRecord;
+    rec.r.type = (uint8_t)e.type;
+    rec.r.categoryId = e.categoryId;
+    rec.r.tracepointId = e.tracepointId;
+    rec.r.pid = e.pid;
+    rec.r.tid = e.tid;
+    rec.r.timestamp = e.timestamp;
+    rec.r.duration = e.duration;
+    rec.r.value = e.value;
+    rec.r.id = e.id;
+    m_writer->write(reinterpret_cast<const char*>(&rec), sizeof(rec));
+}
+
+void BinaryTraceOutput::writeRawChunk(uint64_t clientId, const char *data, size_t length)
+{
+    struct {
+        RecordHeader h;
+        uint64_t clientId;
+    } __attribute__((packed)) rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.h.length = offsetof(RawChunkRecord, chunkData) + length;
+    rec.h.type = RecordType::RawChunkRecord;
+    rec.clientId = clientId;
+    m_writer->write(reinterpret_cast<const char*>(&rec), sizeof(rec));
+    m_writer->write(data, length);
+}
+
+void BinaryTraceOutput::writeHost(const std::string &name)
+{
+    RecordHeader h;
+    memset(&h, 0, sizeof(h));
+    h.length = name.size();
+    h.type = RecordType::HostRecord;
+    m_writer->write(reinterpret_cast<const char*>(&h), sizeof(h));
+    m_writer->write(name.data(), name.size());
+}
+
+void BinaryTraceOutput::writeClockSync(uint64_t probeTime, uint64_t localTime)
+{
+    struct {
+        RecordHeader h;
+        ClockSyncRecord r;
+    } __attribute__((packed)) rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.h.length = sizeof(rec.r);
+    rec.h.type = RecordType::ClockSyncRecord;
+    rec.r.probeTime = probeTime;
+    rec.r.localTime = localTime;
+    m_writer->write(reinterpret_cast<const char*>(&rec), sizeof(rec));
+}
+
+void BinaryTraceOutput::flushed(bool dropped)
+{
+    // Forget any strings that went with the dropped data, so that they're
+    // written again before their next use.
+    if (dropped)
+        m_writtenStrings = m_flushedStrings;
+    else
+        m_flushedStrings = m_writtenStrings;
+}
+
+void StoreTraceOutput::write(const void *data, size_t length)
+{
+    m_writer->write(static_cast<const char*>(data), length);
+    m_offset += length;
+}
+
+void StoreTraceOutput::writeHeader()
+{
+    m_pending.clear();
+    m_index.clear();
+    m_offset = 0;
+    m_flushedOffset = 0;
+    m_flushedIndexCount = 0;
+
+    StoreFileHeader h;
+    memcpy(h.magic, TRACED_STORE_MAGIC, sizeof(h.magic));
+    h.version = 1;
+    h.reserved = 0;
+    write(&h, sizeof(h));
+}
+
+void StoreTraceOutput::writeEvent(const TraceEvent &e)
+{
+    ThreadKey thread(e.pid, e.tid);
+    std::vector<EventRecord> &events = m_pending[thread];
+
+    EventRecord r;
+    memset(&r, 0, sizeof(r));
+    r.type = (uint8_t)e.type;
+    r.categoryId = e.categoryId;
+    r.tracepointId = e.tracepointId;
+    r.pid = e.pid;
+    r.tid = e.tid;
+    r.timestamp = e.timestamp;
+    r.duration = e.duration;
+    r.value = e.value;
+    r.id = e.id;
+    events.push_back(r);
+
+    if (events.size() >= StoreBlockEvents)
+        writeBlock(thread, events);
+}
+
+void StoreTraceOutput::writeBlock(const ThreadKey &thread, std::vector<EventRecord> &events)
+{
+    // Mostly in order already: complete events are the exception, as they're
+    // written when they end.
+    std::stable_sort(events.begin(), events.end(), [](const EventRecord &a, const EventRecord &b) {
+        return a.timestamp < b.timestamp;
+    });
+
+    StoreIndexEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.offset = m_offset;
+    entry.count = events.size();
+    entry.pid = thread.first;
+    entry.tid = thread.second;
+    entry.start = events.front().timestamp;
+    for (const EventRecord &r : events) {
+        entry.end = std::max<uint64_t>(entry.end, r.timestamp + r.duration);
+        entry.addTracepoint(r.tracepointId);
+    }
+    m_index.push_back(entry);
+
+    write(events.data(), events.size() * sizeof(EventRecord));
+    events.clear();
+}
+
+void StoreTraceOutput::writeFooter()
+{
+    for (auto &pending : m_pending) {
+        if (!pending.second.empty())
+            writeBlock(pending.first, pending.second);
+    }
+    m_pending.clear();
+
+    StoreTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.stringsOffset = m_offset;
+    trailer.stringCount = m_strings.size();
+    for (uint32_t id = 0; id < trailer.stringCount; ++id) {
+        const char *str = m_strings.string(id);
+        uint32_t len = strlen(str);
+        write(&len, sizeof(len));
+        write(str, len);
+    }
+
+    trailer.indexOffset = m_offset;
+    trailer.indexCount = m_index.size();
+    write(m_index.data(), m_index.size() * sizeof(StoreIndexEntry));
+
+    memcpy(trailer.magic, TRACED_STORE_MAGIC, sizeof(trailer.magic));
+    write(&trailer, sizeof(trailer));
+}
+
+void StoreTraceOutput::flushed(bool dropped)
+{
+    // Blocks that were dropped never made it into the file, so the ones
+    // after them will be where they would have been.
+    if (dropped) {
+        m_offset = m_flushedOffset;
+        m_index.resize(m_flushedIndexCount);
+    } else {
+        m_flushedOffset = m_offset;
+        m_flushedIndexCount = m_index.size();
+    }
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACEOUTPUT_H
+#define CTRACEOUTPUT_H
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "CTraceEvent.h"
+#include "CTraceRecords.h"
+#include "CTraceStore.h"
+#include "CProtoWriter.h"
+#include "CTraceWriter.h"
+
+class TraceStringTable;
+
+// Turns decoded events into a trace file of some format.
+class TraceOutput : public TraceEventSink
+{
+public:
+    TraceOutput(TraceWriter *writer, const TraceStringTable &strings)
+        : m_writer(writer)
+        , m_strings(strings)
+    {
+    }
+
+    virtual ~TraceOutput() {}
+
+    virtual void writeHeader() {}
+    virtual void writeFooter() {}
+
+    virtual void flush()
+    {
+        flushed(!m_writer->flush());
+    }
+
+    // Write the footer, and hand it to the writer even if it's behind, so
+    // that the trace is complete whatever was dropped before it.
+    void finish()
+    {
+        writeFooter();
+        flushed(!m_writer->flush(true));
+    }
+
+protected:
+    // Called after each flush(). If dropped is set, everything written since
+    // the previous flush() was thrown away, and formats must fix up any state
+    // that referred to it.
+    virtual void flushed(bool dropped) { (void)dropped; }
+
+    TraceWriter *m_writer;
+    const TraceStringTable &m_strings;
+};
+
+// Chrome's JSON trace event format, as understood by catapult.
+class JsonTraceOutput : public TraceOutput
+{
+public:
+    using TraceOutput::TraceOutput;
+
+    void writeHeader() override;
+    void writeEvent(const TraceEvent &event) override;
+    void writeFooter() override;
+
+    // A complete event standing in for count slices of the same name, which
+    // took totalDuration between them (see tracequery's levels of detail).
+    void writeAggregate(const TraceEvent &event, uint64_t count, uint64_t totalDuration);
+
+    // A clock sync marker, recording that timestamp (on CLOCK_MONOTONIC, as
+    // events are) was realtime (in microseconds since the epoch), so that
+    // traces from different runs or hosts can be lined up (see tracemerge).
+    // Like atrace's, but in the trace itself.
+    void writeClockSync(uint64_t pid, uint64_t timestamp, uint64_t realtime);
+
+    // Kernel trace data (from atrace) to embed in the trace.
+    void setSystemTraceEvents(const std::string &data) { m_systemTraceEvents = data; }
+
+protected:
+    void flushed(bool dropped) override;
+
+private:
+    std::string m_systemTraceEvents;
+
+    // Events are separated by a leading comma, so that we never need to go
+    // back and remove a trailing one (we can't seek in a pipe, or a
+    // compressed stream).
+    bool m_hasEvents = false;
+    bool m_hasFlushedEvents = false;
+};
+
+// Perfetto's protobuf trace format (a stream of TracePackets), as understood
+// by ui.perfetto.dev and trace_processor.
+//
+// Categories and event names are interned, so each string is written once per
+// trace rather than once per event.
+//
+// Complete events come innermost first, as that's the order they end in, but
+// readers sort slices by timestamp alone, so a child that begins in the same
+// microsecond as its parent must have its begin written after the parent's.
+// So each complete event's begin is held back until nothing still to come can
+// enclose it with the same begin: until too many are held on its thread, or
+// they're HeldBeginMicroseconds old, or the trace ends.
+class PerfettoTraceOutput : public TraceOutput
+{
+public:
+    using TraceOutput::TraceOutput;
+
+    void writeHeader() override;
+    void writeEvent(const TraceEvent &event) override;
+    void writeFooter() override;
+    void flush() override;
+
+protected:
+    void flushed(bool dropped) override;
+
+private:
+    void resetIncrementalState();
+    uint64_t processTrack(uint64_t pid);
+    uint64_t threadTrack(uint64_t pid, uint64_t tid);
+    uint64_t counterTrack(const TraceEvent &event);
+    uint64_t asyncTrack(const TraceEvent &event);
+
+    void beginPacket(uint64_t timestamp);
+    void endPacket();
+    void writeSlice(const TraceEvent &event, uint64_t timestamp, int type, uint64_t track);
+    void writeCompleteSlice(const TraceEvent &event);
+    void writeHeldBegins(std::vector<TraceEvent> &begins, size_t count);
+
+    ProtoWriter m_packet;
+
+    // Complete events whose begins haven't been written yet, by thread track,
+    // in the order they came (so by begin, and innermost first for the same
+    // begin).
+    struct HeldBegins
+    {
+        std::vector<TraceEvent> events;
+        uint64_t latest = 0; // the latest end on the thread
+    };
+    std::unordered_map<uint64_t, HeldBegins> m_heldBegins;
+    uint64_t m_latest = 0; // the latest end on any thread
+    std::unordered_set<uint64_t> m_knownTracks;
+    std::vector<bool> m_internedCategories;
+    std::vector<bool> m_internedNames;
+};
+
+// traced's own record-framed binary format (see CTraceRecords.h). This is
+// the one to use when traced might not get to exit cleanly: the output is
+// readable up to the last complete record no matter where it stops.
+class BinaryTraceOutput : public TraceOutput
+{
+public:
+    using TraceOutput::TraceOutput;
+
+    void writeHeader() override;
+    void writeEvent(const TraceEvent &event) override;
+
+    // Writes a client's chunk without decoding it (--raw).
+    void writeRawChunk(uint64_t clientId, const char *data, size_t length);
+
+    // For a stream forwarded to another traced (see CTraceRelay.h).
+    void writeHost(const std::string &name);
+    void writeClockSync(uint64_t probeTime, uint64_t localTime);
+
+protected:
+    void flushed(bool dropped) override;
+
+private:
+    void writeString(uint32_t id);
+
+    std::vector<bool> m_writtenStrings;
+    std::vector<bool> m_flushedStrings;
+};
+
+// traced's indexed store format (see CTraceStore.h).
+class StoreTraceOutput : public TraceOutput
+{
+public:
+    using TraceOutput::TraceOutput;
+
+    void writeHeader() override;
+    void writeEvent(const TraceEvent &event) override;
+    void writeFooter() override;
+
+protected:
+    void flushed(bool dropped) override;
+
+private:
+    typedef std::pair<uint64_t, uint64_t> ThreadKey; // pid, tid
+
+    void writeBlock(const ThreadKey &thread, std::vector<EventRecord> &events);
+    void write(const void *data, size_t length);
+
+    // Events not yet written, for each thread.
+    std::map<ThreadKey, std::vector<EventRecord>> m_pending;
+
+    std::vector<StoreIndexEntry> m_index;
+    uint64_t m_offset = 0;
+
+    // As of the last flush that made it out, so we can forget any blocks
+    // that were dropped.
+    uint64_t m_flushedOffset = 0;
+    size_t m_flushedIndexCount = 0;
+};
+
+#endif // CTRACEOUTPUT_H
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACERECORDS_H
+#define CTRACERECORDS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+#include "CTraceEvent.h"
+
+// traced's own binary trace format (-f binary).
+//
+// A file header, followed by a stream of length-prefixed records. Records
+// are only ever appended whole, so the file is usable at any point: if traced
+// dies half way through writing one, readers just ignore the incomplete
+// record at the end. That makes it safe to write to a pipe, and to read while
+// it's still being written.
+//
+// Strings are written (once) before the first event that uses them. All
+// integers are little-endian, as we only ever read them back on the same
+// kind of host.
+//
+// A raw capture (--raw) has RawChunkRecords instead: the chunks exactly as
+// clients wrote them, to be decoded later. A client's strings are registered
+// in its earlier chunks, so those have to be read in order, from the start.
+// (traced starts each file with chunks of its own, registering all of its
+// clients' strings so far.)
+//
+// A stream forwarded to another traced (-X) also has a HostRecord, and
+// ClockSyncRecords (see CTraceRelay.h). Other readers skip them.
+
+#define TRACED_RECORDS_MAGIC "TRACEDR1"
+
+// No record is bigger than a client's chunk (10KB) and the RawChunkRecord
+// around it, so anything much longer means the stream is corrupt.
+const uint32_t MaxRecordLength = 1024 * 1024;
+
+struct RecordFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+enum class RecordType : uint8_t
+{
+    StringRecord = 1,
+    EventRecord = 2,
+    RawChunkRecord = 3,
+    HostRecord = 4,
+    ClockSyncRecord = 5
+};
+
+struct RecordHeader
+{
+    uint32_t length; // of the payload that follows
+    RecordType type;
+    uint8_t reserved[3];
+};
+
+struct __attribute__((packed)) StringRecord
+{
+    uint32_t id;
+    char stringData; // and it follows on for the rest of the record
+};
+
+struct __attribute__((packed)) EventRecord
+{
+    uint8_t type; // MessageType
+    uint32_t categoryId;
+    uint32_t tracepointId;
+    uint64_t pid;
+    uint64_t tid;
+    uint64_t timestamp;
+    uint64_t duration;
+    uint64_t value;
+    uint64_t id;
+};
+
+struct __attribute__((packed)) RawChunkRecord
+{
+    uint64_t clientId; // the same for all chunks from one connection
+    char chunkData; // a ChunkHeader and messages, for the rest of the record
+};
+
+// The payload of a HostRecord is just the host's name.
+
+struct __attribute__((packed)) ClockSyncRecord
+{
+    uint64_t probeTime; // from the aggregator's ClockProbe
+    uint64_t localTime; // when we got it
+};
+
+// Reads records back from a file or pipe.
+class RecordReader
+{
+public:
+    explicit RecordReader(FILE *file)
+        : m_file(file)
+        , m_corrupt(false)
+    {
+    }
+
+    // Returns false if this isn't a record stream we understand.
+    bool readFileHeader()
+    {
+        RecordFileHeader h;
+        if (fread(&h, sizeof(h), 1, m_file) != 1)
+            return false;
+        return memcmp(h.magic, TRACED_RECORDS_MAGIC, sizeof(h.magic)) == 0 && h.version == 1;
+    }
+
+    // Reads the next record into type and payload. Returns false at the end
+    // of the stream (including a truncated final record), or if it's
+    // corrupt().
+    bool next(RecordType &type, std::string &payload)
+    {
+        RecordHeader h;
+        if (fread(&h, sizeof(h), 1, m_file) != 1)
+            return false;
+
+        // A new file header marks the start of a new segment or session, as
+        // when segments are concatenated. Skip it.
+        if (memcmp(&h, TRACED_RECORDS_MAGIC, sizeof(h)) == 0) {
+            uint32_t rest[2];
+            if (fread(rest, sizeof(rest), 1, m_file) != 1)
+                return false;
+            return next(type, payload);
+        }
+
+        if (h.length > MaxRecordLength) {
+            m_corrupt = true;
+            return false;
+        }
+
+        payload.resize(h.length);
+        if (h.length && fread(&payload[0], h.length, 1, m_file) != 1)
+            return false;
+        type = h.type;
+        return true;
+    }
+
+    // Whether next() stopped at a record too long to be real.
+    bool corrupt() const { return m_corrupt; }
+
+    static void toEvent(const EventRecord &r, TraceEvent &e)
+    {
+        e.type = (MessageType)r.type;
+        e.categoryId = r.categoryId;
+        e.tracepointId = r.tracepointId;
+        e.pid = r.pid;
+        e.tid = r.tid;
+        e.timestamp = r.timestamp;
+        e.duration = r.duration;
+        e.value = r.value;
+        e.id = r.id;
+    }
+
+private:
+    FILE *m_file;
+    bool m_corrupt;
+};
+
+#endif // CTRACERECORDS_H
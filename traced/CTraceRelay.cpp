@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <string.h>
+
+#include <algorithm>
+
+#include "CTraceRelay.h"
+#include "CTraceStrings.h"
+
+// How many clock samples to pick the best of. Probes go once a second, so
+// the offset follows any drift within this many seconds.
+static const size_t MaxClockSamples = 16;
+
+// How much to hold on to while waiting for the first clock sample, before
+// giving up and passing events on with no offset.
+static const size_t MaxUnsyncedBytes = 16 * 1024 * 1024;
+
+std::map<std::string, uint64_t> RelayedStream::s_hostNumbers;
+
+RelayedStream::RelayedStream(TraceStringTable &strings, uint32_t overflowStringId, const StringLimits &limits,
+                             TraceEventSink *next)
+    : m_strings(strings)
+    , m_overflowStringId(overflowStringId)
+    , m_limits(limits)
+    , m_next(next)
+    , m_readOffset(0)
+    , m_headerRead(false)
+    , m_pidBase(0)
+    , m_synced(false)
+    , m_clockOffset(0)
+    , m_roundTrip(0)
+    , m_events(0)
+{
+}
+
+void RelayedStream::addClockSample(const ClockSyncRecord &r, uint64_t now)
+{
+    // Samples may be seen twice (see findClockSamples()).
+    for (const ClockSample &s : m_clockSamples) {
+        if (s.probeTime == r.probeTime)
+            return;
+    }
+    if (r.probeTime > now)
+        return;
+
+    ClockSample sample;
+    sample.probeTime = r.probeTime;
+    sample.roundTrip = now - r.probeTime;
+    // Assume the probe got there half way through the round trip.
+    sample.offset = (int64_t)(r.probeTime + sample.roundTrip / 2) - (int64_t)r.localTime;
+    m_clockSamples.push_back(sample);
+    if (m_clockSamples.size() > MaxClockSamples)
+        m_clockSamples.pop_front();
+
+    auto best = std::min_element(m_clockSamples.begin(), m_clockSamples.end(),
+                                 [](const ClockSample &a, const ClockSample &b) {
+        return a.roundTrip < b.roundTrip;
+    });
+    m_clockOffset = best->offset;
+    m_roundTrip = best->roundTrip;
+    m_synced = true;
+}
+
+// Until the first clock sample arrives, events are held back, but the
+// sample itself is behind them in the stream. Look ahead for it.
+void RelayedStream::findClockSamples(uint64_t now)
+{
+    size_t offset = m_readOffset;
+    while (m_buffer.size() - offset >= sizeof(RecordHeader)) {
+        RecordHeader h;
+        memcpy(&h, m_buffer.data() + offset, sizeof(h));
+        if (memcmp(&h, TRACED_RECORDS_MAGIC, sizeof(h)) == 0) {
+            offset += sizeof(RecordFileHeader);
+            continue;
+        }
+        if (m_buffer.size() - offset - sizeof(h) < h.length)
+            break;
+        if (h.type == RecordType::ClockSyncRecord && h.length == sizeof(ClockSyncRecord)) {
+            ClockSyncRecord r;
+            memcpy(&r, m_buffer.data() + offset + sizeof(h), sizeof(r));
+            addClockSample(r, now);
+        }
+        offset += sizeof(h) + h.length;
+    }
+}
+
+bool RelayedStream::receive(const char *data, size_t length, uint64_t now)
+{
+    m_buffer.append(data, length);
+
+    if (!m_headerRead) {
+        if (m_buffer.size() < sizeof(RecordFileHeader))
+            return true;
+        RecordFileHeader h;
+        memcpy(&h, m_buffer.data(), sizeof(h));
+        if (memcmp(h.magic, TRACED_RECORDS_MAGIC, sizeof(h.magic)) != 0 || h.version != 1)
+            return false;
+        m_readOffset = sizeof(h);
+        m_headerRead = true;
+    }
+
+    if (!m_synced) {
+        findClockSamples(now);
+        if (!m_synced && m_buffer.size() - m_readOffset < MaxUnsyncedBytes)
+            return true;
+        if (!m_synced) {
+            fprintf(stderr, "No clock sync from host %s; its events may be out of time\n", m_hostName.c_str());
+            m_synced = true;
+        }
+    }
+
+    while (m_buffer.size() - m_readOffset >= sizeof(RecordHeader)) {
+        RecordHeader h;
+        memcpy(&h, m_buffer.data() + m_readOffset, sizeof(h));
+
+        // The forwarder stopped recording and started again.
+        if (memcmp(&h, TRACED_RECORDS_MAGIC, sizeof(h)) == 0) {
+            if (m_buffer.size() - m_readOffset < sizeof(RecordFileHeader))
+                break;
+            m_readOffset += sizeof(RecordFileHeader);
+            continue;
+        }
+
+        if (h.length > MaxRecordLength)
+            return false;
+        if (m_buffer.size() - m_readOffset - sizeof(h) < h.length)
+            break;
+        if (!readRecord(h.type, m_buffer.data() + m_readOffset + sizeof(h), h.length, now))
+            return false;
+        m_readOffset += sizeof(h) + h.length;
+    }
+
+    if (m_readOffset > 1024 * 1024 || m_readOffset == m_buffer.size()) {
+        m_buffer.erase(0, m_readOffset);
+        m_readOffset = 0;
+    }
+    return true;
+}
+
+bool RelayedStream::readRecord(RecordType type, const char *payload, size_t length, uint64_t now)
+{
+    switch (type) {
+    case RecordType::HostRecord: {
+        m_hostName.assign(payload, length);
+        auto it = s_hostNumbers.find(m_hostName);
+        if (it == s_hostNumbers.end())
+            it = s_hostNumbers.insert(std::make_pair(m_hostName, s_hostNumbers.size() + 1)).first;
+        m_pidBase = it->second * PidsPerHost;
+        break;
+    }
+    case RecordType::ClockSyncRecord: {
+        ClockSyncRecord r;
+        if (length != sizeof(r))
+            return false;
+        memcpy(&r, payload, sizeof(r));
+        addClockSample(r, now);
+        break;
+    }
+    case RecordType::StringRecord: {
+        uint32_t id;
+        if (length < sizeof(id))
+            return false;
+        memcpy(&id, payload, sizeof(id));
+        if (id >= m_limits.maxIdsPerClient)
+            return false;
+        if (id >= m_stringIds.size())
+            m_stringIds.resize(id + 1, 0);
+        m_stringIds[id] = m_strings.intern(payload + sizeof(id), length - sizeof(id));
+        break;
+    }
+    case RecordType::EventRecord: {
+        EventRecord r;
+        if (length != sizeof(r))
+            return false;
+        memcpy(&r, payload, sizeof(r));
+        TraceEvent ev;
+        RecordReader::toEvent(r, ev);
+        ev.categoryId = ev.categoryId < m_stringIds.size() ? m_stringIds[ev.categoryId] : 0;
+        ev.tracepointId = ev.tracepointId < m_stringIds.size() ? m_stringIds[ev.tracepointId] : 0;
+        writeEvent(ev);
+        break;
+    }
+    case RecordType::RawChunkRecord: {
+        uint64_t clientId;
+        if (length < sizeof(clientId))
+            return false;
+        memcpy(&clientId, payload, sizeof(clientId));
+        std::unique_ptr<ChunkDecoder> &decoder = m_decoders[clientId];
+        if (!decoder)
+            decoder.reset(new ChunkDecoder(m_strings, m_overflowStringId, m_limits));
+        if (!decoder->decode(payload + sizeof(clientId), length - sizeof(clientId), this))
+            fprintf(stderr, "Skipping malformed chunk from host %s\n", m_hostName.c_str());
+        break;
+    }
+    default:
+        // From a newer traced; skip it.
+        break;
+    }
+    return true;
+}
+
+void RelayedStream::writeEvent(const TraceEvent &event)
+{
+    TraceEvent ev = event;
+    ev.pid += m_pidBase;
+    ev.tid += m_pidBase;
+    ev.timestamp += m_clockOffset;
+    m_processes.insert(ev.pid);
+    ++m_events;
+    m_next->writeEvent(ev);
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACERELAY_H
+#define CTRACERELAY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "CTraceDecoder.h"
+#include "CTraceEvent.h"
+#include "CTraceRecords.h"
+
+class TraceStringTable;
+
+// Relaying traces between hosts. A forwarding traced (-X) records in the
+// binary format (see CTraceRecords.h), decoded or raw, and streams it over
+// TCP to an aggregating traced (-A), which merges the streams from all of its
+// hosts (and its own clients) into one trace.
+//
+// Each stream starts with a HostRecord naming the forwarder's host. Every so
+// often, the aggregator writes a ClockProbe back the other way: its own
+// CLOCK_MONOTONIC time. The forwarder answers each with a ClockSyncRecord in
+// the stream, adding its own time, which tells the aggregator how far apart
+// their clocks are, give or take half the round trip.
+struct ClockProbe
+{
+    uint64_t time;
+};
+
+// The aggregator's end of one forwarded stream. Its events are passed on
+// with their timestamps moved onto our clock, and their pids and tids moved
+// into a range of their own for the host (see pidBase()), so that processes
+// on different hosts don't collide.
+class RelayedStream : public TraceEventSink
+{
+public:
+    RelayedStream(TraceStringTable &strings, uint32_t overflowStringId, const StringLimits &limits,
+                  TraceEventSink *next);
+
+    // Takes data as it arrives, and passes on the events in it, once we know
+    // the host's clock offset. now is our time. Returns false if the stream
+    // is malformed.
+    bool receive(const char *data, size_t length, uint64_t now);
+
+    // Each host's pids (and tids) have this added to them. The aggregator's
+    // own clients are host 0.
+    static const uint64_t PidsPerHost = 10000000;
+
+    // Empty until the stream's HostRecord has arrived.
+    const std::string &hostName() const { return m_hostName; }
+    uint64_t pidBase() const { return m_pidBase; }
+
+    // Whether we know the clock offset yet, and if so, what to add to the
+    // host's times to get ours, and the round trip time of the probe it's
+    // from (so how far out it might be, twice over).
+    bool synced() const { return m_synced; }
+    int64_t clockOffset() const { return m_clockOffset; }
+    uint64_t roundTrip() const { return m_roundTrip; }
+
+    // The host's processes seen so far, as we've renumbered them.
+    const std::set<uint64_t> &processes() const { return m_processes; }
+
+    uint64_t events() const { return m_events; }
+
+    // Remaps and passes on an event decoded from a raw chunk.
+    void writeEvent(const TraceEvent &event) override;
+
+private:
+    bool readRecord(RecordType type, const char *payload, size_t length, uint64_t now);
+    void addClockSample(const ClockSyncRecord &r, uint64_t now);
+    void findClockSamples(uint64_t now);
+
+    TraceStringTable &m_strings;
+    uint32_t m_overflowStringId;
+    StringLimits m_limits;
+    TraceEventSink *m_next;
+
+    // Received, but not yet read; m_buffer is only compacted now and then.
+    std::string m_buffer;
+    size_t m_readOffset;
+    bool m_headerRead;
+
+    std::string m_hostName;
+    uint64_t m_pidBase;
+
+    // The stream's string IDs, mapped to ours, and for a raw stream, a
+    // decoder for each of the host's clients.
+    std::vector<uint32_t> m_stringIds;
+    std::unordered_map<uint64_t, std::unique_ptr<ChunkDecoder>> m_decoders;
+
+    // The latest clock samples; the offset is from the one with the
+    // shortest round trip, as that's the one that can be the least out.
+    struct ClockSample
+    {
+        uint64_t probeTime;
+        uint64_t roundTrip;
+        int64_t offset;
+    };
+    std::deque<ClockSample> m_clockSamples;
+    bool m_synced;
+    int64_t m_clockOffset;
+    uint64_t m_roundTrip;
+
+    std::set<uint64_t> m_processes;
+    uint64_t m_events;
+
+    // Hosts are numbered by name, so one that reconnects gets the same pids.
+    static std::map<std::string, uint64_t> s_hostNumbers;
+};
+
+#endif // CTRACERELAY_H
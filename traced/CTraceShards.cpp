@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "CTraceShards.h"
+#include "CTraceFilter.h"
+
+ShardedTraceOutput::ShardedTraceOutput(const std::string &path, int processesPerShard,
+                                       const TraceFileOptions &fileOptions,
+                                       TraceCompressor::Format compression, size_t maxQueuedBytes,
+                                       const TraceStringTable &strings, const std::string &formatName,
+                                       const OutputFactory &createOutput)
+    : TraceOutput(nullptr, strings)
+    , m_path(path)
+    , m_processesPerShard(processesPerShard)
+    , m_fileOptions(fileOptions)
+    , m_compression(compression)
+    , m_maxQueuedBytes(maxQueuedBytes)
+    , m_formatName(formatName)
+    , m_createOutput(createOutput)
+    , m_converting(false)
+    , m_openShard(nullptr)
+    , m_lastPid(UINT64_MAX)
+    , m_lastShard(nullptr)
+{
+}
+
+ShardedTraceOutput::~ShardedTraceOutput()
+{
+    for (Shard *shard : m_shards) {
+        delete shard->output;
+        delete shard->writer;
+        delete shard;
+    }
+}
+
+void ShardedTraceOutput::writeHeader()
+{
+    // Each shard writes its own, when it's opened.
+    writeManifest();
+}
+
+void ShardedTraceOutput::writeEvent(const TraceEvent &event)
+{
+    Shard *shard = event.pid == m_lastPid ? m_lastShard : shardFor(event.pid);
+    m_lastPid = event.pid;
+    m_lastShard = shard;
+    if (!shard->output)
+        return; // finished, and its process is gone; this is a straggler
+    shard->output->writeEvent(event);
+    shard->events++;
+}
+
+void ShardedTraceOutput::writeFooter()
+{
+    for (Shard *shard : m_shards)
+        finishShard(shard);
+    writeManifest();
+}
+
+void ShardedTraceOutput::flush()
+{
+    for (Shard *shard : m_shards) {
+        if (shard->output)
+            shard->output->flush();
+    }
+}
+
+void ShardedTraceOutput::finishProcess(uint64_t pid)
+{
+    auto it = m_processShards.find(pid);
+    if (it == m_processShards.end())
+        return;
+    Shard *shard = it->second;
+    shard->liveProcesses--;
+
+    // Its pid may be reused, by a process that belongs somewhere else.
+    m_processShards.erase(it);
+    if (pid == m_lastPid)
+        m_lastPid = UINT64_MAX;
+
+    if (shard->liveProcesses == 0 && shard != m_openShard) {
+        finishShard(shard);
+        writeManifest();
+    }
+}
+
+uint64_t ShardedTraceOutput::droppedBytes() const
+{
+    uint64_t dropped = 0;
+    for (const Shard *shard : m_shards)
+        dropped += shard->writer ? shard->writer->droppedBytes() : shard->droppedBytes;
+    return dropped;
+}
+
+size_t ShardedTraceOutput::queuedBytes() const
+{
+    size_t queued = 0;
+    for (const Shard *shard : m_shards) {
+        if (shard->writer)
+            queued = std::max(queued, shard->writer->queuedBytes());
+    }
+    return queued;
+}
+
+ShardedTraceOutput::Shard *ShardedTraceOutput::shardFor(uint64_t pid)
+{
+    auto it = m_processShards.find(pid);
+    if (it != m_processShards.end())
+        return it->second;
+
+    if (!m_openShard) {
+        Shard *shard = new Shard();
+        shard->index = m_shards.size() + 1;
+
+        size_t base = m_path.rfind('/');
+        base = base == std::string::npos ? 0 : base + 1;
+        size_t ext = m_path.find('.', base);
+        if (ext == std::string::npos)
+            ext = m_path.size();
+        char seq[32];
+        snprintf(seq, sizeof(seq), ".shard%04d", shard->index);
+        shard->path = m_path.substr(0, ext) + seq + m_path.substr(ext);
+
+        // If it can't be opened, its events are dropped, as any others that
+        // can't be written are.
+        shard->writer = new TraceWriter(shard->path, m_fileOptions, m_compression, m_maxQueuedBytes);
+        if (!shard->writer->isOpen())
+            fprintf(stderr, "Can't open trace shard %s: %s\n", shard->path.c_str(), strerror(errno));
+        shard->output = m_createOutput(shard->writer);
+        shard->output->writeHeader();
+        shard->liveProcesses = 0;
+        shard->events = 0;
+        shard->droppedBytes = 0;
+        m_shards.push_back(shard);
+        m_openShard = shard;
+    }
+
+    Shard *shard = m_openShard;
+    shard->pids.push_back(pid);
+    shard->processNames.push_back(m_converting ? std::string() : EventFilter::processName(pid));
+    shard->liveProcesses++;
+    m_processShards[pid] = shard;
+    if (shard->pids.size() >= (size_t)m_processesPerShard)
+        m_openShard = nullptr;
+    writeManifest();
+    return shard;
+}
+
+void ShardedTraceOutput::finishShard(Shard *shard)
+{
+    if (!shard->output)
+        return;
+    shard->output->writeFooter();
+    shard->output->flush();
+    delete shard->output;
+    shard->output = nullptr;
+    shard->droppedBytes = shard->writer->droppedBytes();
+    delete shard->writer;
+    shard->writer = nullptr;
+    if (m_lastShard == shard)
+        m_lastPid = UINT64_MAX;
+}
+
+static std::string baseName(const std::string &path)
+{
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+void ShardedTraceOutput::writeManifest()
+{
+    size_t base = m_path.rfind('/');
+    base = base == std::string::npos ? 0 : base + 1;
+    size_t ext = m_path.find('.', base);
+    std::string path = m_path.substr(0, ext) + ".manifest";
+    std::string temporary = path + ".tmp";
+
+    FILE *f = fopen(temporary.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "Can't write manifest %s: %s\n", temporary.c_str(), strerror(errno));
+        return;
+    }
+
+    fprintf(f, "traced-manifest 1\n");
+    fprintf(f, "format %s\n", m_formatName.c_str());
+    if (!m_converting) {
+        // Timestamps are CLOCK_MONOTONIC; this turns them into wall clock
+        // time, for lining traces up with others from elsewhere.
+        struct timespec mono, real;
+        clock_gettime(CLOCK_MONOTONIC, &mono);
+        clock_gettime(CLOCK_REALTIME, &real);
+        int64_t realtimeOffset = (int64_t(real.tv_sec) - mono.tv_sec) * 1000000 + (real.tv_nsec - mono.tv_nsec) / 1000;
+        fprintf(f, "realtime-offset %" PRId64 "\n", realtimeOffset);
+    }
+    for (const Shard *shard : m_shards) {
+        // All of one traced's shards share its clock, so their offsets are
+        // 0; they're there for merging manifests from several hosts.
+        fprintf(f, "shard %s offset 0 events %" PRIu64 " %s", baseName(shard->path).c_str(),
+                shard->events, shard->output ? "open" : "finished");
+        for (size_t i = 0; i < shard->pids.size(); ++i) {
+            std::string name = shard->processNames[i];
+            std::replace(name.begin(), name.end(), ' ', '_');
+            fprintf(f, " %" PRIu64 ":%s", shard->pids[i], name.c_str());
+        }
+        fprintf(f, "\n");
+    }
+
+    if (fclose(f) != 0 || rename(temporary.c_str(), path.c_str()) != 0)
+        fprintf(stderr, "Can't write manifest %s: %s\n", path.c_str(), strerror(errno));
+}
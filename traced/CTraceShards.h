@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACESHARDS_H
+#define CTRACESHARDS_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "CTraceOutput.h"
+
+// Splits the trace into shards, each holding the events of a few processes
+// (-H), so that each shard is written (and compressed) by a writer thread of
+// its own, and one service's trace can be handed over without the rest.
+//
+// Processes are assigned to shards in the order they're first seen, n to a
+// shard. Each shard is a complete trace in whatever format was asked for,
+// named after the output file: trace.json becomes trace.shard0001.json and so
+// on. A shard is finished as soon as all of its processes have gone away
+// (see finishProcess()), or otherwise, when recording stops.
+//
+// Alongside them, a manifest (trace.manifest) lists the shards, which
+// processes each holds, and the offset to add to its timestamps to put them
+// on a common clock (see tools/tracemerge). It's rewritten as shards are
+// added and finished, so it's usable even if traced doesn't exit cleanly.
+class ShardedTraceOutput : public TraceOutput
+{
+public:
+    typedef std::function<TraceOutput*(TraceWriter*)> OutputFactory;
+
+    ShardedTraceOutput(const std::string &path, int processesPerShard, const TraceFileOptions &fileOptions,
+                       TraceCompressor::Format compression, size_t maxQueuedBytes,
+                       const TraceStringTable &strings, const std::string &formatName,
+                       const OutputFactory &createOutput);
+    ~ShardedTraceOutput();
+
+    void writeHeader() override;
+    void writeEvent(const TraceEvent &event) override;
+    void writeFooter() override;
+    void flush() override;
+
+    // The process has gone away, and none of its events are still to come,
+    // so once all of its shard's processes have, that shard can be finished.
+    void finishProcess(uint64_t pid);
+
+    // The trace is being converted (-i), so it may be from another host, or
+    // another boot: leave what we'd look up here, processes' names and the
+    // wall clock time, out of the manifest.
+    void setConverting(bool converting) { m_converting = converting; }
+
+    uint64_t droppedBytes() const;
+
+    // How far behind the furthest-behind shard's writer is.
+    size_t queuedBytes() const;
+
+private:
+    struct Shard
+    {
+        int index;
+        std::string path;
+        TraceWriter *writer;
+        TraceOutput *output; // nullptr once finished
+        std::vector<uint64_t> pids;
+        std::vector<std::string> processNames;
+        int liveProcesses;
+        uint64_t events;
+        uint64_t droppedBytes;
+    };
+
+    Shard *shardFor(uint64_t pid);
+    void finishShard(Shard *shard);
+    void writeManifest();
+
+    std::string m_path;
+    int m_processesPerShard;
+    TraceFileOptions m_fileOptions;
+    TraceCompressor::Format m_compression;
+    size_t m_maxQueuedBytes;
+    std::string m_formatName;
+    OutputFactory m_createOutput;
+    bool m_converting;
+
+    std::vector<Shard*> m_shards;
+    std::unordered_map<uint64_t, Shard*> m_processShards;
+    Shard *m_openShard; // the one new processes go to
+
+    // Events come in runs from the same process.
+    uint64_t m_lastPid;
+    Shard *m_lastShard;
+};
+
+#endif // CTRACESHARDS_H
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include "CTraceShedding.h"
+
+// How long the lag must stay low for before each step down, in microseconds.
+static const uint64_t RecoveryInterval = 5 * 1000000;
+
+LoadShedder::LoadShedder(uint64_t threshold)
+    : m_threshold(threshold)
+    , m_level(DegradeLevel::Full)
+    , m_calmSince(0)
+{
+}
+
+bool LoadShedder::update(uint64_t lag, uint64_t now)
+{
+    DegradeLevel wanted = DegradeLevel::Full;
+    if (lag >= m_threshold * 16)
+        wanted = DegradeLevel::Stopped;
+    else if (lag >= m_threshold * 4)
+        wanted = DegradeLevel::PriorityOnly;
+    else if (lag >= m_threshold)
+        wanted = DegradeLevel::Sampled;
+
+    if (wanted > m_level) {
+        m_level = wanted;
+        m_calmSince = 0;
+        return true;
+    }
+
+    if (lag >= m_threshold / 2 || m_level == DegradeLevel::Full) {
+        m_calmSince = 0;
+        return false;
+    }
+
+    if (m_calmSince == 0) {
+        m_calmSince = now;
+        return false;
+    }
+    if (now - m_calmSince < RecoveryInterval)
+        return false;
+
+    m_level = (DegradeLevel)((uint16_t)m_level - 1);
+    m_calmSince = now;
+    return true;
+}
+
+const char *LoadShedder::levelName(DegradeLevel level)
+{
+    switch (level) {
+    case DegradeLevel::Full:
+        return "full";
+    case DegradeLevel::Sampled:
+        return "sampled";
+    case DegradeLevel::PriorityOnly:
+        return "priority only";
+    case DegradeLevel::Stopped:
+        return "stopped";
+    }
+    return "unknown";
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACESHEDDING_H
+#define CTRACESHEDDING_H
+
+#include <stdint.h>
+
+#include "CTraceMessages.h"
+
+// Decides how much clients should cut back their tracing (see DegradeLevel),
+// from how far behind traced is with decoding their chunks (--shed).
+//
+// The level goes up as soon as the lag passes threshold, 4 * threshold or
+// 16 * threshold, so that clients back off before their chunks pile up in
+// /dev/shm. It only comes down a step at a time, once the lag has stayed
+// under half the threshold for a while, so that it doesn't flap.
+class LoadShedder
+{
+public:
+    // threshold is in microseconds.
+    explicit LoadShedder(uint64_t threshold);
+
+    // Called once a second, with the worst lag (in microseconds) over that
+    // second, and the time. Returns whether the level changed.
+    bool update(uint64_t lag, uint64_t now);
+
+    DegradeLevel level() const { return m_level; }
+
+    static const char *levelName(DegradeLevel level);
+
+private:
+    uint64_t m_threshold;
+    DegradeLevel m_level;
+
+    // When the lag went under half the threshold, or 0 if it isn't.
+    uint64_t m_calmSince;
+};
+
+#endif // CTRACESHEDDING_H
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stddef.h>
+
+#include "CTraceSlices.h"
+
+// Past this depth, Begins and Ends are passed on as they are.
+const size_t MaxPendingSlicesPerThread = 256;
+
+SliceMerger::SliceMerger(TraceEventSink *next)
+    : m_next(next)
+{
+}
+
+void SliceMerger::writeEvent(const TraceEvent &event)
+{
+    switch (event.type) {
+    case MessageType::BeginMessage: {
+        std::vector<Pending> &stack = m_threads[ThreadKey(event.pid, event.tid)];
+        bool written = stack.size() >= MaxPendingSlicesPerThread;
+        if (written)
+            m_next->writeEvent(event);
+        stack.push_back(Pending { event, written });
+        return;
+    }
+    case MessageType::EndMessage: {
+        auto it = m_threads.find(ThreadKey(event.pid, event.tid));
+        if (it == m_threads.end() || it->second.empty())
+            break; // its Begin was written (or lost) before we saw it
+
+        Pending pending = it->second.back();
+        it->second.pop_back();
+        if (pending.written || event.timestamp < pending.begin.timestamp) {
+            if (!pending.written)
+                m_next->writeEvent(pending.begin);
+            break;
+        }
+
+        TraceEvent complete = pending.begin;
+        complete.type = MessageType::DurationMessage;
+        complete.duration = event.timestamp - pending.begin.timestamp;
+        m_next->writeEvent(complete);
+        return;
+    }
+    default:
+        break;
+    }
+
+    m_next->writeEvent(event);
+}
+
+void SliceMerger::flushProcess(uint64_t pid)
+{
+    auto it = m_threads.lower_bound(ThreadKey(pid, 0));
+    while (it != m_threads.end() && it->first.first == pid) {
+        for (const Pending &pending : it->second) {
+            if (!pending.written)
+                m_next->writeEvent(pending.begin);
+        }
+        it = m_threads.erase(it);
+    }
+}
+
+void SliceMerger::flush()
+{
+    for (const auto &thread : m_threads) {
+        for (const Pending &pending : thread.second) {
+            if (!pending.written)
+                m_next->writeEvent(pending.begin);
+        }
+    }
+    m_threads.clear();
+}
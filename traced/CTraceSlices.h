@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACESLICES_H
+#define CTRACESLICES_H
+
+#include <stdint.h>
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "CTraceEvent.h"
+
+// Turns each Begin/End pair into a single complete (Duration) event, which
+// is about half the size in JSON, and saves the viewer matching them up
+// again. (Perfetto has no complete events, so there it makes no difference.)
+//
+// Begins are held per thread until their End arrives (in whichever chunk),
+// and the complete event is written then, with the Begin's timestamp. So
+// nested slices are written innermost first. Any that never end are written
+// as plain Begins by flush().
+class SliceMerger : public TraceEventSink
+{
+public:
+    explicit SliceMerger(TraceEventSink *next);
+
+    void writeEvent(const TraceEvent &event) override;
+
+    // Write out the Begins still waiting for an End, from one process (when
+    // it goes away), or from all of them.
+    void flushProcess(uint64_t pid);
+    void flush();
+
+private:
+    struct Pending
+    {
+        TraceEvent begin;
+        bool written; // too deep to hold on to, so already passed on
+    };
+
+    typedef std::pair<uint64_t, uint64_t> ThreadKey; // pid, tid
+
+    TraceEventSink *m_next;
+    std::map<ThreadKey, std::vector<Pending>> m_threads;
+};
+
+#endif // CTRACESLICES_H
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <time.h>
+
+#include <algorithm>
+
+#include "CTraceSorter.h"
+
+TraceEventSorter::TraceEventSorter(TraceEventSink *next, uint64_t window, size_t maxEventsPerThread)
+    : m_next(next)
+    , m_window(window)
+    , m_maxEventsPerThread(maxEventsPerThread)
+    , m_sequence(0)
+    , m_lastWritten(0)
+    , m_lateEvents(0)
+{
+}
+
+void TraceEventSorter::writeEvent(const TraceEvent &event)
+{
+    uint64_t time = sortTime(event);
+    if (time < m_lastWritten) {
+        // Too late to put it in the right place.
+        m_lateEvents++;
+        m_next->writeEvent(event);
+        return;
+    }
+
+    Stream &stream = m_streams[StreamKey(event.pid, event.tid)];
+    stream.push(Entry { event, time, m_sequence++ });
+
+    // Keep per-thread memory bounded. Moving the watermark up through this
+    // thread's oldest events keeps the output in order, at the cost of making
+    // anything older that shows up later on late.
+    if (stream.size() > m_maxEventsPerThread)
+        drainOverflow(stream);
+}
+
+void TraceEventSorter::drainOverflow(const Stream &stream)
+{
+    // Every drain looks at every stream, so write out the older half of this
+    // one in one go, rather than one event each time another comes in.
+    std::vector<uint64_t> times;
+    times.reserve(stream.size());
+    for (const Entry &entry : stream.entries())
+        times.push_back(entry.time);
+    size_t keep = m_maxEventsPerThread / 2;
+    auto nth = times.begin() + (times.size() - keep - 1);
+    std::nth_element(times.begin(), nth, times.end());
+    drainUpTo(*nth);
+}
+
+void TraceEventSorter::drain()
+{
+    // Client timestamps are CLOCK_MONOTONIC, so we can use our own clock to
+    // tell how long events have been waiting: anything older than the window
+    // is written, even if nothing newer has come in since.
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    uint64_t now = uint64_t(tp.tv_sec) * 1000000 + tp.tv_nsec / 1000;
+
+    if (now > m_window)
+        drainUpTo(now - m_window);
+}
+
+void TraceEventSorter::drainAll()
+{
+    drainUpTo(UINT64_MAX);
+}
+
+void TraceEventSorter::drainUpTo(uint64_t watermark)
+{
+    // Each stream's oldest event, so the heap orders streams the same way
+    // that each stream orders its events.
+    struct HeapEntry
+    {
+        Entry head;
+        std::map<StreamKey, Stream>::iterator stream;
+
+        bool operator>(const HeapEntry &other) const { return head > other.head; }
+    };
+    std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>> heap;
+
+    auto it = m_streams.begin();
+    while (it != m_streams.end()) {
+        if (it->second.empty()) {
+            it = m_streams.erase(it);
+            continue;
+        }
+        if (it->second.top().time <= watermark)
+            heap.push(HeapEntry { it->second.top(), it });
+        ++it;
+    }
+
+    while (!heap.empty()) {
+        auto sit = heap.top().stream;
+        heap.pop();
+
+        Stream &stream = sit->second;
+        m_lastWritten = stream.top().time;
+        m_next->writeEvent(stream.top().event);
+        stream.pop();
+
+        if (!stream.empty() && stream.top().time <= watermark)
+            heap.push(HeapEntry { stream.top(), sit });
+    }
+}
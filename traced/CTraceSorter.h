@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACESORTER_H
+#define CTRACESORTER_H
+
+#include <stdint.h>
+
+#include <map>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "CTraceEvent.h"
+
+// Puts events back into timestamp order before passing them on.
+//
+// Each thread's events arrive in order of submission, a chunk at a time, and
+// chunks from different threads arrive whenever they fill up. So we hold on
+// to events in a buffer per thread, and write them out with a k-way merge
+// once they are older than the reorder window.
+//
+// Anything that arrives after we've already written newer events is "late":
+// it is still written, but out of order, and counted.
+//
+// Complete events are ordered by their end, not their start: that's when
+// they are known (the SliceMerger writes them when the End arrives), so
+// slices longer than the window aren't late. Viewers don't mind what order
+// complete events come in.
+class TraceEventSorter : public TraceEventSink
+{
+public:
+    // window is in microseconds. No thread may buffer more than
+    // maxEventsPerThread; beyond that, we write out early, down to half that.
+    TraceEventSorter(TraceEventSink *next, uint64_t window, size_t maxEventsPerThread);
+
+    void writeEvent(const TraceEvent &event) override;
+
+    // Write out everything that has left the reorder window.
+    void drain();
+
+    // Write out everything.
+    void drainAll();
+
+    uint64_t lateEvents() const { return m_lateEvents; }
+
+private:
+    static uint64_t sortTime(const TraceEvent &event)
+    {
+        if (event.type == MessageType::DurationMessage)
+            return event.timestamp + event.duration;
+        return event.timestamp;
+    }
+
+    struct Entry
+    {
+        TraceEvent event;
+        uint64_t time; // sortTime(event)
+        uint64_t sequence; // keeps events with the same time in order
+
+        bool operator>(const Entry &other) const
+        {
+            if (time != other.time)
+                return time > other.time;
+            return sequence > other.sequence;
+        }
+    };
+
+    struct Stream : std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>>
+    {
+        // In heap order.
+        const std::vector<Entry> &entries() const { return c; }
+    };
+    typedef std::pair<uint64_t, uint64_t> StreamKey; // pid, tid
+
+    void drainUpTo(uint64_t watermark);
+    void drainOverflow(const Stream &stream);
+
+    TraceEventSink *m_next;
+    uint64_t m_window;
+    size_t m_maxEventsPerThread;
+
+    std::map<StreamKey, Stream> m_streams;
+    uint64_t m_sequence;
+    uint64_t m_lastWritten;
+    uint64_t m_lateEvents;
+};
+
+#endif // CTRACESORTER_H
@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <functional>
+
+#include "CTraceStatistics.h"
+#include "CTraceStrings.h"
+
+// Bounds on what we keep while matching slices up, against clients that
+// never end what they begin.
+const size_t MaxOpenSlicesPerThread = 1024;
+const size_t MaxFinishedSlicesPerThread = 4096;
+const size_t MaxOpenAsyncSlices = 1024 * 1024;
+
+// Values below 2^SubBucketBits get a bucket each; each power of two above
+// that is split into 2^(SubBucketBits - 1) buckets.
+const int SubBucketBits = 7;
+const uint64_t SubBucketCount = 1 << SubBucketBits;
+const uint64_t SubBucketHalf = SubBucketCount / 2;
+
+static size_t bucketIndex(uint64_t value)
+{
+    if (value < SubBucketCount)
+        return value;
+    int shift = (63 - __builtin_clzll(value)) - (SubBucketBits - 1);
+    return SubBucketCount + (shift - 1) * SubBucketHalf + ((value >> shift) - SubBucketHalf);
+}
+
+// The largest value that lands in bucket index.
+static uint64_t bucketValue(size_t index)
+{
+    if (index < SubBucketCount)
+        return index;
+    int shift = (index - SubBucketCount) / SubBucketHalf + 1;
+    uint64_t top = (index - SubBucketCount) % SubBucketHalf + SubBucketHalf;
+    return ((top + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    size_t index = bucketIndex(value);
+    if (index >= m_counts.size())
+        m_counts.resize(index + 1, 0);
+    m_counts[index]++;
+    m_total++;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    if (other.m_counts.size() > m_counts.size())
+        m_counts.resize(other.m_counts.size(), 0);
+    for (size_t i = 0; i < other.m_counts.size(); ++i)
+        m_counts[i] += other.m_counts[i];
+    m_total += other.m_total;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const
+{
+    uint64_t wanted = std::max<uint64_t>(1, uint64_t(fraction * m_total + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < m_counts.size(); ++i) {
+        seen += m_counts[i];
+        if (seen >= wanted)
+            return bucketValue(i);
+    }
+    return 0;
+}
+
+uint64_t LatencyHistogram::countAbove(uint64_t value) const
+{
+    uint64_t count = 0;
+    for (size_t i = bucketIndex(value) + 1; i < m_counts.size(); ++i)
+        count += m_counts[i];
+    return count;
+}
+
+TracepointStatistics::TracepointStatistics(TraceEventSink *next, const TraceStringTable &strings, size_t slowest)
+    : m_next(next)
+    , m_strings(strings)
+    , m_slowest(slowest)
+{
+}
+
+void TracepointStatistics::writeEvent(const TraceEvent &e)
+{
+    switch (e.type) {
+    case MessageType::BeginMessage: {
+        ThreadState &thread = m_threads[ThreadKey(e.pid, e.tid)];
+        if (thread.open.size() < MaxOpenSlicesPerThread)
+            thread.open.push_back(OpenSlice { e.categoryId, e.tracepointId, e.timestamp });
+        break;
+    }
+    case MessageType::EndMessage: {
+        // Ends match the innermost open Begin, whatever they're called.
+        ThreadState &thread = m_threads[ThreadKey(e.pid, e.tid)];
+        if (thread.open.empty())
+            break;
+        OpenSlice begin = thread.open.back();
+        thread.open.pop_back();
+        if (e.timestamp >= begin.timestamp)
+            sliceEnded(Key(e.pid, begin.categoryId, begin.tracepointId), e.tid, begin.timestamp, e.timestamp, &thread);
+        break;
+    }
+    case MessageType::DurationMessage: {
+        ThreadState &thread = m_threads[ThreadKey(e.pid, e.tid)];
+        sliceEnded(Key(e.pid, e.categoryId, e.tracepointId), e.tid, e.timestamp, e.timestamp + e.duration, &thread);
+        break;
+    }
+    case MessageType::AsyncBeginMessage:
+        if (m_openAsync.size() < MaxOpenAsyncSlices)
+            m_openAsync[AsyncKey(e.pid, e.tracepointId, e.id)] = e.timestamp;
+        break;
+    case MessageType::AsyncEndMessage: {
+        auto it = m_openAsync.find(AsyncKey(e.pid, e.tracepointId, e.id));
+        if (it == m_openAsync.end())
+            break;
+        if (e.timestamp >= it->second)
+            sliceEnded(Key(e.pid, e.categoryId, e.tracepointId), e.tid, it->second, e.timestamp, nullptr);
+        m_openAsync.erase(it);
+        break;
+    }
+    default:
+        break;
+    }
+
+    m_next->writeEvent(e);
+}
+
+// Async slices (without a thread) aren't nested, so their self time is all
+// of it.
+void TracepointStatistics::sliceEnded(const Key &key, uint64_t tid, uint64_t start, uint64_t end, ThreadState *thread)
+{
+    uint64_t duration = end - start;
+    uint64_t children = 0;
+    if (thread) {
+        std::vector<Interval> &finished = thread->finished;
+        while (!finished.empty() && finished.back().start >= start && finished.back().end <= end) {
+            children += finished.back().end - finished.back().start;
+            finished.pop_back();
+        }
+        if (finished.size() >= MaxFinishedSlicesPerThread)
+            finished.erase(finished.begin(), finished.begin() + finished.size() / 2);
+        finished.push_back(Interval { start, end });
+    }
+
+    Stats &s = m_stats[key];
+    s.count++;
+    s.total += duration;
+    s.self += duration - std::min(children, duration);
+    s.max = std::max(s.max, duration);
+    s.histogram.record(duration);
+
+    if (m_slowest) {
+        Instance instance { duration, start, tid };
+        if (s.slowest.size() < m_slowest) {
+            s.slowest.push_back(instance);
+            std::push_heap(s.slowest.begin(), s.slowest.end(), std::greater<Instance>());
+        } else if (duration > s.slowest.front().duration) {
+            std::pop_heap(s.slowest.begin(), s.slowest.end(), std::greater<Instance>());
+            s.slowest.back() = instance;
+            std::push_heap(s.slowest.begin(), s.slowest.end(), std::greater<Instance>());
+        }
+    }
+}
+
+void TracepointStatistics::forgetProcess(uint64_t pid)
+{
+    // Both are ordered by pid first.
+    m_threads.erase(m_threads.lower_bound(ThreadKey(pid, 0)),
+                    m_threads.lower_bound(ThreadKey(pid + 1, 0)));
+    m_openAsync.erase(m_openAsync.lower_bound(AsyncKey(pid, 0, 0)),
+                      m_openAsync.lower_bound(AsyncKey(pid + 1, 0, 0)));
+}
+
+std::string TracepointStatistics::report() const
+{
+    std::vector<std::pair<Key, const Stats*>> rows;
+    for (const auto &entry : m_stats)
+        rows.push_back(std::make_pair(entry.first, &entry.second));
+    std::sort(rows.begin(), rows.end(), [](const std::pair<Key, const Stats*> &a, const std::pair<Key, const Stats*> &b) {
+        return a.second->total > b.second->total;
+    });
+
+    std::string out;
+    char line[512];
+    snprintf(line, sizeof(line), "%-8s %-16s %-32s %10s %14s %14s %10s %10s %10s\n",
+             "pid", "category", "tracepoint", "count", "total us", "self us", "p50 us", "p99 us", "max us");
+    out += line;
+
+    for (const auto &row : rows) {
+        const Stats &s = *row.second;
+        snprintf(line, sizeof(line), "%-8" PRIu64 " %-16s %-32s %10" PRIu64 " %14" PRIu64 " %14" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                 std::get<0>(row.first), m_strings.string(std::get<1>(row.first)), m_strings.string(std::get<2>(row.first)),
+                 s.count, s.total, s.self, std::min(s.histogram.percentile(0.5), s.max),
+                 std::min(s.histogram.percentile(0.99), s.max), s.max);
+        out += line;
+
+        std::vector<Instance> slowest = s.slowest;
+        std::sort(slowest.begin(), slowest.end(), std::greater<Instance>());
+        for (const Instance &i : slowest) {
+            snprintf(line, sizeof(line), "    %" PRIu64 " us at %" PRIu64 " (tid %" PRIu64 ")\n",
+                     i.duration, i.timestamp, i.tid);
+            out += line;
+        }
+    }
+    return out;
+}
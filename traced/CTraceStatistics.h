@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACESTATISTICS_H
+#define CTRACESTATISTICS_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "CTraceEvent.h"
+
+class TraceStringTable;
+
+// Counts of durations in log-linear buckets, as in HdrHistogram: exact below
+// 128, and to within 1/64 (about 1.5%) above that, in a few KB.
+class LatencyHistogram
+{
+public:
+    void record(uint64_t value);
+
+    // Adds in other's values, as if they'd been recorded here.
+    void merge(const LatencyHistogram &other);
+
+    uint64_t count() const { return m_total; }
+
+    // The value that fraction (0 to 1) of the recorded values are at or
+    // below, to within the histogram's precision.
+    uint64_t percentile(double fraction) const;
+
+    // How many of the recorded values are in buckets above value's.
+    uint64_t countAbove(uint64_t value) const;
+
+private:
+    std::vector<uint64_t> m_counts; // grows to the largest bucket used
+    uint64_t m_total = 0;
+};
+
+// Per-tracepoint statistics, kept as events go by: for each process,
+// category and tracepoint, how many slices there were, their total and self
+// time (total less that of the slices nested in them), and their latency
+// distribution. Optionally, also the slowest few of each, with when they
+// happened.
+//
+// Begin/End pairs, complete (Duration) events and async begin/end pairs all
+// count as slices. Sync slices are matched per thread, so this needs each
+// thread's events in order (as they are, straight from the decoder).
+class TracepointStatistics : public TraceEventSink
+{
+public:
+    TracepointStatistics(TraceEventSink *next, const TraceStringTable &strings, size_t slowest);
+
+    void writeEvent(const TraceEvent &event) override;
+
+    // A table of everything so far, busiest first.
+    std::string report() const;
+
+    // A process exited: forget its threads' open slices and its async slices
+    // (which can't end now), but keep its statistics.
+    void forgetProcess(uint64_t pid);
+
+private:
+    struct Instance
+    {
+        uint64_t duration;
+        uint64_t timestamp;
+        uint64_t tid;
+
+        bool operator>(const Instance &other) const { return duration > other.duration; }
+    };
+
+    struct Stats
+    {
+        uint64_t count = 0;
+        uint64_t total = 0;
+        uint64_t self = 0;
+        uint64_t max = 0;
+        LatencyHistogram histogram;
+        std::vector<Instance> slowest; // a min-heap
+    };
+
+    struct OpenSlice
+    {
+        uint32_t categoryId;
+        uint32_t tracepointId;
+        uint64_t timestamp;
+    };
+
+    struct Interval
+    {
+        uint64_t start;
+        uint64_t end;
+    };
+
+    struct ThreadState
+    {
+        // Begins still waiting for their End.
+        std::vector<OpenSlice> open;
+
+        // Slices that have finished, but may yet turn out to be nested in one
+        // that hasn't (slices finish innermost first).
+        std::vector<Interval> finished;
+    };
+
+    typedef std::tuple<uint64_t, uint32_t, uint32_t> Key; // pid, category, tracepoint
+    typedef std::pair<uint64_t, uint64_t> ThreadKey; // pid, tid
+    typedef std::tuple<uint64_t, uint32_t, uint64_t> AsyncKey; // pid, tracepoint, cookie
+
+    void sliceEnded(const Key &key, uint64_t tid, uint64_t start, uint64_t end, ThreadState *thread);
+
+    TraceEventSink *m_next;
+    const TraceStringTable &m_strings;
+    size_t m_slowest;
+
+    std::map<Key, Stats> m_stats;
+    std::map<ThreadKey, ThreadState> m_threads;
+    std::map<AsyncKey, uint64_t> m_openAsync;
+};
+
+#endif // CTRACESTATISTICS_H
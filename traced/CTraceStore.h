@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACESTORE_H
+#define CTRACESTORE_H
+
+#include <stdint.h>
+
+#include "CTraceRecords.h"
+
+// traced's indexed store format (-f store), for answering questions about
+// part of a huge trace without reading all of it (see tools/tracequery).
+//
+// After a file header, events are written in blocks. Each block holds up to
+// StoreBlockEvents of one thread's events, as EventRecords sorted by
+// timestamp. Then come the strings, and an index with an entry for each
+// block: which thread it's for, the time range it covers, and roughly which
+// tracepoints are in it. A trailer at the very end says where to find those,
+// so a reader can go straight to the index, and only touch the blocks that
+// might have what it's looking for.
+//
+// The strings and index are only written when the store is finished (at
+// exit, or when a segment is rotated). If traced might not get to exit
+// cleanly, capture with -f binary, and build the store from that with -i.
+
+#define TRACED_STORE_MAGIC "TRACEDS1"
+
+const uint32_t StoreBlockEvents = 4096;
+
+struct StoreFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct __attribute__((packed)) StoreIndexEntry
+{
+    uint64_t offset; // of the block's first EventRecord, from the start of the file
+    uint32_t count;
+    uint64_t pid;
+    uint64_t tid;
+    uint64_t start; // earliest timestamp
+    uint64_t end; // latest timestamp + duration
+
+    // Bit (tracepointId % 256) is set for each tracepoint in the block.
+    uint64_t tracepoints[4];
+
+    void addTracepoint(uint32_t id) { tracepoints[(id / 64) % 4] |= 1ULL << (id % 64); }
+    bool mayHaveTracepoint(uint32_t id) const { return tracepoints[(id / 64) % 4] & (1ULL << (id % 64)); }
+};
+
+// Strings are written one after another, each as a uint32_t length and then
+// that many bytes, in order of ID (starting from 0).
+struct __attribute__((packed)) StoreTrailer
+{
+    uint64_t stringsOffset;
+    uint32_t stringCount;
+    uint64_t indexOffset;
+    uint32_t indexCount;
+    char magic[8];
+};
+
+#endif // CTRACESTORE_H
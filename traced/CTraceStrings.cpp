@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <string.h>
+
+#include "CTraceStrings.h"
+
+// Strings are allocated out of blocks of this size (or larger, for strings
+// that don't fit).
+static const size_t ArenaBlockSize = 64 * 1024;
+
+TraceStringTable::TraceStringTable()
+    : m_slots(1024, 0)
+    , m_blockUsed(0)
+    , m_blockSize(0)
+    , m_arenaBytes(0)
+{
+    intern("", 0);
+}
+
+// FNV-1a.
+uint32_t TraceStringTable::hash(const char *data, size_t length)
+{
+    uint32_t h = 2166136261U;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+// Returns the slot that holds this string, or the empty one where it would go.
+size_t TraceStringTable::slotFor(const char *data, size_t length, uint32_t h) const
+{
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        uint32_t slot = m_slots[i];
+        if (slot == 0)
+            return i;
+        const Entry &e = m_strings[slot - 1];
+        if (e.hash == h && e.length == length && memcmp(e.data, data, length) == 0)
+            return i;
+    }
+}
+
+uint32_t TraceStringTable::find(const char *data, size_t length) const
+{
+    uint32_t slot = m_slots[slotFor(data, length, hash(data, length))];
+    return slot ? slot - 1 : NotFound;
+}
+
+const char *TraceStringTable::store(const char *data, size_t length)
+{
+    if (m_blocks.empty() || m_blockUsed + length + 1 > m_blockSize) {
+        m_blockSize = length + 1 > ArenaBlockSize ? length + 1 : ArenaBlockSize;
+        m_blocks.emplace_back(new char[m_blockSize]);
+        m_blockUsed = 0;
+        m_arenaBytes += m_blockSize;
+    }
+
+    char *p = m_blocks.back().get() + m_blockUsed;
+    memcpy(p, data, length);
+    p[length] = 0;
+    m_blockUsed += length + 1;
+    return p;
+}
+
+void TraceStringTable::grow()
+{
+    std::vector<uint32_t> table(m_slots.size() * 2, 0);
+    size_t mask = table.size() - 1;
+    for (size_t id = 0; id < m_strings.size(); ++id) {
+        size_t i = m_strings[id].hash & mask;
+        while (table[i])
+            i = (i + 1) & mask;
+        table[i] = id + 1;
+    }
+    m_slots.swap(table);
+}
+
+uint32_t TraceStringTable::intern(const char *data, size_t length)
+{
+    uint32_t h = hash(data, length);
+    size_t i = slotFor(data, length, h);
+    if (m_slots[i])
+        return m_slots[i] - 1;
+
+    uint32_t id = m_strings.size();
+    Entry e = { store(data, length), uint32_t(length), h };
+    m_strings.push_back(e);
+    m_slots[i] = id + 1;
+
+    // Keep the load factor under 1/2.
+    if (m_strings.size() * 2 > m_slots.size())
+        grow();
+    return id;
+}
+
+size_t TraceStringTable::bytes() const
+{
+    return m_arenaBytes + m_strings.capacity() * sizeof(Entry) + m_slots.capacity() * sizeof(uint32_t);
+}
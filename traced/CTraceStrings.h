@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACESTRINGS_H
+#define CTRACESTRINGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+// All strings registered by all clients during a session.
+//
+// Clients each number their strings independently, so traced maps them into
+// this table as they are registered. An identical string registered by two
+// processes (or twice by the same process) ends up with a single ID, which is
+// what output formats with string interning want to see.
+//
+// ID 0 is always the empty string, and is used for IDs a client never
+// registered.
+//
+// String data lives in large arena blocks rather than one allocation per
+// string, and the lookup table only holds IDs, so memory use is close to the
+// total length of the strings (see bytes()).
+class TraceStringTable
+{
+public:
+    static const uint32_t NotFound = ~0U;
+
+    TraceStringTable();
+
+    uint32_t intern(const char *data, size_t length);
+
+    // The ID of the string, or NotFound if it hasn't been interned.
+    uint32_t find(const char *data, size_t length) const;
+
+    const char *string(uint32_t id) const
+    {
+        if (id >= m_strings.size())
+            return "";
+        return m_strings[id].data;
+    }
+
+    size_t size() const { return m_strings.size(); }
+
+    // Roughly how much memory the table is using.
+    size_t bytes() const;
+
+private:
+    struct Entry
+    {
+        const char *data; // nul-terminated, in one of m_blocks
+        uint32_t length;
+        uint32_t hash;
+    };
+
+    static uint32_t hash(const char *data, size_t length);
+    size_t slotFor(const char *data, size_t length, uint32_t h) const;
+    const char *store(const char *data, size_t length);
+    void grow();
+
+    std::vector<Entry> m_strings;
+
+    // Open addressing: each slot holds an ID + 1, or 0 if empty.
+    std::vector<uint32_t> m_slots;
+
+    std::vector<std::unique_ptr<char[]>> m_blocks;
+    size_t m_blockUsed;
+    size_t m_blockSize;
+    size_t m_arenaBytes;
+};
+
+#endif // CTRACESTRINGS_H
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include "CTraceSubscriber.h"
+#include "CTraceOutput.h"
+#include "CTraceWriter.h"
+
+// How much may wait to be sent to a subscriber before we give up on it.
+const size_t MaxQueuedSubscriberOutput = 4 * 1024 * 1024;
+
+static std::vector<std::string> split(const std::string &s, char separator)
+{
+    std::vector<std::string> parts;
+    size_t pos = 0;
+    while (pos <= s.size()) {
+        size_t end = std::min(s.find(separator, pos), s.size());
+        if (end > pos)
+            parts.push_back(s.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return parts;
+}
+
+TraceSubscriber::TraceSubscriber(int fd, const TraceStringTable &strings)
+    : m_fd(fd)
+    , m_filter(strings)
+    , m_writer(nullptr)
+    , m_output(nullptr)
+{
+}
+
+TraceSubscriber *TraceSubscriber::create(int fd, const std::string &request,
+                                         const TraceStringTable &strings, std::string &error)
+{
+    std::vector<std::string> words = split(request, ' ');
+    if (words.empty() || (words[0] != "json" && words[0] != "binary")) {
+        error = "request must start with json or binary";
+        return nullptr;
+    }
+
+    TraceSubscriber *s = new TraceSubscriber(fd, strings);
+    if (!s->m_filter.setExpression(std::vector<std::string>(words.begin() + 1, words.end()), error)) {
+        delete s;
+        return nullptr;
+    }
+
+    s->m_writer = new TraceWriter(fd, TraceCompressor::NoCompression, MaxQueuedSubscriberOutput);
+    if (words[0] == "json")
+        s->m_output = new JsonTraceOutput(s->m_writer, strings);
+    else
+        s->m_output = new BinaryTraceOutput(s->m_writer, strings);
+    s->m_filter.setNext(s->m_output);
+    s->m_output->writeHeader();
+    return s;
+}
+
+TraceSubscriber::~TraceSubscriber()
+{
+    if (m_writer) {
+        // Anything still queued fails straight away, rather than waiting for
+        // a subscriber that may never read it.
+        shutdown(m_fd, SHUT_RDWR);
+        delete m_output;
+        delete m_writer;
+    }
+}
+
+void TraceSubscriber::writeEvent(const TraceEvent &event)
+{
+    m_filter.writeEvent(event);
+}
+
+bool TraceSubscriber::flush()
+{
+    m_output->flush();
+    return m_writer->droppedBytes() == 0;
+}
+
+void TraceSubscribers::add(TraceSubscriber *subscriber)
+{
+    m_subscribers.push_back(subscriber);
+}
+
+void TraceSubscribers::remove(TraceSubscriber *subscriber)
+{
+    m_subscribers.erase(std::remove(m_subscribers.begin(), m_subscribers.end(), subscriber),
+                        m_subscribers.end());
+}
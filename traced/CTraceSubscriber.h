@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACESUBSCRIBER_H
+#define CTRACESUBSCRIBER_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "CTraceEvent.h"
+#include "CTraceFilter.h"
+
+class TraceStringTable;
+class TraceWriter;
+class TraceOutput;
+
+// A live stream of events to a local socket, for dashboards and the like
+// (see TRACED_SUBSCRIBE_SUFFIX).
+//
+// Each subscriber has its own writer, with a small queue. One that falls
+// behind isn't waited for: flush() says so, and it should be dropped.
+class TraceSubscriber : public TraceEventSink
+{
+public:
+    // Parses a request such as "json pid=123 cat=app,gfx type=counter": the
+    // format, then a filter expression (see EventFilter).
+    // Returns nullptr, and sets error, if it isn't valid.
+    static TraceSubscriber *create(int fd, const std::string &request,
+                                   const TraceStringTable &strings, std::string &error);
+
+    // Stops writing to fd at once, even if the subscriber is stuck. The
+    // caller still owns fd.
+    ~TraceSubscriber();
+
+    void writeEvent(const TraceEvent &event) override;
+    void forgetProcess(uint64_t pid) { m_filter.forgetProcess(pid); }
+
+    // Send what's been written. Returns false if the subscriber isn't
+    // keeping up.
+    bool flush();
+
+private:
+    TraceSubscriber(int fd, const TraceStringTable &strings);
+
+    int m_fd;
+    EventFilter m_filter;
+    TraceWriter *m_writer;
+    TraceOutput *m_output;
+};
+
+// Passes events on, and to each subscriber.
+class TraceSubscribers : public TraceEventSink
+{
+public:
+    explicit TraceSubscribers(TraceEventSink *next)
+        : m_next(next)
+    {
+    }
+
+    void add(TraceSubscriber *subscriber);
+    void remove(TraceSubscriber *subscriber);
+
+    // See EventFilter::forgetProcess().
+    void forgetProcess(uint64_t pid)
+    {
+        for (TraceSubscriber *s : m_subscribers)
+            s->forgetProcess(pid);
+    }
+
+    void writeEvent(const TraceEvent &event) override
+    {
+        m_next->writeEvent(event);
+        for (TraceSubscriber *s : m_subscribers)
+            s->writeEvent(event);
+    }
+
+private:
+    TraceEventSink *m_next;
+    std::vector<TraceSubscriber*> m_subscribers;
+};
+
+#endif // CTRACESUBSCRIBER_H
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <time.h>
+
+#include "CTraceWindow.h"
+
+// When over the memory limit, evict down to this much of it, so that we
+// aren't doing it again for every event.
+static const double EvictTo = 0.9;
+
+TraceWindow::TraceWindow(uint64_t window, size_t maxBytes)
+    : m_window(window)
+    , m_maxBytes(maxBytes)
+    , m_events(0)
+    , m_evictedEvents(0)
+    , m_writingTo(nullptr)
+{
+}
+
+void TraceWindow::writeEvent(const TraceEvent &event)
+{
+    // What's being written can't be evicted.
+    if (isWriting() && bytes() >= m_maxBytes) {
+        m_evictedEvents++;
+        return;
+    }
+
+    Event e;
+    e.timestamp = event.timestamp;
+    e.value = event.type == MessageType::DurationMessage ? event.duration : event.value;
+    e.id = event.id;
+    e.categoryId = event.categoryId;
+    e.tracepointId = event.tracepointId;
+    e.type = (uint8_t)event.type;
+    m_threads[ThreadKey(event.pid, event.tid)].push_back(e);
+    m_events++;
+
+    if (bytes() > m_maxBytes && !isWriting())
+        evictOldest();
+}
+
+void TraceWindow::trim()
+{
+    if (isWriting())
+        return;
+
+    // Client timestamps are CLOCK_MONOTONIC, as is our clock, so anything
+    // this far behind it has had its time, even from threads that have gone
+    // quiet since.
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    uint64_t now = uint64_t(tp.tv_sec) * 1000000 + tp.tv_nsec / 1000;
+    if (now <= m_window)
+        return;
+    uint64_t cutoff = now - m_window;
+
+    auto it = m_threads.begin();
+    while (it != m_threads.end()) {
+        std::deque<Event> &events = it->second;
+        while (!events.empty() && events.front().timestamp < cutoff) {
+            events.pop_front();
+            m_events--;
+        }
+        if (events.empty())
+            it = m_threads.erase(it);
+        else
+            ++it;
+    }
+}
+
+void TraceWindow::evictOldest()
+{
+    size_t target = size_t(m_maxBytes * EvictTo);
+    while (bytes() > target && !m_threads.empty()) {
+        // Take from the thread with the oldest events, until it's no longer
+        // the oldest.
+        Threads::iterator oldest = m_threads.end();
+        uint64_t next = UINT64_MAX;
+        for (auto it = m_threads.begin(); it != m_threads.end(); ++it) {
+            uint64_t front = it->second.front().timestamp;
+            if (oldest == m_threads.end() || front < oldest->second.front().timestamp) {
+                if (oldest != m_threads.end())
+                    next = oldest->second.front().timestamp;
+                oldest = it;
+            } else if (front < next) {
+                next = front;
+            }
+        }
+
+        std::deque<Event> &events = oldest->second;
+        do {
+            events.pop_front();
+            m_events--;
+            m_evictedEvents++;
+        } while (!events.empty() && events.front().timestamp <= next && bytes() > target);
+        if (events.empty())
+            m_threads.erase(oldest);
+    }
+}
+
+void TraceWindow::startWriting(TraceEventSink *next)
+{
+    // A k-way merge of the threads, as in TraceEventSorter. Events that come
+    // in from now on go after the end of each thread, and aren't written.
+    m_writingTo = next;
+    for (auto it = m_threads.begin(); it != m_threads.end(); ++it)
+        m_writeHeap.push(WritePosition { it->second.front().timestamp, it, 0, it->second.size() });
+    if (m_writeHeap.empty())
+        m_writingTo = nullptr;
+}
+
+bool TraceWindow::writeMore(size_t count)
+{
+    for (size_t i = 0; i < count && !m_writeHeap.empty(); ++i) {
+        WritePosition w = m_writeHeap.top();
+        m_writeHeap.pop();
+
+        const Event &e = w.thread->second[w.index];
+        TraceEvent event;
+        event.type = (MessageType)e.type;
+        event.pid = w.thread->first.first;
+        event.tid = w.thread->first.second;
+        event.timestamp = e.timestamp;
+        event.duration = event.type == MessageType::DurationMessage ? e.value : 0;
+        event.value = event.type == MessageType::DurationMessage ? 0 : e.value;
+        event.id = e.id;
+        event.categoryId = e.categoryId;
+        event.tracepointId = e.tracepointId;
+        m_writingTo->writeEvent(event);
+
+        if (++w.index < w.end) {
+            w.timestamp = w.thread->second[w.index].timestamp;
+            m_writeHeap.push(w);
+        }
+    }
+
+    if (!m_writeHeap.empty())
+        return true;
+    m_writingTo = nullptr;
+    return false;
+}
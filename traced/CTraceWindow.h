@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACEWINDOW_H
+#define CTRACEWINDOW_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "CTraceEvent.h"
+
+// Keeps the last so many seconds of events in memory (-W), so that traced
+// can run all the time, and only write a trace when something interesting
+// happens (on SIGUSR1, or tracectl trigger).
+//
+// Events are kept per thread, in the order they arrive (which for any one
+// thread is time order), without their pid and tid. Anything older than the
+// window is dropped as time goes on, and if the window takes up more than
+// maxBytes, the oldest events (across all threads) go first.
+class TraceWindow : public TraceEventSink
+{
+public:
+    // window is in microseconds.
+    TraceWindow(uint64_t window, size_t maxBytes);
+
+    void writeEvent(const TraceEvent &event) override;
+
+    // Drop whatever has aged out of the window. Called regularly.
+    void trim();
+
+    // Start writing everything in the window to next, in timestamp order, a
+    // batch at a time (see writeMore()). The window keeps it all, so a later
+    // trigger can overlap. Until it's all written, nothing is trimmed, and if
+    // the window fills up, new events are dropped rather than old ones.
+    void startWriting(TraceEventSink *next);
+
+    // Write up to count more events. Returns false once they've all been
+    // written.
+    bool writeMore(size_t count);
+
+    bool isWriting() const { return m_writingTo != nullptr; }
+
+    uint64_t events() const { return m_events; }
+    size_t bytes() const { return m_events * sizeof(Event); }
+
+    // How many events were dropped to stay under maxBytes (rather than
+    // because they were too old), old or new.
+    uint64_t evictedEvents() const { return m_evictedEvents; }
+
+private:
+    // A TraceEvent, minus what's the same for the whole thread.
+    struct __attribute__((packed)) Event
+    {
+        uint64_t timestamp;
+        uint64_t value; // or duration, for DurationMessage
+        uint64_t id;
+        uint32_t categoryId;
+        uint32_t tracepointId;
+        uint8_t type;
+    };
+
+    typedef std::pair<uint64_t, uint64_t> ThreadKey; // pid, tid
+    typedef std::map<ThreadKey, std::deque<Event>> Threads;
+
+    // Where writing has got to in a thread, for a k-way merge of them.
+    struct WritePosition
+    {
+        uint64_t timestamp;
+        Threads::const_iterator thread;
+        size_t index;
+        size_t end; // as it was when writing started
+
+        bool operator>(const WritePosition &other) const { return timestamp > other.timestamp; }
+    };
+
+    void evictOldest();
+
+    uint64_t m_window;
+    size_t m_maxBytes;
+    Threads m_threads;
+    uint64_t m_events;
+    uint64_t m_evictedEvents;
+
+    TraceEventSink *m_writingTo;
+    std::priority_queue<WritePosition, std::vector<WritePosition>, std::greater<WritePosition>> m_writeHeap;
+};
+
+#endif // CTRACEWINDOW_H
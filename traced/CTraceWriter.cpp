@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "CTraceWriter.h"
+
+// Size at which we start a new buffer, rather than growing the current one.
+static const size_t BufferSize = 64 * 1024;
+
+TraceWriter::TraceWriter(int fd, TraceCompressor::Format compression, size_t maxQueuedBytes)
+    : m_compression(compression)
+    , m_compressor(nullptr)
+    , m_maxQueuedBytes(maxQueuedBytes)
+    , m_segmented(false)
+{
+    m_file.adopt(fd);
+    start(std::string());
+}
+
+TraceWriter::TraceWriter(const std::string &path, const TraceFileOptions &fileOptions,
+                         TraceCompressor::Format compression, size_t maxQueuedBytes)
+    : m_fileOptions(fileOptions)
+    , m_compression(compression)
+    , m_compressor(nullptr)
+    , m_maxQueuedBytes(maxQueuedBytes)
+    , m_segmented(false)
+{
+    start(path);
+}
+
+TraceWriter::TraceWriter(const TraceSegmentOptions &segments, const TraceFileOptions &fileOptions,
+                         TraceCompressor::Format compression, size_t maxQueuedBytes)
+    : m_fileOptions(fileOptions)
+    , m_compression(compression)
+    , m_compressor(nullptr)
+    , m_maxQueuedBytes(maxQueuedBytes)
+    , m_segments(segments)
+    , m_segmented(true)
+{
+    start(std::string());
+}
+
+void TraceWriter::start(const std::string &path)
+{
+    m_segmentBytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &m_segmentStart);
+    m_queuedBytes = 0;
+    m_closing = false;
+    m_segmentIndex = 0;
+    m_droppedBytes = 0;
+    m_writtenBytes = 0;
+
+    if (m_compression != TraceCompressor::NoCompression) {
+        TraceCompressor test(m_compression);
+        if (!test.isValid()) {
+            fprintf(stderr, "Can't initialize %s compression, writing uncompressed\n",
+                    TraceCompressor::formatName(m_compression));
+            m_compression = TraceCompressor::NoCompression;
+        }
+    }
+
+    if (!path.empty() && !m_file.open(path, m_fileOptions))
+        fprintf(stderr, "Can't open trace file %s: %s\n", path.c_str(), strerror(errno));
+
+    if (m_segmented)
+        openSegment();
+    else if (m_compression != TraceCompressor::NoCompression)
+        m_compressor = new TraceCompressor(m_compression);
+
+    m_current.reserve(BufferSize);
+    m_thread = std::thread(&TraceWriter::run, this);
+}
+
+TraceWriter::~TraceWriter()
+{
+    close();
+}
+
+void TraceWriter::printf(const char *format, ...)
+{
+    size_t used = m_current.size();
+    size_t room = 256;
+
+    for (;;) {
+        m_current.resize(used + room);
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(&m_current[used], room, format, args);
+        va_end(args);
+
+        if (len < 0) {
+            m_current.resize(used);
+            return;
+        }
+        if ((size_t)len < room) {
+            m_current.resize(used + len);
+            return;
+        }
+        room = len + 1;
+    }
+}
+
+bool TraceWriter::flush(bool force)
+{
+    if (m_current.empty())
+        return true;
+
+    bool queued = false;
+    size_t size = m_current.size();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (force || m_queuedBytes + size <= m_maxQueuedBytes) {
+            m_queuedBytes += size;
+            m_queue.push_back(Buffer { std::move(m_current), false });
+            queued = true;
+        }
+    }
+
+    if (queued) {
+        m_segmentBytes += size;
+        m_cond.notify_one();
+    } else {
+        if (m_droppedBytes == 0)
+            fprintf(stderr, "Output can't keep up, dropping trace data\n");
+        m_droppedBytes += size;
+    }
+
+    m_current = std::string();
+    m_current.reserve(BufferSize);
+    return queued;
+}
+
+size_t TraceWriter::queuedBytes()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queuedBytes;
+}
+
+bool TraceWriter::segmentFull() const
+{
+    if (!m_segmented)
+        return false;
+    if (m_segments.maxBytes && m_segmentBytes >= m_segments.maxBytes)
+        return true;
+    if (m_segments.maxSeconds) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - m_segmentStart.tv_sec >= m_segments.maxSeconds)
+            return true;
+    }
+    return false;
+}
+
+void TraceWriter::rotate()
+{
+    if (!m_segmented)
+        return;
+
+    flush();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back(Buffer { std::string(), true });
+    }
+    m_cond.notify_one();
+
+    m_segmentBytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &m_segmentStart);
+}
+
+void TraceWriter::close()
+{
+    if (!m_thread.joinable())
+        return;
+
+    flush(true);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closing = true;
+    }
+    m_cond.notify_one();
+    m_thread.join();
+
+    if (m_segmented)
+        closeSegment();
+    delete m_compressor;
+    m_compressor = nullptr;
+
+    if (m_droppedBytes)
+        fprintf(stderr, "Dropped %llu bytes of trace data\n", (unsigned long long)m_droppedBytes);
+}
+
+std::string TraceWriter::segmentName(int index) const
+{
+    const std::string &path = m_segments.path;
+    size_t base = path.rfind('/');
+    base = base == std::string::npos ? 0 : base + 1;
+    size_t ext = path.find('.', base);
+    if (ext == std::string::npos)
+        ext = path.size();
+
+    char seq[32];
+    snprintf(seq, sizeof(seq), ".%06d", index);
+    return path.substr(0, ext) + seq + path.substr(ext);
+}
+
+void TraceWriter::openSegment()
+{
+    std::string name = segmentName(++m_segmentIndex);
+    if (!m_file.open(name, m_fileOptions))
+        fprintf(stderr, "Can't open trace segment %s: %s\n", name.c_str(), strerror(errno));
+
+    if (m_compression != TraceCompressor::NoCompression)
+        m_compressor = new TraceCompressor(m_compression);
+
+    m_segmentFiles.push_back(name);
+    while (m_segments.keep && m_segmentFiles.size() > (size_t)m_segments.keep) {
+        unlink(m_segmentFiles.front().c_str());
+        m_segmentFiles.pop_front();
+    }
+}
+
+void TraceWriter::closeSegment()
+{
+    writeOut(std::string(), TraceCompressor::Finish);
+    delete m_compressor;
+    m_compressor = nullptr;
+    m_file.close();
+}
+
+void TraceWriter::writeOut(const std::string &data, TraceCompressor::Flush flush)
+{
+    const std::string *out = &data;
+
+    if (m_compressor) {
+        m_compressed.clear();
+        if (!m_compressor->compress(data.data(), data.size(), flush, m_compressed))
+            fprintf(stderr, "Error compressing trace data\n");
+        out = &m_compressed;
+    }
+
+    if (!m_file.isOpen())
+        return;
+
+    m_file.write(out->data(), out->size());
+    m_writtenBytes += out->size();
+
+    if (flush != TraceCompressor::NoFlush)
+        m_file.push();
+}
+
+void TraceWriter::run()
+{
+    for (;;) {
+        Buffer buffer;
+        bool idle;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return !m_queue.empty() || m_closing; });
+            if (m_queue.empty())
+                break;
+            buffer = std::move(m_queue.front());
+            m_queue.pop_front();
+            m_queuedBytes -= buffer.data.size();
+            idle = m_queue.empty();
+        }
+
+        if (buffer.rotate) {
+            closeSegment();
+            openSegment();
+            continue;
+        }
+
+        // Once we've caught up, start writing out everything so far, so that
+        // it's readable in case we're killed. (Without waiting for it, so
+        // that writes keep overlapping.)
+        writeOut(buffer.data, idle ? TraceCompressor::SyncFlush : TraceCompressor::NoFlush);
+    }
+
+    if (!m_segmented) {
+        writeOut(std::string(), TraceCompressor::Finish);
+        m_file.close();
+    }
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2017 Crimson AS <info@crimson.no>
+ * Author: Robin Burchell <robin.burchell@crimson.no>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef CTRACEWRITER_H
+#define CTRACEWRITER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "CTraceCompressor.h"
+#include "CTraceFile.h"
+
+// Splitting the output into a series of files, for continuous capture.
+struct TraceSegmentOptions
+{
+    // Segments are named after this, with a sequence number inserted before
+    // the extension: trace.json becomes trace.000001.json and so on.
+    std::string path;
+
+    // Start a new segment once this much (uncompressed) trace data, or this
+    // many seconds, have gone into the current one. 0 for no limit.
+    uint64_t maxBytes = 0;
+    int maxSeconds = 0;
+
+    // Delete the oldest segments beyond this many. 0 to keep them all.
+    int keep = 0;
+};
+
+// Buffers formatted trace data, and hands it over to a thread of its own for
+// (optional) compression and writing, so that chunk processing never waits on
+// either. The writer thread in turn doesn't wait on the disk (see TraceFile).
+//
+// The queue between the two is bounded. If the writer thread falls too far
+// behind, flush() drops the data instead of waiting, and says so, so that the
+// output format can recover (see TraceOutput::flushed()).
+class TraceWriter
+{
+public:
+    // Write to fd, which the caller owns.
+    TraceWriter(int fd, TraceCompressor::Format compression, size_t maxQueuedBytes);
+
+    // Write to the file at path.
+    TraceWriter(const std::string &path, const TraceFileOptions &fileOptions,
+                TraceCompressor::Format compression, size_t maxQueuedBytes);
+
+    // Write to a series of segment files.
+    TraceWriter(const TraceSegmentOptions &segments, const TraceFileOptions &fileOptions,
+                TraceCompressor::Format compression, size_t maxQueuedBytes);
+
+    // False if the output file couldn't be opened.
+    bool isOpen() const { return m_file.isOpen(); }
+
+    const char *backendName() const { return m_file.backendName(); }
+
+    ~TraceWriter();
+
+    void write(const char *data, size_t length)
+    {
+        m_current.append(data, length);
+    }
+
+    void printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    // Hand everything written so far to the writer thread. Returns false if
+    // it had to be dropped. With force, it's queued however far behind the
+    // writer is: that's for the little that finishes a trace off, which has
+    // to get there whatever was dropped before it.
+    bool flush(bool force = false);
+
+    // Flush (forced), finish the compressed stream, and wait for it all to be
+    // written.
+    void close();
+
+    // Whether the current segment is full (by size or age), and the caller
+    // should finish it off and rotate().
+    bool segmentFull() const;
+
+    // Flush, and start a new segment for everything written after this.
+    void rotate();
+
+    uint64_t droppedBytes() const { return m_droppedBytes; }
+    uint64_t writtenBytes() const { return m_writtenBytes; }
+
+    // How much has been flushed, and is still waiting for the writer thread:
+    // how far behind it is.
+    size_t queuedBytes();
+
+private:
+    struct Buffer
+    {
+        std::string data;
+        bool rotate; // start a new segment before writing data
+    };
+
+    void start(const std::string &path);
+    void run();
+    void writeOut(const std::string &data, TraceCompressor::Flush flush);
+    void openSegment();
+    void closeSegment();
+    std::string segmentName(int index) const;
+
+    TraceFile m_file;
+    TraceFileOptions m_fileOptions;
+    TraceCompressor::Format m_compression;
+    TraceCompressor *m_compressor;
+    size_t m_maxQueuedBytes;
+    TraceSegmentOptions m_segments;
+    bool m_segmented;
+
+    // Only touched by the producer.
+    std::string m_current;
+    uint64_t m_segmentBytes;
+    struct timespec m_segmentStart;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<Buffer> m_queue;
+    size_t m_queuedBytes;
+    bool m_closing;
+
+    // Only touched by the writer thread.
+    std::string m_compressed;
+    int m_segmentIndex;
+    std::deque<std::string> m_segmentFiles;
+
+    std::atomic<uint64_t> m_droppedBytes;
+    std::atomic<uint64_t> m_writtenBytes;
+    std::thread m_thread;
+};
+
+#endif // CTRACEWRITER_H
@@ -28,7 +28,6 @@
 #include <sys/sendfile.h>
 #include <time.h>
 #include <unistd.h>
-#include <zlib.h>
 #include <memory>
 #if defined(ANDROID)
 #include <binder/IBinder.h>
@@ -47,6 +46,7 @@ using namespace android;
 #include "atrace_compat.h"
 #endif
 #include <string>
+#include "CTraceCompressor.h"
 
 using std::string;
 #define NELEM(x) ((int) (sizeof(x) / sizeof((x)[0])))
@@ -849,72 +849,36 @@ static void dumpTrace(int outFd)
         return;
     }
     if (g_compress) {
-#if 0
-        z_stream zs;
-        memset(&zs, 0, sizeof(zs));
-        int result = deflateInit(&zs, Z_DEFAULT_COMPRESSION);
-        if (result != Z_OK) {
-            fprintf(stderr, "error initializing zlib: %d\n", result);
+        TraceCompressor compressor(TraceCompressor::Zlib);
+        if (!compressor.isValid()) {
+            fprintf(stderr, "error initializing zlib\n");
             close(traceFD);
             return;
         }
         constexpr size_t bufSize = 64*1024;
-        std::unique_ptr<uint8_t> in(new uint8_t[bufSize]);
-        std::unique_ptr<uint8_t> out(new uint8_t[bufSize]);
-        if (!in || !out) {
-            fprintf(stderr, "couldn't allocate buffers\n");
-            close(traceFD);
-            return;
-        }
-        int flush = Z_NO_FLUSH;
-        zs.next_out = reinterpret_cast<Bytef*>(out.get());
-        zs.avail_out = bufSize;
+        std::unique_ptr<char[]> in(new char[bufSize]);
+        std::string out;
+        TraceCompressor::Flush flush = TraceCompressor::NoFlush;
         do {
-            if (zs.avail_in == 0) {
-                // More input is needed.
-                result = read(traceFD, in.get(), bufSize);
-                if (result < 0) {
-                    fprintf(stderr, "error reading trace: %s (%d)\n",
-                            strerror(errno), errno);
-                    result = Z_STREAM_END;
-                    break;
-                } else if (result == 0) {
-                    flush = Z_FINISH;
-                } else {
-                    zs.next_in = reinterpret_cast<Bytef*>(in.get());
-                    zs.avail_in = result;
-                }
+            ssize_t bytes_read = read(traceFD, in.get(), bufSize);
+            if (bytes_read < 0) {
+                fprintf(stderr, "error reading trace: %s (%d)\n",
+                        strerror(errno), errno);
+                bytes_read = 0;
             }
-            if (zs.avail_out == 0) {
-                // Need to write the output.
-                result = write(outFd, out.get(), bufSize);
-                if ((size_t)result < bufSize) {
-                    fprintf(stderr, "error writing deflated trace: %s (%d)\n",
-                            strerror(errno), errno);
-                    result = Z_STREAM_END; // skip deflate error message
-                    zs.avail_out = bufSize; // skip the final write
-                    break;
-                }
-                zs.next_out = reinterpret_cast<Bytef*>(out.get());
-                zs.avail_out = bufSize;
+            if (bytes_read == 0)
+                flush = TraceCompressor::Finish;
+            out.clear();
+            if (!compressor.compress(in.get(), bytes_read, flush, out)) {
+                fprintf(stderr, "error deflating trace\n");
+                break;
             }
-        } while ((result = deflate(&zs, flush)) == Z_OK);
-        if (result != Z_STREAM_END) {
-            fprintf(stderr, "error deflating trace: %s\n", zs.msg);
-        }
-        if (zs.avail_out < bufSize) {
-            size_t bytes = bufSize - zs.avail_out;
-            result = write(outFd, out.get(), bytes);
-            if ((size_t)result < bytes) {
+            if (!out.empty() && write(outFd, out.data(), out.size()) != (ssize_t)out.size()) {
                 fprintf(stderr, "error writing deflated trace: %s (%d)\n",
                         strerror(errno), errno);
+                break;
             }
-        }
-        result = deflateEnd(&zs);
-        if (result != Z_OK) {
-            fprintf(stderr, "error cleaning up zlib: %d\n", result);
-        }
-#endif
+        } while (flush != TraceCompressor::Finish);
     } else {
         ssize_t sent = 0;
         while ((sent = sendfile(outFd, traceFD, NULL, 64*1024*1024)) > 0);
@@ -1,6 +1,6 @@
 TEMPLATE = app
 TARGET = atrace
-INCLUDEPATH += .
+INCLUDEPATH += . ..
 
 # The following define makes your compiler warn you if you use any
 # feature of Qt which has been marked as deprecated (the exact warnings
@@ -9,8 +9,13 @@ INCLUDEPATH += .
 DEFINES += QT_DEPRECATED_WARNINGS
 
 # Input
-HEADERS += atrace_compat.h
+HEADERS += atrace_compat.h \
+           ../CTraceCompressor.h
 SOURCES += atrace.cpp
 
 linux:LIBS += -lrt
 
+# Compressed output (-z)
+DEFINES += HAVE_ZLIB
+LIBS += -lz
+
@@ -26,8 +26,10 @@
 #include <signal.h>
 #include <assert.h>
 #include <errno.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/shm.h>
 #include <sys/types.h>
@@ -36,6 +38,10 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/uio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <dirent.h>
+#include <time.h>
 #include <unistd.h>
 
 // ### remove Qt dep
@@ -46,267 +52,1647 @@
 #include <QObject>
 #include <QProcess>
 #include <QFile>
+#include <QTimer>
 
+#include <algorithm>
+#include <memory>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "CTraceMessages.h"
+#include "CTraceEvent.h"
+#include "CTraceStrings.h"
+#include "CTraceOutput.h"
+#include "CTraceWriter.h"
+#include "CTraceSorter.h"
+#include "CTraceRecords.h"
+#include "CTraceDecoder.h"
+#include "CTraceFilter.h"
+#include "CTraceSubscriber.h"
+#include "CTraceStatistics.h"
+#include "CTraceSlices.h"
+#include "CTraceWindow.h"
+#include "CTraceShards.h"
+#include "CTraceShedding.h"
+#include "CTraceRelay.h"
 
 const int ShmChunkSize = 1024 * 10;
+
+// How much formatted output may wait for the writer thread before we start
+// dropping it.
+const size_t MaxQueuedOutput = 64 * 1024 * 1024;
+
+// Strings a client registers past its limits are recorded as this.
+static StringLimits stringLimits;
+static const char OverflowString[] = "(too many strings)";
+static uint32_t overflowStringId;
+
+
+// How many events we'll hold back for any one thread when sorting (-w).
+const size_t MaxSortedEventsPerThread = 256 * 1024;
+
+enum class TraceFormat
+{
+    Json,
+    Perfetto,
+    Binary,
+    Store
+};
+
+// How to record, from the command line. Recording can be stopped and
+// started again (see tracectl), but always like this.
+struct RecordingOptions
+{
+    TraceFormat format = TraceFormat::Json;
+    TraceCompressor::Format compression = TraceCompressor::NoCompression;
+    int sortWindow = 0;
+    bool mergeSlices = true;
+    int processesPerShard = 0; // 0 for one file for everything
+    TraceSegmentOptions segments;
+    TraceFileOptions fileOptions;
+};
+
 static FILE *traceOutputFile;
+static RecordingOptions recordingOptions;
+static TraceStringTable traceStrings;
+
+// These are only set while recording.
+static TraceWriter *traceWriter; // unless sharded
+static TraceOutput *traceOutput;
+static ShardedTraceOutput *traceShards; // traceOutput, if sharded (-H)
+static TraceEventSorter *traceSorter;
+static SliceMerger *traceSlices;
+static DurationFilter *traceDurations;
+static std::string recordingPath; // empty for stdout
+
+// SHM chunk names for this session start with this (see TRACED_SHM_PREFIX).
+static std::string sessionChunkPrefix;
+
+// Whether to store chunks as they are, rather than decoding them (--raw).
+static bool rawCapture;
+
+// Whether we're converting a binary trace (-i), rather than tracing.
+static bool convertingRecords;
+
+// With -X, the trace goes to the aggregating traced on this socket instead
+// of to a file, labelled with our host's name (see CTraceRelay.h).
+static int forwardSocket = -1;
+static std::string forwardHostName;
+static QSocketNotifier *probeNotifier; // see listenForProbes()
+
+// With -W, events are kept here (rather than recorded), and each trigger
+// writes them out to a new trace named after this.
+static TraceWindow *traceWindow;
+static std::string windowPath;
+
+// Where decoded events go: traceStatistics, if we're keeping them (-R), then
+// traceSubscribers, which passes them to any live subscribers, and to
+// traceFilter. That passes them on to the output (via traceSlices,
+// traceDurations and traceSorter, if we're using them) while recording.
+static EventFilter traceFilter(traceStrings);
+static TraceSubscribers traceSubscribers(&traceFilter);
+static TracepointStatistics *traceStatistics;
+static TraceEventSink *traceSink;
+
+static void flushSubscribers();
+static void writeClientStrings();
+
+// Tells clients to cut back when we fall behind (unless --shed 0), keeping
+// the categories in priorityCategoryIds longest.
+static LoadShedder *loadShedder;
+static std::vector<uint32_t> priorityCategoryIds;
+
+// Counters for tracectl status.
+struct TraceStats
+{
+    uint64_t chunks = 0;
+    uint64_t bytes = 0;
+    uint64_t lostChunks = 0; // couldn't be opened, or malformed
+
+    // Over the last second.
+    uint64_t chunkRate = 0;
+    uint64_t byteRate = 0;
+
+    // How long after its last event a chunk was decoded, in microseconds:
+    // for the latest chunk, and the worst over the last second.
+    uint64_t decodeLag = 0;
+    uint64_t maxDecodeLag = 0;
+    uint64_t currentMaxDecodeLag = 0;
+
+    // The worst decode lag of full chunks (see TRACED_CHUNK_FULL) over the
+    // current second, for loadShedder. A chunk submitted for any other
+    // reason, such as the process exiting, may have sat idle for any length
+    // of time since its last event.
+    uint64_t currentMaxFullChunkLag = 0;
+
+    uint64_t lastChunks = 0;
+    uint64_t lastBytes = 0;
+};
+static TraceStats traceStats;
+
+static uint64_t monotonicMicroseconds()
+{
+    struct timespec tp;
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+    return tp.tv_sec * 1000000ULL + tp.tv_nsec / 1000;
+}
+
+// Called once a second.
+static void updateStats()
+{
+    traceStats.chunkRate = traceStats.chunks - traceStats.lastChunks;
+    traceStats.byteRate = traceStats.bytes - traceStats.lastBytes;
+    traceStats.lastChunks = traceStats.chunks;
+    traceStats.lastBytes = traceStats.bytes;
+    traceStats.maxDecodeLag = traceStats.currentMaxDecodeLag;
+    traceStats.currentMaxDecodeLag = 0;
+}
+
+static void sendDegradeLevel();
+
+// Called once a second, after updateStats().
+static void updateLoadShedding()
+{
+    if (!loadShedder)
+        return;
+    uint64_t now = monotonicMicroseconds();
+    uint64_t lag = traceStats.currentMaxFullChunkLag;
+    traceStats.currentMaxFullChunkLag = 0;
+    if (!loadShedder->update(lag, now))
+        return;
+
+    DegradeLevel level = loadShedder->level();
+    qWarning() << "Decode lag is" << lag / 1000 << "ms; clients now tracing at level" << (int)level
+               << "(" << LoadShedder::levelName(level) << ")";
+    sendDegradeLevel();
+
+    // Record the change, so that whoever reads the trace knows why events
+    // thin out or go missing.
+    static const char Category[] = "traced";
+    static const char Tracepoint[] = "degradation level";
+    static const uint32_t category = traceStrings.intern(Category, strlen(Category));
+    static const uint32_t tracepoint = traceStrings.intern(Tracepoint, strlen(Tracepoint));
+    TraceEvent ev;
+    ev.type = MessageType::CounterMessage;
+    ev.pid = ev.tid = getpid();
+    ev.timestamp = now;
+    ev.duration = 0;
+    ev.value = (uint64_t)level;
+    ev.id = 0;
+    ev.categoryId = category;
+    ev.tracepointId = tracepoint;
+    traceSink->writeEvent(ev);
+    flushSubscribers();
+    if (traceOutput)
+        traceOutput->flush();
+}
+
+// Start a trace (or segment) off. JSON traces say what time it is, so that
+// they can be lined up with others later. A converted trace (-i) may not be
+// from this host, or this boot, so can't.
+static void writeOutputHeader()
+{
+    traceOutput->writeHeader();
+    if (recordingOptions.format == TraceFormat::Json && !traceShards && !convertingRecords) {
+        struct timespec real;
+        clock_gettime(CLOCK_REALTIME, &real);
+        static_cast<JsonTraceOutput*>(traceOutput)->writeClockSync(getpid(), monotonicMicroseconds(),
+                                                                   real.tv_sec * 1000000ULL + real.tv_nsec / 1000);
+    }
+}
+
+// Finish off the current output segment, and start a new one. Each segment
+// is a complete trace in its own right.
+static void rotateOutput()
+{
+    traceOutput->finish();
+    traceWriter->rotate();
+    writeOutputHeader();
+    if (rawCapture)
+        writeClientStrings();
+    traceOutput->flush();
+}
+
+static void rotateOutputIfNeeded()
+{
+    if (!traceWriter || !traceWriter->segmentFull())
+        return;
+    rotateOutput();
+}
+
+// After a batch of events has come in.
+static void flushOutput()
+{
+    if (traceSorter)
+        traceSorter->drain();
+    if (traceOutput) {
+        traceOutput->flush();
+        rotateOutputIfNeeded();
+    }
+}
+
+static bool isSegmented()
+{
+    return recordingOptions.segments.maxBytes || recordingOptions.segments.maxSeconds;
+}
+
+static const char *formatName(TraceFormat format)
+{
+    switch (format) {
+    case TraceFormat::Json:
+        return "json";
+    case TraceFormat::Perfetto:
+        return "perfetto";
+    case TraceFormat::Binary:
+        return "binary";
+    case TraceFormat::Store:
+        return "store";
+    }
+    return "";
+}
+
+static TraceOutput *createOutput(TraceFormat format, TraceWriter *writer)
+{
+    switch (format) {
+    case TraceFormat::Json:
+        return new JsonTraceOutput(writer, traceStrings);
+    case TraceFormat::Perfetto:
+        return new PerfettoTraceOutput(writer, traceStrings);
+    case TraceFormat::Binary:
+        return new BinaryTraceOutput(writer, traceStrings);
+    case TraceFormat::Store:
+        return new StoreTraceOutput(writer, traceStrings);
+    }
+    return nullptr;
+}
+
+// Start writing the trace to path (or stdout, if it's empty). Returns false
+// if it can't be opened.
+static bool startRecording(const std::string &path)
+{
+    const RecordingOptions &o = recordingOptions;
+    if (o.processesPerShard) {
+        TraceFormat format = o.format;
+        traceShards = new ShardedTraceOutput(path, o.processesPerShard, o.fileOptions, o.compression,
+                                             MaxQueuedOutput, traceStrings, formatName(format),
+                                             [format](TraceWriter *writer) {
+            return createOutput(format, writer);
+        });
+        traceShards->setConverting(convertingRecords);
+        traceOutput = traceShards;
+    } else if (isSegmented()) {
+        TraceSegmentOptions segments = o.segments;
+        segments.path = path;
+        traceWriter = new TraceWriter(segments, o.fileOptions, o.compression, MaxQueuedOutput);
+    } else if (forwardSocket != -1) {
+        traceWriter = new TraceWriter(forwardSocket, o.compression, MaxQueuedOutput);
+    } else if (!path.empty()) {
+        traceWriter = new TraceWriter(path, o.fileOptions, o.compression, MaxQueuedOutput);
+        if (!traceWriter->isOpen()) {
+            delete traceWriter;
+            traceWriter = nullptr;
+            return false;
+        }
+    } else {
+        traceWriter = new TraceWriter(fileno(traceOutputFile), o.compression, MaxQueuedOutput);
+    }
+    if (traceWriter) {
+        qInfo() << "Writing the trace with" << traceWriter->backendName();
+        traceOutput = createOutput(o.format, traceWriter);
+    }
+
+    TraceEventSink *next = traceOutput;
+    if (o.sortWindow) {
+        traceSorter = new TraceEventSorter(next, o.sortWindow * 1000, MaxSortedEventsPerThread);
+        next = traceSorter;
+    }
+    if (o.mergeSlices) {
+        // Slices' durations are only known once they're merged, so that's
+        // when the filter's mindur applies.
+        traceDurations = new DurationFilter(next, traceFilter);
+        traceSlices = new SliceMerger(traceDurations);
+        next = traceSlices;
+    }
+    traceFilter.setMergingSlices(o.mergeSlices);
+    traceFilter.setNext(next);
+
+    recordingPath = path;
+    writeOutputHeader();
+    if (forwardSocket != -1)
+        static_cast<BinaryTraceOutput*>(traceOutput)->writeHost(forwardHostName);
+    if (rawCapture)
+        writeClientStrings();
+    traceOutput->flush();
+    return true;
+}
+
+// Write out everything we have, and finish the trace.
+static void stopRecording()
+{
+    traceFilter.setNext(nullptr);
+
+    if (traceSlices) {
+        traceSlices->flush();
+        delete traceSlices;
+        traceSlices = nullptr;
+        delete traceDurations;
+        traceDurations = nullptr;
+    }
+
+    if (traceSorter) {
+        traceSorter->drainAll();
+        if (traceSorter->lateEvents())
+            qWarning() << traceSorter->lateEvents() << "events arrived too late to be sorted";
+        delete traceSorter;
+        traceSorter = nullptr;
+    }
+
+    traceOutput->writeFooter();
+    delete traceOutput;
+    delete traceWriter;
+    traceOutput = nullptr;
+    traceWriter = nullptr;
+    traceShards = nullptr;
+
+    // The writer only borrowed the aggregator's socket. Closing it ends our
+    // stream there; anything recorded after this goes to a file.
+    if (forwardSocket != -1) {
+        delete probeNotifier;
+        probeNotifier = nullptr;
+        close(forwardSocket);
+        forwardSocket = -1;
+    }
+}
+
+// A name for a trace of the window, with the time it was written: for
+// trace.json, trace.20170101-120000.json.
+static std::string windowDumpName()
+{
+    size_t base = windowPath.rfind('/');
+    base = base == std::string::npos ? 0 : base + 1;
+    size_t ext = windowPath.find('.', base);
+    if (ext == std::string::npos)
+        ext = windowPath.size();
+
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), ".%Y%m%d-%H%M%S", localtime(&now));
+    std::string name = windowPath.substr(0, ext) + stamp + windowPath.substr(ext);
+    for (int n = 2; access(name.c_str(), F_OK) == 0; ++n)
+        name = windowPath.substr(0, ext) + stamp + "-" + std::to_string(n) + windowPath.substr(ext);
+    return name;
+}
+
+// How many of the window's events are written at a time (-W), between
+// serving clients.
+static const size_t WindowBatchEvents = 10000;
+
+// The trace the window is being written to, if it is.
+static std::string windowWritingPath;
+static QTimer *windowWriteTimer;
+
+static void windowWritten(const std::string &path, uint64_t droppedBytes);
+
+// How far behind the writer thread (or the furthest behind shard's) is.
+static size_t queuedOutputBytes()
+{
+    return traceShards ? traceShards->queuedBytes() : traceWriter->queuedBytes();
+}
+
+static uint64_t droppedOutputBytes()
+{
+    return traceShards ? traceShards->droppedBytes() : traceWriter ? traceWriter->droppedBytes() : 0;
+}
+
+// Write the next batch of the window out, and once that's all of it, finish
+// the trace. Returns false if the writer hadn't caught up with the last batch
+// yet, so nothing was written: holding back is better than dropping.
+static bool writeWindowBatch()
+{
+    if (queuedOutputBytes() > MaxQueuedOutput / 2)
+        return false;
+    if (traceWindow->writeMore(WindowBatchEvents)) {
+        flushOutput();
+        return true;
+    }
+
+    // The rest is forced out, so can't be dropped.
+    uint64_t dropped = droppedOutputBytes();
+    windowWriteTimer->stop();
+    stopRecording();
+    traceFilter.setNext(traceWindow);
+    std::string path = windowWritingPath;
+    windowWritingPath.clear();
+    windowWritten(path, dropped);
+    return true;
+}
+
+// Start writing the window out as a complete trace. A big window takes a
+// while, so it's written a batch at a time from the event loop, with clients
+// served in between; windowWritten() is called once it's done. Returns its
+// name, or an empty string if it couldn't be written.
+static std::string startWritingWindow()
+{
+    std::string path = windowDumpName();
+    if (!startRecording(path))
+        return std::string();
+
+    // What comes in meanwhile goes to the window, not this trace.
+    traceWindow->startWriting(traceFilter.next());
+    traceFilter.setNext(traceWindow);
+    windowWritingPath = path;
+    if (!windowWriteTimer) {
+        windowWriteTimer = new QTimer;
+        QObject::connect(windowWriteTimer, &QTimer::timeout, []() {
+            writeWindowBatch();
+        });
+    }
+    windowWriteTimer->start(1);
+    return path;
+}
+
+class TraceClient : public QObject
+{
+    Q_OBJECT
+
+public:
+    TraceClient(int f)
+        : fd(f), id(nextClientId++), pid(-1), nextSequence(0), bufferedBytes(0)
+        , decoder(traceStrings, overflowStringId, stringLimits), stringsRefused(false)
+    {
+        qInfo() << "New process connected on " << fd;
+        decoder.watchStrings(priorityCategoryIds);
+        all.push_back(this);
+        ++count;
+    }
+
+    ~TraceClient()
+    {
+        qInfo() << "Process disconnected on " << fd;
+        close(fd);
+        // Its slices won't be ending now.
+        if (traceSlices && pid != -1)
+            traceSlices->flushProcess(pid);
+        // With -w, some of its events may still be waiting to be sorted.
+        if (traceShards && !traceSorter && pid != -1)
+            traceShards->finishProcess(pid);
+        if (pid != -1) {
+            EventFilter::forgetProcessName(pid);
+            traceFilter.forgetProcess(pid);
+            traceSubscribers.forgetProcess(pid);
+            if (traceStatistics)
+                traceStatistics->forgetProcess(pid);
+        }
+        all.erase(std::find(all.begin(), all.end(), this));
+        --count;
+    }
+
+    // How many are connected, and which.
+    static int count;
+    static std::vector<TraceClient*> all;
+
+    // Tell the client what level to trace at (see loadShedder).
+    void sendDegradeLevel(DegradeLevel level);
+
+    // With --raw, write a chunk registering all of the client's strings so
+    // far (see writeClientStrings()).
+    void writeRegisteredStrings(BinaryTraceOutput *output);
+
+    int fd;
+
+    // Identifies this connection's chunks in a raw capture.
+    uint64_t id;
+
+    // From the client's HelloMessage; -1 until then.
+    int64_t pid;
+    uint64_t nextSequence;
+
+    // Control messages read from fd, and how many bytes of them we have. Only
+    // ever holds a partial message in between reads.
+    ControlMessage buf[256];
+    size_t bufferedBytes;
+
+public slots:
+    void readControlSocket();
+private:
+    bool processChunk(const ControlMessage &m);
+    bool decodeChunk(int shm_fd, size_t length, bool full);
+    bool captureChunk(int shm_fd, size_t length);
+    void refuseStrings();
+    bool sendControl(ControlMessageType type, uint16_t flags, uint64_t chunkId);
+
+    static uint64_t nextClientId;
+
+    ChunkDecoder decoder;
+
+    // Whether the client has been told to stop registering strings.
+    bool stringsRefused;
+};
+
+uint64_t TraceClient::nextClientId = 1;
+int TraceClient::count = 0;
+std::vector<TraceClient*> TraceClient::all;
+
+bool TraceClient::sendControl(ControlMessageType type, uint16_t flags, uint64_t chunkId)
+{
+    ControlMessage m;
+    memset(&m, 0, sizeof(m));
+    m.type = type;
+    m.flags = flags;
+    m.chunkId = chunkId;
+    return send(this->fd, &m, sizeof(m), MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(m);
+}
+
+// Tell the client to stop registering new strings.
+void TraceClient::refuseStrings()
+{
+    if (stringsRefused)
+        return;
+    stringsRefused = true;
+
+    qWarning() << "Client " << this->fd << " (pid " << pid << ") has registered too many strings; further ones will be recorded as " << OverflowString;
+
+    if (!sendControl(ControlMessageType::TooManyStringsMessage, 0, 0))
+        qWarning() << "Can't tell client " << this->fd << " to stop registering strings";
+}
+
+void TraceClient::sendDegradeLevel(DegradeLevel level)
+{
+    if (!sendControl(ControlMessageType::DegradeMessage, (uint16_t)level, 0))
+        qWarning() << "Can't tell client " << this->fd << " (pid " << pid << ") to trace at level " << (int)level;
+}
+
+static void sendDegradeLevel()
+{
+    for (TraceClient *client : TraceClient::all) {
+        if (client->pid != -1)
+            client->sendDegradeLevel(loadShedder->level());
+    }
+}
+
+bool TraceClient::processChunk(const ControlMessage &m)
+{
+    if (pid == -1) {
+        qWarning() << "Client " << this->fd << " submitted a chunk before saying hello";
+        return false;
+    }
+    if (m.length < sizeof(ChunkHeader) || m.length > ShmChunkSize) {
+        qWarning() << "Client " << this->fd << " submitted a chunk of bad length " << m.length;
+        return false;
+    }
+
+    // We only ever open chunks in our own session's namespace.
+    char name[128];
+    snprintf(name, sizeof(name), "%s-%" PRId64 "-%" PRIu64, sessionChunkPrefix.c_str(), pid, m.chunkId);
+
+    int shm_fd = shm_open(name, O_RDONLY, S_IRUSR | S_IWUSR);
+    if (shm_fd == -1) {
+        qWarning() << "shm_open: " << name << strerror(errno);
+        return false;
+    }
+
+    // Immediately unlink, so the chunk goes away with the last reference
+    if (shm_unlink(name) == -1)
+        qWarning() << "shm_unlink: " << name << strerror(errno);
+
+    bool ok = rawCapture ? captureChunk(shm_fd, m.length) : decodeChunk(shm_fd, m.length, m.flags & TRACED_CHUNK_FULL);
+    close(shm_fd);
+
+    if (!ok) {
+        qWarning() << "Client " << this->fd << " (pid " << pid << ") submitted a malformed chunk";
+        this->deleteLater();
+        return false;
+    }
+
+    traceStats.chunks++;
+    traceStats.bytes += m.length;
+    return true;
+}
+
+bool TraceClient::decodeChunk(int shm_fd, size_t length, bool full)
+{
+    void *data = mmap(0, ShmChunkSize, PROT_READ, MAP_SHARED, shm_fd, 0);
+    if (data == MAP_FAILED) {
+        qWarning() << "mmap: " << strerror(errno);
+        return false;
+    }
+
+    bool ok = decoder.decode((const char*)data, length, traceSink);
+    munmap(data, ShmChunkSize);
+
+    // A batch of chunks can be more than a subscriber's whole queue, so
+    // don't wait for the end of it.
+    flushSubscribers();
+
+    uint64_t now = monotonicMicroseconds();
+    traceStats.decodeLag = now > decoder.lastTimestamp() ? now - decoder.lastTimestamp() : 0;
+    traceStats.currentMaxDecodeLag = std::max(traceStats.currentMaxDecodeLag, traceStats.decodeLag);
+    if (full)
+        traceStats.currentMaxFullChunkLag = std::max(traceStats.currentMaxFullChunkLag, traceStats.decodeLag);
+
+    // The client keeps these to itself until it's told to trace only
+    // priority categories.
+    for (uint64_t id : decoder.takeWatchedStrings()) {
+        if (!sendControl(ControlMessageType::KeepCategoryMessage, 0, id))
+            qWarning() << "Can't tell client " << this->fd << " (pid " << pid << ") about priority category " << id;
+    }
+
+    if (decoder.stringsRefused())
+        refuseStrings();
+    return ok;
+}
+
+// Copy the chunk as it is into the output, for decoding later (see -i).
+bool TraceClient::captureChunk(int shm_fd, size_t length)
+{
+    char chunk[ShmChunkSize];
+    ssize_t got = pread(shm_fd, chunk, length, 0);
+    if (got != (ssize_t)length) {
+        qWarning() << "Can't read chunk from client " << this->fd << ": " << (got < 0 ? strerror(errno) : "short read");
+        return false;
+    }
+
+    const ChunkHeader *h = (const ChunkHeader*)chunk;
+    if (h->magic != TRACED_PROTOCOL_MAGIC || h->version != TRACED_PROTOCOL_VERSION)
+        return false;
+
+    // Even while we aren't recording, keep track of the strings it
+    // registers: later chunks will use them.
+    if (!decoder.registerStrings(chunk, length))
+        return false;
+    if (decoder.stringsRefused())
+        refuseStrings();
+
+    if (traceOutput)
+        static_cast<BinaryTraceOutput*>(traceOutput)->writeRawChunk(id, chunk, length);
+    return true;
+}
+
+void TraceClient::writeRegisteredStrings(BinaryTraceOutput *output)
+{
+    if (pid == -1)
+        return;
+
+    ChunkHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = TRACED_PROTOCOL_MAGIC;
+    h.version = TRACED_PROTOCOL_VERSION;
+    h.pid = h.tid = pid;
+    std::string chunk(reinterpret_cast<const char*>(&h), sizeof(h));
+
+    const std::vector<uint32_t> &strings = decoder.registeredStrings();
+    for (size_t i = 0; i < strings.size(); ++i) {
+        if (!strings[i])
+            continue;
+        const char *string = traceStrings.string(strings[i]);
+        size_t length = std::min<size_t>(strlen(string), UINT8_MAX);
+        size_t size = sizeof(RegisterStringMessage) + length;
+        if (chunk.size() + size > ShmChunkSize) {
+            output->writeRawChunk(id, chunk.data(), chunk.size());
+            chunk.resize(sizeof(h));
+        }
+
+        size_t offset = chunk.size();
+        chunk.resize(offset + size);
+        RegisterStringMessage *m = reinterpret_cast<RegisterStringMessage*>(&chunk[offset]);
+        m->messageType = MessageType::RegisterStringMessage;
+        m->id = i;
+        m->length = length;
+        memcpy(&m->stringData, string, length);
+    }
+    if (chunk.size() > sizeof(h))
+        output->writeRawChunk(id, chunk.data(), chunk.size());
+}
+
+// A raw capture's strings are registered in whichever chunks the clients
+// happened to send them in, which may have gone into an earlier recording or
+// segment, or none at all (while stopped). So start each recording, and each
+// segment, by registering every connected client's strings again.
+static void writeClientStrings()
+{
+    BinaryTraceOutput *output = static_cast<BinaryTraceOutput*>(traceOutput);
+    for (TraceClient *client : TraceClient::all)
+        client->writeRegisteredStrings(output);
+}
+
+void TraceClient::readControlSocket()
+{
+    char *data = reinterpret_cast<char*>(buf);
+    ssize_t len = ::read(this->fd, data + bufferedBytes, sizeof(buf) - bufferedBytes);
+    if (len <= 0) {
+        this->deleteLater();
+        return;
+    }
+    bufferedBytes += len;
+
+    size_t count = bufferedBytes / sizeof(ControlMessage);
+    for (size_t i = 0; i < count; ++i) {
+        const ControlMessage &m = buf[i];
+        if (m.sequence != nextSequence) {
+            qWarning() << "Client " << this->fd << " skipped from message " << nextSequence << " to " << m.sequence;
+        }
+        nextSequence = m.sequence + 1;
+
+        switch (m.type) {
+        case ControlMessageType::HelloMessage:
+            pid = m.chunkId;
+            EventFilter::rememberProcessName(pid);
+            if (loadShedder && loadShedder->level() != DegradeLevel::Full)
+                sendDegradeLevel(loadShedder->level());
+            break;
+        case ControlMessageType::SubmitChunkMessage:
+            qDebug() << "Trying chunk " << m.chunkId;
+            if (!processChunk(m)) {
+                // segment got eaten out from under us perhaps
+                traceStats.lostChunks++;
+                continue;
+            }
+            qDebug() << "Done chunk " << m.chunkId;
+            break;
+        default:
+            qWarning() << "Client " << this->fd << " sent unknown message " << (int)m.type;
+            break;
+        }
+    }
+
+    // Keep any partial message for next time.
+    size_t used = count * sizeof(ControlMessage);
+    bufferedBytes -= used;
+    memmove(data, data + used, bufferedBytes);
+
+    flushOutput();
+}
+
+// Read a trace written with -f binary (or --raw) back in, and write it out
+// again in whatever format was asked for.
+static bool convertRecords(FILE *input)
+{
+    RecordReader reader(input);
+    if (!reader.readFileHeader()) {
+        fprintf(stderr, "Not a traced binary trace\n");
+        return false;
+    }
+
+    // The file's string IDs, mapped to ours.
+    std::vector<uint32_t> stringIds;
+
+    // For raw captures: each client's strings are numbered separately.
+    std::unordered_map<uint64_t, std::unique_ptr<ChunkDecoder>> decoders;
+
+    RecordType type;
+    std::string payload;
+    uint64_t events = 0;
+    uint64_t chunks = 0;
+    while (reader.next(type, payload)) {
+        switch (type) {
+        case RecordType::StringRecord: {
+            uint32_t id;
+            if (payload.size() < sizeof(id))
+                break;
+            memcpy(&id, payload.data(), sizeof(id));
+            if (id >= stringIds.size())
+                stringIds.resize(id + 1, 0);
+            stringIds[id] = traceStrings.intern(payload.data() + sizeof(id), payload.size() - sizeof(id));
+            break;
+        }
+        case RecordType::EventRecord: {
+            EventRecord r;
+            if (payload.size() < sizeof(r))
+                break;
+            memcpy(&r, payload.data(), sizeof(r));
+            TraceEvent ev;
+            RecordReader::toEvent(r, ev);
+            ev.categoryId = ev.categoryId < stringIds.size() ? stringIds[ev.categoryId] : 0;
+            ev.tracepointId = ev.tracepointId < stringIds.size() ? stringIds[ev.tracepointId] : 0;
+            traceSink->writeEvent(ev);
+            if (++events % 10000 == 0) {
+                traceOutput->flush();
+                rotateOutputIfNeeded();
+            }
+            break;
+        }
+        case RecordType::RawChunkRecord: {
+            uint64_t clientId;
+            if (payload.size() < sizeof(clientId))
+                break;
+            memcpy(&clientId, payload.data(), sizeof(clientId));
+            std::unique_ptr<ChunkDecoder> &decoder = decoders[clientId];
+            if (!decoder)
+                decoder.reset(new ChunkDecoder(traceStrings, overflowStringId, stringLimits));
+            if (!decoder->decode(payload.data() + sizeof(clientId), payload.size() - sizeof(clientId), traceSink))
+                fprintf(stderr, "Skipping malformed chunk from client %" PRIu64 "\n", clientId);
+            if (++chunks % 100 == 0) {
+                traceOutput->flush();
+                rotateOutputIfNeeded();
+            }
+            break;
+        }
+        default:
+            // From a newer traced; skip it.
+            break;
+        }
+    }
+
+    if (ferror(input)) {
+        perror("Can't read trace");
+        return false;
+    }
+    if (reader.corrupt()) {
+        fprintf(stderr, "Stopping at a corrupt record\n");
+        return false;
+    }
+    return true;
+}
+
+// Remove chunks that were created for us or for a session that has since
+// died, but that were never processed (and so never unlinked). Chunks from
+// other users, or other traced instances that are still running, are left
+// alone.
+static void removeLeftoverChunks()
+{
+#if defined(__linux__)
+    DIR *dir = opendir("/dev/shm");
+    if (!dir)
+        return;
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        unsigned uid;
+        int pid;
+        int n = 0;
+        if (sscanf(de->d_name, TRACED_SHM_PREFIX "-%u-%d-%n", &uid, &pid, &n) != 2 || n == 0)
+            continue;
+        if (uid != getuid())
+            continue;
+        if (pid != getpid() && !(kill(pid, 0) == -1 && errno == ESRCH))
+            continue;
+        shm_unlink(de->d_name);
+    }
+
+    closedir(dir);
+#endif
+}
+
+// Returns a socket listening on path.
+static int listenOn(const char *socketPath)
+{
+    struct sockaddr_un local;
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s == -1) {
+        perror("Can't create socket");
+        abort();
+    }
+
+    int optval = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+
+    local.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(local.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socketPath);
+        exit(-1);
+    }
+    strcpy(local.sun_path, socketPath);
+    unlink(local.sun_path);
+    int len = strlen(local.sun_path) + sizeof(local.sun_family) + 1;
+    if (bind(s, (struct sockaddr *)&local, len) == -1) {
+        perror("Can't bind()");
+        abort();
+    }
+
+    if (listen(s, 5) == -1) {
+        perror("Can't listen");
+        abort();
+    }
+
+    return s;
+}
+
+static void listenForClients(const char *socketPath)
+{
+    int s = listenOn(socketPath);
+    QObject::connect(new QSocketNotifier(s, QSocketNotifier::Read),
+        &QSocketNotifier::activated, [s]() {
+        struct sockaddr_un remote;
+        int len = sizeof(struct sockaddr_un);
+        int client = accept(s, (struct sockaddr*)&remote, (socklen_t *)&len);
+        if (client == -1)
+            return;
+
+        SessionMessage session;
+        memset(&session, 0, sizeof(session));
+        session.magic = TRACED_PROTOCOL_MAGIC;
+        session.version = TRACED_PROTOCOL_VERSION;
+        strncpy(session.chunkPrefix, sessionChunkPrefix.c_str(), sizeof(session.chunkPrefix) - 1);
+        if (write(client, &session, sizeof(session)) != sizeof(session)) {
+            perror("Can't send session to client");
+            close(client);
+            return;
+        }
+
+        TraceClient *tc = new TraceClient(client);
+        QSocketNotifier *csn = new QSocketNotifier(client,  QSocketNotifier::Read);
+        csn->setParent(tc);
+        QObject::connect(csn, 
+            &QSocketNotifier::activated, tc, &TraceClient::readControlSocket);
+    });
+}
+
+// An aggregator's connection from a forwarding traced (-A).
+class RelayConnection : public QObject
+{
+    Q_OBJECT
+
+public:
+    RelayConnection(int f)
+        : fd(f), stream(traceStrings, overflowStringId, stringLimits, traceSink)
+    {
+        qInfo() << "New forwarded stream on " << fd;
+        all.push_back(this);
+        sendProbe();
+    }
+
+    ~RelayConnection()
+    {
+        qInfo() << "Forwarded stream from" << stream.hostName().c_str() << "ended on " << fd;
+        close(fd);
+        for (uint64_t pid : stream.processes()) {
+            if (traceSlices)
+                traceSlices->flushProcess(pid);
+            traceFilter.forgetProcess(pid);
+            traceSubscribers.forgetProcess(pid);
+            if (traceStatistics)
+                traceStatistics->forgetProcess(pid);
+        }
+        all.erase(std::find(all.begin(), all.end(), this));
+    }
+
+    // Ask the forwarder what time it is (see ClockProbe).
+    void sendProbe()
+    {
+        ClockProbe probe;
+        probe.time = monotonicMicroseconds();
+        if (send(fd, &probe, sizeof(probe), MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(probe))
+            qWarning() << "Can't send clock probe to" << stream.hostName().c_str();
+    }
+
+    int fd;
+    RelayedStream stream;
+    static std::vector<RelayConnection*> all;
+
+public slots:
+    void readSocket();
+};
+
+std::vector<RelayConnection*> RelayConnection::all;
+
+void RelayConnection::readSocket()
+{
+    char data[64 * 1024];
+    ssize_t len = ::read(this->fd, data, sizeof(data));
+    if (len <= 0) {
+        this->deleteLater();
+        return;
+    }
+    bool hadHost = !stream.hostName().empty();
+    if (!stream.receive(data, len, monotonicMicroseconds())) {
+        qWarning() << "Malformed stream from" << stream.hostName().c_str() << "on " << fd;
+        this->deleteLater();
+        return;
+    }
+    if (!hadHost && !stream.hostName().empty())
+        qInfo() << "Stream on " << fd << " is from" << stream.hostName().c_str() << "; its pids start at" << stream.pidBase();
+    flushSubscribers();
+    flushOutput();
+}
+
+// How many forwarders an aggregator takes in at once. Each one can have up to
+// 16MB of its trace held back until its clock is synced (see RelayedStream).
+static const size_t MaxRelayConnections = 32;
+
+// Split address, as host:port or [host]:port, into its parts. Without a
+// colon, it's just a port. Returns false if there's no port.
+static bool splitAddress(const char *address, std::string &host, std::string &port)
+{
+    host = address;
+    size_t colon = host.rfind(':');
+    if (colon == std::string::npos) {
+        port = host;
+        host.clear();
+    } else {
+        port = host.substr(colon + 1);
+        host.resize(colon);
+    }
+    // [::1]:port
+    if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+    return !port.empty();
+}
+
+// Listen for forwarding traceds on TCP address, as [host:]port. Anyone who can
+// connect can add to the trace, so with no host, only this machine can.
+static void listenForRelays(const char *address)
+{
+    std::string host, port;
+    splitAddress(address, host, port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    // With no host, these are the loopback addresses.
+    struct addrinfo *addresses;
+    int ret = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addresses);
+    if (ret != 0) {
+        fprintf(stderr, "Can't look up %s: %s\n", address, gai_strerror(ret));
+        exit(-1);
+    }
+
+    int listening = 0;
+    int error = 0;
+    for (struct addrinfo *ai = addresses; ai; ai = ai->ai_next) {
+        int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == -1) {
+            error = errno;
+            continue;
+        }
+        int optval = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+        if (ai->ai_family == AF_INET6) {
+            // [::]:port takes IPv4 connections too.
+            optval = 0;
+            setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof optval);
+        }
+        if (bind(s, ai->ai_addr, ai->ai_addrlen) == -1 || listen(s, 16) == -1) {
+            error = errno;
+            close(s);
+            continue;
+        }
+        ++listening;
+
+        QObject::connect(new QSocketNotifier(s, QSocketNotifier::Read),
+            &QSocketNotifier::activated, [s]() {
+            int client = accept(s, NULL, NULL);
+            if (client == -1)
+                return;
+            if (RelayConnection::all.size() >= MaxRelayConnections) {
+                qWarning() << "Refusing forwarded stream on " << client << ": already taking" << MaxRelayConnections;
+                close(client);
+                return;
+            }
+
+            RelayConnection *rc = new RelayConnection(client);
+            QSocketNotifier *csn = new QSocketNotifier(client, QSocketNotifier::Read);
+            csn->setParent(rc);
+            QObject::connect(csn,
+                &QSocketNotifier::activated, rc, &RelayConnection::readSocket);
+        });
+    }
+    freeaddrinfo(addresses);
+    if (!listening) {
+        fprintf(stderr, "Can't listen on %s: %s\n", address, strerror(error));
+        exit(-1);
+    }
+
+    // Keep the clock offsets up to date.
+    QTimer *probeTimer = new QTimer;
+    QObject::connect(probeTimer, &QTimer::timeout, []() {
+        for (RelayConnection *rc : RelayConnection::all)
+            rc->sendProbe();
+    });
+    probeTimer->start(1000);
+}
+
+// Connect to the aggregator at address, as host:port. Returns -1 if we can't.
+static int connectToAggregator(const char *address)
+{
+    std::string host, port;
+    if (!splitAddress(address, host, port) || host.empty()) {
+        fprintf(stderr, "Aggregator address should be host:port, not %s\n", address);
+        return -1;
+    }
 
-class TraceClient : public QObject
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses;
+    int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+    if (ret != 0) {
+        fprintf(stderr, "Can't look up %s: %s\n", address, gai_strerror(ret));
+        return -1;
+    }
+
+    int s = -1;
+    for (struct addrinfo *ai = addresses; ai && s == -1; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s != -1 && ::connect(s, ai->ai_addr, ai->ai_addrlen) == -1) {
+            close(s);
+            s = -1;
+        }
+    }
+    if (s == -1)
+        fprintf(stderr, "Can't connect to %s: %s\n", address, strerror(errno));
+    freeaddrinfo(addresses);
+    return s;
+}
+
+// Answer the aggregator's clock probes, through the stream (see
+// CTraceRelay.h). If it goes away, there's nowhere left to write to.
+static void listenForProbes()
+{
+    static ClockProbe probes[64];
+    static size_t bufferedBytes;
+    probeNotifier = new QSocketNotifier(forwardSocket, QSocketNotifier::Read);
+    QObject::connect(probeNotifier, &QSocketNotifier::activated, []() {
+        char *data = reinterpret_cast<char*>(probes);
+        ssize_t len = ::read(forwardSocket, data + bufferedBytes, sizeof(probes) - bufferedBytes);
+        if (len <= 0) {
+            qWarning() << "The aggregator closed the connection";
+            qApp->exit(-1);
+            return;
+        }
+        uint64_t now = monotonicMicroseconds();
+        bufferedBytes += len;
+        size_t count = bufferedBytes / sizeof(ClockProbe);
+        for (size_t i = 0; i < count && traceOutput; ++i)
+            static_cast<BinaryTraceOutput*>(traceOutput)->writeClockSync(probes[i].time, now);
+        bufferedBytes -= count * sizeof(ClockProbe);
+        memmove(data, data + count * sizeof(ClockProbe), bufferedBytes);
+        if (traceOutput)
+            traceOutput->flush();
+    });
+}
+
+// A tracectl connection. Each command is a line of text, and the reply is any
+// number of lines of text, then "ok" or "error <why>".
+class TraceController : public QObject
 {
     Q_OBJECT
 
 public:
-    TraceClient(int f)
-        : fd(f), ptr(nullptr), remainingChunkSize(0)
+    TraceController(int f)
+        : fd(f)
     {
-        qInfo() << "New process connected on " << fd;
     }
 
-    ~TraceClient()
+    ~TraceController()
     {
-        qInfo() << "Process disconnected on " << fd;
+        waitingForWindow.erase(std::remove(waitingForWindow.begin(), waitingForWindow.end(), this),
+                               waitingForWindow.end());
         close(fd);
     }
 
     int fd;
-    QByteArray buf;
+
+    // Answer the triggers that were waiting for the window to be written.
+    static void windowWritten(const std::string &path, uint64_t droppedBytes);
 
 public slots:
-    void readControlSocket();
+    void readSocket();
+
 private:
-    bool advanceChunk(size_t len);
-    bool processChunk(const char *name);
-    const char *getString(uint64_t id);
+    void runCommand(const std::string &command, const std::string &args);
+    void reply(const std::string &text);
 
-    std::unordered_map<uint64_t, std::string> registeredStrings;
+    // Read but not yet run.
+    std::string buffer;
 
-    // Only valid while processing a chunk.
-    char *ptr;
-    size_t remainingChunkSize;
+    static std::vector<TraceController*> waitingForWindow;
 };
 
-const char *TraceClient::getString(uint64_t id)
+std::vector<TraceController*> TraceController::waitingForWindow;
+
+void TraceController::windowWritten(const std::string &path, uint64_t droppedBytes)
 {
-    auto it = registeredStrings.find(id);
-    if (it == registeredStrings.end()) {
-        return 0;
+    std::vector<TraceController*> waiting;
+    waiting.swap(waitingForWindow);
+    for (TraceController *tc : waiting) {
+        if (droppedBytes) {
+            tc->reply("error wrote " + path + ", but the output couldn't keep up, and " +
+                      std::to_string(droppedBytes) + " bytes of it were dropped");
+        } else {
+            tc->reply("wrote " + path);
+            tc->reply("ok");
+        }
     }
-
-    return it->second.c_str();
 }
 
-bool TraceClient::advanceChunk(size_t len)
+static void windowWritten(const std::string &path, uint64_t droppedBytes)
 {
-    assert(len > 0);
-    assert(len <= remainingChunkSize);
+    if (droppedBytes)
+        qWarning() << "Wrote window to" << path.c_str() << "but dropped" << droppedBytes << "bytes of it";
+    else
+        qInfo() << "Wrote window to" << path.c_str();
+    TraceController::windowWritten(path, droppedBytes);
+}
 
-    if (len > remainingChunkSize) {
-        qWarning() << "Advanced chunk too far for client " << this->fd;
+void TraceController::reply(const std::string &text)
+{
+    std::string line = text + "\n";
+    if (write(this->fd, line.data(), line.size()) != (ssize_t)line.size())
         this->deleteLater();
-        return false;
-    }
-
-    ptr += len;
-    remainingChunkSize -= len;
-    return true;
 }
 
-// ### this function should become a little more robust and less sloppy.
-// * change asserts into runtime checks too
-// * remove abort calls, instead, clean up safely and disconnect the client.
-bool TraceClient::processChunk(const char *name)
+void TraceController::runCommand(const std::string &command, const std::string &args)
 {
-    int shm_fd;
-    char *initialPtr;
-
-    shm_fd = shm_open(name, O_RDONLY, S_IRUSR | S_IWUSR);
-    if (shm_fd == -1) {
-        qWarning() << "shm_open: " << name << strerror(errno);
-        return false;
-    }
-
-    // Immediately unlink
-    if (shm_unlink(name) == -1) {
-        qWarning() << "shm_unlink: " << strerror(errno);
-        abort();
-    }
-
-    remainingChunkSize = ShmChunkSize;
-    initialPtr = ptr = (char*)mmap(0, ShmChunkSize, PROT_READ, MAP_SHARED, shm_fd, 0);
-    if (ptr == MAP_FAILED) {
-        qWarning() << "mmap: " << strerror(errno);
-        abort();
-    }
-
-    ChunkHeader *h = (ChunkHeader*)ptr;
-    const uint64_t processEpoch = h->epoch;
-    if (!advanceChunk(sizeof(ChunkHeader)))
-        goto out;
-
-    assert(h->magic == TRACED_PROTOCOL_MAGIC);
-    assert(h->version == TRACED_PROTOCOL_VERSION);
-
-    if (h->magic != TRACED_PROTOCOL_MAGIC || h->version != TRACED_PROTOCOL_VERSION) {
-        qWarning() << "malformed chunk! magic " << h->magic
-                   << " version " << h->version
-                   << " epoch " << h->epoch;
-        munmap(initialPtr, ShmChunkSize);
-        return true;
-    }
+    char line[256];
 
-    while (remainingChunkSize) {
-        MessageType mtype = (MessageType)*ptr;
-        switch (mtype) {
-        case MessageType::RegisterStringMessage: {
-            // String registration
-            assert(remainingChunkSize >= sizeof(RegisterStringMessage)); // can we read the header?
-            RegisterStringMessage *m = (RegisterStringMessage*)ptr;
-            assert(remainingChunkSize >= sizeof(RegisterStringMessage) + m->length); // and the whole string?
-            std::string s(&m->stringData, m->length);
-            registeredStrings[m->id] = s;
-            if (!advanceChunk(sizeof(RegisterStringMessage) + m->length))
-                goto out;
-            break;
+    if (command == "start") {
+        if (traceWindow) {
+            reply("error traced is keeping a window (-W); use trigger to write it");
+            return;
         }
-        case MessageType::BeginMessage: {
-            assert(remainingChunkSize >= sizeof(BeginMessage));
-            BeginMessage *m = (BeginMessage*)ptr;
-            fprintf(traceOutputFile, "{\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"ts\":%llu,\"ph\":\"B\",\"cat\":\"%s\",\"name\":\"%s\"},\n", h->pid, h->tid, processEpoch + m->microseconds, getString(m->categoryId), getString(m->tracepointId));
-            if (!advanceChunk(sizeof(BeginMessage)))
-                goto out;
-            break;
+        if (traceOutput) {
+            reply("error already recording to " + (recordingPath.empty() ? "stdout" : recordingPath));
+            return;
         }
-        case MessageType::EndMessage: {
-            assert(remainingChunkSize >= sizeof(EndMessage));
-            EndMessage *m = (EndMessage*)ptr;
-            fprintf(traceOutputFile, "{\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"ts\":%llu,\"ph\":\"E\",\"cat\":\"%s\",\"name\":\"%s\"},\n", h->pid, h->tid, processEpoch + m->microseconds, getString(m->categoryId), getString(m->tracepointId));
-            if (!advanceChunk(sizeof(EndMessage)))
-                goto out;
-            break;
+        if (args.empty()) {
+            reply("error start needs an output file");
+            return;
         }
-        case MessageType::DurationMessage: {
-            assert(remainingChunkSize >= sizeof(DurationMessage));
-            DurationMessage *m = (DurationMessage*)ptr;
-            fprintf(traceOutputFile, "{\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ",\"ts\":%llu,\"dur\":%llu,\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\"},\n", h->pid, h->tid, processEpoch + m->microseconds, m->duration, getString(m->categoryId), getString(m->tracepointId));
-            if (!advanceChunk(sizeof(DurationMessage)))
-                goto out;
-            break;
+        if (!startRecording(args)) {
+            reply("error can't open " + args);
+            return;
         }
-        case MessageType::CounterMessage: {
-            assert(remainingChunkSize >= sizeof(CounterMessage));
-            CounterMessage *m = (CounterMessage*)ptr;
-            fprintf(traceOutputFile, "{\"pid\":%" PRIu64 ",\"ts\":%llu,\"ph\":\"C\",\"cat\":\"%s\",\"name\":\"%s\",\"args\":{\"%s\":%" PRIu64 "}},\n", h->pid, processEpoch + m->microseconds, getString(m->categoryId), getString(m->tracepointId), getString(m->tracepointId), m->value);
-            if (!advanceChunk(sizeof(CounterMessage)))
-                goto out;
-            break;
+        qInfo() << "Recording to" << args.c_str();
+    } else if (command == "stop") {
+        if (!traceOutput || traceWindow) {
+            reply("error not recording");
+            return;
         }
-        case MessageType::CounterMessageWithId: {
-            assert(remainingChunkSize >= sizeof(CounterMessageWithId));
-            CounterMessageWithId *m = (CounterMessageWithId*)ptr;
-            fprintf(traceOutputFile, "{\"pid\":%" PRIu64 ",\"ts\":%llu,\"ph\":\"C\",\"cat\":\"%s\",\"name\":\"%s\",\"id\":%" PRIu64 ",\"args\":{\"%s\":%" PRIu64 "}},\n", h->pid, processEpoch + m->microseconds, getString(m->categoryId), getString(m->tracepointId), m->id, getString(m->tracepointId), m->value);
-            if (!advanceChunk(sizeof(CounterMessageWithId)))
-                goto out;
-            break;
+        stopRecording();
+        qInfo() << "Stopped recording";
+    } else if (command == "categories") {
+        std::vector<std::string> categories;
+        size_t pos = 0;
+        while (pos < args.size()) {
+            size_t end = std::min(args.find(' ', pos), args.size());
+            if (end > pos)
+                categories.push_back(args.substr(pos, end - pos));
+            pos = end + 1;
         }
-        case MessageType::AsyncBeginMessage: {
-            assert(remainingChunkSize >= sizeof(AsyncBeginMessage));
-            AsyncBeginMessage *m = (AsyncBeginMessage*)ptr;
-            fprintf(traceOutputFile, "{\"pid\":%" PRIu64 ",\"ts\":%llu,\"ph\":\"b\",\"cat\":\"%s\",\"name\":\"%s\",\"id\":\"%p\",\"args\":{}},\n", h->pid, processEpoch + m->microseconds, getString(m->categoryId), getString(m->tracepointId), (void*)m->cookie);
-            if (!advanceChunk(sizeof(AsyncBeginMessage)))
-                goto out;
-            break;
+        traceFilter.setCategories(categories);
+    } else if (command == "filter") {
+        std::string error;
+        if (!traceFilter.setExpression(args, error)) {
+            reply("error " + error);
+            return;
         }
-        case MessageType::AsyncEndMessage: {
-            assert(remainingChunkSize >= sizeof(AsyncEndMessage));
-            AsyncEndMessage *m = (AsyncEndMessage*)ptr;
-            fprintf(traceOutputFile, "{\"pid\":%" PRIu64 ",\"ts\":%llu,\"ph\":\"e\",\"cat\":\"%s\",\"name\":\"%s\",\"id\":\"%p\",\"args\":{}},\n", h->pid, processEpoch + m->microseconds, getString(m->categoryId), getString(m->tracepointId), (void*)m->cookie);
-            if (!advanceChunk(sizeof(AsyncEndMessage)))
-                goto out;
-            break;
+    } else if (command == "trigger" && traceWindow) {
+        if (!windowWritingPath.empty()) {
+            reply("error already writing the window to " + windowWritingPath);
+            return;
         }
-        case MessageType::NoMessage:
-            goto out;
-            break;
-        default:
-            qWarning() << "Unknown token " << (uint)mtype;
-            this->deleteLater();
-            goto out;
-            break;
+        if (startWritingWindow().empty()) {
+            reply("error can't write " + windowPath);
+            return;
+        }
+        // Answered once it's all written.
+        waitingForWindow.push_back(this);
+        return;
+    } else if (command == "trigger") {
+        if (!traceOutput) {
+            reply("error not recording");
+            return;
+        }
+        if (!isSegmented()) {
+            reply("error trigger needs a segmented trace (-S or -T), or a window (-W)");
+            return;
+        }
+        rotateOutput();
+    } else if (command == "report") {
+        if (!traceStatistics) {
+            reply("error traced isn't keeping statistics (see -R)");
+            return;
+        }
+        std::string report = traceStatistics->report();
+        size_t pos = 0;
+        while (pos < report.size()) {
+            size_t end = report.find('\n', pos);
+            reply(report.substr(pos, end - pos));
+            pos = end + 1;
+        }
+    } else if (command == "status") {
+        if (traceWindow) {
+            snprintf(line, sizeof(line), "recording: window of %" PRIu64 " events (%zu MB, %" PRIu64 " evicted for memory)",
+                     traceWindow->events(), traceWindow->bytes() / (1024 * 1024), traceWindow->evictedEvents());
+            reply(line);
+        } else {
+            reply("recording: " + (traceOutput ? (recordingPath.empty() ? "stdout" : recordingPath) : std::string("no")));
         }
+        reply(std::string("format: ") + formatName(recordingOptions.format) + (rawCapture ? " (raw)" : ""));
+        std::string filter = traceFilter.expression();
+        reply("filter: " + (filter.empty() ? std::string("none") : filter));
+        snprintf(line, sizeof(line), "clients: %d", TraceClient::count);
+        reply(line);
+        snprintf(line, sizeof(line), "chunks: %" PRIu64 " (%" PRIu64 "/s)", traceStats.chunks, traceStats.chunkRate);
+        reply(line);
+        snprintf(line, sizeof(line), "bytes: %" PRIu64 " (%" PRIu64 "/s)", traceStats.bytes, traceStats.byteRate);
+        reply(line);
+        snprintf(line, sizeof(line), "dropped: %" PRIu64 " bytes, %" PRIu64 " chunks",
+                 droppedOutputBytes(), traceStats.lostChunks);
+        reply(line);
+        snprintf(line, sizeof(line), "decode lag: %" PRIu64 " us (max %" PRIu64 " us)",
+                 traceStats.decodeLag, traceStats.maxDecodeLag);
+        reply(line);
+        for (RelayConnection *rc : RelayConnection::all) {
+            const RelayedStream &stream = rc->stream;
+            snprintf(line, sizeof(line), "host: %s (pids from %" PRIu64 ", clock offset %" PRId64 " +/- %" PRIu64 " us, %" PRIu64 " events)",
+                     stream.hostName().empty() ? "?" : stream.hostName().c_str(), stream.pidBase(),
+                     stream.clockOffset(), stream.roundTrip() / 2, stream.events());
+            reply(line);
+        }
+        reply(std::string("clients tracing: ") + (loadShedder ? LoadShedder::levelName(loadShedder->level()) : "everything (--shed 0)"));
+    } else {
+        reply("error unknown command " + command);
+        return;
     }
+    reply("ok");
+}
 
-#if 0
-            fprintf(traceOutputFile, 
-            "{\"pid\":%" PRIu64 ",\"tid\":0,\"ts\":%llu,\"ph\":\"v\",\"cat\":\"%s\",\"name\":\"periodic_interval\",\"args\":{\"dumps\":{\"allocators\":{", h->pid, processEpoch + m->microseconds, getString(m->categoryId));
-                fprintf(traceOutputFile, "\"RootCategory\":{\"attrs\":{\"size\":{\"type\":\"scalar\",\"units\":\"bytes\",\"value\":\"%06x\"}},\"guid\":\"801c8c513b1eb102\"},", rand());
-                fprintf(traceOutputFile, "\"AnotherRootCategory\":{\"attrs\":{\"size\":{\"type\":\"scalar\",\"units\":\"bytes\",\"value\":\"%06x\"}},\"guid\":\"801c8c513b1eb102\"},", rand());
-                fprintf(traceOutputFile, "\"AnotherRootCategory/SubCategory\":{\"attrs\":{\"size\":{\"type\":\"scalar\",\"units\":\"bytes\",\"value\":\"%06x\"}},\"guid\":\"806a715752927f85\"}", rand());
-            fprintf(traceOutputFile, "},");
-            fprintf(traceOutputFile, "\"allocators_graph\":[{\"importance\":0,\"source\":\"ded2e1173e7b598\",\"target\":\"95abf146875695a7\",\"type\":\"ownership\"},{\"importance\":0,\"source\":\"842bb4d00b4c8889\",\"target\":\"8cc156f029476744\",\"type\":\"ownership\"},{\"importance\":0,\"source\":\"993000ebdb6eae1d\",\"target\":\"587fda87208d4e6c\",\"type\":\"ownership\"}]");
-            fprintf(traceOutputFile, ",\"level_of_detail\":\"light\",");
-            fprintf(traceOutputFile, "\"process_totals\":{\"resident_set_bytes\":\"%d\"}}},\"tts\":681796,\"id\":\"%p\"},", rand(), (void*)rand());
+void TraceController::readSocket()
+{
+    char data[1024];
+    ssize_t len = ::read(this->fd, data, sizeof(data));
+    if (len <= 0) {
+        this->deleteLater();
+        return;
+    }
+    buffer.append(data, len);
 
-#endif
-    fflush(traceOutputFile);
+    size_t end;
+    while ((end = buffer.find('\n')) != std::string::npos) {
+        std::string line = buffer.substr(0, end);
+        buffer.erase(0, end + 1);
+        size_t space = std::min(line.find(' '), line.size());
+        runCommand(line.substr(0, space), space < line.size() ? line.substr(space + 1) : std::string());
+    }
 
-out:
-    munmap(initialPtr, ShmChunkSize);
-    close(shm_fd);
+    if (buffer.size() > 4096) {
+        reply("error command too long");
+        this->deleteLater();
+    }
+}
 
-    return true;
+static void listenForControl(const char *socketPath)
+{
+    int s = listenOn(socketPath);
+    QObject::connect(new QSocketNotifier(s, QSocketNotifier::Read),
+        &QSocketNotifier::activated, [s]() {
+        int client = accept(s, NULL, NULL);
+        if (client == -1)
+            return;
+
+        TraceController *tc = new TraceController(client);
+        QSocketNotifier *csn = new QSocketNotifier(client, QSocketNotifier::Read);
+        csn->setParent(tc);
+        QObject::connect(csn,
+            &QSocketNotifier::activated, tc, &TraceController::readSocket);
+    });
 }
 
-void TraceClient::readControlSocket()
+// A connection on the subscriber socket. The subscriber sends one line
+// saying what it wants (see TraceSubscriber::create()), we reply with "ok"
+// or "error <why>", and then stream events to it until it goes away, or
+// can't keep up.
+class SubscriberConnection : public QObject
+{
+    Q_OBJECT
+
+public:
+    SubscriberConnection(int f)
+        : fd(f), subscriber(nullptr)
+    {
+        connections.push_back(this);
+    }
+
+    ~SubscriberConnection()
+    {
+        drop();
+        connections.erase(std::find(connections.begin(), connections.end(), this));
+        close(fd);
+    }
+
+    // Stop sending events.
+    void drop()
+    {
+        if (!subscriber)
+            return;
+        traceSubscribers.remove(subscriber);
+        delete subscriber;
+        subscriber = nullptr;
+    }
+
+    int fd;
+    TraceSubscriber *subscriber;
+    static std::vector<SubscriberConnection*> connections;
+
+public slots:
+    void readSocket();
+
+private:
+    std::string request;
+};
+
+std::vector<SubscriberConnection*> SubscriberConnection::connections;
+
+void SubscriberConnection::readSocket()
 {
-    int lcmd;
-    char cmd[1024];
+    char data[1024];
+    ssize_t len = ::read(this->fd, data, sizeof(data));
+    if (len <= 0) {
+        this->deleteLater();
+        return;
+    }
+    if (subscriber)
+        return; // nothing more to say
+
+    request.append(data, len);
+    size_t end = request.find('\n');
+    if (end == std::string::npos) {
+        if (request.size() > 4096)
+            this->deleteLater();
+        return;
+    }
+    request.resize(end);
 
-    if ((lcmd = ::read(this->fd, cmd, sizeof(cmd)-1)) <= 0) {
+    std::string error;
+    subscriber = TraceSubscriber::create(this->fd, request, traceStrings, error);
+    std::string reply = subscriber ? std::string("ok\n") : "error " + error + "\n";
+    if (write(this->fd, reply.data(), reply.size()) != (ssize_t)reply.size() || !subscriber) {
         this->deleteLater();
         return;
     }
 
-    buf += QByteArray(cmd, lcmd);
-    QList<QByteArray> bufs = buf.split('\n');
-    for (const QByteArray &abuf : bufs) {
-        if (abuf.isEmpty()) {
-            buf = "";
-            break;
-        }
-        qDebug() << "Trying chunk "  << abuf;
-        if (!processChunk(abuf.constData())) {
-            // segment got eaten out from under us perhaps
-            continue;
+    qInfo() << "New subscriber on " << fd << ": " << request.c_str();
+    traceSubscribers.add(subscriber);
+}
+
+static void flushSubscribers()
+{
+    for (SubscriberConnection *c : SubscriberConnection::connections) {
+        if (c->subscriber && !c->subscriber->flush()) {
+            qWarning() << "Subscriber " << c->fd << " can't keep up; dropping it";
+            c->drop();
+            c->deleteLater();
         }
-        qDebug() << "Done chunk " << abuf;
     }
 }
 
+static void listenForSubscribers(const char *socketPath)
+{
+    int s = listenOn(socketPath);
+    QObject::connect(new QSocketNotifier(s, QSocketNotifier::Read),
+        &QSocketNotifier::activated, [s]() {
+        int client = accept(s, NULL, NULL);
+        if (client == -1)
+            return;
+
+        SubscriberConnection *sc = new SubscriberConnection(client);
+        QSocketNotifier *csn = new QSocketNotifier(client, QSocketNotifier::Read);
+        csn->setParent(sc);
+        QObject::connect(csn,
+            &QSocketNotifier::activated, sc, &SubscriberConnection::readSocket);
+    });
+}
+
 void sigintHandler(int signo)
 {
-    assert(signo == SIGINT);
+    assert(signo == SIGINT || signo == SIGTERM);
     // Force a normal exit so we flush the file
     qApp->exit();
 }
 
+// SIGUSR1 writes the window (-W). That can't be done from a signal handler,
+// so it's passed on to the event loop through a pipe.
+static int windowSignalPipe[2];
+
+void sigusr1Handler(int signo)
+{
+    assert(signo == SIGUSR1);
+    char c = 0;
+    if (write(windowSignalPipe[1], &c, 1) != 1) {
+        // Already one pending.
+    }
+}
+
+static void listenForWindowSignal()
+{
+    if (pipe(windowSignalPipe) == -1) {
+        perror("Can't create signal pipe");
+        exit(-1);
+    }
+    fcntl(windowSignalPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(windowSignalPipe[1], F_SETFL, O_NONBLOCK);
+
+    QObject::connect(new QSocketNotifier(windowSignalPipe[0], QSocketNotifier::Read),
+        &QSocketNotifier::activated, []() {
+        char buf[64];
+        while (read(windowSignalPipe[0], buf, sizeof(buf)) > 0) {
+        }
+        if (!windowWritingPath.empty())
+            qWarning() << "Already writing the window to" << windowWritingPath.c_str();
+        else if (startWritingWindow().empty())
+            qWarning() << "Can't write window to" << windowPath.c_str();
+    });
+
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = &sigusr1Handler;
+    act.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &act, NULL);
+}
+
 // Experimental.
 //#define USE_ATRACE
 
+// How much memory the window (-W) may use by default, in MB.
+static const int DefaultWindowMemory = 256;
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    fprintf(stderr, "  -o, --output <file>    write the trace to <file> (default: stdout)\n");
+    fprintf(stderr, "  -f, --format <format>  trace format: json (default), perfetto,\n"
+                    "                         binary (readable even if traced is killed), or\n"
+                    "                         store (indexed, for tracequery)\n");
+    fprintf(stderr, "  -z, --compress         compress the trace (%s)\n",
+            TraceCompressor::formatName(TraceCompressor::bestFormat()));
+    fprintf(stderr, "  -w, --sort-window <ms> write events in timestamp order, holding them\n"
+                    "                         back for up to <ms> to do so (default: off)\n");
+    fprintf(stderr, "  -S, --segment-size <MB>\n"
+                    "                         split the trace into files of about <MB> each\n");
+    fprintf(stderr, "  -T, --segment-time <seconds>\n"
+                    "                         split the trace into files of <seconds> each\n");
+    fprintf(stderr, "  -k, --keep-segments <n>\n"
+                    "                         only keep the newest <n> files (default: all)\n");
+    fprintf(stderr, "  -H, --shard <n>        write each <n> processes to a separate file, with\n"
+                    "                         a manifest listing them (1 for one per process;\n"
+                    "                         each open file has a thread and 4MB of buffers)\n");
+    fprintf(stderr, "  -D, --direct           write the trace with direct I/O, bypassing the\n"
+                    "                         page cache\n");
+    fprintf(stderr, "  -P, --preallocate <MB> reserve disk space for the trace up front\n"
+                    "                         (default: the segment size, with -S)\n");
+    fprintf(stderr, "  -s, --socket <path>    listen for clients on <path> (default: $%s\n"
+                    "                         or %s)\n", TRACED_SOCKET_ENV, TRACED_SOCKET_PATH);
+    fprintf(stderr, "  -m, --string-memory <MB>\n"
+                    "                         stop accepting new event names past <MB> (default: %zu)\n",
+            stringLimits.maxTotalBytes / (1024 * 1024));
+    fprintf(stderr, "  -i, --input <file>     convert a binary trace (- for stdin) to the\n"
+                    "                         output format, instead of tracing\n");
+    fprintf(stderr, "  -r, --raw              store chunks as clients wrote them, and decode\n"
+                    "                         them later with -i (implies -f binary)\n");
+    fprintf(stderr, "  -F, --filter <expr>    only record events matching <expr>, such as\n"
+                    "                         \"proc=myapp cat=gfx* name=Foo::* mindur=100\"\n");
+    fprintf(stderr, "  -W, --window <seconds> keep only the last <seconds> of events in\n"
+                    "                         memory, and write them to a new trace named\n"
+                    "                         after -o on SIGUSR1 or tracectl trigger\n");
+    fprintf(stderr, "  -M, --window-memory <MB>\n"
+                    "                         keep at most <MB> of events in the window\n"
+                    "                         (default: %d)\n", DefaultWindowMemory);
+    fprintf(stderr, "  -X, --forward <host:port>\n"
+                    "                         send the trace (binary, or raw with --raw) to\n"
+                    "                         the traced at <host:port> instead of to a file\n");
+    fprintf(stderr, "  -I, --host-name <name> with -X, what to call this host (default: its\n"
+                    "                         hostname)\n");
+    fprintf(stderr, "  -A, --aggregate [<address>:]<port>\n"
+                    "                         take in traces forwarded from other hosts on\n"
+                    "                         TCP <port>, and merge them into ours; only on\n"
+                    "                         loopback, unless <address> is given (up to %zu\n"
+                    "                         hosts at once)\n", MaxRelayConnections);
+    fprintf(stderr, "  -L, --shed <ms>        when decoding falls <ms> behind, have clients\n"
+                    "                         sample events, then trace only priority\n"
+                    "                         categories, then stop, until it catches up\n"
+                    "                         (default: never, so traced falls behind instead)\n");
+    fprintf(stderr, "  -C, --priority <categories>\n"
+                    "                         comma separated categories to keep tracing for\n"
+                    "                         longest when shedding load\n");
+    fprintf(stderr, "  -n, --idle             don't record until told to by tracectl\n");
+    fprintf(stderr, "  -B, --keep-begin-end   write slices as separate begin and end events,\n"
+                    "                         rather than one complete event (binary always does)\n");
+    fprintf(stderr, "  -R, --report <file>    keep per-tracepoint statistics, and write them\n"
+                    "                         to <file> (- for stderr) at exit\n");
+    fprintf(stderr, "  -N, --slowest <n>      with -R, also list the <n> slowest instances\n"
+                    "                         of each tracepoint\n");
+    fprintf(stderr, "  -h, --help             show this help\n");
+}
+
 int main(int argc, char **argv) 
 {
-    // Unlink all chunks on startup to prevent leaks.
-    for (int i = 0; i < TRACED_MAX_SHM_CHUNKS; ++i) {
-        char buf[1024];
-        sprintf(buf, "tracechunk-%d", i);
-        shm_unlink(buf);
-    }
+    overflowStringId = traceStrings.intern(OverflowString, sizeof(OverflowString) - 1);
+    sessionChunkPrefix = TRACED_SHM_PREFIX "-" + std::to_string(getuid()) + "-" + std::to_string(getpid());
+    removeLeftoverChunks();
 
     struct sigaction act;
+    memset(&act, 0, sizeof(act));
     act.sa_handler = &sigintHandler;
     sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+
+    // Don't die if we're writing to a pipe and the reader goes away: the
+    // write fails instead, and we get to exit normally.
+    signal(SIGPIPE, SIG_IGN);
 
     QCoreApplication app(argc, argv);
 
@@ -341,79 +1727,414 @@ int main(int argc, char **argv)
 #endif // USE_ATRACE
 
     traceOutputFile = stdout;
+    TraceFormat format = TraceFormat::Json;
+    TraceCompressor::Format compression = TraceCompressor::NoCompression;
+    int sortWindow = 0;
+    const char *outputPath = nullptr;
+    const char *inputPath = nullptr;
+    bool idle = false;
+    bool keepBeginEnd = false;
+    const char *reportPath = nullptr;
+    int slowest = 0;
+    const char *filter = nullptr;
+    int windowSeconds = 0;
+    int processesPerShard = 0;
+    size_t windowMemory = DefaultWindowMemory * 1024 * 1024;
+    int shedThreshold = 0;
+    const char *priorityCategories = nullptr;
+    const char *forwardAddress = nullptr;
+    const char *hostName = nullptr;
+    const char *aggregateAddress = nullptr;
+    const char *socketPath = getenv(TRACED_SOCKET_ENV);
+    if (!socketPath || !*socketPath)
+        socketPath = TRACED_SOCKET_PATH;
+    TraceSegmentOptions segments;
+    TraceFileOptions fileOptions;
+
+    static const struct option longOptions[] = {
+        { "output", required_argument, 0, 'o' },
+        { "format", required_argument, 0, 'f' },
+        { "compress", no_argument, 0, 'z' },
+        { "sort-window", required_argument, 0, 'w' },
+        { "segment-size", required_argument, 0, 'S' },
+        { "segment-time", required_argument, 0, 'T' },
+        { "keep-segments", required_argument, 0, 'k' },
+        { "shard", required_argument, 0, 'H' },
+        { "direct", no_argument, 0, 'D' },
+        { "preallocate", required_argument, 0, 'P' },
+        { "socket", required_argument, 0, 's' },
+        { "string-memory", required_argument, 0, 'm' },
+        { "input", required_argument, 0, 'i' },
+        { "raw", no_argument, 0, 'r' },
+        { "filter", required_argument, 0, 'F' },
+        { "window", required_argument, 0, 'W' },
+        { "window-memory", required_argument, 0, 'M' },
+        { "forward", required_argument, 0, 'X' },
+        { "host-name", required_argument, 0, 'I' },
+        { "aggregate", required_argument, 0, 'A' },
+        { "shed", required_argument, 0, 'L' },
+        { "priority", required_argument, 0, 'C' },
+        { "idle", no_argument, 0, 'n' },
+        { "keep-begin-end", no_argument, 0, 'B' },
+        { "report", required_argument, 0, 'R' },
+        { "slowest", required_argument, 0, 'N' },
+        { "help", no_argument, 0, 'h' },
+        { 0, 0, 0, 0 }
+    };
 
-    for (int i = 0; i < argc; ++i) {
-        if (strcmp(argv[i], "-o")  == 0 && i < argc - 1) {
-            traceOutputFile = fopen(argv[i+1], "w");
-            if (traceOutputFile == NULL) {
-                perror("Can't open trace file");
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:f:zw:S:T:k:H:DP:s:m:i:rF:W:M:X:I:A:L:C:nBR:N:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'o':
+            outputPath = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                format = TraceFormat::Json;
+            } else if (strcmp(optarg, "perfetto") == 0) {
+                format = TraceFormat::Perfetto;
+            } else if (strcmp(optarg, "binary") == 0) {
+                format = TraceFormat::Binary;
+            } else if (strcmp(optarg, "store") == 0) {
+                format = TraceFormat::Store;
+            } else {
+                fprintf(stderr, "Unknown trace format: %s\n", optarg);
+                usage(argv[0]);
+                exit(-1);
+            }
+            break;
+        case 'z':
+            compression = TraceCompressor::bestFormat();
+            if (compression == TraceCompressor::NoCompression) {
+                fprintf(stderr, "traced was built without compression support\n");
+                exit(-1);
+            }
+            break;
+        case 'w':
+            sortWindow = atoi(optarg);
+            if (sortWindow <= 0) {
+                fprintf(stderr, "Invalid sort window: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'S':
+            segments.maxBytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'T':
+            segments.maxSeconds = atoi(optarg);
+            break;
+        case 'k':
+            segments.keep = atoi(optarg);
+            break;
+        case 'H':
+            processesPerShard = atoi(optarg);
+            if (processesPerShard <= 0) {
+                fprintf(stderr, "Invalid shard size: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'D':
+            fileOptions.direct = true;
+            break;
+        case 'P':
+            fileOptions.preallocate = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 's':
+            socketPath = optarg;
+            break;
+        case 'm':
+            stringLimits.maxTotalBytes = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'i':
+            inputPath = optarg;
+            convertingRecords = true;
+            break;
+        case 'r':
+            rawCapture = true;
+            break;
+        case 'F':
+            filter = optarg;
+            break;
+        case 'W':
+            windowSeconds = atoi(optarg);
+            if (windowSeconds <= 0) {
+                fprintf(stderr, "Invalid window: %s\n", optarg);
+                exit(-1);
+            }
+            break;
+        case 'M':
+            windowMemory = strtoull(optarg, NULL, 10) * 1024 * 1024;
+            break;
+        case 'X':
+            forwardAddress = optarg;
+            break;
+        case 'I':
+            hostName = optarg;
+            break;
+        case 'A':
+        {
+            std::string host, port;
+            int number = splitAddress(optarg, host, port) ? atoi(port.c_str()) : 0;
+            if (number <= 0 || number > 65535) {
+                fprintf(stderr, "Invalid port: %s\n", optarg);
+                exit(-1);
+            }
+            aggregateAddress = optarg;
+            break;
+        }
+        case 'L':
+            shedThreshold = atoi(optarg);
+            if (shedThreshold < 0) {
+                fprintf(stderr, "Invalid shedding threshold: %s\n", optarg);
                 exit(-1);
             }
+            break;
+        case 'C':
+            priorityCategories = optarg;
+            break;
+        case 'n':
+            idle = true;
+            break;
+        case 'B':
+            keepBeginEnd = true;
+            break;
+        case 'R':
+            reportPath = optarg;
+            break;
+        case 'N':
+            slowest = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(-1);
         }
     }
 
-    struct sockaddr_un local;
-    int s = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (s == -1) {
-        perror("Can't create socket");
-        abort();
+    if (rawCapture) {
+        if (inputPath || sortWindow || filter) {
+            fprintf(stderr, "--raw can't be used with -i, -w or -F\n");
+            exit(-1);
+        }
+        format = TraceFormat::Binary;
     }
 
-    int optval = 1;
-    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof optval);
+    if (format == TraceFormat::Store && compression != TraceCompressor::NoCompression) {
+        fprintf(stderr, "Stores can't be compressed (-z), as they're read in place\n");
+        exit(-1);
+    }
 
-    local.sun_family = AF_UNIX;
-    strcpy(local.sun_path, "/tmp/traced");
-    unlink(local.sun_path);
-    int len = strlen(local.sun_path) + sizeof(local.sun_family) + 1;
-    if (bind(s, (struct sockaddr *)&local, len) == -1) {
-        perror("Can't bind()");
-        abort();
+    if (filter) {
+        std::string error;
+        if (!traceFilter.setExpression(filter, error)) {
+            fprintf(stderr, "Invalid filter: %s\n", error.c_str());
+            exit(-1);
+        }
     }
 
-    if (listen(s, 5) == -1) {
-        perror("Can't listen");
-        abort();
+    if (idle && inputPath) {
+        fprintf(stderr, "--idle can't be used with -i\n");
+        exit(-1);
     }
 
-    QObject::connect(new QSocketNotifier(s, QSocketNotifier::Read),
-        &QSocketNotifier::activated, [s]() {
-        struct sockaddr_un remote;
-        int len = sizeof(struct sockaddr_un);
-        int client = accept(s, (struct sockaddr*)&remote, (socklen_t *)&len);
-        TraceClient *tc = new TraceClient(client);
-        QSocketNotifier *csn = new QSocketNotifier(client,  QSocketNotifier::Read);
-        csn->setParent(tc);
-        QObject::connect(csn, 
-            &QSocketNotifier::activated, tc, &TraceClient::readControlSocket);
-    });
+    if (processesPerShard) {
+        if (rawCapture || segments.maxBytes || segments.maxSeconds) {
+            fprintf(stderr, "--shard can't be used with --raw, -S or -T\n");
+            exit(-1);
+        }
+        if (!outputPath && !idle) {
+            fprintf(stderr, "--shard needs an output file (-o) to name the shards after\n");
+            exit(-1);
+        }
+    }
+
+    if (windowSeconds) {
+        if (inputPath || rawCapture || idle || segments.maxBytes || segments.maxSeconds) {
+            fprintf(stderr, "--window can't be used with -i, --raw, --idle, -S or -T\n");
+            exit(-1);
+        }
+        if (!outputPath) {
+            fprintf(stderr, "--window needs an output file (-o) to name its traces after\n");
+            exit(-1);
+        }
+    }
+
+    if (forwardAddress) {
+        if (outputPath || inputPath || processesPerShard || windowSeconds || segments.maxBytes || segments.maxSeconds ||
+                compression != TraceCompressor::NoCompression || (format != TraceFormat::Json && format != TraceFormat::Binary)) {
+            fprintf(stderr, "--forward sends binary traces, so can't be used with -o, -i, -f, -z, -H, -W, -S or -T\n");
+            exit(-1);
+        }
+        format = TraceFormat::Binary;
+        forwardSocket = connectToAggregator(forwardAddress);
+        if (forwardSocket == -1)
+            exit(-1);
+        // We find out that the aggregator has gone when we next write to it.
+        signal(SIGPIPE, SIG_IGN);
+
+        char name[256];
+        if (hostName)
+            forwardHostName = hostName;
+        else if (gethostname(name, sizeof(name)) == 0)
+            forwardHostName.assign(name, strnlen(name, sizeof(name)));
+        else
+            forwardHostName = "unknown";
+    }
+
+    if (aggregateAddress && inputPath) {
+        fprintf(stderr, "--aggregate can't be used with -i\n");
+        exit(-1);
+    }
+
+    if (segments.maxBytes || segments.maxSeconds) {
+        if (!outputPath && !idle) {
+            fprintf(stderr, "Splitting the trace into segments needs an output file (-o)\n");
+            exit(-1);
+        }
+        // We know roughly how big each segment will be.
+        if (!fileOptions.preallocate)
+            fileOptions.preallocate = segments.maxBytes;
+    }
+
+    recordingOptions.format = format;
+    recordingOptions.compression = compression;
+    recordingOptions.sortWindow = sortWindow;
+    // The binary format is for capturing everything as it comes, so that
+    // nothing is lost if traced dies.
+    recordingOptions.mergeSlices = !keepBeginEnd && format != TraceFormat::Binary;
+    recordingOptions.processesPerShard = processesPerShard;
+    recordingOptions.segments = segments;
+    recordingOptions.fileOptions = fileOptions;
+    traceSink = &traceSubscribers;
+    if (reportPath) {
+        traceStatistics = new TracepointStatistics(traceSink, traceStrings, std::max(slowest, 0));
+        traceSink = traceStatistics;
+    }
+
+    if (windowSeconds) {
+        traceWindow = new TraceWindow(windowSeconds * 1000000ULL, windowMemory);
+        windowPath = outputPath;
+        traceFilter.setMergingSlices(recordingOptions.mergeSlices);
+        traceFilter.setNext(traceWindow);
+        listenForWindowSignal();
+    } else if (!idle && !startRecording(outputPath ? outputPath : std::string())) {
+        exit(-1);
+    }
+
+    if (segments.maxSeconds) {
+        // Rotate on time even if nothing is being traced.
+        QTimer *rotateTimer = new QTimer;
+        QObject::connect(rotateTimer, &QTimer::timeout, []() {
+            rotateOutputIfNeeded();
+        });
+        rotateTimer->start(1000);
+    }
 
-    fprintf(traceOutputFile, "{\"traceEvents\": [\n");
+    if (sortWindow) {
+        // Don't hold on to events for longer than the window just because no
+        // new chunks are coming in.
+        QTimer *drainTimer = new QTimer;
+        QObject::connect(drainTimer, &QTimer::timeout, []() {
+            if (!traceSorter)
+                return;
+            traceSorter->drain();
+            traceOutput->flush();
+            rotateOutputIfNeeded();
+        });
+        drainTimer->start(std::max(sortWindow / 4, 1));
+    }
+
+    int ret = 0;
+    if (inputPath) {
+        FILE *input = strcmp(inputPath, "-") == 0 ? stdin : fopen(inputPath, "r");
+        if (input == NULL) {
+            perror("Can't open input trace");
+            ret = -1;
+        } else {
+            if (!convertRecords(input))
+                ret = -1;
+            if (input != stdin)
+                fclose(input);
+        }
+    } else {
+        std::string controlPath = std::string(socketPath) + TRACED_CONTROL_SUFFIX;
+        std::string subscribePath = std::string(socketPath) + TRACED_SUBSCRIBE_SUFFIX;
+        listenForClients(socketPath);
+        listenForControl(controlPath.c_str());
+        listenForSubscribers(subscribePath.c_str());
+        if (aggregateAddress)
+            listenForRelays(aggregateAddress);
+        if (forwardSocket != -1)
+            listenForProbes();
+
+        // Raw captures aren't decoded, so we can't tell how far behind we
+        // are; they're for when decoding can't keep up anyway.
+        if (shedThreshold && !rawCapture) {
+            loadShedder = new LoadShedder(shedThreshold * 1000ULL);
+            std::string categories = priorityCategories ? priorityCategories : "";
+            size_t pos = 0;
+            while (pos < categories.size()) {
+                size_t end = std::min(categories.find(',', pos), categories.size());
+                if (end > pos)
+                    priorityCategoryIds.push_back(traceStrings.intern(categories.data() + pos, end - pos));
+                pos = end + 1;
+            }
+            EventFilter::rememberProcessName(getpid());
+        }
 
-    int ret = app.exec();
+        QTimer *statsTimer = new QTimer;
+        QObject::connect(statsTimer, &QTimer::timeout, []() {
+            updateStats();
+            updateLoadShedding();
+            if (traceWindow)
+                traceWindow->trim();
+        });
+        statsTimer->start(1000);
+
+        ret = app.exec();
+        unlink(socketPath);
+        unlink(controlPath.c_str());
+        unlink(subscribePath.c_str());
+        removeLeftoverChunks();
+    }
 
 #if defined(USE_ATRACE)
     if (traceProcess.waitForFinished(-1)) {
         qWarning("Can't stop trace-cmd!");
     }
-#endif
 
-    // Remove trailing , from traceOutputFile (-2 because there's a \n there too).
-    fseek(traceOutputFile, -2, SEEK_CUR);
-    fprintf(traceOutputFile, "]\n");
+    if (format == TraceFormat::Json && traceOutput && !traceShards) {
+        QByteArray out = traceProcess.readAllStandardOutput();
+        out = out.replace("\n", "\\n");
+        static_cast<JsonTraceOutput*>(traceOutput)->setSystemTraceEvents(out.toStdString());
+    }
+#endif
 
-#if defined(USE_ATRACE)
-    QByteArray out = traceProcess.readAllStandardOutput();
-    out = out.replace("\n", "\\n");
+    // Finish writing the window, if we were in the middle of it.
+    while (!windowWritingPath.empty()) {
+        if (!writeWindowBatch())
+            usleep(1000);
+    }
 
-    fprintf(traceOutputFile, ",\"systemTraceEvents\":\"# tracer:\\n");
-    fprintf(traceOutputFile, "%s", out.constData());
-    fprintf(traceOutputFile, "\"\n");
-#endif
+    if (traceOutput)
+        stopRecording();
 
-    fprintf(traceOutputFile, "}\n");
+    if (traceStatistics) {
+        FILE *report = strcmp(reportPath, "-") == 0 ? stderr : fopen(reportPath, "w");
+        if (report == NULL) {
+            perror("Can't write report");
+            ret = -1;
+        } else {
+            std::string text = traceStatistics->report();
+            fwrite(text.data(), 1, text.size(), report);
+            if (report != stderr)
+                fclose(report);
+        }
+        delete traceStatistics;
+    }
 
-    fclose(traceOutputFile);
     return ret;
 }
 
@@ -1,9 +1,54 @@
 CONFIG -= app_bundle
+CONFIG += c++11 thread
 TEMPLATE = app
 TARGET = traced
 INCLUDEPATH += .
 
 linux:LIBS += -lrt
 
+# Output compression (-z): prefer zstd, fall back to zlib.
+CONFIG += link_pkgconfig
+packagesExist(libzstd) {
+    PKGCONFIG += libzstd
+    DEFINES += HAVE_ZSTD
+}
+packagesExist(zlib) {
+    PKGCONFIG += zlib
+    DEFINES += HAVE_ZLIB
+}
+
 # Input
-SOURCES += main.cpp
+HEADERS += CTraceMessages.h \
+           CTraceEvent.h \
+           CTraceStrings.h \
+           CTraceOutput.h \
+           CTraceWriter.h \
+           CTraceSorter.h \
+           CTraceRecords.h \
+           CTraceDecoder.h \
+           CTraceFilter.h \
+           CTraceSubscriber.h \
+           CTraceStatistics.h \
+           CTraceSlices.h \
+           CTraceWindow.h \
+           CTraceShards.h \
+           CTraceShedding.h \
+           CTraceRelay.h \
+           CTraceFile.h \
+           CTraceCompressor.h \
+           CProtoWriter.h
+SOURCES += main.cpp \
+           CTraceStrings.cpp \
+           CTraceOutput.cpp \
+           CTraceWriter.cpp \
+           CTraceFile.cpp \
+           CTraceDecoder.cpp \
+           CTraceFilter.cpp \
+           CTraceSubscriber.cpp \
+           CTraceStatistics.cpp \
+           CTraceSlices.cpp \
+           CTraceWindow.cpp \
+           CTraceShards.cpp \
+           CTraceShedding.cpp \
+           CTraceRelay.cpp \
+           CTraceSorter.cpp
@@ -36,21 +36,40 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <fcntl.h>
+#include <poll.h>
 // MAC
 #include <unistd.h> // syscall()
 #include <sys/syscall.h> // SYS_thread_selfid
 // ENDMAC
 
+#include <algorithm>
 #include <unordered_map>
 
 #include "CSystrace.h"
 #include "CTraceMessages.h"
 
 #include <atomic>
+#include <mutex>
+#include <sched.h>
 
 // Information about SHM chunks
 const int ShmChunkSize = 1024 * 10;
 
+// How many control messages may queue up while one is being sent.
+const int MaxPendingControlMessages = 64;
+
+// CSystraceEvent::m_begin, if the event began while we weren't tracing.
+const uint64_t NotStarted = ~0ULL;
+
+// How many priority categories traced can tell us to keep (see
+// DegradeLevel::PriorityOnly), and how many of its messages naming them by ID
+// we remember.
+const int MaxKeptCategories = 32;
+
+// How deeply nested slices can be for us to remember whether their begin was
+// written (see CTracerThreadData::m_keptSlices).
+const int MaxKeptDepth = 64;
+
 // Data about the process of tracing itself.
 // This is held thread-local.
 struct CTracerThreadData
@@ -68,6 +87,9 @@ struct CTracerThreadData
     // The name of the current SHM chunk
     char *m_currentChunkName = 0;
 
+    // ... and the sequence number it ends with, which is how traced knows it.
+    uint64_t m_currentChunkId = 0;
+
     // How much of the SHM chunk for this thread is left, in bytes?
     int m_remainingChunkSize = 0;
 
@@ -75,30 +97,118 @@ struct CTracerThreadData
     // independently (as it has its own chunks, its own code, and we don't want
     // to lock as much as possible).
     std::unordered_map<const char *, uint64_t> m_registeredStrings;
+
+    // The session that the above belong to (see m_session).
+    uint64_t m_session = 0;
+
+    // This thread's copy of the session's chunk name prefix.
+    char m_chunkPrefix[128];
+
+    // How deeply the current slice is nested, and whether the outermost one
+    // (and so everything in it) is being traced (see slice_begin()).
+    int m_depth = 0;
+    bool m_sampling = true;
+
+    // Counts top level slices and counter updates, to pick which to sample.
+    uint32_t m_sampleCounter = 0;
+
+    // Which of the open slices (bit n for depth n) had their begin written,
+    // so that their end is too, and which didn't, so that theirs isn't:
+    // whatever traced has asked for in between, one without the other is no
+    // use. Slices nested deeper than MaxKeptDepth are decided at each end.
+    uint64_t m_keptSlices = 0;
 };
 
 static thread_local CTracerThreadData tracerThreadData;
 
 // Global data. There are no locks in place, so don't be dumb when using this.
+//
+// Everything here must be constant-initialized: systrace_init() runs as a
+// constructor, possibly before this file's dynamic initializers would.
 struct CTracerGlobalData
 {
-    // FD to communicate with traced
-    int m_traced_fd = -1;
+    // FD to communicate with traced, or -1 if there's no session.
+    std::atomic<int> m_traced_fd { -1 };
+
+    // A socket that traced went away from. It isn't closed until the next
+    // connection attempt, so that other threads that might still be writing
+    // to it can't end up writing to something else that got its fd number.
+    int m_stale_fd = -1;
+
+    // Bumped each time we connect to traced. Threads compare it with their
+    // own to know when to forget the strings and chunk they set up for a
+    // previous session.
+    std::atomic<uint64_t> m_session { 0 };
+
+    // While disconnected: when (in CLOCK_MONOTONIC milliseconds) to next look
+    // for traced.
+    std::atomic<uint64_t> m_nextConnectAttempt { 0 };
+
+    // Set while a thread is looking for traced. That thread owns the two
+    // below: a socket connected to traced that we're waiting on to start the
+    // session, and when (in CLOCK_MONOTONIC milliseconds) we connected it.
+    std::atomic<bool> m_connecting { false };
+    int m_pending_fd = -1;
+    uint64_t m_pendingSince = 0;
+
+    // Set if this process shouldn't ever connect (it's traced itself).
+    bool m_disabled = false;
 
     // Each thread registers unique strings as it comes across them here and sends a
     // registration message to traced.
-    std::atomic<uint64_t> m_currentStringId;
+    // ID 0 is TRACED_OVERFLOW_STRING_ID, so start from 1.
+    std::atomic<uint64_t> m_currentStringId { 1 };
+
+    // Set when traced tells us it won't accept any more strings.
+    std::atomic<bool> m_stringsRefused { false };
+
+    // Set while a thread is reading messages from traced.
+    std::atomic<bool> m_receivingControl { false };
+
+    // How much traced has asked us to cut back (a DegradeLevel).
+    std::atomic<uint16_t> m_degradeLevel { 0 };
+
+    // While Stopped: when (in CLOCK_MONOTONIC milliseconds) to next check
+    // whether traced wants us to start again.
+    std::atomic<uint64_t> m_nextControlPoll { 0 };
+
+    // The categories to keep at PriorityOnly, by string. traced names them
+    // by the IDs we registered them as, but each thread registers its own
+    // (and again for each session), so those go in m_keptCategoryIds as they
+    // arrive (newest over oldest), and the first thread to find its own there
+    // adds the category here, for all of them (see category_kept()). Both are
+    // cleared on connecting.
+    std::atomic<const char *> m_keptCategories[MaxKeptCategories] = {};
+    std::atomic<int> m_keptCategoryCount { 0 };
+    std::atomic<uint64_t> m_keptCategoryIds[MaxKeptCategories] = {};
+    std::atomic<uint64_t> m_keptCategoryIdCount { 0 };
+
+    // Chunk names for this session: the prefix traced gave us, plus our pid.
+    // Only written while m_traced_fd is -1.
+    char m_chunkPrefix[128] = {};
+
+    // Sequence number for the next chunk name.
+    std::atomic<uint64_t> m_nextChunkId { 0 };
+
+    // Control messages waiting to be sent to traced. Whichever thread finds
+    // nobody else sending sends them all at once; everything below is
+    // protected by m_controlMutex.
+    std::mutex m_controlMutex;
+    ControlMessage m_pendingControl[MaxPendingControlMessages] = {};
+    int m_pendingControlCount = 0;
+    bool m_sendingControl = false;
+    uint64_t m_nextControlSequence = 0;
 
     // When the trace started (when systrace_init was called).
     // Do not modify this outside of systrace_init! It is read from multiple
     // threads.
-    struct timespec m_originalTp;
+    struct timespec m_originalTp = {};
 };
 
 static CTracerGlobalData tracerGlobalData;
 
-//gettid(); except that mac sucks
-static int gettid()
+//gettid(); except that mac sucks (and glibc now has its own)
+static int systrace_gettid()
 {
 #ifdef __APPLE__
     return syscall(SYS_thread_selfid);
@@ -107,6 +217,314 @@ static int gettid()
 #endif
 }
 
+static uint64_t getCoarseMilliseconds()
+{
+    struct timespec tp;
+#if defined(CLOCK_MONOTONIC_COARSE)
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &tp);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+#endif
+    return uint64_t(tp.tv_sec) * 1000 + tp.tv_nsec / 1000000;
+}
+
+// How often to look for traced while we aren't connected to it.
+const uint64_t ConnectIntervalMs = 1000;
+
+// Once connected, how often to check whether traced has started the session,
+// and how long to give it.
+const uint64_t SessionPollMs = 10;
+const uint64_t SessionTimeoutMs = 5000;
+
+/*!
+ * End the session on \a fd, if it's still the current one.
+ */
+static void systrace_detach(int fd)
+{
+    if (!tracerGlobalData.m_traced_fd.compare_exchange_strong(fd, -1))
+        return; // someone else got there first
+
+    // Writes from other threads will fail from here on, but don't close it
+    // yet (see m_stale_fd).
+    shutdown(fd, SHUT_RDWR);
+    tracerGlobalData.m_stale_fd = fd;
+    tracerGlobalData.m_degradeLevel = (uint16_t)DegradeLevel::Full;
+    tracerGlobalData.m_nextConnectAttempt = getCoarseMilliseconds() + ConnectIntervalMs;
+}
+
+/*!
+ * Write all of \a data to \a fd. Returns false if we couldn't.
+ */
+static bool send_all(int fd, const void *data, size_t len)
+{
+    const char *p = static_cast<const char*>(data);
+    while (len) {
+        ssize_t ret = send(fd, p, len, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/*!
+ * Send \a m to traced, if \a session is still the current one. Messages
+ * that other threads queue while this is sending are sent in one go after
+ * it, so traced gets them in batches when the chunk rate is high.
+ *
+ * Returns false if \a m couldn't be sent.
+ */
+static bool send_control(ControlMessage m, uint64_t session)
+{
+    std::unique_lock<std::mutex> lock(tracerGlobalData.m_controlMutex);
+    for (;;) {
+        if (session != tracerGlobalData.m_session.load(std::memory_order_acquire) ||
+                tracerGlobalData.m_traced_fd.load(std::memory_order_acquire) == -1)
+            return false;
+        if (tracerGlobalData.m_pendingControlCount < MaxPendingControlMessages)
+            break;
+        // Wait for the sending thread to take the queue.
+        lock.unlock();
+        sched_yield();
+        lock.lock();
+    }
+
+    m.sequence = tracerGlobalData.m_nextControlSequence++;
+    tracerGlobalData.m_pendingControl[tracerGlobalData.m_pendingControlCount++] = m;
+    if (tracerGlobalData.m_sendingControl)
+        return true; // it'll be sent with the rest
+
+    tracerGlobalData.m_sendingControl = true;
+    ControlMessage batch[MaxPendingControlMessages];
+    bool ok = true;
+    while (ok && tracerGlobalData.m_pendingControlCount) {
+        int count = tracerGlobalData.m_pendingControlCount;
+        memcpy(batch, tracerGlobalData.m_pendingControl, count * sizeof(ControlMessage));
+        tracerGlobalData.m_pendingControlCount = 0;
+        int fd = tracerGlobalData.m_traced_fd.load(std::memory_order_acquire);
+        lock.unlock();
+
+        ok = fd != -1 && send_all(fd, batch, count * sizeof(ControlMessage));
+        if (!ok && fd != -1) {
+            // traced has gone away: end the session, and go back to looking
+            // for a new one.
+            systrace_detach(fd);
+        }
+
+        lock.lock();
+    }
+    tracerGlobalData.m_sendingControl = false;
+    return ok;
+}
+
+/*!
+ * Handle any messages traced has sent us, without waiting for them.
+ */
+static void receive_control()
+{
+    if (tracerGlobalData.m_receivingControl.exchange(true))
+        return; // someone else is on it
+
+    int fd = tracerGlobalData.m_traced_fd.load(std::memory_order_acquire);
+    ControlMessage m;
+    while (fd != -1 && recv(fd, &m, sizeof(m), MSG_DONTWAIT | MSG_PEEK) == sizeof(m)) {
+        if (recv(fd, &m, sizeof(m), MSG_DONTWAIT) != sizeof(m))
+            break;
+        switch (m.type) {
+        case ControlMessageType::TooManyStringsMessage:
+            tracerGlobalData.m_stringsRefused = true;
+            break;
+        case ControlMessageType::DegradeMessage:
+            tracerGlobalData.m_degradeLevel.store(m.flags, std::memory_order_relaxed);
+            break;
+        case ControlMessageType::KeepCategoryMessage: {
+            uint64_t count = tracerGlobalData.m_keptCategoryIdCount.load(std::memory_order_relaxed);
+            tracerGlobalData.m_keptCategoryIds[count % MaxKeptCategories].store(m.chunkId, std::memory_order_relaxed);
+            tracerGlobalData.m_keptCategoryIdCount.store(count + 1, std::memory_order_release);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    tracerGlobalData.m_receivingControl = false;
+}
+
+/*!
+ * Connect to traced, without waiting. Returns the socket, or -1 if it isn't
+ * there (or isn't taking connections right now).
+ */
+static int systrace_open_socket()
+{
+    const char *socketPath = getenv(TRACED_SOCKET_ENV);
+    if (!socketPath || !*socketPath)
+        socketPath = TRACED_SOCKET_PATH;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("Can't create socket for traced!");
+        return -1;
+    }
+#if defined(SO_NOSIGPIPE)
+    int optval = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
+#endif
+
+    // A local connect() only blocks when traced's backlog is full, and then
+    // we'd rather look again later.
+    int flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+    struct sockaddr_un remote;
+    remote.sun_family = AF_UNIX;
+    strncpy(remote.sun_path, socketPath, sizeof(remote.sun_path) - 1);
+    remote.sun_path[sizeof(remote.sun_path) - 1] = 0;
+    int len = strlen(remote.sun_path) + sizeof(remote.sun_family) + 1;
+    if (connect(fd, (struct sockaddr *)&remote, len) == -1) {
+        // Not running (yet). That's fine, we'll look again later.
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, flags);
+    return fd;
+}
+
+/*!
+ * Try to start a session with traced, waiting up to \a waitMs for it to say
+ * hello. Returns true if we did.
+ *
+ * This is called from whichever thread happens to be tracing, so unless it's
+ * told to wait, it doesn't: if traced hasn't started the session yet, the
+ * socket is kept, and looked at again on a later call.
+ */
+static bool systrace_connect(int waitMs)
+{
+    if (tracerGlobalData.m_connecting.exchange(true))
+        return false; // someone else is on it
+
+    if (tracerGlobalData.m_stale_fd != -1) {
+        close(tracerGlobalData.m_stale_fd);
+        tracerGlobalData.m_stale_fd = -1;
+    }
+
+    int fd = tracerGlobalData.m_pending_fd;
+    if (fd == -1) {
+        fd = systrace_open_socket();
+        if (fd == -1) {
+            tracerGlobalData.m_connecting = false;
+            return false;
+        }
+        tracerGlobalData.m_pending_fd = fd;
+        tracerGlobalData.m_pendingSince = getCoarseMilliseconds();
+    }
+
+    // traced tells us what to call our chunks. Don't hang around forever
+    // if it doesn't.
+    SessionMessage session;
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    ssize_t received = -1;
+    errno = EAGAIN;
+    if (poll(&pfd, 1, waitMs) == 1)
+        received = recv(fd, &session, sizeof(session), MSG_DONTWAIT | MSG_PEEK);
+    bool waiting = received == -1 ? errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+                                  : received > 0 && received < (ssize_t)sizeof(session);
+    if (waiting && getCoarseMilliseconds() < tracerGlobalData.m_pendingSince + SessionTimeoutMs) {
+        // Not yet.
+        tracerGlobalData.m_nextConnectAttempt = getCoarseMilliseconds() + SessionPollMs;
+        tracerGlobalData.m_connecting = false;
+        return false;
+    }
+    tracerGlobalData.m_pending_fd = -1;
+
+    if (received != sizeof(session) || recv(fd, &session, sizeof(session), MSG_DONTWAIT) != sizeof(session) ||
+            session.magic != TRACED_PROTOCOL_MAGIC || session.version != TRACED_PROTOCOL_VERSION) {
+        fprintf(stderr, "Can't start session with traced (is it the same version?)\n");
+        close(fd);
+        tracerGlobalData.m_connecting = false;
+        return false;
+    }
+    session.chunkPrefix[sizeof(session.chunkPrefix) - 1] = 0;
+    int pid = getpid();
+    snprintf(tracerGlobalData.m_chunkPrefix, sizeof(tracerGlobalData.m_chunkPrefix), "%s-%d",
+             session.chunkPrefix, pid);
+
+    ControlMessage hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.type = ControlMessageType::HelloMessage;
+    hello.chunkId = pid;
+    hello.sequence = 0;
+    if (!send_all(fd, &hello, sizeof(hello))) {
+        close(fd);
+        tracerGlobalData.m_connecting = false;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(tracerGlobalData.m_controlMutex);
+    tracerGlobalData.m_currentStringId = 1;
+    tracerGlobalData.m_stringsRefused = false;
+    tracerGlobalData.m_degradeLevel = (uint16_t)DegradeLevel::Full;
+    tracerGlobalData.m_keptCategoryCount = 0;
+    tracerGlobalData.m_keptCategoryIdCount = 0;
+    tracerGlobalData.m_pendingControlCount = 0;
+    tracerGlobalData.m_nextControlSequence = 1;
+    tracerGlobalData.m_session.fetch_add(1, std::memory_order_release);
+    tracerGlobalData.m_traced_fd.store(fd, std::memory_order_release);
+    tracerGlobalData.m_connecting = false;
+    return true;
+}
+
+/*!
+ * If we aren't connected, and it's time to look for traced again, do so.
+ * Only one thread gets to try at a time.
+ */
+static void systrace_maybe_connect()
+{
+    uint64_t next = tracerGlobalData.m_nextConnectAttempt.load(std::memory_order_relaxed);
+    uint64_t now = getCoarseMilliseconds();
+    if (now < next)
+        return;
+    if (!tracerGlobalData.m_nextConnectAttempt.compare_exchange_strong(next, now + ConnectIntervalMs))
+        return;
+    if (tracerGlobalData.m_traced_fd.load(std::memory_order_acquire) != -1)
+        return;
+
+    systrace_connect(0);
+}
+
+/*!
+ * Throw away this thread's state from a previous session: its chunk (which
+ * that session will never read) and its registered strings.
+ */
+static void systrace_reset_thread()
+{
+    if (tracerThreadData.m_shm_fd != -1) {
+        munmap(tracerThreadData.m_shmInitialPtr, ShmChunkSize);
+        close(tracerThreadData.m_shm_fd);
+        shm_unlink(tracerThreadData.m_currentChunkName);
+        tracerThreadData.m_shm_fd = -1;
+        tracerThreadData.m_shmPtr = 0;
+        tracerThreadData.m_remainingChunkSize = 0;
+    }
+    tracerThreadData.m_registeredStrings.clear();
+
+    // Anything begun in the last session ends there.
+    tracerThreadData.m_keptSlices = 0;
+
+    // Make sure the prefix we copy is the one for the session we think it is.
+    uint64_t session;
+    do {
+        session = tracerGlobalData.m_session.load(std::memory_order_acquire);
+        memcpy(tracerThreadData.m_chunkPrefix, tracerGlobalData.m_chunkPrefix, sizeof(tracerThreadData.m_chunkPrefix));
+    } while (session != tracerGlobalData.m_session.load(std::memory_order_acquire));
+    tracerThreadData.m_session = session;
+}
+
 /*! Update the book keeping for the current position in the chunk.
  */
 static void advance_chunk(int len)
@@ -117,12 +535,13 @@ static void advance_chunk(int len)
 }
 
 /*!
- * Send the current chunk to traced for processing.
+ * Send the current chunk to traced for processing. \a flags is
+ * TRACED_CHUNK_FULL if it's being sent because there's no room left in it.
  *
  * ### right now, this will not be called if a thread terminates abruptly.
  * we should somehow monitor old, stale chunks and force-submit them.
  */
-static void submit_chunk()
+static void submit_chunk(uint16_t flags)
 {
     if (tracerThreadData.m_shm_fd == -1)
         return;
@@ -132,17 +551,17 @@ static void submit_chunk()
     tracerThreadData.m_shm_fd = -1;
     tracerThreadData.m_shmPtr = 0;
 
-    char buf[1024];
-    int blen = sprintf(buf, "%s\n", tracerThreadData.m_currentChunkName);
+    ControlMessage m;
+    memset(&m, 0, sizeof(m));
+    m.type = ControlMessageType::SubmitChunkMessage;
+    m.flags = flags;
+    m.length = ShmChunkSize - tracerThreadData.m_remainingChunkSize;
+    m.chunkId = tracerThreadData.m_currentChunkId;
     if (0) // left for debug purposes
-        printf("TID %d sending %s", gettid(), buf);
-    int ret = write(tracerGlobalData.m_traced_fd, buf, blen);
-    if (ret == -1) {
-        // ### we also need to ignore SIGPIPE or clients will die if traced does.
-        perror("Can't write to traced! Giving up!");
+        printf("TID %d sending %s\n", systrace_gettid(), tracerThreadData.m_currentChunkName);
+    if (!send_control(m, tracerThreadData.m_session)) {
+        // The session this chunk was for is gone.
         shm_unlink(tracerThreadData.m_currentChunkName);
-        close(tracerGlobalData.m_traced_fd);
-        tracerGlobalData.m_traced_fd = -1;
     }
 }
 
@@ -171,7 +590,7 @@ static void systrace_debug()
     static thread_local int lastm_remainingChunkSize = 0;
     if (m_remainingChunkSize != lastm_remainingChunkSize) {
         lastm_remainingChunkSize = m_remainingChunkSize;
-        systrace_record_counter("systrace",  "m_remainingChunkSize",  m_remainingChunkSize, gettid());
+        systrace_record_counter("systrace",  "m_remainingChunkSize",  m_remainingChunkSize, systrace_gettid());
     }
     static uint64_t lastStringCount = 0;
     if (lastStringCount != tracerGlobalData.m_currentStringId.load()) {
@@ -183,113 +602,265 @@ static void systrace_debug()
 }
 
 /*!
- * Make sure we have a valid SHM chunk to write events to, or abort if not.
+ * We couldn't set up a chunk (we're probably out of fds, memory or space in
+ * /dev/shm). Throw away what we have of it, and end the session, rather than
+ * the process: we'll try again when we next connect.
  */
-static void ensure_chunk(int mlen)
+static bool chunk_failed()
+{
+    if (tracerThreadData.m_shm_fd != -1) {
+        close(tracerThreadData.m_shm_fd);
+        shm_unlink(tracerThreadData.m_currentChunkName);
+        tracerThreadData.m_shm_fd = -1;
+    }
+    tracerThreadData.m_shmPtr = 0;
+    tracerThreadData.m_remainingChunkSize = 0;
+
+    int fd = tracerGlobalData.m_traced_fd.load(std::memory_order_acquire);
+    if (fd != -1)
+        systrace_detach(fd);
+    return false;
+}
+
+/*!
+ * Make sure we have a valid SHM chunk to write events to. Returns false (and
+ * ends the session) if we can't, in which case the event is dropped.
+ */
+static bool ensure_chunk(int mlen)
 {
     if (tracerThreadData.m_shm_fd != -1 && tracerThreadData.m_remainingChunkSize >= mlen)
-        return;
+        return true;
 
     if (tracerThreadData.m_shm_fd != -1) {
-        submit_chunk();
+        submit_chunk(TRACED_CHUNK_FULL);
     }
 
-    // ### linux via /dev/shm or memfd_create?
-    int nextShmId = 0;
-    while (tracerThreadData.m_shm_fd == -1 && nextShmId < TRACED_MAX_SHM_CHUNKS) {
-        if (!tracerThreadData.m_currentChunkName)
-            asprintf(&tracerThreadData.m_currentChunkName, "tracechunk-%d", nextShmId++);
+    // A new chunk is a good time to see whether traced wants us to cut back
+    // (or has caught up).
+    receive_control();
 
-        tracerThreadData.m_shm_fd = shm_open(tracerThreadData.m_currentChunkName, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
-        if (tracerThreadData.m_shm_fd != -1) {
-            break; // we won!
-        } else {
-            // try again. either something is using that chunk name, or traced
-            // hasn't released it for us to reuse yet.
-            free(tracerThreadData.m_currentChunkName);
+    // ### linux via /dev/shm or memfd_create?
+    // Names are never reused within a session, so the first one we try should
+    // be free. O_EXCL is just to be sure we aren't handed someone else's.
+    while (tracerThreadData.m_shm_fd == -1) {
+        free(tracerThreadData.m_currentChunkName);
+        tracerThreadData.m_currentChunkName = 0;
+        tracerThreadData.m_currentChunkId = tracerGlobalData.m_nextChunkId.fetch_add(1);
+        if (asprintf(&tracerThreadData.m_currentChunkName, "%s-%llu", tracerThreadData.m_chunkPrefix,
+                     (unsigned long long)tracerThreadData.m_currentChunkId) == -1) {
+            perror("Can't allocate SHM chunk name!");
             tracerThreadData.m_currentChunkName = 0;
+            return chunk_failed();
         }
-    }
 
-    if (tracerThreadData.m_shm_fd == -1) {
-        fprintf(stderr, "Something is seriously screwed. Can't find any free SHM chunk, tried all %d\n", TRACED_MAX_SHM_CHUNKS);
-        abort();
+        tracerThreadData.m_shm_fd = shm_open(tracerThreadData.m_currentChunkName, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+        if (tracerThreadData.m_shm_fd == -1 && errno != EEXIST) {
+            fprintf(stderr, "Can't create SHM chunk %s: %s\n", tracerThreadData.m_currentChunkName, strerror(errno));
+            return chunk_failed();
+        }
     }
 
     if (ftruncate(tracerThreadData.m_shm_fd, ShmChunkSize) == -1) {
         perror("Can't ftruncate SHM!");
-        abort();
+        return chunk_failed();
     }
     tracerThreadData.m_shmPtr = (char*)mmap(0, ShmChunkSize, PROT_READ | PROT_WRITE, MAP_SHARED, tracerThreadData.m_shm_fd, 0);
     if (tracerThreadData.m_shmPtr == MAP_FAILED) {
         perror("Can't map SHM!");
-        abort();
+        return chunk_failed();
     }
+    tracerThreadData.m_shmInitialPtr = tracerThreadData.m_shmPtr;
     tracerThreadData.m_remainingChunkSize = ShmChunkSize;
 
     ChunkHeader *h = (ChunkHeader*)tracerThreadData.m_shmPtr;
     h->magic = TRACED_PROTOCOL_MAGIC;
     h->version = TRACED_PROTOCOL_VERSION;
     h->pid = getpid();
-    h->tid = gettid();
+    h->tid = systrace_gettid();
     h->epoch = (tracerGlobalData.m_originalTp.tv_sec * 1000000) +
                (tracerGlobalData.m_originalTp.tv_nsec / 1000);
     advance_chunk(sizeof(ChunkHeader));
+    return true;
+}
+
+static DegradeLevel degrade_level()
+{
+    return (DegradeLevel)tracerGlobalData.m_degradeLevel.load(std::memory_order_relaxed);
 }
 
 __attribute__((constructor)) void systrace_init()
 {
+    static std::atomic<bool> initialized { false };
+    if (initialized.exchange(true))
+        return;
+
     if (clock_gettime(CLOCK_MONOTONIC, &tracerGlobalData.m_originalTp) == -1) {
         perror("Can't get time");
         abort();
     }
 
     if (getenv("TRACED") == NULL) {
-        tracerGlobalData.m_traced_fd = open("/tmp/traced", O_WRONLY);
-
-        if ((tracerGlobalData.m_traced_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-            perror("Can't create socket for traced!");
-        }
-
-        struct sockaddr_un remote;
-        remote.sun_family = AF_UNIX;
-        strcpy(remote.sun_path, "/tmp/traced");
-        int len = strlen(remote.sun_path) + sizeof(remote.sun_family) + 1;
-        if (connect(tracerGlobalData.m_traced_fd, (struct sockaddr *)&remote, len) == -1) {
-            perror("Can't connect to traced!");
-        }
+        // If traced is already running, start tracing right away (nothing's
+        // being traced yet, so we can wait for it). If not,
+        // systrace_should_trace() keeps looking for it.
+        tracerGlobalData.m_nextConnectAttempt = getCoarseMilliseconds() + ConnectIntervalMs;
+        systrace_connect(SessionTimeoutMs);
     } else {
+        tracerGlobalData.m_disabled = true;
         fprintf(stderr, "Running trace daemon. Not tracing.\n");
     }
 }
 
 __attribute__((destructor)) void systrace_deinit()
 {
-    if (tracerGlobalData.m_traced_fd == -1)
+    tracerGlobalData.m_disabled = true;
+    int fd = tracerGlobalData.m_traced_fd.load();
+    if (fd == -1)
         return;
-    submit_chunk();
-    close(tracerGlobalData.m_traced_fd);
-    tracerGlobalData.m_traced_fd = -1;
+    submit_chunk(0);
+    systrace_detach(fd);
+    close(tracerGlobalData.m_stale_fd);
+    tracerGlobalData.m_stale_fd = -1;
 }
 
 int systrace_should_trace(const char *module)
 {
-    if (tracerGlobalData.m_traced_fd == -1)
-        return 0;
+    if (tracerGlobalData.m_traced_fd.load(std::memory_order_acquire) == -1) {
+        if (tracerGlobalData.m_disabled)
+            return 0;
+        systrace_maybe_connect();
+        if (tracerGlobalData.m_traced_fd.load(std::memory_order_acquire) == -1)
+            return 0;
+    }
+
+    if (tracerThreadData.m_session != tracerGlobalData.m_session.load(std::memory_order_acquire))
+        systrace_reset_thread();
+
+    if (degrade_level() == DegradeLevel::Stopped) {
+        // We aren't writing chunks, so look for traced telling us to start
+        // again every so often.
+        uint64_t next = tracerGlobalData.m_nextControlPoll.load(std::memory_order_relaxed);
+        uint64_t now = getCoarseMilliseconds();
+        if (now >= next && tracerGlobalData.m_nextControlPoll.compare_exchange_strong(next, now + ConnectIntervalMs))
+            receive_control();
+        if (degrade_level() == DegradeLevel::Stopped)
+            return 0;
+    }
+
     // hack this if you want to temporarily omit some traces.
     return 1;
 }
 
+/*!
+ * Whether a slice starting now should be traced, as far as sampling goes.
+ * Each call must be matched by one to slice_end(), whether it's traced or
+ * not, so that we know which slices are top level ones: those decide for
+ * everything nested in them.
+ */
+static bool slice_begin()
+{
+    if (tracerThreadData.m_depth++ == 0) {
+        tracerThreadData.m_sampling = degrade_level() < DegradeLevel::Sampled ||
+                                      tracerThreadData.m_sampleCounter++ % TRACED_SAMPLE_INTERVAL == 0;
+    }
+    return tracerThreadData.m_sampling;
+}
+
+static bool slice_end()
+{
+    if (tracerThreadData.m_depth == 0)
+        return degrade_level() < DegradeLevel::Sampled; // began before we knew
+    --tracerThreadData.m_depth;
+    return tracerThreadData.m_sampling;
+}
+
+/*!
+ * Remember whether the slice slice_begin() just began was written.
+ */
+static void keep_slice(bool kept)
+{
+    int depth = tracerThreadData.m_depth - 1;
+    if (depth >= MaxKeptDepth)
+        return;
+    if (kept)
+        tracerThreadData.m_keptSlices |= 1ULL << depth;
+    else
+        tracerThreadData.m_keptSlices &= ~(1ULL << depth);
+}
+
+/*!
+ * Whether we're still in the session this thread last traced in, so that an
+ * end can follow its begin there.
+ */
+static bool same_session()
+{
+    return tracerGlobalData.m_traced_fd.load(std::memory_order_acquire) != -1 &&
+           tracerThreadData.m_session == tracerGlobalData.m_session.load(std::memory_order_acquire);
+}
+
+/*!
+ * Whether to trace this counter update, as far as sampling goes.
+ */
+static bool sample_counter()
+{
+    return degrade_level() < DegradeLevel::Sampled ||
+           tracerThreadData.m_sampleCounter++ % TRACED_SAMPLE_INTERVAL == 0;
+}
+
+/*!
+ * Whether to trace async slices with this cookie, as far as sampling goes.
+ * Their begins and ends may be on different threads, so it only depends on
+ * the cookie.
+ */
+static bool sample_cookie(const void *cookie)
+{
+    uint64_t hash = (uint64_t)(uintptr_t)cookie * 0x9E3779B97F4A7C15ULL;
+    return degrade_level() < DegradeLevel::Sampled || (hash >> 32) % TRACED_SAMPLE_INTERVAL == 0;
+}
+
+/*!
+ * Whether to trace events in \a category, which this thread registered as
+ * \a categoryId.
+ */
+static bool category_kept(const char *category, uint64_t categoryId)
+{
+    if (degrade_level() < DegradeLevel::PriorityOnly)
+        return true;
+    int count = std::min(tracerGlobalData.m_keptCategoryCount.load(std::memory_order_acquire), MaxKeptCategories);
+    for (int i = 0; i < count; ++i) {
+        if (tracerGlobalData.m_keptCategories[i].load(std::memory_order_relaxed) == category)
+            return true;
+    }
+
+    uint64_t ids = tracerGlobalData.m_keptCategoryIdCount.load(std::memory_order_acquire);
+    for (uint64_t i = ids > MaxKeptCategories ? ids - MaxKeptCategories : 0; i < ids; ++i) {
+        if (tracerGlobalData.m_keptCategoryIds[i % MaxKeptCategories].load(std::memory_order_relaxed) == categoryId) {
+            int slot = tracerGlobalData.m_keptCategoryCount.fetch_add(1, std::memory_order_relaxed);
+            if (slot < MaxKeptCategories)
+                tracerGlobalData.m_keptCategories[slot].store(category, std::memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
 static uint64_t getStringId(const char *string)
 {
     auto it = tracerThreadData.m_registeredStrings.find(string);
     if (it == tracerThreadData.m_registeredStrings.end()) {
+        // New strings are rare enough that this is a good time to check
+        // whether traced still wants them.
+        receive_control();
+        if (tracerGlobalData.m_stringsRefused.load(std::memory_order_relaxed))
+            return TRACED_OVERFLOW_STRING_ID;
+
         uint64_t nid = tracerGlobalData.m_currentStringId.fetch_add(1);
         tracerThreadData.m_registeredStrings[string] = nid;
 
         int slen = strlen(string);
         assert(slen < ShmChunkSize / 100); // 102 characters, assuming 10kb
-        ensure_chunk(sizeof(RegisterStringMessage) + slen);
+        if (!ensure_chunk(sizeof(RegisterStringMessage) + slen))
+            return TRACED_OVERFLOW_STRING_ID;
         RegisterStringMessage *m = (RegisterStringMessage*)tracerThreadData.m_shmPtr;
         m->messageType = MessageType::RegisterStringMessage;
         m->id = nid;
@@ -305,13 +876,16 @@ static uint64_t getStringId(const char *string)
 
 void systrace_duration_begin(const char *module, const char *tracepoint)
 {
-     if (!systrace_should_trace(module))
-         return;
-
-    uint64_t modid = getStringId(module);
+    bool kept = slice_begin() && systrace_should_trace(module);
+    uint64_t modid = kept ? getStringId(module) : 0;
+    kept = kept && category_kept(module, modid);
+    keep_slice(kept);
+    if (!kept)
+        return;
     uint64_t tpid = getStringId(tracepoint);
 
-    ensure_chunk(sizeof(BeginMessage));
+    if (!ensure_chunk(sizeof(BeginMessage)))
+        return;
     BeginMessage *m = (BeginMessage*)tracerThreadData.m_shmPtr;
     m->messageType = MessageType::BeginMessage;
     m->microseconds = getMicroseconds();
@@ -324,13 +898,22 @@ void systrace_duration_begin(const char *module, const char *tracepoint)
 
 void systrace_duration_end(const char *module, const char *tracepoint)
 {
-    if (!systrace_should_trace(module))
+    // Written if the begin was, even if traced has since asked us to stop.
+    int depth = tracerThreadData.m_depth - 1;
+    bool sampled = slice_end();
+    if (depth >= 0 && depth < MaxKeptDepth) {
+        if (!(tracerThreadData.m_keptSlices & (1ULL << depth)) || !same_session())
+            return;
+    } else if (!sampled || !systrace_should_trace(module) || !category_kept(module, getStringId(module))) {
+        // Too deep to remember, or begun before we knew.
         return;
+    }
 
     uint64_t modid = getStringId(module);
     uint64_t tpid = getStringId(tracepoint);
 
-    ensure_chunk(sizeof(EndMessage));
+    if (!ensure_chunk(sizeof(EndMessage)))
+        return;
     EndMessage *m = (EndMessage*)tracerThreadData.m_shmPtr;
     m->messageType = MessageType::EndMessage;
     m->microseconds = getMicroseconds();
@@ -343,8 +926,10 @@ void systrace_duration_end(const char *module, const char *tracepoint)
 
 void systrace_duration_begin(CSystraceEvent &event)
 {
-    if (!systrace_should_trace(event.m_module))
+    if (!slice_begin() || !systrace_should_trace(event.m_module) || !category_kept(event.m_module, getStringId(event.m_module))) {
+        event.m_begin = NotStarted;
         return;
+    }
 
     event.m_begin = getMicroseconds();
     // Do nothing We will write the event on end.
@@ -352,13 +937,17 @@ void systrace_duration_begin(CSystraceEvent &event)
 
 void systrace_duration_end(CSystraceEvent &event)
 {
-    if (!systrace_should_trace(event.m_module))
+    // Whether it's traced was decided when it began, as with the begin and
+    // end above; but a session may have ended in between.
+    slice_end();
+    if (event.m_begin == NotStarted || !same_session())
         return;
 
     uint64_t modid = getStringId(event.m_module);
     uint64_t tpid = getStringId(event.m_tracepoint);
 
-    ensure_chunk(sizeof(DurationMessage));
+    if (!ensure_chunk(sizeof(DurationMessage)))
+        return;
     DurationMessage *m = (DurationMessage*)tracerThreadData.m_shmPtr;
     m->messageType = MessageType::DurationMessage;
     m->microseconds = event.m_begin;
@@ -372,14 +961,17 @@ void systrace_duration_end(CSystraceEvent &event)
 
 void systrace_record_counter(const char *module, const char *tracepoint, int value, int id)
 {
-    if (!systrace_should_trace(module))
+    if (!systrace_should_trace(module) || !sample_counter())
         return;
 
     uint64_t modid = getStringId(module);
+    if (!category_kept(module, modid))
+        return;
     uint64_t tpid = getStringId(tracepoint);
 
     if (id == -1) {
-        ensure_chunk(sizeof(CounterMessage));
+        if (!ensure_chunk(sizeof(CounterMessage)))
+            return;
         CounterMessage *m = (CounterMessage*)tracerThreadData.m_shmPtr;
         m->messageType = MessageType::CounterMessage;
         m->microseconds = getMicroseconds();
@@ -388,7 +980,8 @@ void systrace_record_counter(const char *module, const char *tracepoint, int val
         m->value = value;
         advance_chunk(sizeof(CounterMessage));
     } else {
-        ensure_chunk(sizeof(CounterMessageWithId));
+        if (!ensure_chunk(sizeof(CounterMessageWithId)))
+            return;
         CounterMessageWithId *m = (CounterMessageWithId*)tracerThreadData.m_shmPtr;
         m->messageType = MessageType::CounterMessageWithId;
         m->microseconds = getMicroseconds();
@@ -404,13 +997,16 @@ void systrace_record_counter(const char *module, const char *tracepoint, int val
 
 void systrace_async_begin(const char *module, const char *tracepoint, const void *cookie)
 {
-    if (!systrace_should_trace(module))
+    if (!systrace_should_trace(module) || !sample_cookie(cookie))
         return;
 
     uint64_t modid = getStringId(module);
+    if (!category_kept(module, modid))
+        return;
     uint64_t tpid = getStringId(tracepoint);
 
-    ensure_chunk(sizeof(AsyncBeginMessage));
+    if (!ensure_chunk(sizeof(AsyncBeginMessage)))
+        return;
     AsyncBeginMessage *m = (AsyncBeginMessage*)tracerThreadData.m_shmPtr;
     m->messageType = MessageType::AsyncBeginMessage;
     m->microseconds = getMicroseconds();
@@ -424,13 +1020,16 @@ void systrace_async_begin(const char *module, const char *tracepoint, const void
 
 void systrace_async_end(const char *module, const char *tracepoint, const void *cookie)
 {
-    if (!systrace_should_trace(module))
+    if (!systrace_should_trace(module) || !sample_cookie(cookie))
         return;
 
     uint64_t modid = getStringId(module);
+    if (!category_kept(module, modid))
+        return;
     uint64_t tpid = getStringId(tracepoint);
 
-    ensure_chunk(sizeof(AsyncEndMessage));
+    if (!ensure_chunk(sizeof(AsyncEndMessage)))
+        return;
     AsyncEndMessage *m = (AsyncEndMessage*)tracerThreadData.m_shmPtr;
     m->messageType = MessageType::AsyncEndMessage;
     m->microseconds = getMicroseconds();